@@ -0,0 +1,59 @@
+#
+# Plugin used by async_bench. commit sends the change uid to a local
+# stand-in server, which answers after BENCH_ASYNC_DELAY seconds, and
+# reports success. The sync sink waits for each commit; the async sink
+# (OSyncObject#async=) keeps up to BENCH_ASYNC_LIMIT of them in flight.
+#
+require "socket"
+
+class BenchAsync < Opensync::Plugin
+    ID="ruby-bench-async"
+    DELAY=(ENV2["BENCH_ASYNC_DELAY"] || 0.02).to_f
+    LIMIT=(ENV2["BENCH_ASYNC_LIMIT"] || 16).to_i
+
+    def self.get_sync_info(env)
+	env.register_plugin(self.new)
+    end
+
+    # The slow backend: one thread per connection
+    def self.server
+	@server ||= begin
+	    server=TCPServer.new("127.0.0.1", 0)
+	    Thread.new do
+		loop do
+		    Thread.new(server.accept) {|client| line=client.gets; sleep DELAY; client.puts(line); client.close }
+		end
+	    end
+	    server
+	end
+    end
+
+    def initialize_new
+	self.name=ID
+	self.longname="Async callbacks benchmark"
+	self.description="Used by bench/async_bench"
+	self.initialize_func {|plugin, info| initialize0(info) }
+	self.finalize_func {|plugin, plugin_data| true }
+	self.discover_func {|plugin, info, plugin_data| true }
+    end
+
+    def initialize0(info)
+	port=BenchAsync.server.addr[1]
+	info.objtype_sinks.each do
+	    |sink|
+	    sink.commit_func {|sink, info, ctx, change, userdata| commit(port, ctx, change) }
+	    sink.async=LIMIT if sink.name == "async"
+	end
+	true
+    end
+
+    def commit(port, ctx, change)
+	socket=TCPSocket.new("127.0.0.1", port)
+	socket.puts(change.uid)
+	raise "Unexpected answer" if socket.gets.chomp != change.uid
+	socket.close
+	ctx.report_success
+    end
+end
+
+Opensync::MetaPlugin.register(BenchAsync)
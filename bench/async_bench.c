@@ -0,0 +1,134 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * [commits] commits against a slow backend (a local server answering after
+ * [delay] seconds), using the sinks of async/bench_async.rb:
+ *
+ * sync:  each commit returns when the ruby code is done
+ * async: commits run in fibers, up to [limit] at once (ruby >= 3.0)
+ *
+ * The time counts until every context got its result.
+ *
+ * Usage: async_bench [commits] [delay] [limit]
+ * Output: mode commits seconds commits/s
+ */
+
+#include "ruby_module.h"
+#include "callbacks_prototypes.h"
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_PLUGIN "ruby-bench-async"
+
+static const char *modes[] = { "sync", "async" };
+
+/* Contexts that got their result */
+static int reported = 0;
+static int failed = 0;
+static pthread_mutex_t reported_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reported_cond = PTHREAD_COND_INITIALIZER;
+
+static void report_result(void *data, OSyncError *error) {
+    pthread_mutex_lock(&reported_lock);
+    if (error) {
+        fprintf(stderr, "commit failed: %s\n", osync_error_print(&error));
+        failed++;
+    }
+    reported++;
+    pthread_cond_signal(&reported_cond);
+    pthread_mutex_unlock(&reported_lock);
+}
+
+int main(int argc, char **argv) {
+    int commits = argc > 1 ? atoi(argv[1]) : 200;
+    OSyncError *error = NULL;
+    OSyncPluginEnv *plugin_env;
+    OSyncPlugin *plugin;
+    OSyncPluginInfo *info;
+    unsigned int m;
+    int i;
+
+    setenv("OPENSYNC_RUBY_PLUGINDIR", BENCH_ASYNCDIR, 0);
+    if (argc > 2)
+        setenv("BENCH_ASYNC_DELAY", argv[2], 1);
+    if (argc > 3)
+        setenv("BENCH_ASYNC_LIMIT", argv[3], 1);
+
+    plugin_env = osync_plugin_env_new(&error);
+    if (!plugin_env || !rubymodule_get_sync_info(plugin_env, &error))
+        goto error;
+    if (!(plugin = osync_plugin_env_find_plugin(plugin_env, BENCH_PLUGIN))) {
+        fprintf(stderr, "Plugin %s not registered\n", BENCH_PLUGIN);
+        return 1;
+    }
+
+    if (!(info = osync_plugin_info_new(&error)))
+        goto error;
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        OSyncObjTypeSink *sink = osync_objtype_sink_new(modes[m], &error);
+        if (!sink)
+            goto error;
+        osync_plugin_info_add_objtype(info, sink);
+        osync_objtype_sink_unref(sink);
+    }
+    osync_rubymodule_plugin_initialize(plugin, info, &error);
+    if (osync_error_is_set(&error))
+        goto error;
+
+    printf("# mode commits seconds commits/s\n");
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        OSyncObjTypeSink *sink = osync_plugin_info_find_objtype(info, modes[m]);
+        double start, elapsed;
+
+        reported = failed = 0;
+        start = bench_now();
+        for (i = 0; i < commits; i++) {
+            char uid[16];
+            OSyncContext *ctx;
+            OSyncChange *change;
+
+            if (!(ctx = osync_context_new(&error)) || !(change = osync_change_new(&error)))
+                goto error;
+            snprintf(uid, sizeof(uid), "%d", i);
+            osync_change_set_uid(change, uid);
+            osync_context_set_callback(ctx, report_result, NULL);
+            osync_rubymodule_objtype_sink_commit(sink, info, ctx, change, osync_objtype_sink_get_userdata(sink));
+            /* The async sink keeps its own references */
+            osync_change_unref(change);
+            osync_context_unref(ctx);
+        }
+        pthread_mutex_lock(&reported_lock);
+        while (reported < commits)
+            pthread_cond_wait(&reported_cond, &reported_lock);
+        pthread_mutex_unlock(&reported_lock);
+        elapsed = bench_now() - start;
+        printf("%-5s %d %.3f %.0f%s\n", modes[m], commits, elapsed, commits / elapsed, failed ? " (failures)" : "");
+        fflush(stdout);
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "%s\n", error ? osync_error_print(&error) : "failed");
+    return 1;
+}
@@ -0,0 +1,99 @@
+#!/usr/bin/ruby
+#
+# Runs bench_suite and compares its results with a baseline, a previous
+# output of bench_suite. Fails when a case got slower than the tolerance
+# allows (0.25: 25% less calls/s, or 25% more p50/p99 latency or peak RSS).
+# Without a baseline, or with --record, it writes one and succeeds. It is
+# the bench_regression CTest test when configured with -DBENCH_REGRESSION=ON.
+#
+# Usage: bench_check.rb BASELINE TOLERANCE bench_suite [options...]
+#        bench_check.rb --record BASELINE bench_suite [options...]
+#
+require "json"
+
+# Latency changes below this are noise, whatever the tolerance says
+LATENCY_SLACK_US = 2.0
+# bench_suite options the results depend on
+PARAMETERS = ["threads", "size", "changes", "calls"]
+
+def usage
+    $stderr.puts "Usage: #{$0} BASELINE TOLERANCE bench_suite [options...]"
+    $stderr.puts "       #{$0} --record BASELINE bench_suite [options...]"
+    exit 1
+end
+
+def run(command)
+    output = IO.popen(command, &:read)
+    if not $?.success?
+	$stderr.puts "#{command.join(" ")} failed (#{$?})"
+	exit 1
+    end
+    output
+end
+
+def parse(text)
+    text.lines.collect {|line| JSON.parse(line) }
+end
+
+def record(baseline, output)
+    File.write(baseline, output)
+    puts "Recorded #{parse(output).size} cases in #{baseline}"
+    exit 0
+end
+
+# Regressions of current against base, as strings
+def regressions(base, current, tolerance)
+    found = []
+    if current["calls_s"] < base["calls_s"] * (1 - tolerance)
+	found << "calls/s #{base["calls_s"]} -> #{current["calls_s"]}"
+    end
+    ["p50_us", "p99_us"].each do
+	|metric|
+	next if current[metric] <= base[metric] * (1 + tolerance) or current[metric] - base[metric] < LATENCY_SLACK_US
+	found << "#{metric} #{base[metric]} -> #{current[metric]}"
+    end
+    if current["peak_rss_kb"] > base["peak_rss_kb"] * (1 + tolerance)
+	found << "peak_rss_kb #{base["peak_rss_kb"]} -> #{current["peak_rss_kb"]}"
+    end
+    found
+end
+
+if ARGV.first == "--record"
+    (_, baseline, *command) = ARGV
+    usage if command.empty?
+    record(baseline, run(command))
+end
+
+(baseline, tolerance, *command) = ARGV
+usage if command.empty?
+tolerance = Float(tolerance) rescue usage
+
+output = run(command)
+if not File.exist?(baseline)
+    puts "No baseline in #{baseline}"
+    record(baseline, output)
+end
+
+bases = Hash[parse(File.read(baseline)).collect {|result| [result["case"], result] }]
+failed = false
+parse(output).each do
+    |current|
+    name = current["case"]
+    base = bases[name]
+    if not base
+	puts "%-12s %10.0f calls/s  no baseline" % [name, current["calls_s"]]
+	next
+    end
+    if PARAMETERS.any? {|parameter| base[parameter] != current[parameter] }
+	puts "%-12s baseline taken with other options (%s), record it again" %
+	    [name, PARAMETERS.collect {|parameter| "#{parameter} #{base[parameter]}" }.join(", ")]
+	failed = true
+	next
+    end
+    found = regressions(base, current, tolerance)
+    puts "%-12s %10.0f calls/s  p50 %8.2fus  p99 %8.2fus  %7d KB  %s" %
+	[name, current["calls_s"], current["p50_us"], current["p99_us"], current["peak_rss_kb"],
+	 found.empty? ? "ok" : "REGRESSION: #{found.join(", ")}"]
+    failed ||= !found.empty?
+end
+exit(failed ? 1 : 0)
@@ -0,0 +1,394 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * Benchmark suite: calls the entry points the OpenSync engine uses from
+ * [threads] C threads, with the plugin and formats of suite/bench_suite.rb.
+ * Runs from the build tree: opensync.rb comes from BENCH_RUBYLIBDIR and no
+ * installed plugin, format or engine is needed.
+ *
+ * sync_info:   rubymodule_get_sync_info on a new plugin env
+ * get_changes: slow sync get_changes, reporting [changes] changes of [size]
+ * commit:      commit of an added change of [size] bytes
+ * compare:     objformat compare of two equal [size] bytes buffers
+ * copy:        objformat copy of [size] bytes
+ * convert:     converter convert of [size] bytes
+ *
+ * Usage: bench_suite [-t threads] [-n calls] [-s size] [-c changes] [case...]
+ *        calls are per thread (sync_info makes calls/100). All cases by default
+ * Output: one JSON object per case, on its own line: case, threads, size,
+ *         changes, calls, seconds, calls_s, p50_us, p99_us and peak_rss_kb
+ *         (the process peak so far; cases run in the order above)
+ */
+
+#include "ruby_module.h"
+#include "callbacks_prototypes.h"
+#include "bench.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define BENCH_PLUGIN  "ruby-bench-suite"
+#define BENCH_FORMAT  "bench_suite"
+#define BENCH_TARGET  "bench_suite_out"
+#define BENCH_SINK    "suite"
+
+/* What every case needs, set up once */
+struct bench {
+    unsigned int size;
+    int changes;
+    OSyncFormatEnv *format_env;
+    OSyncObjFormat *format;
+    void *format_data;
+    OSyncFormatConverter *converter;
+    void *converter_data;
+    OSyncPluginInfo *info;
+    OSyncObjTypeSink *sink;
+};
+
+/* Per thread buffers: the input, a second copy (compare) and the change (commit) */
+struct bench_thread {
+    struct bench *bench;
+    int (*run)(struct bench *, struct bench_thread *, OSyncError **);
+    int calls;
+    char *left;
+    char *right;
+    OSyncChange *change;
+    uint64_t *latency;
+    OSyncError *error;
+    pthread_t thread;
+};
+
+/* Given to the context callbacks */
+struct bench_result {
+    int changes;
+    int done;
+    OSyncError *error;
+};
+
+static pthread_barrier_t bench_start;
+
+static void count_change(OSyncChange *change, void *data) {
+    ((struct bench_result *) data)->changes++;
+}
+
+static void report_result(void *data, OSyncError *error) {
+    struct bench_result *result = data;
+    result->done = 1;
+    if (error) {
+        osync_error_ref(&error);
+        result->error = error;
+    }
+}
+
+/* Runs a sink call with a new context; FALSE if it failed or did not report */
+static int run_sink(struct bench *bench, OSyncChange *change, OSyncError **error) {
+    struct bench_result result = { 0, 0, NULL };
+    OSyncContext *ctx = osync_context_new(error);
+
+    if (!ctx)
+        return FALSE;
+    osync_context_set_changes_callback(ctx, count_change);
+    osync_context_set_callback(ctx, report_result, &result);
+    if (change)
+        osync_rubymodule_objtype_sink_commit(bench->sink, bench->info, ctx, change, osync_objtype_sink_get_userdata(bench->sink));
+    else
+        osync_rubymodule_objtype_sink_get_changes(bench->sink, bench->info, ctx, TRUE, osync_objtype_sink_get_userdata(bench->sink));
+    osync_context_unref(ctx);
+
+    if (result.error) {
+        *error = result.error;
+        return FALSE;
+    }
+    if (!result.done || (!change && result.changes != bench->changes)) {
+        osync_error_set(error, OSYNC_ERROR_GENERIC, "%s reported %d changes and %s", change ? "commit" : "get_changes",
+                        result.changes, result.done ? "its result" : "no result");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int run_sync_info(struct bench *bench, struct bench_thread *thread, OSyncError **error) {
+    OSyncPluginEnv *env = osync_plugin_env_new(error);
+    osync_bool result;
+
+    if (!env)
+        return FALSE;
+    result = rubymodule_get_sync_info(env, error);
+    osync_plugin_env_unref(env);
+    return result;
+}
+
+static int run_get_changes(struct bench *bench, struct bench_thread *thread, OSyncError **error) {
+    return run_sink(bench, NULL, error);
+}
+
+static int run_commit(struct bench *bench, struct bench_thread *thread, OSyncError **error) {
+    return run_sink(bench, thread->change, error);
+}
+
+static int run_compare(struct bench *bench, struct bench_thread *thread, OSyncError **error) {
+    return osync_rubymodule_objformat_compare(bench->format, thread->left, bench->size, thread->right, bench->size,
+                                              bench->format_data, error) == OSYNC_CONV_DATA_SAME;
+}
+
+static int run_copy(struct bench *bench, struct bench_thread *thread, OSyncError **error) {
+    char *output = NULL;
+    unsigned int outputsize = 0;
+
+    if (!osync_rubymodule_objformat_copy(bench->format, thread->left, bench->size, &output, &outputsize, bench->format_data, error))
+        return FALSE;
+    free(output);
+    return outputsize == bench->size;
+}
+
+static int run_convert(struct bench *bench, struct bench_thread *thread, OSyncError **error) {
+    char *output = NULL;
+    unsigned int outputsize = 0;
+    osync_bool free_input = FALSE;
+
+    if (!osync_rubymodule_converter_convert(bench->converter, thread->left, bench->size, &output, &outputsize, &free_input,
+                                            NULL, bench->converter_data, error))
+        return FALSE;
+    /* The converter returns a new buffer and keeps the input */
+    free(output);
+    return outputsize == bench->size && !free_input;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(struct bench *, struct bench_thread *, OSyncError **);
+    int divisor;
+} cases[] = {
+    { "sync_info",   run_sync_info,   100 },
+    { "get_changes", run_get_changes, 1 },
+    { "commit",      run_commit,      1 },
+    { "compare",     run_compare,     1 },
+    { "copy",        run_copy,        1 },
+    { "convert",     run_convert,     1 },
+};
+
+static osync_bool bench_thread_init(struct bench *bench, struct bench_thread *thread, OSyncError **error) {
+    OSyncData *data;
+    char *buffer;
+
+    thread->bench = bench;
+    thread->left = malloc(bench->size);
+    thread->right = malloc(bench->size);
+    memset(thread->left, 'x', bench->size);
+    memset(thread->right, 'x', bench->size);
+    if (!(thread->change = osync_change_new(error)))
+        return FALSE;
+    osync_change_set_uid(thread->change, "suite");
+    osync_change_set_changetype(thread->change, OSYNC_CHANGE_TYPE_ADDED);
+    /* data owns its buffer */
+    buffer = g_malloc(bench->size);
+    memcpy(buffer, thread->left, bench->size);
+    if (!(data = osync_data_new(buffer, bench->size, bench->format, error)))
+        return FALSE;
+    osync_data_set_objtype(data, BENCH_SINK);
+    osync_change_set_data(thread->change, data);
+    osync_data_unref(data);
+    return TRUE;
+}
+
+static void *bench_thread_main(void *data) {
+    struct bench_thread *thread = data;
+    int i;
+
+    pthread_barrier_wait(&bench_start);
+    for (i = 0; i < thread->calls; i++) {
+        uint64_t start = bench_now_ns();
+        if (!thread->run(thread->bench, thread, &thread->error)) {
+            if (!thread->error)
+                osync_error_set(&thread->error, OSYNC_ERROR_GENERIC, "unexpected result");
+            break;
+        }
+        thread->latency[i] = bench_now_ns() - start;
+    }
+    return NULL;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t left = *(const uint64_t *) a, right = *(const uint64_t *) b;
+    return left < right ? -1 : left > right;
+}
+
+/* Runs one case and prints its line. FALSE if any call failed */
+static int run_case(struct bench *bench, int c, int threads, int calls) {
+    struct bench_thread *thread = calloc(threads, sizeof(*thread));
+    uint64_t *latency, start, elapsed;
+    struct rusage usage;
+    int i, total, failed = 0;
+
+    calls = calls / cases[c].divisor > 0 ? calls / cases[c].divisor : 1;
+    total = threads * calls;
+    latency = malloc(total * sizeof(*latency));
+    pthread_barrier_init(&bench_start, NULL, threads + 1);
+    for (i = 0; i < threads; i++) {
+        OSyncError *error = NULL;
+        thread[i].run = cases[c].run;
+        thread[i].calls = calls;
+        thread[i].latency = latency + i * calls;
+        if (!bench_thread_init(bench, &thread[i], &error)) {
+            fprintf(stderr, "%s: %s\n", cases[c].name, osync_error_print(&error));
+            osync_error_unref(&error);
+            return FALSE;
+        }
+    }
+
+    for (i = 0; i < threads; i++)
+        pthread_create(&thread[i].thread, NULL, bench_thread_main, &thread[i]);
+    pthread_barrier_wait(&bench_start);
+    start = bench_now_ns();
+    for (i = 0; i < threads; i++)
+        pthread_join(thread[i].thread, NULL);
+    elapsed = bench_now_ns() - start;
+    pthread_barrier_destroy(&bench_start);
+
+    for (i = 0; i < threads; i++) {
+        if (thread[i].error) {
+            fprintf(stderr, "%s: %s\n", cases[c].name, osync_error_print(&thread[i].error));
+            osync_error_unref(&thread[i].error);
+            failed = 1;
+        }
+        osync_change_unref(thread[i].change);
+        free(thread[i].left);
+        free(thread[i].right);
+    }
+
+    if (!failed) {
+        qsort(latency, total, sizeof(*latency), compare_latency);
+        getrusage(RUSAGE_SELF, &usage);
+        printf("{\"case\":\"%s\",\"threads\":%d,\"size\":%u,\"changes\":%d,\"calls\":%d,\"seconds\":%.6f,"
+               "\"calls_s\":%.0f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"peak_rss_kb\":%ld}\n",
+               cases[c].name, threads, bench->size, bench->changes, total, elapsed / 1e9,
+               total / (elapsed / 1e9), latency[(total - 1) * 50 / 100] / 1e3, latency[(total - 1) * 99 / 100] / 1e3,
+               usage.ru_maxrss);
+        fflush(stdout);
+    }
+    free(latency);
+    free(thread);
+    return !failed;
+}
+
+static osync_bool bench_setup(struct bench *bench, OSyncError **error) {
+    OSyncPluginEnv *plugin_env;
+    OSyncPlugin *plugin;
+    OSyncObjFormat *target;
+
+    if (!(bench->format_env = osync_format_env_new(error)) ||
+            !rubymodule_get_format_info(bench->format_env, error) ||
+            !rubymodule_get_conversion_info(bench->format_env, error))
+        return FALSE;
+    bench->format = osync_format_env_find_objformat(bench->format_env, BENCH_FORMAT);
+    target = osync_format_env_find_objformat(bench->format_env, BENCH_TARGET);
+    if (!bench->format || !target ||
+            !(bench->converter = osync_format_env_find_converter(bench->format_env, bench->format, target))) {
+        osync_error_set(error, OSYNC_ERROR_GENERIC, "Formats of %s not registered", BENCH_SUITEDIR);
+        return FALSE;
+    }
+    bench->format_data = rubymodule_objformat_userdata(bench->format, error);
+    if (osync_error_is_set(error))
+        return FALSE;
+    bench->converter_data = rubymodule_converter_userdata(bench->converter, NULL, error);
+    if (osync_error_is_set(error))
+        return FALSE;
+
+    if (!(plugin_env = osync_plugin_env_new(error)) || !rubymodule_get_sync_info(plugin_env, error))
+        return FALSE;
+    if (!(plugin = osync_plugin_env_find_plugin(plugin_env, BENCH_PLUGIN))) {
+        osync_error_set(error, OSYNC_ERROR_GENERIC, "Plugin %s not registered", BENCH_PLUGIN);
+        return FALSE;
+    }
+    if (!(bench->info = osync_plugin_info_new(error)) || !(bench->sink = osync_objtype_sink_new(BENCH_SINK, error)))
+        return FALSE;
+    osync_plugin_info_set_format_env(bench->info, bench->format_env);
+    osync_plugin_info_add_objtype(bench->info, bench->sink);
+    osync_rubymodule_plugin_initialize(plugin, bench->info, error);
+    return !osync_error_is_set(error);
+}
+
+static void usage(const char *name) {
+    unsigned int c;
+
+    fprintf(stderr, "Usage: %s [-t threads] [-n calls] [-s size] [-c changes] [case...]\nCases:", name);
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+        fprintf(stderr, " %s", cases[c].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+    struct bench bench = { 1024, 100 };
+    int threads = 4, calls = 10000, failed = 0, opt, i;
+    unsigned int c;
+    char number[32];
+    OSyncError *error = NULL;
+
+    while ((opt = getopt(argc, argv, "t:n:s:c:h")) != -1) {
+        switch (opt) {
+        case 't': threads = atoi(optarg); break;
+        case 'n': calls = atoi(optarg); break;
+        case 's': bench.size = atoi(optarg); break;
+        case 'c': bench.changes = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (threads < 1 || calls < 1 || bench.size < 1 || bench.changes < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (i = optind; i < argc; i++) {
+        for (c = 0; c < sizeof(cases) / sizeof(cases[0]) && strcmp(argv[i], cases[c].name); c++);
+        if (c == sizeof(cases) / sizeof(cases[0])) {
+            fprintf(stderr, "Unknown case %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    setenv("OPENSYNC_RUBY_LIBDIR", BENCH_RUBYLIBDIR, 0);
+    setenv("OPENSYNC_RUBY_PLUGINDIR", BENCH_SUITEDIR, 0);
+    setenv("OPENSYNC_RUBY_FORMATSDIR", BENCH_SUITEDIR, 0);
+    snprintf(number, sizeof(number), "%u", bench.size);
+    setenv("BENCH_SUITE_SIZE", number, 1);
+    snprintf(number, sizeof(number), "%d", bench.changes);
+    setenv("BENCH_SUITE_CHANGES", number, 1);
+
+    if (!bench_setup(&bench, &error)) {
+        fprintf(stderr, "%s\n", error ? osync_error_print(&error) : "failed");
+        return 1;
+    }
+
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        int selected = optind == argc;
+        for (i = optind; i < argc; i++)
+            selected |= !strcmp(argv[i], cases[c].name);
+        if (selected && !run_case(&bench, c, threads, calls))
+            failed = 1;
+    }
+    return failed;
+}
@@ -0,0 +1,83 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * Callback dispatches per second, using the objformat compare callback of
+ * formats/bench_format.rb as the hot case. Each call goes through the
+ * generated osync_rubymodule_objformat_compare wrapper, the dispatcher and
+ * the ruby Proc. Run it on two revisions to compare them.
+ *
+ * Usage: callback_bench [calls] [size]
+ * Output: calls size calls/s
+ */
+
+#include "ruby_module.h"
+#include "callbacks_prototypes.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_FORMAT "bench_format"
+
+int main(int argc, char **argv) {
+    int calls = argc > 1 ? atoi(argv[1]) : 100000;
+    unsigned int size = argc > 2 ? atoi(argv[2]) : 64;
+    OSyncError *error = NULL;
+    OSyncFormatEnv *env;
+    OSyncObjFormat *format;
+    char *left, *right;
+    double start, elapsed;
+    int i;
+
+    setenv("OPENSYNC_RUBY_FORMATSDIR", BENCH_FORMATSDIR, 0);
+
+    env = osync_format_env_new(&error);
+    if (!env || !rubymodule_get_format_info(env, &error))
+        goto error;
+    format = osync_format_env_find_objformat(env, BENCH_FORMAT);
+    if (!format) {
+        fprintf(stderr, "Format %s not registered\n", BENCH_FORMAT);
+        return 1;
+    }
+
+    left = calloc(1, size);
+    right = calloc(1, size);
+
+    start = bench_now();
+    for (i = 0; i < calls; i++) {
+        if (osync_rubymodule_objformat_compare(format, left, size, right, size, NULL, &error) != OSYNC_CONV_DATA_SAME)
+            goto error;
+    }
+    elapsed = bench_now() - start;
+
+    printf("# startup %.3fs\n", rubymodule_startup_time());
+    printf("# calls size calls/s\n");
+    printf("%d %u %.0f\n", calls, size, calls / elapsed);
+
+    free(left);
+    free(right);
+    osync_format_env_unref(env);
+    return 0;
+
+error:
+    fprintf(stderr, "%s\n", error ? osync_error_print(&error) : "failed");
+    return 1;
+}
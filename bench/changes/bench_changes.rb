@@ -0,0 +1,96 @@
+#
+# Plugin used by changes_bench. Every sink reports all files below
+# BENCH_CHANGES_TREE, each one in a different way:
+#
+#  single: one Change, one Data and separate hashtable calls per file
+#  batch:  HashTable#classify_and_update and Context#report_changes
+#  walk:   stats and reads the files but reports nothing (the I/O baseline)
+#
+require "pathname"
+
+class BenchChanges < Opensync::Plugin
+    ID="ruby-bench-changes"
+    # Changes reported per native call
+    BATCH=1000
+
+    def self.get_sync_info(env)
+	env.register_plugin(self.new)
+    end
+
+    def initialize_new
+	self.name=ID
+	self.longname="Change reporting benchmark"
+	self.description="Used by bench/changes_bench"
+	self.initialize_func {|plugin, info| initialize0(info) }
+	self.finalize_func {|plugin, plugin_data| true }
+	self.discover_func {|plugin, info, plugin_data| true }
+    end
+
+    def initialize0(info)
+	format = info.format_env.find_objformat("bench_format") or
+	    raise "Unable to find bench_format format"
+	info.objtype_sinks.each do
+	    |sink|
+	    hashtable = Opensync::HashTable.new("#{ENV2["BENCH_CHANGES_DB"]}/#{sink.name}.db", sink.name)
+	    hashtable.load
+	    sink.userdata = [hashtable, format]
+	    sink.get_changes_func {|sink, info, ctx, slow_sync, userdata| send("get_changes_#{sink.name}", sink, ctx, *userdata) }
+	end
+	true
+    end
+
+    def each_file
+	root = ENV2["BENCH_CHANGES_TREE"]
+	Pathname.new(root).find {|path| yield path, path.to_s[root.size+1..-1] if path.file? }
+    end
+
+    def hash_of(path)
+	stat = path.stat
+	"#{stat.mtime.to_i}-#{stat.ctime.to_i}"
+    end
+
+    def get_changes_single(sink, ctx, hashtable, format)
+	each_file do
+	    |path, uid|
+	    change = Opensync::Change.new
+	    change.uid = uid
+	    change.hash = hash_of(path)
+	    type = hashtable.get_changetype(change)
+	    change.changetype = type
+	    hashtable.update_change(change)
+	    next if type == Opensync::OSYNC_CHANGE_TYPE_UNMODIFIED
+
+	    odata = Opensync::Data.new(path.read, format)
+	    odata.objtype = sink.name
+	    change.data = odata
+	    ctx.report_change(change)
+	end
+	ctx.report_success
+    end
+
+    def get_changes_batch(sink, ctx, hashtable, format)
+	paths = []; uids = []; hashes = []
+	each_file {|path, uid| paths << path; uids << uid; hashes << hash_of(path) }
+
+	types = hashtable.classify_and_update(uids, hashes)
+	changes = []
+	uids.each_index do
+	    |i|
+	    next if types[i] == Opensync::OSYNC_CHANGE_TYPE_UNMODIFIED
+	    changes << [uids[i], types[i], hashes[i], paths[i].read]
+	    if changes.size >= BATCH
+		ctx.report_changes(changes, format, sink.name)
+		changes.clear
+	    end
+	end
+	ctx.report_changes(changes, format, sink.name)
+	ctx.report_success
+    end
+
+    def get_changes_walk(sink, ctx, hashtable, format)
+	each_file {|path, uid| hash_of(path); path.read }
+	ctx.report_success
+    end
+end
+
+Opensync::MetaPlugin.register(BenchChanges)
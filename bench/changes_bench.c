@@ -0,0 +1,160 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * Slow sync get_changes over a synthetic tree (100 directories, [files] files
+ * of [size] bytes), using the sinks of changes/bench_changes.rb:
+ *
+ * walk:   only stats and reads the files (the I/O cost)
+ * single: one Change/Data/hashtable round trip per file
+ * batch:  HashTable#classify_and_update + Context#report_changes
+ *
+ * Usage: changes_bench [files] [size]
+ * Output: mode files reported seconds files/s
+ */
+
+#define _GNU_SOURCE 1
+#include "ruby_module.h"
+#include "callbacks_prototypes.h"
+#include "bench.h"
+
+#include <ftw.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PLUGIN "ruby-bench-changes"
+#define BENCH_DIRS   100
+
+static const char *modes[] = { "walk", "single", "batch" };
+
+/* Gets the data given to osync_context_set_callback */
+static void count_change(OSyncChange *change, void *data) {
+    (*(int *) data)++;
+}
+
+static void report_result(void *data, OSyncError *error) {
+    if (error)
+        fprintf(stderr, "get_changes failed: %s\n", osync_error_print(&error));
+}
+
+static int make_tree(const char *root, int files, int size) {
+    char path[PATH_MAX];
+    char *content = malloc(size);
+    int i;
+
+    memset(content, 'x', size);
+    for (i = 0; i < BENCH_DIRS; i++) {
+        snprintf(path, sizeof(path), "%s/tree/d%03d", root, i);
+        if (g_mkdir_with_parents(path, 0755))
+            return 0;
+    }
+    for (i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/tree/d%03d/f%06d", root, i % BENCH_DIRS, i);
+        if (!g_file_set_contents(path, content, size, NULL))
+            return 0;
+    }
+    free(content);
+    return 1;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+int main(int argc, char **argv) {
+    int files = argc > 1 ? atoi(argv[1]) : 100000;
+    int size = argc > 2 ? atoi(argv[2]) : 1024;
+    char root[] = "/tmp/changes_bench.XXXXXX";
+    char *tree, *db;
+    OSyncError *error = NULL;
+    OSyncFormatEnv *format_env;
+    OSyncPluginEnv *plugin_env;
+    OSyncPlugin *plugin;
+    OSyncPluginInfo *info;
+    unsigned int i;
+
+    if (!mkdtemp(root) || !make_tree(root, files, size)) {
+        perror("Failed to create the tree");
+        return 1;
+    }
+    tree = g_strdup_printf("%s/tree", root);
+    db = g_strdup_printf("%s", root);
+
+    setenv("OPENSYNC_RUBY_PLUGINDIR", BENCH_CHANGESDIR, 0);
+    setenv("OPENSYNC_RUBY_FORMATSDIR", BENCH_FORMATSDIR, 0);
+    setenv("BENCH_CHANGES_TREE", tree, 1);
+    setenv("BENCH_CHANGES_DB", db, 1);
+
+    format_env = osync_format_env_new(&error);
+    if (!format_env || !rubymodule_get_format_info(format_env, &error))
+        goto error;
+    plugin_env = osync_plugin_env_new(&error);
+    if (!plugin_env || !rubymodule_get_sync_info(plugin_env, &error))
+        goto error;
+    if (!(plugin = osync_plugin_env_find_plugin(plugin_env, BENCH_PLUGIN))) {
+        fprintf(stderr, "Plugin %s not registered\n", BENCH_PLUGIN);
+        return 1;
+    }
+
+    if (!(info = osync_plugin_info_new(&error)))
+        goto error;
+    osync_plugin_info_set_format_env(info, format_env);
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        OSyncObjTypeSink *sink = osync_objtype_sink_new(modes[i], &error);
+        if (!sink)
+            goto error;
+        osync_plugin_info_add_objtype(info, sink);
+        osync_objtype_sink_unref(sink);
+    }
+    osync_rubymodule_plugin_initialize(plugin, info, &error);
+    if (osync_error_is_set(&error))
+        goto error;
+
+    printf("# mode files reported seconds files/s\n");
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        OSyncObjTypeSink *sink = osync_plugin_info_find_objtype(info, modes[i]);
+        OSyncContext *ctx = osync_context_new(&error);
+        int reported = 0;
+        double start, elapsed;
+
+        if (!ctx)
+            goto error;
+        osync_context_set_changes_callback(ctx, count_change);
+        osync_context_set_callback(ctx, report_result, &reported);
+        start = bench_now();
+        osync_rubymodule_objtype_sink_get_changes(sink, info, ctx, TRUE, osync_objtype_sink_get_userdata(sink));
+        elapsed = bench_now() - start;
+        printf("%-6s %d %d %.3f %.0f\n", modes[i], files, reported, elapsed, files / elapsed);
+        fflush(stdout);
+        osync_context_unref(ctx);
+    }
+
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    g_free(tree);
+    g_free(db);
+    return 0;
+
+error:
+    fprintf(stderr, "%s\n", error ? osync_error_print(&error) : "failed");
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return 1;
+}
@@ -0,0 +1,106 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * The compare calls of a slow sync: [records] pairs of [size] bytes, of
+ * which [same]% are byte identical, compared through the generated
+ * osync_rubymodule_objformat_compare wrapper with the formats of
+ * formats/bench_format.rb:
+ *
+ * ruby: bench_compare, every pair goes to the ruby compare callback
+ * fast: bench_compare_fast, identical pairs are answered in C
+ *
+ * Usage: compare_bench [records] [size] [same]
+ * Output: mode records size same seconds records/s
+ */
+
+#include "ruby_module.h"
+#include "callbacks_prototypes.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+static const char *formats[][2] = {
+    { "ruby", "bench_compare" },
+    { "fast", "bench_compare_fast" },
+};
+
+int main(int argc, char **argv) {
+    int records = argc > 1 ? atoi(argv[1]) : 100000;
+    unsigned int size = argc > 2 ? atoi(argv[2]) : 1024;
+    int same = argc > 3 ? atoi(argv[3]) : 95;
+    OSyncError *error = NULL;
+    OSyncFormatEnv *env;
+    char **left, **right;
+    unsigned int i;
+    int r;
+
+    setenv("OPENSYNC_RUBY_FORMATSDIR", BENCH_FORMATSDIR, 0);
+
+    env = osync_format_env_new(&error);
+    if (!env || !rubymodule_get_format_info(env, &error))
+        goto error;
+
+    /* Separate buffers on each side, as the engine compares two copies */
+    left = malloc(records * sizeof(char *));
+    right = malloc(records * sizeof(char *));
+    for (r = 0; r < records; r++) {
+        left[r] = malloc(size);
+        right[r] = malloc(size);
+        memset(left[r], 'a' + r % 26, size);
+        memcpy(right[r], left[r], size);
+        if (r % 100 >= same)
+            right[r][size - 1] ^= 1;
+    }
+
+    printf("# mode records size same seconds records/s\n");
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        OSyncObjFormat *format = osync_format_env_find_objformat(env, formats[i][1]);
+        double start, elapsed;
+
+        if (!format) {
+            fprintf(stderr, "Format %s not registered\n", formats[i][1]);
+            return 1;
+        }
+        start = bench_now();
+        for (r = 0; r < records; r++) {
+            OSyncConvCmpResult expected = r % 100 >= same ? OSYNC_CONV_DATA_MISMATCH : OSYNC_CONV_DATA_SAME;
+            if (osync_rubymodule_objformat_compare(format, left[r], size, right[r], size, NULL, &error) != expected)
+                goto error;
+        }
+        elapsed = bench_now() - start;
+        printf("%-4s %d %u %d%% %.3f %.0f\n", formats[i][0], records, size, same, elapsed, records / elapsed);
+        fflush(stdout);
+    }
+
+    for (r = 0; r < records; r++) {
+        free(left[r]);
+        free(right[r]);
+    }
+    free(left);
+    free(right);
+    osync_format_env_unref(env);
+    return 0;
+
+error:
+    fprintf(stderr, "%s\n", error ? osync_error_print(&error) : "failed");
+    return 1;
+}
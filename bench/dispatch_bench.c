@@ -0,0 +1,209 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * Measures how fast calls are handed from N caller threads to the single
+ * "ruby" thread. The called function is empty, so this is pure dispatch cost.
+ *
+ * legacy: the protocol used before the dispatcher (one global funcall slot,
+ *         ruby_call_lock + ruby_context_lock, fcall_requested/fcall_returned)
+ * ring:   ruby_dispatcher.c
+ *
+ * Usage: dispatch_bench [calls per thread]
+ * Output: mode threads calls calls/s handoff_p50_us handoff_p99_us
+ */
+
+#include "ruby_dispatcher.h"
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct bench_thread {
+    pthread_t	thread;
+    int		calls;
+    double	*handoff;
+    void	(* request) (struct bench_thread *self, int i);
+};
+
+/* Runs in the consumer thread: records how long the request waited */
+static void bench_record(void **args) {
+    double *submitted = args[0];
+    double *handoff   = args[1];
+    *handoff = bench_now_ns() / 1e3 - *submitted;
+}
+
+/** legacy: single slot, as in the original ruby_module.c */
+
+static pthread_mutex_t legacy_context_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t legacy_call_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  legacy_running_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  legacy_requested = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  legacy_returned = PTHREAD_COND_INITIALIZER;
+static int             legacy_running = 0;
+static struct {
+    void	(* func) (void **args);
+    void	**args;
+} legacy_slot;
+
+static void legacy_stop(void **args) {
+    legacy_running = 0;
+}
+
+static void *legacy_consumer(void *unused) {
+    pthread_mutex_lock(&legacy_context_lock);
+    legacy_running = 1;
+    pthread_cond_broadcast(&legacy_running_cond);
+    while (legacy_running) {
+        pthread_cond_wait(&legacy_requested, &legacy_context_lock);
+        if (!legacy_slot.func)
+            continue;
+        legacy_slot.func(legacy_slot.args);
+        pthread_cond_signal(&legacy_returned);
+    }
+    pthread_mutex_unlock(&legacy_context_lock);
+    return NULL;
+}
+
+static void legacy_call(void (* func) (void **args), void **args) {
+    pthread_mutex_lock(&legacy_call_lock);
+    pthread_mutex_lock(&legacy_context_lock);
+    if (!legacy_running)
+        pthread_cond_wait(&legacy_running_cond, &legacy_context_lock);
+    legacy_slot.func = func;
+    legacy_slot.args = args;
+    pthread_cond_signal(&legacy_requested);
+    pthread_cond_wait(&legacy_returned, &legacy_context_lock);
+    legacy_slot.func = NULL;
+    legacy_slot.args = NULL;
+    pthread_mutex_unlock(&legacy_context_lock);
+    pthread_mutex_unlock(&legacy_call_lock);
+}
+
+static void legacy_request(struct bench_thread *self, int i) {
+    double submitted = bench_now_ns() / 1e3;
+    void *args[2] = { &submitted, &self->handoff[i] };
+    legacy_call(bench_record, args);
+}
+
+/** ring: ruby_dispatcher.c */
+
+static struct rubymodule_dispatcher ring_dispatcher;
+static int ring_running = 0;
+
+static void ring_record(struct rubymodule_call *call) {
+    bench_record(call->args);
+}
+
+static void ring_stop(struct rubymodule_call *call) {
+    ring_running = 0;
+}
+
+static void *ring_consumer(void *unused) {
+    ring_running = 1;
+    while (ring_running) {
+        struct rubymodule_call *call = rubymodule_dispatcher_next(&ring_dispatcher);
+        call->func(call);
+        rubymodule_call_complete(call);
+    }
+    return NULL;
+}
+
+static void ring_request(struct bench_thread *self, int i) {
+    struct rubymodule_call call;
+    double submitted = bench_now_ns() / 1e3;
+    void *args[2] = { &submitted, &self->handoff[i] };
+    rubymodule_call_init(&call, ring_record, args, NULL);
+    rubymodule_dispatcher_request(&ring_dispatcher, &call);
+}
+
+/** driver */
+
+static void *bench_producer(void *data) {
+    struct bench_thread *self = data;
+    int i;
+    for (i = 0; i < self->calls; i++)
+        self->request(self, i);
+    return NULL;
+}
+
+static void run(const char *mode, int nthreads, int calls) {
+    struct bench_thread *threads = calloc(nthreads, sizeof(struct bench_thread));
+    double *handoff = malloc(sizeof(double) * nthreads * calls);
+    pthread_t consumer;
+    double start, elapsed;
+    int legacy = !strcmp(mode, "legacy");
+    int i;
+
+    if (legacy) {
+        pthread_create(&consumer, NULL, legacy_consumer, NULL);
+    } else {
+        rubymodule_dispatcher_init(&ring_dispatcher);
+        pthread_create(&consumer, NULL, ring_consumer, NULL);
+    }
+
+    start = bench_now_ns() / 1e3;
+    for (i = 0; i < nthreads; i++) {
+        threads[i].calls   = calls;
+        threads[i].handoff = handoff + i * calls;
+        threads[i].request = legacy ? legacy_request : ring_request;
+        pthread_create(&threads[i].thread, NULL, bench_producer, &threads[i]);
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i].thread, NULL);
+    elapsed = bench_now_ns() / 1e3 - start;
+
+    if (legacy) {
+        legacy_call(legacy_stop, NULL);
+    } else {
+        struct rubymodule_call call;
+        rubymodule_call_init(&call, ring_stop, NULL, NULL);
+        rubymodule_dispatcher_request(&ring_dispatcher, &call);
+    }
+    pthread_join(consumer, NULL);
+    if (!legacy)
+        rubymodule_dispatcher_destroy(&ring_dispatcher);
+
+    qsort(handoff, nthreads * calls, sizeof(double), bench_compare_double);
+    printf("%-6s %2d %8d %12.0f %10.2f %10.2f\n", mode, nthreads, nthreads * calls,
+           nthreads * calls / (elapsed / 1e6),
+           handoff[(size_t) (nthreads * calls * 0.50)],
+           handoff[(size_t) (nthreads * calls * 0.99)]);
+    fflush(stdout);
+
+    free(handoff);
+    free(threads);
+}
+
+int main(int argc, char **argv) {
+    static const int nthreads[] = { 1, 4, 16 };
+    int calls = argc > 1 ? atoi(argv[1]) : 20000;
+    unsigned int i;
+
+    printf("# mode threads calls calls/s handoff_p50_us handoff_p99_us\n");
+    for (i = 0; i < sizeof(nthreads) / sizeof(nthreads[0]); i++) {
+        run("legacy", nthreads[i], calls);
+        run("ring", nthreads[i], calls);
+    }
+    return 0;
+}
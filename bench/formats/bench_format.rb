@@ -0,0 +1,40 @@
+#
+# Formats used by the benchmarks in this directory. Load them by pointing
+# OPENSYNC_RUBY_FORMATSDIR here.
+#
+
+class BenchFormat < Opensync::ObjectFormat
+    ID="bench_format"
+
+    def self.get_format_info(env)
+	format = self.new(ID, "data")
+	env.register_objformat(format)
+    end
+
+    def initialize_new(name, objtype)
+	# Cheapest possible callback: measures the binding, not the format
+	self.compare_func {|format, leftdata, rightdata, user_data| Opensync::OSYNC_CONV_DATA_SAME }
+	self.copy_func {|format, input, user_data| input }
+    end
+end
+
+# Real byte compare, with and without the native fast path (compare_bench)
+class BenchCompareFormat < Opensync::ObjectFormat
+    ID="bench_compare"
+    FAST_ID="bench_compare_fast"
+
+    def self.get_format_info(env)
+	env.register_objformat(self.new(ID, "data"))
+	env.register_objformat(self.new(FAST_ID, "data"))
+    end
+
+    def initialize_new(name, objtype)
+	self.compare_fast_path = (name == FAST_ID)
+	self.compare_func {|format, leftdata, rightdata, user_data|
+	    leftdata == rightdata ? Opensync::OSYNC_CONV_DATA_SAME : Opensync::OSYNC_CONV_DATA_MISMATCH
+	}
+    end
+end
+
+Opensync::MetaFormat.register(BenchFormat)
+Opensync::MetaFormat.register(BenchCompareFormat)
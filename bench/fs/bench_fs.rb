@@ -0,0 +1,78 @@
+#
+# Walks of fs_bench.c over a synthetic tree (100 directories with a
+# subdirectory each, [files] files of [size] bytes). Both build the uids and
+# hashes the example plugin gives to HashTable#classify_and_update:
+#
+#  pathname: the walk of RubyFileSync#report_dir before Opensync::FS.scan
+#            (Pathname per entry, directory?/file?/stat per file)
+#  scan:     Opensync::FS.scan, as the example does it now
+#
+require "pathname"
+require "tmpdir"
+require "fileutils"
+
+module FSBench
+    DIRS = 100
+
+    def self.now
+	Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    def self.make_tree(root, files, size)
+	content = "x" * size
+	DIRS.times {|i| FileUtils.mkdir_p("#{root}/d%03d/sub" % i) }
+	files.times do
+	    |i|
+	    File.write("#{root}/d%03d/%sf%06d" % [i % DIRS, (i / DIRS).odd? ? "sub/" : "", i], content)
+	end
+    end
+
+    def self.hash_of(mtime, ctime)
+	"#{mtime}-#{ctime}"
+    end
+
+    def self.walk_pathname(root, subdir, uids, hashes)
+	path = Pathname.new(root) + subdir
+	path.each_child(false) do
+	    |entry|
+	    relative_filename = subdir.empty? ? entry : Pathname.new(subdir) + entry
+	    filename = Pathname.new(root) + relative_filename
+	    if filename.directory?
+		walk_pathname(root, relative_filename.to_s, uids, hashes)
+	    elsif filename.file?
+		stat = filename.stat
+		uids << relative_filename.to_s
+		hashes << hash_of(stat.mtime.to_i, stat.ctime.to_i)
+	    end
+	end
+    end
+
+    def self.walk_scan(root, uids, hashes)
+	# Opensync::FS.scan(root, batch: 1000) without opensync.rb
+	Opensync.osync_rubymodule_fs_scan(root, true, 1000, 0) do
+	    |paths, modes, sizes, mtimes, ctimes, inodes|
+	    uids.concat(paths)
+	    paths.each_index {|i| hashes << hash_of(mtimes[i], ctimes[i]) }
+	end
+    end
+
+    def self.run(files, size)
+	Dir.mktmpdir("fs_bench") do
+	    |root|
+	    make_tree(root, files, size)
+	    results = {}
+	    puts "# walk files seconds files/s"
+	    [:pathname, :scan].each do
+		|walk|
+		uids = []; hashes = []
+		start = now
+		walk == :scan ? walk_scan(root, uids, hashes) : walk_pathname(root, "", uids, hashes)
+		elapsed = now - start
+		results[walk] = uids.zip(hashes).sort
+		puts "%-8s %d %.3f %.0f" % [walk, uids.size, elapsed, uids.size / elapsed]
+		$stdout.flush
+	    end
+	    raise "The walks found different files" if results[:pathname] != results[:scan]
+	end
+    end
+end
@@ -0,0 +1,69 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * Slow sync directory walk of the example plugin: the Pathname walk against
+ * Opensync::FS.scan, over a synthetic tree of [files] files of [size] bytes
+ * (see fs/bench_fs.rb). Runs in an embedded ruby with only the scanner, so
+ * this needs no opensync. Drop the page cache before it to measure a cold
+ * walk.
+ *
+ * Usage: fs_bench [files] [size]
+ * Output: walk files seconds files/s
+ */
+
+#include "ruby_fs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static VALUE bench_run(VALUE args) {
+    rb_require(BENCH_FSDIR "/bench_fs.rb");
+    return rb_funcall(rb_path2class("FSBench"), rb_intern("run"), 2, rb_ary_entry(args, 0), rb_ary_entry(args, 1));
+}
+
+int main(int argc, char **argv) {
+    VALUE mOpensync, args;
+    int state = 0;
+
+    ruby_init();
+#if RUBY_API_VERSION_MAJOR >= 3
+    {
+        /* As in ruby_module.c: loads the builtin ruby code */
+        static char *options[] = { "fs_bench", "-e", "" };
+        ruby_options(3, options);
+    }
+#else
+    ruby_init_loadpath();
+#endif
+    mOpensync = rb_define_module("Opensync");
+    rubymodule_fs_init(mOpensync);
+
+    args = rb_ary_new();
+    rb_ary_push(args, INT2NUM(argc > 1 ? atoi(argv[1]) : 100000));
+    rb_ary_push(args, INT2NUM(argc > 2 ? atoi(argv[2]) : 1024));
+    rb_protect(bench_run, args, &state);
+    if (state) {
+        VALUE message = rb_obj_as_string(rb_errinfo());
+        fprintf(stderr, "%s\n", StringValueCStr(message));
+        return 1;
+    }
+    return ruby_cleanup(0);
+}
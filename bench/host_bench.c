@@ -0,0 +1,114 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * Latency of format callbacks run by the ruby thread of this process vs by
+ * opensync-ruby-host (see ruby_host.h), through the generated wrappers and
+ * with the formats of formats/bench_format.rb:
+ *
+ * compare: bench_format compare, a callback doing nothing
+ * copy:    bench_format copy of [size] bytes
+ *
+ * The host loads its formats through the installed ruby-format plugin.
+ *
+ * Usage: host_bench [calls] [size] [host binary]
+ * Output: mode call calls size p50(us) p99(us) calls/s
+ */
+
+#include "ruby_module.h"
+#include "callbacks_prototypes.h"
+#include "ruby_host.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static osync_bool run(const char *mode, OSyncFormatEnv *env, int calls, unsigned int size, OSyncError **error) {
+    OSyncObjFormat *format = osync_format_env_find_objformat(env, "bench_format");
+    double *latency = malloc(calls * sizeof(double));
+    char *data = malloc(size);
+    int c, i;
+
+    if (!format) {
+        osync_error_set(error, OSYNC_ERROR_GENERIC, "Bench formats not registered");
+        return FALSE;
+    }
+    memset(data, 'x', size);
+    for (c = 0; c < 2; c++) {
+        double start = bench_now(), elapsed;
+        for (i = 0; i < calls; i++) {
+            double call = bench_now();
+            if (c == 0) {
+                osync_rubymodule_objformat_compare(format, data, size, data, size, NULL, error);
+            } else {
+                char *output = NULL;
+                unsigned int outputsize;
+                osync_rubymodule_objformat_copy(format, data, size, &output, &outputsize, NULL, error);
+                free(output);
+            }
+            if (osync_error_is_set(error))
+                return FALSE;
+            latency[i] = bench_now() - call;
+        }
+        elapsed = bench_now() - start;
+        qsort(latency, calls, sizeof(double), bench_compare_double);
+        printf("%-7s %-7s %d %u %.1f %.1f %.0f\n", mode, c ? "copy" : "compare", calls, size,
+               latency[calls / 2] * 1e6, latency[calls * 99 / 100] * 1e6, calls / elapsed);
+        fflush(stdout);
+    }
+    free(latency);
+    free(data);
+    return TRUE;
+}
+
+int main(int argc, char **argv) {
+    int calls = argc > 1 ? atoi(argv[1]) : 100000;
+    unsigned int size = argc > 2 ? atoi(argv[2]) : 1024;
+    char socket_path[64];
+    OSyncError *error = NULL;
+    OSyncFormatEnv *env;
+
+    setenv("OPENSYNC_RUBY_FORMATSDIR", BENCH_FORMATSDIR, 0);
+    if (argc > 3)
+        setenv("OPENSYNC_RUBY_HOST_BINARY", argv[3], 1);
+    /* The host exits soon after the bench */
+    setenv("OPENSYNC_RUBY_HOST_IDLE", "2", 1);
+    snprintf(socket_path, sizeof(socket_path), "/tmp/host_bench.%d", (int) getpid());
+
+    env = osync_format_env_new(&error);
+    if (!env || !rubymodule_get_format_info(env, &error))
+        goto error;
+
+    printf("# mode call calls size p50(us) p99(us) calls/s\n");
+    rubymodule_host_configure(NULL);
+    if (!run("process", env, calls, size, &error))
+        goto error;
+    rubymodule_host_configure(socket_path);
+    if (!run("host", env, calls, size, &error))
+        goto error;
+
+    osync_format_env_unref(env);
+    return 0;
+
+error:
+    fprintf(stderr, "%s\n", error ? osync_error_print(&error) : "failed");
+    return 1;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# Ruby module startup (startup_bench: thread launch to the first
+# get_sync_info) without the compiled code cache, with an empty cache (cold:
+# compiles and writes the entries) and with a filled one (warm).
+#
+# Usage: iseq_bench.sh <startup_bench> [runs]
+# Output: mode runs mean_seconds
+#
+BENCH=${1:?usage: $0 <startup_bench> [runs]}
+RUNS=${2:-10}
+CACHEDIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$CACHEDIR"' EXIT
+
+echo "# mode runs mean_seconds"
+run() {
+    mode=$1; shift
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        [ "$mode" = cold ] && rm -rf "$CACHEDIR/cache"
+        env "$@" "$BENCH"
+        i=$((i + 1))
+    done | awk -v mode="$mode" '{ total += $1; n++ } END { printf "%-4s %d %.4f\n", mode, n, total / n }'
+}
+run off  OPENSYNC_RUBY_CACHEDIR=
+run cold OPENSYNC_RUBY_CACHEDIR="$CACHEDIR/cache"
+run warm OPENSYNC_RUBY_CACHEDIR="$CACHEDIR/cache"
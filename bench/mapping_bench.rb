@@ -0,0 +1,94 @@
+#!/usr/bin/ruby
+#
+# Load time of opensync.rb and steady state cost of the mapped wrappers, with
+# the wrappers compiled by map_methods at load time (class_eval) or generated
+# at build time (opensync_mapped.rb). The osync functions are empty fakes
+# taken from the SWIG wrapper, so this is only the ruby side cost.
+# It also measures wrapping the same C object again and again, as getters and
+# callback arguments do, through the identity map (from) and with a new
+# wrapper, ref and finalizer each time (new_pvt, what from used to do).
+# The time from the ruby thread launch to the first get_*_info is printed by
+# callback_bench.
+#
+# Usage: mapping_bench.rb opensyncRUBY_wrap.c opensync.rb [opensync_mapped.rb] [calls]
+# Output: mode load_ms getter_ns setter_ns method_ns from_ns from_allocs new_ns new_allocs
+#
+require "set"
+
+(wrapper, base, mapped, calls) = ARGV
+calls = (calls || 1000000).to_i
+mapped = nil if mapped and mapped.empty?
+if not base
+    $stderr.puts "Usage: #{$0} opensyncRUBY_wrap.c opensync.rb [opensync_mapped.rb] [calls]"
+    exit 1
+end
+
+def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+FUNCTIONS = File.read(wrapper).scan(/rb_define_module_function\(mOpensync, "(osync_\w+)"/).flatten.uniq
+
+module SWIG
+    def self.const_missing(name)
+	const_set(name, Class.new)
+    end
+end
+
+module Opensync
+    def self.const_missing(name)
+	const_set(name, name.to_s)
+    end
+
+    FUNCTIONS.each {|function| define_singleton_method(function) {|*args| } }
+
+    class List
+    end
+
+    def self.osync_rubymodule_address(obj)
+	obj.instance_variable_get(:@address)
+    end
+end
+
+ENV.delete("OSYNC_TRACE")
+$VERBOSE = nil
+start = now
+require File.expand_path(mapped) if mapped
+load base
+load_time = now - start
+
+plugin = Opensync::Plugin.allocate
+plugin.instance_variable_set(:@_self, Object.new)
+env = Opensync::Plugin::Env.allocate
+env.instance_variable_set(:@_self, Object.new)
+
+def measure(calls)
+    start = now
+    calls.times { yield }
+    (now - start) / calls * 1e9
+end
+
+def allocations(calls)
+    return 0 if not GC.respond_to?(:stat)
+    GC.start
+    before = GC.stat[:total_allocated_objects]
+    calls.times { yield }
+    (GC.stat[:total_allocated_objects] - before).to_f / calls
+end
+
+getter = measure(calls) { plugin.name }
+setter = measure(calls) { plugin.name = "x" }
+method = measure(calls) { env.find_plugin("x") }
+
+# A new SWIG object for the same C object on each access, as SWIG returns it
+swig = lambda { SWIG::TYPE_p_OSyncPlugin.new.tap {|_self| _self.instance_variable_set(:@address, 0x1000) } }
+Opensync::Plugin.represent SWIG::TYPE_p_OSyncPlugin
+keep = Opensync::Plugin.from(swig.call)
+from = measure(calls) { Opensync::Plugin.from(swig.call) }
+from_allocs = allocations(calls / 10) { Opensync::Plugin.from(swig.call) }
+wrap = measure(calls / 10) { Opensync::Plugin.new_pvt(swig.call) }
+wrap_allocs = allocations(calls / 10) { Opensync::Plugin.new_pvt(swig.call) }
+
+puts "# mode load_ms getter_ns setter_ns method_ns from_ns from_allocs new_ns new_allocs"
+printf("%-9s %8.2f %8.1f %8.1f %8.1f %8.1f %6.1f %8.1f %6.1f\n", (mapped ? "generated" : "class_eval"), load_time * 1e3, getter, setter, method,
+       from, from_allocs, wrap, wrap_allocs)
@@ -0,0 +1,118 @@
+#
+# Callbacks of packed_bench.c: FileFormat::Data _compare and _copy as the
+# example did them with Marshal and as it does them with
+# Opensync::PackedRecord. Both compare identical records, the common case in
+# a slow sync, so compare reads the whole payload. Packed copy returns a
+# String sharing the input bytes; the copy into opensync memory done by the
+# callback wrapper is the same for both and is not measured.
+#
+module PackedBench
+    # FileFormat::Data before PackedRecord
+    class MarshalData
+	attr_accessor :mode, :userid, :groupid, :last_mod, :path, :data, :size
+
+	def marshal_dump
+	  [@mode, @userid, @groupid, @last_mod, @path, @data, @size]
+	end
+
+	def marshal_load(array)
+	  (@mode, @userid, @groupid, @last_mod, @path, @data, @size) = array
+	end
+
+	def to_buf
+	    Marshal.dump(self)
+	end
+
+	def self.from_buf(buf)
+	    Marshal.load(buf)
+	end
+    end
+
+    module MarshalCodec
+	def self.build(path, data, stat)
+	    file = MarshalData.new
+	    file.path = path
+	    file.data = data
+	    file.size = data.size
+	    file.mode = stat.mode
+	    file.userid = stat.uid
+	    file.groupid = stat.gid
+	    file.last_mod = stat.mtime
+	    file.to_buf
+	end
+
+	def self.compare(leftdata, rightdata)
+	    leftfile = MarshalData.from_buf(leftdata)
+	    rightfile = MarshalData.from_buf(rightdata)
+	    return :mismatch if not leftfile.path == rightfile.path
+	    return :similar  if not leftfile.size == rightfile.size
+	    return :similar  if leftfile.size>0 and not leftfile.data == rightfile.data
+	    :same
+	end
+
+	def self.copy(input)
+	    MarshalData.from_buf(input).dup.to_buf
+	end
+    end
+
+    module PackedCodec
+	def self.build(path, data, stat)
+	    Opensync::PackedRecord.pack(path, data, stat.mode, stat.uid, stat.gid, stat.mtime)
+	end
+
+	def self.compare(leftdata, rightdata)
+	    leftfile = Opensync::PackedRecord.new(leftdata)
+	    rightfile = Opensync::PackedRecord.new(rightdata)
+	    return :mismatch if not leftfile.path_equal?(rightfile)
+	    return :similar  if not leftfile.data_equal?(rightfile)
+	    :same
+	end
+
+	def self.copy(input)
+	    Opensync::PackedRecord.new(input).to_s
+	end
+    end
+
+    CODECS = { "marshal" => MarshalCodec, "packed" => PackedCodec }
+    SIZES = [1024, 10 * 1024 * 1024]
+
+    def self.now
+	Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    # Calls block until seconds pass, returns calls/s
+    def self.rate(seconds)
+	calls = 0
+	start = now
+	begin
+	    yield
+	    calls += 1
+	end while now - start < seconds
+	calls / (now - start)
+    end
+
+    def self.run(seconds)
+	stat = File.stat(__FILE__)
+	puts "# codec operation size ops/s MB/s"
+	SIZES.each do
+	    |size|
+	    CODECS.each do
+		|name, codec|
+		# Separate strings, as opensync gives two buffers
+		left = codec.build("dir/file", "x" * size, stat)
+		right = codec.build("dir/file", "x" * size, stat)
+		raise "#{name} compare failed" if codec.compare(left, right) != :same
+		{
+		    "compare" => proc { codec.compare(left, right) },
+		    "copy"    => proc { codec.copy(left) },
+		}.each do
+		    |operation, call|
+		    ops = rate(seconds, &call)
+		    printf("%-7s %-7s %8d %10.0f %8.0f\n", name, operation, size, ops, ops * size / 1e6)
+		    $stdout.flush
+		end
+	    end
+	end
+	nil
+    end
+end
@@ -0,0 +1,69 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * FileFormat::Data compare/copy throughput with Marshal records (the format
+ * before Opensync::PackedRecord) and packed records, for 1 KB and 10 MB
+ * payloads. The callbacks of packed/bench_packed.rb run in an embedded ruby
+ * with only Opensync::Buffer and Opensync::PackedRecord, so this needs no
+ * opensync.
+ *
+ * Usage: packed_bench [seconds per case]
+ * Output: codec operation size ops/s MB/s
+ */
+
+#include "ruby_buffer.h"
+#include "ruby_packed.h"
+
+#include <ruby/version.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static VALUE bench_run(VALUE seconds) {
+    rb_require(BENCH_PACKEDDIR "/bench_packed.rb");
+    return rb_funcall(rb_path2class("PackedBench"), rb_intern("run"), 1, seconds);
+}
+
+int main(int argc, char **argv) {
+    VALUE mOpensync;
+    int state = 0;
+
+    ruby_init();
+#if RUBY_API_VERSION_MAJOR >= 3
+    {
+        /* As in ruby_module.c: loads the builtin ruby code (Marshal.load...) */
+        static char *options[] = { "packed_bench", "-e", "" };
+        ruby_options(3, options);
+    }
+#else
+    ruby_init_loadpath();
+#endif
+    mOpensync = rb_define_module("Opensync");
+    rubymodule_buffer_init(mOpensync);
+    rubymodule_packed_init(mOpensync);
+
+    rb_protect(bench_run, rb_float_new(argc > 1 ? atof(argv[1]) : 1.0), &state);
+    if (state) {
+        VALUE message = rb_obj_as_string(rb_errinfo());
+        fprintf(stderr, "%s\n", StringValueCStr(message));
+        return 1;
+    }
+    return ruby_cleanup(0);
+}
@@ -0,0 +1,156 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * Concurrent get_changes on 1, 2, 4 and 8 sinks of ractors/bench_ractors.rb,
+ * one caller thread per sink, [calls] calls each:
+ *
+ * main:  sinks run in the main ruby thread (the default)
+ * lanes: each sink is bound to a Ractor lane of its own (ruby >= 3.0)
+ *
+ * Usage: ractor_bench [calls] [work]
+ * Output: mode sinks calls seconds calls/s speedup
+ */
+
+#include "ruby_module.h"
+#include "callbacks_prototypes.h"
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_PLUGIN "ruby-bench-ractors"
+#define BENCH_SINKS  8
+
+static const char *modes[] = { "main", "lane" };
+
+struct bench_caller {
+    pthread_t thread;
+    OSyncObjTypeSink *sink;
+    OSyncPluginInfo *info;
+    int calls;
+    int failed;
+};
+
+static void report_result(void *data, OSyncError *error) {
+    if (error) {
+        fprintf(stderr, "get_changes failed: %s\n", osync_error_print(&error));
+        (*(int *) data)++;
+    }
+}
+
+static void *call_sink(void *data) {
+    struct bench_caller *caller = data;
+    OSyncError *error = NULL;
+    int i;
+
+    for (i = 0; i < caller->calls; i++) {
+        OSyncContext *ctx = osync_context_new(&error);
+        if (!ctx) {
+            caller->failed++;
+            break;
+        }
+        osync_context_set_callback(ctx, report_result, &caller->failed);
+        osync_rubymodule_objtype_sink_get_changes(caller->sink, caller->info, ctx, TRUE,
+                                                  osync_objtype_sink_get_userdata(caller->sink));
+        osync_context_unref(ctx);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int calls = argc > 1 ? atoi(argv[1]) : 20;
+    OSyncError *error = NULL;
+    OSyncPluginEnv *plugin_env;
+    OSyncPlugin *plugin;
+    OSyncPluginInfo *info;
+    struct bench_caller callers[BENCH_SINKS];
+    unsigned int m;
+    int i, sinks;
+
+    setenv("OPENSYNC_RUBY_PLUGINDIR", BENCH_RACTORSDIR, 0);
+    if (argc > 2)
+        setenv("BENCH_RACTORS_WORK", argv[2], 1);
+
+    plugin_env = osync_plugin_env_new(&error);
+    if (!plugin_env || !rubymodule_get_sync_info(plugin_env, &error))
+        goto error;
+    if (!(plugin = osync_plugin_env_find_plugin(plugin_env, BENCH_PLUGIN))) {
+        fprintf(stderr, "Plugin %s not registered\n", BENCH_PLUGIN);
+        return 1;
+    }
+
+    if (!(info = osync_plugin_info_new(&error)))
+        goto error;
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        for (i = 0; i < BENCH_SINKS; i++) {
+            char name[16];
+            OSyncObjTypeSink *sink;
+
+            snprintf(name, sizeof(name), "%s%d", modes[m], i);
+            if (!(sink = osync_objtype_sink_new(name, &error)))
+                goto error;
+            osync_plugin_info_add_objtype(info, sink);
+            osync_objtype_sink_unref(sink);
+        }
+    }
+    osync_rubymodule_plugin_initialize(plugin, info, &error);
+    if (osync_error_is_set(&error))
+        goto error;
+
+    printf("# mode sinks calls seconds calls/s speedup\n");
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        double base = 0;
+
+        for (sinks = 1; sinks <= BENCH_SINKS; sinks *= 2) {
+            double start, elapsed, rate;
+            int failed = 0;
+
+            start = bench_now();
+            for (i = 0; i < sinks; i++) {
+                char name[16];
+
+                snprintf(name, sizeof(name), "%s%d", modes[m], i);
+                callers[i].sink = osync_plugin_info_find_objtype(info, name);
+                callers[i].info = info;
+                callers[i].calls = calls;
+                callers[i].failed = 0;
+                pthread_create(&callers[i].thread, NULL, call_sink, &callers[i]);
+            }
+            for (i = 0; i < sinks; i++) {
+                pthread_join(callers[i].thread, NULL);
+                failed += callers[i].failed;
+            }
+            elapsed = bench_now() - start;
+            rate = sinks * calls / elapsed;
+            if (sinks == 1)
+                base = rate;
+            printf("%-5s %d %d %.3f %.1f %.2f%s\n", modes[m], sinks, sinks * calls, elapsed, rate,
+                   rate / base, failed ? " (failures)" : "");
+            fflush(stdout);
+        }
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "%s\n", error ? osync_error_print(&error) : "failed");
+    return 1;
+}
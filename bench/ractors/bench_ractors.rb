@@ -0,0 +1,42 @@
+#
+# Plugin used by ractor_bench. Every sink get_changes burns
+# BENCH_RACTORS_WORK iterations of ruby code and reports success.
+# Sinks named lane* are bound to a Ractor lane of their own, the others
+# run in the main ruby thread.
+#
+class BenchRactors < Opensync::Plugin
+    ID="ruby-bench-ractors"
+    WORK=(ENV2["BENCH_RACTORS_WORK"] || 200000).to_i
+
+    def self.get_sync_info(env)
+	env.register_plugin(self.new)
+    end
+
+    # Runs in a lane: only shareable state and the procedural API
+    def self.get_changes(sink, info, ctx, slow_sync, userdata)
+	sum=0
+	WORK.times {|i| sum+=i*i }
+	Opensync.osync_context_report_success(ctx)
+    end
+
+    def initialize_new
+	self.name=ID
+	self.longname="Ractor lanes benchmark"
+	self.description="Used by bench/ractor_bench"
+	self.initialize_func {|plugin, info| initialize0(info) }
+	self.finalize_func {|plugin, plugin_data| true }
+	self.discover_func {|plugin, info, plugin_data| true }
+    end
+
+    def initialize0(info)
+	callback=Opensync::Ractors.callback(BenchRactors, :get_changes)
+	info.objtype_sinks.each do
+	    |sink|
+	    sink.get_changes_func=callback
+	    Opensync::Ractors.bind(sink) if sink.name =~ /^lane/
+	end
+	true
+    end
+end
+
+Opensync::MetaPlugin.register(BenchRactors)
@@ -0,0 +1,51 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * Startup of the ruby module in a new process: from the ruby thread launch
+ * to the end of the first get_sync_info, loading opensync.rb and the
+ * plugins in OPENSYNC_RUBY_PLUGINDIR (the example, by default).
+ * iseq_bench.sh runs it with the compiled code cache off, cold and warm.
+ *
+ * Usage: startup_bench
+ * Output: seconds
+ */
+
+#include "ruby_module.h"
+
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+    OSyncError *error = NULL;
+    OSyncPluginEnv *env;
+
+    setenv("OPENSYNC_RUBY_PLUGINDIR", BENCH_EXAMPLEDIR, 0);
+
+    env = osync_plugin_env_new(&error);
+    if (!env || !rubymodule_get_sync_info(env, &error))
+        goto error;
+    printf("%.4f\n", rubymodule_startup_time());
+    osync_plugin_env_unref(env);
+    return 0;
+
+error:
+    fprintf(stderr, "%s\n", error ? osync_error_print(&error) : "failed");
+    return 1;
+}
@@ -0,0 +1,88 @@
+#
+# Plugin and formats used by bench_suite. Callbacks do as little as possible,
+# so the suite measures the binding (wrappers, dispatcher, conversions):
+#
+#  ruby-bench-suite: get_changes reports BENCH_SUITE_CHANGES changes of
+#                    BENCH_SUITE_SIZE bytes, commit reports success
+#  bench_suite:      compare (byte compare) and copy
+#  bench_suite_out:  target of the bench_suite converter (returns its input)
+#
+class BenchSuite < Opensync::Plugin
+    ID="ruby-bench-suite"
+    SIZE=(ENV2["BENCH_SUITE_SIZE"] || 1024).to_i
+    CHANGES=(ENV2["BENCH_SUITE_CHANGES"] || 100).to_i
+    # Changes reported per native call
+    BATCH=1000
+
+    def self.get_sync_info(env)
+	env.register_plugin(self.new)
+    end
+
+    def initialize_new
+	self.name=ID
+	self.longname="Benchmark suite plugin"
+	self.description="Used by bench/bench_suite"
+	self.initialize_func {|plugin, info| initialize0(info) }
+	self.finalize_func {|plugin, plugin_data| true }
+	self.discover_func {|plugin, info, plugin_data| true }
+    end
+
+    def initialize0(info)
+	format = info.format_env.find_objformat(BenchSuiteFormat::ID) or
+	    raise "Unable to find #{BenchSuiteFormat::ID} format"
+	payload = ("x" * SIZE).freeze
+	info.objtype_sinks.each do
+	    |sink|
+	    sink.get_changes_func {|sink, info, ctx, slow_sync, userdata| get_changes(sink, ctx, format, payload) }
+	    sink.commit_func {|sink, info, ctx, change, userdata| ctx.report_success }
+	end
+	true
+    end
+
+    def get_changes(sink, ctx, format, payload)
+	changes = []
+	CHANGES.times do
+	    |i|
+	    changes << ["suite-#{i}", Opensync::OSYNC_CHANGE_TYPE_ADDED, i.to_s, payload]
+	    if changes.size >= BATCH
+		ctx.report_changes(changes, format, sink.name)
+		changes.clear
+	    end
+	end
+	ctx.report_changes(changes, format, sink.name)
+	ctx.report_success
+    end
+end
+
+class BenchSuiteFormat < Opensync::ObjectFormat
+    ID="bench_suite"
+    OUT_ID="bench_suite_out"
+
+    def self.get_format_info(env)
+	env.register_objformat(self.new(ID, "data"))
+	env.register_objformat(self.new(OUT_ID, "data"))
+    end
+
+    def self.get_conversion_info(env)
+	source = env.find_objformat(ID) or
+	    raise "Unable to find #{ID} format"
+	target = env.find_objformat(OUT_ID) or
+	    raise "Unable to find #{OUT_ID} format"
+	env.register_converter(Opensync::FormatConverter.new(Opensync::OSYNC_CONVERTER_CONV, source, target,
+	    Proc.new {|converter, input, config, userdata| [input, false] }))
+	true
+    end
+
+    def initialize_new(name, objtype)
+	# No native fast path: every compare reaches ruby
+	self.compare_fast_path = false
+	self.compare_func {|format, leftdata, rightdata, user_data|
+	    leftdata == rightdata ? Opensync::OSYNC_CONV_DATA_SAME : Opensync::OSYNC_CONV_DATA_MISMATCH
+	}
+	self.copy_func {|format, input, user_data| input }
+    end
+end
+
+Opensync::MetaPlugin.register(BenchSuite)
+Opensync::MetaFormat.register(BenchSuiteFormat)
+Opensync::MetaConverter.register(BenchSuiteFormat)
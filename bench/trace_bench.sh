@@ -0,0 +1,23 @@
+#!/bin/sh
+#
+# Callback throughput (callback_bench) with the ruby tracer off, sampled
+# and full. Tracing is enabled by OSYNC_TRACE, that also makes opensync
+# write its own trace files into a temporary directory.
+#
+# Usage: trace_bench.sh <callback_bench> [calls] [sample]
+# Output: mode calls size calls/s
+#
+BENCH=${1:?usage: $0 <callback_bench> [calls] [sample]}
+CALLS=${2:-100000}
+SAMPLE=${3:-100}
+TRACEDIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$TRACEDIR"' EXIT
+
+echo "# mode calls size calls/s"
+run() {
+    mode=$1; shift
+    env "$@" "$BENCH" "$CALLS" | grep -v '^#' | sed "s/^/$mode /"
+}
+run off     -u OSYNC_TRACE
+run sampled OSYNC_TRACE="$TRACEDIR" OPENSYNC_RUBY_TRACE_SAMPLE="$SAMPLE"
+run full    OSYNC_TRACE="$TRACEDIR" OPENSYNC_RUBY_TRACE_SAMPLE=1
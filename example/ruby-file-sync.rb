@@ -115,6 +115,14 @@ class RubyFileSync < Opensync::Plugin
       ID="ruby-file-sync"
       class Dir
 	  attr_accessor :env, :sink, :recursive, :path
+	  # Opensync::FS::Journal of path, when enabled, and the cursor to
+	  # store once this sync is done
+	  attr_accessor :journal, :journal_cursor
+	  # Files of this size or more are mapped instead of read
+	  attr_accessor :map_threshold
+	  # Opensync::DigestCache of path when hashing contents, and whether
+	  # this sync walked the whole tree (entries of files gone can go)
+	  attr_accessor :digests, :digests_prune
       end
 
       class FileSyncEnv
@@ -136,6 +144,7 @@ class RubyFileSync < Opensync::Plugin
       def initialize0(info)
 	  env=FileSyncEnv.new
 	  config = info.config
+	  configure_gc(config)
 
 	  info.objtype_sinks.each do
 	    |sink|
@@ -155,6 +164,9 @@ class RubyFileSync < Opensync::Plugin
 		raise Opensync::OsyncMisconfigurationError.new("Path for object type \"#{objtype}\" defined for more than one objtype.")
 	    end
 	    pathes << dir.path
+	    dir.journal = Opensync::FS::Journal.new(dir.path) if journal?(config)
+	    dir.map_threshold = map_threshold(config)
+	    dir.digests = Opensync::DigestCache.of(dir.path) if content_hash?(config)
 
 	    res.objformat_sinks.each do
 		|sink|
@@ -182,6 +194,33 @@ class RubyFileSync < Opensync::Plugin
 	  return env
       end
 
+      # Advanced option "Journal" (true/false, default false): get the changes
+      # from a journal kept by a watcher instead of scanning the whole tree.
+      # The first sync and slow syncs still scan it
+      def journal?(config)
+	  option = config.advancedoptions.find {|option| option.name == "Journal" } if config
+	  option ? option.value == "true" : false
+      end
+
+      MAP_THRESHOLD=4 << 20
+
+      # Advanced option "MapThreshold" (bytes, default 4 MiB): files this
+      # large are reported as read-only mappings (Opensync::PackedRecord.map)
+      # instead of being read into ruby
+      def map_threshold(config)
+	  option = config.advancedoptions.find {|option| option.name == "MapThreshold" } if config
+	  option ? Integer(option.value) : MAP_THRESHOLD
+      end
+
+      # Advanced option "ContentHash" (true/false, default false): tell
+      # modified files by their contents instead of their times, so a touch,
+      # chmod or restore is not reported. Only files whose size or mtime
+      # changed are read again. Switching it reports every file once
+      def content_hash?(config)
+	  option = config.advancedoptions.find {|option| option.name == "ContentHash" } if config
+	  option ? option.value == "true" : false
+      end
+
       def finalize(plugin_data)
 	  # Clean the callback references (and let GC clean) TODO: check if it is cleaned
 	  plugin_data.directories.each {|dir| dir.sink.clean }
@@ -220,21 +259,27 @@ class RubyFileSync < Opensync::Plugin
 	  tmp = filename_scape_characters(change.uid)
 	  filename = Pathname.new(dir.path) + tmp
 
-	  data=nil
-	  file = FileFormat::FileFormat::Data.new
-	  filename.open do|io|
-	      file.data     = io.gets(nil);
-	      file.path     = change.uid;
-	      stat = io.stat
-	      file.userid   = stat.uid
-	      file.groupid  = stat.gid;
-	      file.mode     = stat.mode;
-	      file.last_mod = stat.mtime;
-	      file.size     = file.data.size;
+	  stat = filename.stat
+	  if stat.size >= dir.map_threshold
+	      record = Opensync::PackedRecord.map(change.uid, filename.to_s, stat.mode, stat.uid, stat.gid, stat.mtime)
+	  else
+	      file = FileFormat::Data.new
+	      filename.open do|io|
+		  file.data     = io.gets(nil) || ""
+		  file.path     = change.uid;
+		  stat = io.stat
+		  file.userid   = stat.uid
+		  file.groupid  = stat.gid;
+		  file.mode     = stat.mode;
+		  file.last_mod = stat.mtime;
+		  file.size     = file.data.size;
+	      end
+	      record = file.to_buf
 	  end
 
 	  fileformat = formatenv.find_objformat(FileFormat::ID)
-	  odata = Opensync::Data.new(file, fileformat)
+	  # Owned by opensync from here: a mapping is handed over, not copied
+	  odata = Opensync::Data.new(record, fileformat)
 	  odata.objtype=sink.name
 	  change.data=odata
 
@@ -268,78 +313,139 @@ class RubyFileSync < Opensync::Plugin
 	      File.open(filename, "w") {|io|
 		  io.print(file.data)
 		  # Maybe this does not make sense as it comes from convert_plain_to_file
-		  # that destroys any evidence of the file mode
- 	          io.chmod(file.mode) if file.mode
+		  # that destroys any evidence of the file mode (packed as 0)
+ 	          io.chmod(file.mode) if file.mode != 0
 	      }
 	end
 	return TRUE
       end
 
-      def report_dir(dir, info, subdir, ctx)
-	  formatenv=info.format_env
-	  hashtable=dir.sink.hashtable
-	  path = Pathname.new(dir.path) + subdir
-	  #$stderr.puts path, path.entries.size, path.entries
-	  path.entries.reject {|entry| [".",".."].include?(entry.to_s)}.each do
-	    |entry|
-	    filename = Pathname.new(dir.path) + entry
-	    if !subdir
-		relative_filename = entr
+      # Changes reported per native call, and bytes read into ruby before
+      # reporting them anyway (mapped files only count their path)
+      REPORT_BATCH=1000
+      REPORT_BYTES=64 << 20
+
+      # Reports the files of dir (or of its subdir) that changed.
+      # Opensync::FS.scan lists and stats them from native threads: each
+      # batch is classified and reported while the next one is being scanned
+      def report_dir(dir, info, ctx, subdir=nil)
+	  fileformat = info.format_env.find_objformat(FileFormat::ID)
+	  root = subdir ? File.join(dir.path, subdir) : dir.path
+	  Opensync::FS.scan(root, recursive: dir.recursive?, batch: REPORT_BATCH) do
+	    |uids, modes, sizes, mtimes, ctimes, inodes|
+	    if dir.digests
+		hashes = Opensync::FS.digest(root, uids, cache: dir.digests)
+		# Removed since the scan: deleted files of this sync, or in the
+		# journal of the next one
+		found = hashes.each_index.select {|i| hashes[i] }
+		uids = found.collect {|i| uids[i] }
+		hashes = hashes.compact
 	    else
-		relative_filename = Pathname.new(subdir) + entry
+		hashes = uids.each_index.collect {|i| hash_of(mtimes[i], ctimes[i]) }
 	    end
-	    if File.directory?(filename)
-		if (dir.recursive?)
-		    report_dir(dir, info, relative_filename, ctx)
-		end
-	    elsif File.file?(filename)
-		change=Opensync::Change.new
-		change.uid=relative_filename.to_s
-		change.hash=generate_hash(File.new(filename))
-		type = hashtable.get_changetype(change)
-		change.changetype=type
-
-		hashtable.update_change(change)
-		next if type == Opensync::OSYNC_CHANGE_TYPE_UNMODIFIED
-
-		file = FileFormat::Data.new
-		filename.open{|io|
-		    file.data     = io.gets(nil)
-		    file.size     = file.data.size
-		    file.path     = relative_filename.to_s
-		}
-		fileformat = formatenv.find_objformat(FileFormat::ID)
-		odata = Opensync::Data.new(file.to_buf, fileformat)
-		odata.objtype=dir.sink.name
-		change.data=odata
-		ctx.report_change(change)
+	    uids = uids.collect {|uid| File.join(subdir, uid) } if subdir
+	    report_files(dir, ctx, fileformat, uids, hashes)
+	  end
+      end
+
+      # Reports the paths recorded in the journal of dir: new directories
+      # are scanned, files are checked one by one. Removed files are
+      # reported if the hashtable knows them
+      def report_journal(dir, info, ctx, changes)
+	  fileformat = info.format_env.find_objformat(FileFormat::ID)
+	  hashtable = dir.sink.hashtable
+	  trees = dir.recursive? ? changes.trees : []
+	  # "a" covers "a/b"
+	  trees = trees.reject {|tree| trees.any? {|other| tree.start_with?("#{other}/") } }
+	  trees.each do
+	    |tree|
+	    begin
+		report_dir(dir, info, ctx, tree)
+	    rescue Errno::ENOENT, Errno::ENOTDIR
+		# Removed meanwhile: the next sync finds it in the journal
+	    end
+	  end
+	  files = changes.files.reject do
+	    |uid|
+	    (not dir.recursive? and uid.include?("/")) or trees.any? {|tree| uid.start_with?("#{tree}/") }
+	  end
+	  files.each_slice(REPORT_BATCH) do
+	    |slice|
+	    uids = []
+	    hashes = []
+	    slice.zip(hashes_of(dir, slice)) do
+	      |uid, hash|
+	      if hash or hashtable.get_hash(uid)
+		  uids << uid
+		  hashes << hash
+	      end
+	    end
+	    report_files(dir, ctx, fileformat, uids, hashes)
+	  end
+      end
+
+      # Classifies uids by their hashes (nil: removed) and reports those
+      # that changed
+      def report_files(dir, ctx, fileformat, uids, hashes)
+	  types = dir.sink.hashtable.classify_and_update(uids, hashes)
+	  changes = []
+	  bytes = 0
+	  uids.each_index do
+	    |i|
+	    next if types[i] == Opensync::OSYNC_CHANGE_TYPE_UNMODIFIED
+	    if not hashes[i]
+		changes << [uids[i], types[i], nil, nil]
+		next
+	    end
+
+	    record = file_record(dir, uids[i])
+	    changes << [uids[i], types[i], hashes[i], record]
+	    bytes += record.size if not record.kind_of?(Opensync::Buffer)
+	    if bytes >= REPORT_BYTES
+		ctx.report_changes(changes, fileformat, dir.sink.name)
+		changes.clear
+		bytes = 0
 	    end
 	  end
+	  ctx.report_changes(changes, fileformat, dir.sink.name)
+      end
+
+      # Packed record of uid, as get_changes reports it. Files of
+      # map_threshold bytes or more are mapped: their contents never reach
+      # ruby, and opensync owns the mapping once reported
+      def file_record(dir, uid)
+	  filename = File.join(dir.path, uid)
+	  return Opensync::PackedRecord.map(uid, filename) if File.size(filename) >= dir.map_threshold
+	  file = FileFormat::Data.new
+	  File.open(filename, "rb") {|io|
+	      file.data     = io.gets(nil) || ""
+	      file.size     = file.data.size
+	      file.path     = uid
+	  }
+	  file.to_buf
       end
 
       def get_changes_func(sink, info, ctx, slow_sync, userdata)
 
 	  dir=userdata
-	  format_env = info.format_env
+	  fileformat = info.format_env.find_objformat(FileFormat::ID)
 	  hashtable = sink.hashtable
 
 	  hashtable.slowsync if (slow_sync)
 
-	  report_dir(dir, info, "", ctx)
-
-	  hashtable.deleted.each do
-	      |uid|
-	      change = Opensync::Change.new
-	      change.uid=uid
-	      change.changetype = Opensync::OSYNC_CHANGE_TYPE_DELETED
-
-	      fileformat = format_env.find_objformat(FileFormat::ID)
-	      odata = Opensync::Data.new("", fileformat)
-	      odata.objtype=sink.name
-	      change.data=odata
-	      ctx.report_change(change)
-	      hashtable.update_change(change)
+	  # A slow sync starts over: the hashtable is empty
+	  changes = dir.journal.changes(slow_sync ? nil : sink.state_db.get("journal")) if dir.journal
+	  if changes and not changes.rescan?
+	      report_journal(dir, info, ctx, changes)
+	  else
+	      report_dir(dir, info, ctx)
+	      dir.digests_prune = true
+
+	      deleted = hashtable.deleted.to_a
+	      ctx.report_changes(deleted.collect {|uid| [uid, Opensync::OSYNC_CHANGE_TYPE_DELETED, nil, nil] }, fileformat, sink.name)
+	      hashtable.classify_and_update(deleted, [nil] * deleted.size)
 	  end
+	  dir.journal_cursor = changes && changes.cursor
 	  ctx.report_success
       end
 
@@ -347,8 +453,24 @@ class RubyFileSync < Opensync::Plugin
 	  tmp.tr('/!?:*\><@',"_")
       end
 
-      def generate_hash(file)
-	  "#{file.mtime.to_i}-#{file.ctime.to_i}"
+      def generate_hash(stat)
+	  hash_of(stat.mtime.to_i, stat.ctime.to_i)
+      end
+
+      # generate_hash of the times given by Opensync::FS.scan
+      def hash_of(mtime, ctime)
+	  "#{mtime}-#{ctime}"
+      end
+
+      # Hashes of the files at uids, nil for those missing: digests of their
+      # contents with the "ContentHash" option, generate_hash otherwise
+      def hashes_of(dir, uids)
+	  return Opensync::FS.digest(dir.path, uids, cache: dir.digests) if dir.digests
+	  uids.collect do
+	    |uid|
+	    stat = File.stat(File.join(dir.path, uid)) rescue nil
+	    generate_hash(stat) if stat and stat.file?
+	  end
       end
 
       def commit_func(sink, info, ctx, change, userdata)
@@ -357,7 +479,7 @@ class RubyFileSync < Opensync::Plugin
 	  write(sink, info, ctx, change, userdata)
 	  filename="#{dir.path}/#{filename_scape_characters(change.uid)}"
 	  if change.changetype != Opensync::OSYNC_CHANGE_TYPE_DELETED
-		hash = generate_hash(File.new(filename));
+		hash = dir.digests ? hashes_of(dir, [filename_scape_characters(change.uid)]).first : generate_hash(File.stat(filename))
 		change.hash=hash
 	  end
 	  hashtable.update_change(change)
@@ -368,12 +490,23 @@ class RubyFileSync < Opensync::Plugin
 	dir=userdata
 	state_db = sink.state_db
 	state_db.set("path", dir.path)
+	# Where the next sync continues the journal ("": scan the tree)
+	state_db.set("journal", dir.journal_cursor.to_s) if dir.journal
+	begin
+	    dir.digests.save(dir.digests_prune) if dir.digests
+	rescue SystemCallError
+	    # Only a cache: the next sync reads the files again
+	end
+	dir.digests_prune = false
 	ctx.report_success
       end
 end
 
 class FileFormat < Opensync::ObjectFormat
     ID="ruby_file"
+    # Builds the buffers of this format. They are Opensync::PackedRecord
+    # blocks: callbacks read a field or compare two of them in place, without
+    # loading the whole record as Marshal did.
     class Data
 	attr_accessor :mode, :userid, :groupid, :last_mod, :path, :data, :size
 
@@ -381,27 +514,13 @@ class FileFormat < Opensync::ObjectFormat
 	    "File #{self.path}: size: #{self.size}"
 	end
 
-	def marshal_dump
-	  [@mode, @userid, @groupid, @last_mod, @path, @data, @size]
-	end
-
-	def marshal_load(array)
-	  (@mode, @userid, @groupid, @last_mod, @path, @data, @size) = array
-	end
-
 	def to_buf
-	    buf=Marshal.dump(self)
-# 	    $stderr.puts "",self,buf
-	    buf
+	    Opensync::PackedRecord.pack(self.path.to_s, self.data || "", self.mode, self.userid, self.groupid, self.last_mod)
 	end
 
+	# A read only view (Opensync::PackedRecord) over buf
 	def self.from_buf(buf)
-# 	    $stderr.puts "",buf
-	    Marshal.load(buf)
-	end
-
-	def ==(obj)
-	    self.marshal_dump==obj.marshal_dump
+	    Opensync::PackedRecord.new(buf)
 	end
     end
 
@@ -411,6 +530,11 @@ class FileFormat < Opensync::ObjectFormat
     end
 
     def initialize_new(name, objtype)
+	# Records reach the callbacks as Opensync::Buffer, not String copies:
+	# mapped files stay mapped
+	self.zero_copy=true
+	# Equal records are the same file: answered without calling _compare
+	self.compare_fast_path=true
 	# Map the callbacks
         self.compare_func {|format, *args| self._compare(*args) }
 	self.destroy_func {|format, *args| self._destroy(*args) }
@@ -426,11 +550,10 @@ class FileFormat < Opensync::ObjectFormat
 #     private
 
     def _compare(leftdata, rightdata, user_data)
-      	leftfile = FileFormat::Data.from_buf(leftdata);
-	rightfile = FileFormat::Data.from_buf(rightdata);
-	return Opensync::OSYNC_CONV_DATA_MISMATCH if not leftfile.path == rightfile.path
-	return Opensync::OSYNC_CONV_DATA_SIMILAR  if not leftfile.size == rightfile.size
-	return Opensync::OSYNC_CONV_DATA_SIMILAR  if leftfile.size>0 and not leftfile.data == rightfile.data
+	leftfile = FileFormat::Data.from_buf(leftdata)
+	rightfile = FileFormat::Data.from_buf(rightdata)
+	return Opensync::OSYNC_CONV_DATA_MISMATCH if not leftfile.path_equal?(rightfile)
+	return Opensync::OSYNC_CONV_DATA_SIMILAR  if not leftfile.data_equal?(rightfile)
 	return Opensync::OSYNC_CONV_DATA_SAME
     end
 
@@ -440,12 +563,13 @@ class FileFormat < Opensync::ObjectFormat
 
     def _duplicate(uid, input,user_data)
 	file=FileFormat::Data.from_buf(input)
-	file.path="#{copy.path}-dupe"
-	[file.path, file.to_buf, true]
+	path="#{file.path}-dupe"
+	[path, file.with_path(path), true]
     end
 
     def _copy(input,user_data)
-	FileFormat::Data.from_buf(input).dup.to_buf
+	# A packed record is its own copy. A mapped one is shared, not copied
+	input.dup
     end
 
     def _revision(input,user_data)
@@ -453,20 +577,19 @@ class FileFormat < Opensync::ObjectFormat
     end
 
     def _print(data,user_data)
-	[FileFormat::Data.from_buf(data).to_s, false]
+	file=FileFormat::Data.from_buf(data)
+	["File #{file.path}: size: #{file.size}", false]
     end
 
+    # The packed record goes as is, read in place
     def _marshal(input, marshal, user_data)
-	fileformat=FileFormat::Data.from_buf(input)
-	marshal.write_string(fileformat.path)
-	marshal.write_buffer(fileformat.data)
+	marshal.write_buffer(input)
     end
 
     def _demarshal(marshal, user_data)
-	file = FileFormat::Data.new
-	file.path = marshal.read_string
-	file.data = marshal.read_buffer
-	file.to_buf
+	record = marshal.read_buffer
+	raise "not a #{ID} record" if not Opensync::PackedRecord.packed?(record)
+	record
     end
 end
 
@@ -476,6 +599,9 @@ class PlainFormat < Opensync::ObjectFormat
 
 
     def initialize_new(name, objtype)
+	# compare and copy only need the bytes: no String copies
+	self.zero_copy=true
+	self.compare_fast_path=true
 	self.compare_func=callback{|format, *args| self._compare(*args) }
 	self.copy_func=callback{|format, *args| self._copy(*args) }
 	self.destroy_func=callback{|format, *args| self._destroy(*args) }
@@ -508,7 +634,7 @@ class FilePlainConverter < Opensync::FormatConverter
 
     def self.convert_file_to_plain(input)
 # 	$stderr.puts 123
-	[FileFormat::Data.from_buf(input).data.dup, false]
+	[FileFormat::Data.from_buf(input).data, false]
     end
 
     def self.convert_plain_to_file(input)
@@ -2,23 +2,129 @@
 #
 # Generate all callback functions
 #
+# Usage: gencallbacks.rb > callbacks.h
+#        gencallbacks.rb --prototypes > callbacks_prototypes.h
+#
 
 require "date"
+require "stringio"
+
+# Code is collected here and printed after the callback slots enum (see
+# define_callback_slots) as the enum must be known before any code.
+$stdout = StringIO.new
+
+
+class String
+    def trim
+	return self.sub(/^[[:blank:]]/,"").sub(/[[:blank:]]$/,"")
+    end
+end
+$ruby_methods={}
+$callback_slots=[]
+$stats_kinds=[]
+$swig_types={}
+$prototypes=[]
+
+#
+# Returns the name of the enum constant that indexes the callback vector
+# of the owner object (see osync_rubymodule_get_callback)
+#
+def callback_slot(name)
+    slot="RUBYMODULE_CB_#{name.sub(/^osync_/,"").upcase}"
+    $callback_slots << slot if not $callback_slots.include?(slot)
+    slot
+end
+
+#
+# Returns the enum constant of the kind of callback func_name runs, for the
+# callback metrics (see ruby_stats.h)
+#
+def stats_kind(func_name)
+    name=func_name.sub(/^(osync_)?rubymodule_/,"")
+    $stats_kinds << name if not $stats_kinds.include?(name)
+    "RUBYMODULE_KIND_#{name.upcase}"
+end
 
+#
+# Returns the SWIG descriptor of a pointer argument type ("OSyncPluginInfo*"
+# is SWIGTYPE_p_OSyncPluginInfo): an entry of the SWIG type table, filled
+# once when the module is initialized, instead of a SWIG_TypeQuery by name
+# on every call. define_callback_slots makes a descriptor the wrapper does
+# not define a build error
+#
+def swig_type(type)
+    match=/\A([_[:alpha:]][_[:alnum:]]*)(\*+)\z/.match(type) or
+	raise "No SWIG descriptor for the callback argument type '#{type}'"
+    descriptor="SWIGTYPE_#{"p_" * match[2].size}#{match[1]}"
+    $swig_types[descriptor]=type
+    descriptor
+end
+
+#
+# Called at the end of this script. Prints the file header and the callback
+# slots enum followed by the collected code. ruby_module.c includes this file
+# once with RUBYMODULE_CALLBACKS_SLOTS_ONLY defined, just to get the enum,
+# and later again for the code.
+#
+def define_callback_slots
+    code=$stdout.string
+    $stdout=STDOUT
 puts <<EOF
 /*
  * This file was generated by #{__FILE__} at #{DateTime.now}
  *
  */
 
+#ifndef RUBYMODULE_CALLBACKS_SLOTS
+#define RUBYMODULE_CALLBACKS_SLOTS
+enum rubymodule_callback_slot {
+#{$callback_slots.collect {|slot| "    #{slot},"}.join("\n")}
+    RUBYMODULE_CB_COUNT
+};
+
+/* Kinds of callback in the callback metrics */
+enum rubymodule_stats_kind {
+#{$stats_kinds.collect {|name| "    RUBYMODULE_KIND_#{name.upcase},"}.join("\n")}
+    RUBYMODULE_KIND_COUNT
+};
+static const char * const rubymodule_kind_names[] = {
+#{$stats_kinds.collect {|name| "    \"#{name}\","}.join("\n")}
+};
+#endif
+
+#ifndef RUBYMODULE_CALLBACKS_SLOTS_ONLY
+#{$swig_types.keys.sort.collect {|descriptor| "#ifndef #{descriptor}\n#error \"The SWIG wrapper has no descriptor for #{$swig_types[descriptor]} (callback argument)\"\n#endif\n" }.join}
+#{code}
+#endif
 EOF
+end
 
-class String
-    def trim
-	return self.sub(/^[[:blank:]]/,"").sub(/[[:blank:]]$/,"")
-    end
+#
+# Called at the end of this script with --prototypes, instead of the two
+# above. Prints the prototypes of the generated functions, for the code that
+# calls the callbacks directly (opensync-ruby-host, tests and benchmarks)
+#
+def define_prototypes
+    $stdout=STDOUT
+puts <<EOF
+/*
+ * This file was generated by #{__FILE__} at #{DateTime.now}
+ *
+ */
+
+#ifndef _RUBYMODULE_CALLBACKS_PROTOTYPES_H
+#define _RUBYMODULE_CALLBACKS_PROTOTYPES_H
+
+#include <opensync/opensync.h>
+#include <opensync/opensync-format.h>
+#include <opensync/opensync-plugin.h>
+#include <time.h>
+
+#{$prototypes.join("\n")}
+
+#endif
+EOF
 end
-$ruby_methods={}
 
 #
 # Called at the end of this script to create the method
@@ -69,12 +175,14 @@ end
 
 
 
-def define_callback(setter, signature, argins, logic)
+# fastpath: C code run in the caller thread before handing the call to ruby
+def define_callback(setter, signature, argins, logic, fastpath=nil)
     (result_type, args, arg_type)=parse_signature(signature)
     has_result    = result_type != "void"
     has_error     = arg_type.include?("error")
     callback_name = setter.sub(/^osync_(.*)_set_(.*)_func$/,"osync_rubymodule_\\1_\\2")
     rb_setter_name= setter.sub(/^osync_(.*)_func$/,"rb_osync_rubymodule_\\1")
+    slot          = callback_slot(setter.sub(/^osync_(.*)_set_(.*)_func$/,"\\1_\\2"))
     $ruby_methods[setter]=rb_setter_name
 
     owner_type 	  = args.first.first.gsub(/\**/,"")
@@ -82,9 +190,11 @@ def define_callback(setter, signature, argins, logic)
     puts <<EOF
 /* This method is the callback wrapper defined by #{setter} inside ruby */
 EOF
-    define_rubycall callback_name, signature, argins, <<EOF
-    VALUE _callback = osync_rubymodule_get_data (#{argins.first}, "#{setter}" );
-    #{has_result ? "VALUE ruby_result = " : "/* no result */" } rb_funcall2_protected ( _callback, "call", #{argins.size}, ruby_args, &ruby_error );
+    # Results reported through the context: the caller can go on (see rubymodule_async_post)
+    async         = (!has_result and arg_type["ctx"] == "OSyncContext*")
+    define_rubycall callback_name, signature, argins, <<EOF, async, fastpath
+    VALUE _callback = osync_rubymodule_get_callback (#{argins.first}, #{slot} );
+    #{has_result ? "VALUE ruby_result = " : "/* no result */" } rb_funcall2_protected ( _callback, id_call, #{argins.size}, ruby_args, &ruby_error );
     if ( ruby_error!=0 ) {
 	osync_rubymodule_error_set( error, OSYNC_ERROR_GENERIC, "Failed to call #{callback_name} function!");
         goto error;
@@ -108,7 +218,7 @@ VALUE #{rb_setter_name}( int argc, VALUE *argv, VALUE self ) {
         SWIG_exception_fail ( SWIG_ArgError ( res1 ), Ruby_Format_TypeError ( "", "#{owner_type}", "#{setter}", 1, argv[0] ) );\
     }
     arg1 = ( #{owner_type} * ) ( argp1 );
-    osync_rubymodule_set_data ( argp1, "#{setter}", argv[1] );
+    osync_rubymodule_set_callback ( argp1, #{slot}, argv[1] );
     #{setter} ( arg1, #{callback_name} );
     return Qnil;
 fail:
@@ -119,11 +229,25 @@ EOF
 end
 
 
-def define_rubycall(func_name, signature, argins, logic)
+# OpenSync objects given to an async callback are referenced until it ends
+ASYNC_REFS={
+    "OSyncObjTypeSink*" => "osync_objtype_sink",
+    "OSyncPluginInfo*"  => "osync_plugin_info",
+    "OSyncContext*"     => "osync_context",
+    "OSyncChange*"      => "osync_change",
+}
+
+def define_rubycall(func_name, signature, argins, logic, async=false, fastpath=nil)
     (result_type, args, arg_type)=parse_signature(signature)
     has_result    = result_type != "void"
     has_error     = arg_type.include?("error")
+    kind          = stats_kind(func_name)
+    # Bytes given to ruby (sized data) and returned (through unsigned int* sizes), for the metrics
+    bytes_in      = argins.select {|name| ["char*", "const char*"].include?(arg_type[name]) }.
+			collect {|name| ["#{name}size", "size"].find {|size| arg_type[size] == "unsigned int" } }.compact
+    bytes_out     = args.select {|(type,name)| type == "unsigned int*" }.collect {|(type,name)| "*#{name}" }
     $stderr.puts "Generating '#{func_name}'"
+    $prototypes << "#{result_type} #{func_name}(#{args.collect{|typename| typename.join(" ")}.join(", ")});"
 
 puts <<EOF
 
@@ -131,50 +255,65 @@ puts <<EOF
     osync_trace ( TRACE_ENTRY, "%s(#{format_for(args)})", __func__, #{args.collect {|(type,name)| name}.join(", ")});
     int ruby_error = 0;
     #{has_result ? "#{result_type} result = (#{result_type})0;" : "/* no result */" }
-    #{has_error ? "" : "OSyncError **error = 0;" }
+    #{has_error ? "" : (async ? "OSyncError *local_error = NULL; OSyncError **error = &local_error;" : "OSyncError **error = 0;") }
     /* Where ruby arguments lives */
     VALUE ruby_args[#{argins.size}];
+    struct rubymodule_stats_span stats_span;
+    uint64_t stats_out = 0;
+    rubymodule_stats_begin(&stats_span);
 #{
+    # Sized data is passed as a borrowed Opensync::Buffer if the owner opted in
+    buffers=[]
     code=[]
     argins.each_index do
       |i|
       type=arg_type[argins[i]]
       case type
       when "char*", "const char*"
+        size=nil
         if arg_type.include?("#{argins[i]}size")
-	  assign="SWIG_FromCharPtrAndSize (#{argins[i]}, #{argins[i]}size)"
+	  size="#{argins[i]}size"
 	elsif arg_type.include?("size")
-          assign="SWIG_FromCharPtrAndSize (#{argins[i]}, size)"
+	  size="size"
+        end
+        if size
+          buffers << i
+	  assign="zero_copy ? rubymodule_buffer_borrow (#{argins[i]}, #{size}) : SWIG_FromCharPtrAndSize (#{argins[i]}, #{size})"
 	else
           assign="SWIG_FromCharPtr(#{argins[i]})"
         end
       when "void*"
-        assign="(#{argins[i]}==NULL?Qnil:*(VALUE*)#{argins[i]})"
+        assign="PTR_VALUE(#{argins[i]})"
       when "osync_bool"
         assign="BOOLR(#{argins[i]})"
       else
-	assign="SWIG_NewPointerObj( #{argins[i]}, SWIG_TypeQuery(\"#{arg_type[argins[i]]}\"), 0 |  0 )"
+	assign="SWIG_NewPointerObj( #{argins[i]}, #{swig_type(type)}, 0 |  0 )"
       end
       code <<"    ruby_args[#{i}]=#{assign};"
     end
+    code.unshift("    osync_bool zero_copy = osync_rubymodule_zero_copy(#{argins.first});") if not buffers.empty?
     code.join("\n")
 }
     /* now, finally runs the code*/
 #{logic}
-    osync_trace ( TRACE_EXIT, \"%s:\", __func__);
+#{bytes_out.empty? ? "" : "    stats_out = #{bytes_out.join(" + ")};\n"}    osync_trace ( TRACE_EXIT, \"%s:\", __func__);
     goto exit;
 error:
     osync_trace ( TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print (error) );
-exit:
+#{async ? "    rubymodule_context_failed(ctx, error);\n" : ""}exit:
+#{
+    # Borrowed buffers must not be used after the input is gone
+    buffers.collect{|i| "    if (zero_copy) rubymodule_buffer_invalidate(ruby_args[#{i}]);\n"}.join
+}    rubymodule_stats_end(&stats_span, #{kind}, #{bytes_in.empty? ? "0" : "(uint64_t) " + bytes_in.join(" + ")}, stats_out);
     #{has_error ? "" : "osync_error_unref(error);" }
     #{has_result ? "return result;": "return;"}
 }
 
-VALUE #{func_name}_load_and_run_protected(VALUE _unused) {
+VALUE #{func_name}_load_and_run_protected(VALUE _call) {
     osync_trace ( TRACE_ENTRY, "%s()", __func__);
+    struct rubymodule_call *call = (struct rubymodule_call *) _call;
     #{has_result ? "#{result_type} result = (#{result_type})0;" : "/* no result */" }
-    #{has_result ? "#{result_type}* result_ptr = (#{result_type}*)0;":"/* no result */"}
-    void* *args = funcall_data.args;
+    void* *args = call->args;
     /* loading args */
 #{
     code=[]
@@ -184,28 +323,36 @@ VALUE #{func_name}_load_and_run_protected(VALUE _unused) {
     code.join("\n")
 }
     #{has_result ? "result =" : ""}#{func_name}_run(#{args.collect{|(type,name)| name}.join(", ")});
-    #{has_result ? "result_ptr = malloc(sizeof(#{result_type}*));": ""}
-    #{has_result ? "*result_ptr = result;" : ""}
-    #{has_result ? "funcall_data.result = result_ptr;": ""}
+    #{has_result ? "*(#{result_type}*)call->result = result;": ""}
     osync_trace ( TRACE_EXIT, \"%s:\", __func__);
     return Qnil;
 }
 
-void #{func_name}_load_and_run() {
+void #{func_name}_load_and_run(struct rubymodule_call *call) {
     int ruby_error = 0;
     osync_trace ( TRACE_ENTRY, "%s()", __func__);
+    if (call->queued)
+        rubymodule_stats_record(#{kind}, RUBYMODULE_STATS_WAIT, rubymodule_stats_now() - call->queued);
 #{if has_error
     error_i = args.size-1
 "
     /* Loading error */
-    void* *args = funcall_data.args;
+    void* *args = call->args;
     OSyncError **error = *((#{args[error_i][0]}*)args[#{error_i}]);
 "
+elsif async
+    ctx_i = args.index {|(type,name)| name == "ctx" }
+"
+    /* Failures go to ctx */
+    void* *args = call->args;
+    OSyncContext* ctx = *((OSyncContext**)args[#{ctx_i}]);
+    OSyncError *local_error = NULL; OSyncError **error = &local_error;
+"
 else
-    "OSyncError *local_error; OSyncError **error = &local_error;"
+    "    OSyncError *local_error = NULL; OSyncError **error = &local_error;"
 end
 }
-    rb_protect(#{func_name}_load_and_run_protected, Qnil, &ruby_error);
+    rb_protect(#{func_name}_load_and_run_protected, (VALUE) call, &ruby_error);
     if ( ruby_error!=0 ) {
 	osync_rubymodule_error_set(error, OSYNC_ERROR_GENERIC, "Error on #{func_name}_load_and_run_protected!");
         goto error;
@@ -213,14 +360,16 @@ end
     goto exit;
 error:
     osync_trace ( TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print (error) );
-    #{has_error ? "" :"fprintf(stderr,\"%s\\n\",osync_error_print (error));osync_error_unref(error);"}
+    #{has_error ? "" : (async ? "rubymodule_context_failed(ctx, error);" : "fprintf(stderr,\"%s\\n\",osync_error_print (error));")}
 exit:
+    #{has_error ? "" : "osync_error_unref(error);"}
     osync_trace ( TRACE_EXIT, \"%s:\", __func__);
 }
 
-#{result_type} #{func_name}_save_and_request(#{args.collect{|typename| typename.join(" ")}.join(", ")}) {
+#{result_type} #{func_name}_save_and_request(#{(["struct rubymodule_dispatcher *dispatcher"] + args.collect{|typename| typename.join(" ")}).join(", ")}) {
     osync_trace ( TRACE_ENTRY, "%s(#{format_for(args)})", __func__, #{args.collect {|(type,name)| name}.join(", ")});
-    #{has_result ? "#{result_type} result;" : "/* no result */" }
+    #{has_result ? "#{result_type} result = (#{result_type})0;" : "/* no result */" }
+    struct rubymodule_call call;
     void* args[#{args.size}];
     /* init ruby, if needed */
     rubymodule_ruby_needed();
@@ -232,52 +381,35 @@ exit:
     }
     code.join("\n")
 }
-    debug_thread("Locking!\\n");
-    pthread_mutex_lock ( &ruby_call_lock);
-    pthread_mutex_lock ( &ruby_context_lock);
-    debug_thread("Waiting for my time!\\n");
-    if (!ruby_running) {
-      debug_thread("Ruby thread is not running. Waiting\\n");
-      pthread_cond_wait(&fcall_ruby_running, &ruby_context_lock);
-      debug_thread("Ruby thread is running!\\n");
-    }
-    funcall_data.args 	= args;
-    funcall_data.func   = #{func_name}_load_and_run;
-    funcall_data.result = NULL;
+    rubymodule_call_init(&call, #{func_name}_load_and_run, args, #{has_result ? "&result" : "NULL"});
+    call.queued = rubymodule_stats_clock();
 
     debug_thread("Sent!\\n");
-    pthread_cond_signal(&fcall_requested);
-
-    debug_thread("Waiting return!\\n");
-    pthread_cond_wait(&fcall_returned, &ruby_context_lock);
+    rubymodule_request(dispatcher, &call);
 
     debug_thread("Returned!\\n");
-    /* freeing */
-    if (funcall_data.result) {
-      #{has_result ? "result = *(#{result_type}*)funcall_data.result;" : "/* no result */"}
-      free(funcall_data.result);
-    }
-    funcall_data.func   = NULL;
-    funcall_data.args   = NULL;
-    funcall_data.result = NULL;
-    pthread_mutex_unlock ( &ruby_context_lock);
-    pthread_mutex_unlock ( &ruby_call_lock);
     #{has_result ? "return result;" : "return;" }
 };
 
-#{result_type} #{func_name}(#{args.collect{|typename| typename.join(" ")}.join(", ")}) {
+#{async ? define_async(func_name, args, argins) : ""}#{result_type} #{func_name}(#{args.collect{|typename| typename.join(" ")}.join(", ")}) {
     osync_trace ( TRACE_ENTRY, "%s(#{format_for(args)})", __func__, #{args.collect {|(type,name)| name}.join(", ")});
     #{has_result ? "#{result_type} result;" : "/* no result */" }
+    struct rubymodule_dispatcher *dispatcher;
     /* init ruby, if needed */
     rubymodule_ruby_needed();
-
-    if (is_running_in_rubythread()) {
+#{fastpath}
+    /* The ruby thread or the lane of #{argins.first}, if any */
+    dispatcher = rubymodule_dispatcher_for(#{argins.first});
+    if (!dispatcher) {
       debug_thread("Called from ruby thread. No need to worry with locks.\\n");
       /* If we are running inside the rubythread, there is no need to worry. We are aready protected*/
       #{has_result ? "result =" : ""} #{func_name}_run(#{args.collect{|(type,name)| name}.join(", ")});
-    } else {
+#{async ? "    } else if (rubymodule_async_acquire(dispatcher, #{argins.first})) {
+      debug_thread(\"Posted to ruby thread.\\n\");
+      #{func_name}_post(#{args.collect{|(type,name)| name}.join(", ")});
+" : ""}    } else {
       debug_thread("Called from outside rubythread. Pass to ruby thread.\\n");
-      #{has_result ? "result =" : ""} #{func_name}_save_and_request(#{args.collect{|(type,name)| name}.join(", ")});
+      #{has_result ? "result =" : ""} #{func_name}_save_and_request(#{(["dispatcher"] + args.collect{|(type,name)| name}).join(", ")});
     }
     #{has_result ? "return result;" : "return;" }
 }
@@ -286,6 +418,36 @@ end
 
 
 
+#
+# Posting for async callbacks: arguments are copied to the heap and the
+# OpenSync objects referenced until the fiber ends
+#
+def define_async(func_name, args, argins)
+    refs=args.select {|(type,name)| ASYNC_REFS[type] }
+<<EOF
+/* Arguments of a posted #{func_name} call */
+struct #{func_name}_async {
+    struct rubymodule_async async;
+    void* args[#{args.size}];
+#{args.collect {|(type,name)| "    #{type} #{name};\n" }.join}};
+
+void #{func_name}_async_dispose(struct rubymodule_call *call) {
+    struct #{func_name}_async *saved = (struct #{func_name}_async *) call;
+
+#{refs.collect {|(type,name)| "    if (saved->#{name}) #{ASYNC_REFS[type]}_unref(saved->#{name});\n" }.join}    rubymodule_call_destroy(call);
+    g_free(saved);
+}
+
+void #{func_name}_post(#{args.collect{|typename| typename.join(" ")}.join(", ")}) {
+    struct #{func_name}_async *saved = g_new0(struct #{func_name}_async, 1);
+
+#{args.each_index.collect {|i| "    saved->#{args[i][1]} = #{args[i][1]};\n    saved->args[#{i}] = &saved->#{args[i][1]};\n" }.join}#{refs.collect {|(type,name)| "    if (#{name}) #{ASYNC_REFS[type]}_ref(#{name});\n" }.join}    rubymodule_async_post(&saved->async, #{func_name}_load_and_run, #{func_name}_async_dispose, #{argins.first}, ctx, saved->args);
+}
+
+EOF
+end
+
+
 define_rubycall  "rubymodule_get_sync_info",
 		"osync_bool ( OSyncPluginEnv *env, OSyncError **error )",
 		%w{env}, <<'EOF'
@@ -336,18 +498,12 @@ EOF
 define_callback "osync_plugin_set_initialize_func",
 		"void* (OSyncPlugin *plugin, OSyncPluginInfo *info, OSyncError **error)",
 		%w{plugin info}, <<'EOF'
-    VALUE *pplugin_data = malloc(sizeof(VALUE));
-    *pplugin_data = ruby_result;
-    rb_gc_register_address(pplugin_data);
-    result = pplugin_data;
+    result = HANDLE2PTR(rubymodule_store_new(ruby_result));
 EOF
 define_callback "osync_plugin_set_finalize_func",
 		"void (OSyncPlugin *plugin, void* plugin_data)",
 		%w{plugin plugin_data}, <<'EOF'
-    if (plugin_data) {
-        rb_gc_unregister_address(plugin_data);
-	free(plugin_data);
-    }
+    rubymodule_store_free(PTR2HANDLE(plugin_data));
 EOF
 define_callback "osync_plugin_set_discover_func",
 		"osync_bool (OSyncPlugin *plugin, OSyncPluginInfo *info, void* plugin_data, OSyncError **error)",
@@ -363,47 +519,50 @@ EOF
 define_callback "osync_objformat_set_initialize_func",
 		"void * (OSyncObjFormat *format, OSyncError **error)",
 		%w{format}, <<'EOF'
-    VALUE *puser_data = malloc(sizeof(VALUE));
-    *puser_data = ruby_result;
-    rb_gc_register_address(puser_data);
-    result = puser_data;
+    result = HANDLE2PTR(rubymodule_store_new(ruby_result));
 EOF
 
 #typedef osync_bool (* OSyncFormatFinalizeFunc) (OSyncObjFormat *format, void *user_data, OSyncError **error);
 define_callback "osync_objformat_set_finalize_func",
 		"osync_bool (OSyncObjFormat *format, void *user_data, OSyncError **error)",
 		%w{format user_data}, <<'EOF'
-    if (user_data) {
-        rb_gc_unregister_address(user_data);
-	free(user_data);
-    }
+    rubymodule_store_free(PTR2HANDLE(user_data));
     result = RBOOL ( ruby_result );
 EOF
 
 # typedef OSyncConvCmpResult (* OSyncFormatCompareFunc) (OSyncObjFormat *format, const char *leftdata, unsigned int leftsize, const char *rightdata, unsigned int rightsize, void *user_data, OSyncError **error);
 define_callback "osync_objformat_set_compare_func",
 		"OSyncConvCmpResult (OSyncObjFormat *format, const char *leftdata, unsigned int leftdatasize, const char *rightdata, unsigned int rightdatasize, void *user_data, OSyncError **error)",
-		%w{format leftdata rightdata user_data}, <<'EOF'
+		%w{format leftdata rightdata user_data}, <<'EOF', <<'EOF'
      if ( !IS_FIXNUM ( ruby_result ) ) {
          osync_error_set ( error, OSYNC_ERROR_GENERIC, "The result should be a FixNum!\n" );
          goto error;
      }
      result = FIX2INT ( ruby_result );
 EOF
+    /* Byte identical data needs no ruby, if the format opted in */
+    if ( rubymodule_compare_fast ( format, leftdata, leftdatasize, rightdata, rightdatasize ) )
+        return OSYNC_CONV_DATA_SAME;
+    /* Run by opensync-ruby-host, if enabled */
+    if ( rubymodule_remote_compare ( format, leftdata, leftdatasize, rightdata, rightdatasize, &result, error ) )
+        return result;
+EOF
 
 # typedef osync_bool (* OSyncFormatCopyFunc) (OSyncObjFormat *format, const char *input, unsigned int inpsize, char **output, unsigned int *outpsize, void *user_data, OSyncError **error);
 define_callback "osync_objformat_set_copy_func",
 		"osync_bool (OSyncObjFormat *format, const char *input, unsigned int inputsize, char **output, unsigned int *outputsize, void *user_data, OSyncError **error)",
-		%w{format input user_data}, <<'EOF'
-    if ( !IS_STRING ( ruby_result ) ) {
-	osync_error_set ( error, OSYNC_ERROR_GENERIC, "The result should be a String!\n" );
+		%w{format input user_data}, <<'EOF', <<'EOF'
+    if ( !IS_BYTES ( ruby_result ) ) {
+	osync_error_set ( error, OSYNC_ERROR_GENERIC, "The result should be a String or Opensync::Buffer!\n" );
 	goto error;
     }
-    *outputsize = RSTRING_LEN ( ruby_result );
-    *output     = malloc(*outputsize);
-    memcpy(*output, RSTRING_PTR ( ruby_result ), *outputsize);
+    *output     = rubymodule_buffer_take ( ruby_result, outputsize );
     result = TRUE;
 EOF
+    /* Run by opensync-ruby-host, if enabled */
+    if ( rubymodule_remote_copy ( format, input, inputsize, output, outputsize, &result, error ) )
+        return result;
+EOF
 
 # typedef osync_bool (* OSyncFormatDuplicateFunc) (OSyncObjFormat *format, const char *uid, const char *input, unsigned int insize, char **newuid, char **output, unsigned int *outsize, osync_bool *dirty, void *user_data, OSyncError **error);
 define_callback "osync_objformat_set_duplicate_func",
@@ -411,16 +570,14 @@ define_callback "osync_objformat_set_duplicate_func",
 		%w{format uid input user_data}, <<'EOF'
     if ( !IS_ARRAY ( ruby_result ) || ( RARRAY_LEN ( ruby_result ) != 3 ) ||
             !IS_STRING ( rb_ary_entry ( ruby_result, 0 ) ) ||
-            !IS_STRING ( rb_ary_entry ( ruby_result, 1 ) ) ||
+            !IS_BYTES ( rb_ary_entry ( ruby_result, 1 ) ) ||
             !IS_BOOL ( rb_ary_entry ( ruby_result, 2 ) )
        ) {
         osync_error_set ( error, OSYNC_ERROR_GENERIC, "The result should be an Array with [newuid:string, output:string, dirty:bool] !\n" );
         goto error;
     }
     *newuid 	= strdup(RSTRING_PTR ( rb_ary_entry ( ruby_result, 0 ) ));
-    *outputsize = RSTRING_LEN ( ruby_result );
-    *output     = malloc(*outputsize);
-    memcpy(*output, RSTRING_PTR ( ruby_result ), *outputsize);
+    *output     = rubymodule_buffer_take ( rb_ary_entry ( ruby_result, 1 ), outputsize );
     *dirty  	= RBOOL ( rb_ary_entry ( ruby_result, 2 ) );
     result 	= TRUE;
 EOF
@@ -429,45 +586,55 @@ EOF
 define_callback "osync_objformat_set_create_func",
 		"osync_bool (OSyncObjFormat *format, char **data, unsigned int *size, void *user_data, OSyncError **error)",
 		%w{format user_data}, <<'EOF'
-    if ( !IS_STRING ( ruby_result ) ) {
-        osync_error_set ( error, OSYNC_ERROR_GENERIC, "The result should be a String!\n" );
+    if ( !IS_BYTES ( ruby_result ) ) {
+        osync_error_set ( error, OSYNC_ERROR_GENERIC, "The result should be a String or Opensync::Buffer!\n" );
         goto error;
     }
-    *size = RSTRING_LEN ( ruby_result );
-    *data     = malloc(*size);
-    memcpy(*data, RSTRING_PTR ( ruby_result ), *size);
+    *data     = rubymodule_buffer_take ( ruby_result, size );
     result = TRUE;
 EOF
 
 # typedef osync_bool (* OSyncFormatDestroyFunc) (OSyncObjFormat *format, char *data, unsigned int size, void *user_data, OSyncError **error);
 define_callback "osync_objformat_set_destroy_func",
 		"osync_bool (OSyncObjFormat *format, char *data, unsigned int size, void *user_data, OSyncError **error)",
-		%w{format data user_data}, <<'EOF'
+		%w{format data user_data}, <<'EOF', <<'EOF'
     result = RBOOL ( ruby_result );
 EOF
+    /* Mapped payloads (PackedRecord.map) are released here: ruby never sees them */
+    if ( rubymodule_buffer_unmap ( data ) )
+        return TRUE;
+EOF
 
 # typedef char *(* OSyncFormatPrintFunc) (OSyncObjFormat *format, const char *data, unsigned int size, void *user_data, OSyncError **error);
 define_callback "osync_objformat_set_print_func",
 		"char * (OSyncObjFormat *format, const char *data, unsigned int size, void *user_data, OSyncError **error)",
-		%w{format data user_data}, <<'EOF'
+		%w{format data user_data}, <<'EOF', <<'EOF'
     if ( !IS_STRING ( ruby_result ) ) {
         osync_error_set ( error, OSYNC_ERROR_GENERIC, "The result should be a String!\n" );
         goto error;
     }
     result = RSTRING_PTR ( ruby_result );
 EOF
+    /* Run by opensync-ruby-host, if enabled */
+    if ( rubymodule_remote_print ( format, data, size, &result, error ) )
+        return result;
+EOF
 
 # typedef time_t (* OSyncFormatRevisionFunc) (OSyncObjFormat *format, const char *data, unsigned int size, void *user_data, OSyncError **error);
 define_callback "osync_objformat_set_revision_func",
 		"time_t (OSyncObjFormat *format, const char *data, unsigned int size, void *user_data, OSyncError **error)",
-		%w{format data user_data}, <<'EOF'
-    ruby_result = rb_funcall2_protected ( ruby_result, "to_i", 0, NULL, &ruby_error );
+		%w{format data user_data}, <<'EOF', <<'EOF'
+    ruby_result = rb_funcall2_protected ( ruby_result, id_to_i, 0, NULL, &ruby_error );
     if ( ( ruby_error=0 ) || !IS_FIXNUM ( ruby_result ) ) {
         osync_rubymodule_error_set( error, OSYNC_ERROR_GENERIC, "Failed to convert time to a number!");
         goto error;
     }
     result = FIX2LONG ( ruby_result );
 EOF
+    /* Run by opensync-ruby-host, if enabled */
+    if ( rubymodule_remote_revision ( format, data, size, &result, error ) )
+        return result;
+EOF
 
 # typedef osync_bool (* OSyncFormatMarshalFunc) (OSyncObjFormat *format, const char *input, unsigned int inputsize, OSyncMarshal *marshal, void *user_data, OSyncError **error);
 define_callback "osync_objformat_set_marshal_func",
@@ -480,13 +647,11 @@ EOF
 define_callback "osync_objformat_set_demarshal_func",
 		"osync_bool (OSyncObjFormat *format, OSyncMarshal *marshal, char **output, unsigned int *outputsize, void *user_data, OSyncError **error)",
 		%w{format marshal user_data}, <<'EOF'
-    if ( !IS_STRING ( ruby_result ) ) {
-        osync_error_set ( error, OSYNC_ERROR_GENERIC, "The result should be a String!\n" );
+    if ( !IS_BYTES ( ruby_result ) ) {
+        osync_error_set ( error, OSYNC_ERROR_GENERIC, "The result should be a String or Opensync::Buffer!\n" );
         goto error;
     }
-    *outputsize = RSTRING_LEN ( ruby_result );
-    *output     = malloc(*outputsize);
-    memcpy(*output, RSTRING_PTR ( ruby_result ), *outputsize);
+    *output     = rubymodule_buffer_take ( ruby_result, outputsize );
     result 	= TRUE;
 EOF
 
@@ -511,6 +676,7 @@ EOF
 define_callback "osync_objtype_sink_set_disconnect_func",
 		"void (OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *data)",
 		%w{sink info ctx data}, <<'EOF'
+    rubymodule_gc_boundary();
 EOF
 
 # typedef void (* OSyncSinkGetChangesFn) (OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync, void *data);
@@ -541,6 +707,7 @@ EOF
 define_callback "osync_objtype_sink_set_sync_done_func",
 		"void (OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *data)",
 		%w{sink info ctx data}, <<'EOF'
+    rubymodule_gc_boundary();
 EOF
 
 # typedef void (* OSyncSinkConnectDoneFn) (OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync, void *data);
@@ -552,46 +719,42 @@ EOF
 # typedef osync_bool (* OSyncFormatConvertFunc) (OSyncFormatConverter *converter, char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, const char *config, void *userdata, OSyncError **error);
 define_rubycall "osync_rubymodule_converter_convert",
 	 "osync_bool (OSyncFormatConverter *converter, char *input, unsigned int inputsize, char **output, unsigned int *outputsize, osync_bool *free_input, const char *config, void *userdata, OSyncError **error)",
-	 %w{converter input config userdata}, <<EOF
+	 %w{converter input config userdata}, <<EOF, false, <<'EOF2'
 
-    VALUE callback = osync_rubymodule_get_data (converter, "convert_func" );
-    VALUE ruby_result = rb_funcall2_protected ( callback, "call", 4, ruby_args, &ruby_error );
+    VALUE callback = osync_rubymodule_get_callback (converter, #{callback_slot("converter_convert")} );
+    VALUE ruby_result = rb_funcall2_protected ( callback, id_call, 4, ruby_args, &ruby_error );
     if ( ruby_error!=0 ) {
 	osync_rubymodule_error_set( error, OSYNC_ERROR_GENERIC, "Failed to call osync_rubymodule_converter_convert function!");
         goto error;
     }
     if ( !IS_ARRAY ( ruby_result ) || ( RARRAY_LEN ( ruby_result ) != 2 ) ||
-            !IS_STRING ( rb_ary_entry ( ruby_result, 0 ) ) ||
+            !IS_BYTES ( rb_ary_entry ( ruby_result, 0 ) ) ||
             !IS_BOOL ( rb_ary_entry ( ruby_result, 1 ) )
        ) {
         osync_error_set ( error, OSYNC_ERROR_GENERIC, "The result should of print should be an Array with [output:string, free_input:bool]!");
         goto error;
     }
-    *outputsize = RSTRING_LEN ( rb_ary_entry ( ruby_result, 0 ) );
-    *output     = malloc(*outputsize);
-    memcpy(*output, RSTRING_PTR ( rb_ary_entry ( ruby_result, 0 ) ), *outputsize);
+    *output     = rubymodule_buffer_take ( rb_ary_entry ( ruby_result, 0 ), outputsize );
     *free_input  = RBOOL ( rb_ary_entry ( ruby_result, 1 ) );
     result = TRUE;
 EOF
+    /* Run by opensync-ruby-host, if enabled */
+    if ( rubymodule_remote_convert ( converter, input, inputsize, output, outputsize, free_input, config, &result, error ) )
+        return result;
+EOF2
 
 #typedef void * (* OSyncFormatConverterInitializeFunc) ;
 define_callback "osync_converter_set_initialize_func",
 		"void* (OSyncFormatConverter *converter, const char *config, OSyncError **error)",
 		%w{converter config}, <<'EOF'
-    VALUE *puser_data = malloc(sizeof(VALUE));
-    *puser_data = ruby_result;
-    rb_gc_register_address(puser_data);
-    result = puser_data;
+    result = HANDLE2PTR(rubymodule_store_new(ruby_result));
 EOF
 
 #typedef osync_bool (* OSyncFormatConverterFinalizeFunc) (OSyncFormatConverter *converter, void *userdata, OSyncError **error);
 define_callback "osync_converter_set_finalize_func",
 		"osync_bool (OSyncFormatConverter *converter, void *userdata, OSyncError **error)",
 		%w{converter userdata}, <<'EOF'
-    if (userdata) {
-        rb_gc_unregister_address(userdata);
-	free(userdata);
-    }
+    rubymodule_store_free(PTR2HANDLE(userdata));
     result = RBOOL ( ruby_result );
 EOF
 
@@ -619,4 +782,9 @@ EOF
 # 		%w{context slowsync_func userdata}, <<'EOF'
 # EOF
 
-define_Init_rubymodule_callbacks
\ No newline at end of file
+if ARGV.include?("--prototypes")
+    define_prototypes
+else
+    define_Init_rubymodule_callbacks
+    define_callback_slots
+end
@@ -0,0 +1,92 @@
+#!/usr/bin/ruby
+#
+# Generates opensync_mapped.rb: the wrappers OSyncObject.map_methods would
+# compile with class_eval every time opensync.rb loads, as plain ruby code.
+#
+# It loads opensync.rb over a fake Opensync module (with the functions
+# exported by the SWIG wrapper), records every map_methods call and writes,
+# for each mapped class, a module with its wrappers. Functions with a fixed
+# number of arguments get wrappers without splats.
+#
+# Usage: genmapped.rb opensyncRUBY_wrap.c opensync.rb > opensync_mapped.rb
+#
+require "set"
+
+(wrapper, base) = ARGV
+if not base
+    $stderr.puts "Usage: #{$0} opensyncRUBY_wrap.c opensync.rb"
+    exit 1
+end
+
+source = File.read(wrapper)
+
+# Functions exported by the SWIG module
+FUNCTIONS = source.scan(/rb_define_module_function\(mOpensync, "(osync_\w+)"/).flatten.uniq
+
+# [min, max] number of arguments of each one
+ARITY = {}
+source.scan(/^_wrap_(osync_\w+)\(int argc, VALUE \*argv, VALUE self\) \{\n(.*?)^\}/m) do
+    |name, body|
+    ARITY[name] = [$1.to_i, $2.to_i] if body =~ /if \(\(argc < (\d+)\) \|\| \(argc > (\d+)\)\)/
+end
+
+module SWIG
+    def self.const_missing(name)
+	const_set(name, Class.new)
+    end
+end
+
+module Opensync
+    def self.const_missing(name)
+	const_set(name, name.to_s)
+    end
+
+    FUNCTIONS.each {|function| define_singleton_method(function) {|*args| } }
+
+    module Mapped
+	RECORDS = []
+	def self.for(klass, regexp, methods)
+	    RECORDS << [klass, regexp, methods]
+	    nil
+	end
+    end
+end
+
+# Load it as the ruby thread would, without tracing or unmapped warnings
+ENV.delete("OSYNC_TRACE")
+verbose, $VERBOSE = $VERBOSE, nil
+load base
+$VERBOSE = verbose
+
+puts <<EOF
+#
+# Generated by genmapped.rb from opensync.rb and the SWIG interface. Do not edit.
+#
+module Opensync
+    module Mapped
+EOF
+Opensync::Mapped::RECORDS.each do
+    |(klass, regexp, methods)|
+    instance_sources = []
+    class_sources = []
+    methods.sort.each do
+	|method|
+	(instance_source, class_source) = klass.mapping_source(method, regexp, ARITY[method.to_s])
+	instance_sources << instance_source if instance_source
+	class_sources << class_source if class_source
+    end
+    puts <<EOF
+	module #{klass.name.sub(/^Opensync::/,"").gsub("::","_")}
+	    METHODS = [#{methods.sort.collect {|method| ":#{method}" }.join(", ")}]
+#{instance_sources.join}
+	    module ClassMethods
+#{class_sources.join}
+	    end
+	end
+
+EOF
+end
+puts <<EOF
+    end
+end
+EOF
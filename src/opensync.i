@@ -29,14 +29,16 @@
  $result = ($1==FALSE ? Qfalse : Qtrue);
 }
 
-/* memory leak */
+/* void* user data are handles into rubymodule store (see ruby_module.c) */
+%{
+unsigned int rubymodule_store_new(VALUE value);
+VALUE rubymodule_store_get(unsigned int handle);
+%}
 %typemap(in) void* {
-  $1 = malloc(sizeof(VALUE));
-  rb_gc_register_address($1);
-  *(VALUE*)$1=$input;
+  $1 = (void*) (unsigned long) rubymodule_store_new($input);
 }
 %typemap(out) void* {
-  $result = $1 ? *(VALUE*)$1 : Qnil;
+  $result = rubymodule_store_get((unsigned int) (unsigned long) $1);
 }
 
 %typemap(in) time_t {
@@ -52,16 +54,47 @@
  $2 = (unsigned int) RSTRING_LEN($input);
 };
 
-/* Translate into ruby string */
-%typemap(in) (const void *value, unsigned int size) {
- $1 = RSTRING_PTR($input);
- $2 = (unsigned int) RSTRING_LEN($input);
+/* Marshalled bytes: a String or an Opensync::Buffer, read in place */
+%{
+void rubymodule_buffer_bytes(VALUE obj, const char **ptr, long *len);
+%}
+%typemap(in) (const void *value, unsigned int size) (const char *temp_ptr, long temp_len) {
+ rubymodule_buffer_bytes($input, &temp_ptr, &temp_len);
+ $1 = (void *) temp_ptr;
+ $2 = (unsigned int) temp_len;
 };
 
-/* Translate into ruby string */
+/* Data buffers (osync_data_new, osync_data_set_data) are owned by opensync
+ * from then on: a String is copied, an owned Opensync::Buffer handed over.
+ * A mapped one (see ruby_buffer.h) is only handed over to data whose format
+ * unmaps it in its destroy callback, and copied otherwise. Any other
+ * function raises for it */
+%{
+int rubymodule_buffer_p(VALUE obj);
+int rubymodule_buffer_mapped_p(VALUE obj);
+VALUE rubymodule_buffer_copy(VALUE buffer);
+char *rubymodule_buffer_take(VALUE obj, unsigned int *size);
+osync_bool rubymodule_objformat_unmaps(OSyncObjFormat *format);
+%}
 %typemap(in) (char *buffer, unsigned int size) {
- $1 = RSTRING_PTR($input);
- $2 = (unsigned int) RSTRING_LEN($input);
+ VALUE bytes = rubymodule_buffer_p($input) ? $input : rb_str_to_str($input);
+ if (rubymodule_buffer_mapped_p(bytes)) {
+  OSyncObjFormat *format = NULL;
+#define $symname
+#if defined(osync_data_new)
+  /* The format is the next argument, not converted yet */
+  if (!NIL_P(argv[1]) && !SWIG_IsOK(SWIG_ConvertPtr(argv[1], (void **) &format, SWIGTYPE_p_OSyncObjFormat, 0)))
+   rb_raise(rb_eTypeError, "osync_data_new: format should be an OSyncObjFormat");
+#elif defined(osync_data_set_data)
+  format = osync_data_get_objformat(arg1);
+#else
+  rb_raise(rb_eArgError, "$symname: a mapped Opensync::Buffer cannot be released here, use to_s");
+#endif
+#undef $symname
+  if (!rubymodule_objformat_unmaps(format))
+   bytes = rubymodule_buffer_copy(bytes);
+ }
+ $1 = rubymodule_buffer_take(bytes, &$2);
 };
 
 /* Convert out arguments into a single ruby value */
@@ -112,51 +145,55 @@
   }
 }
 
-/* Convert each syncList to its own type for each method*/
-/* TODO: complete this list */
+/* Each OSyncList becomes a lazy Opensync::List (see ruby_list.c) that wraps
+   its items with their own type for each method */
+%{
+#ifndef _RUBY_LIST_H
+typedef VALUE (*rubymodule_list_item_func)(void *data, void *type);
+VALUE rubymodule_list_new(OSyncList *list, rubymodule_list_item_func item, void *type);
+VALUE rubymodule_list_string(void *data, void *type);
+#endif
+
+static VALUE rubymodule_list_pointer(void *data, void *type) {
+  return SWIG_NewPointerObj(data, (swig_type_info *) type, 0 |  0 );
+}
+%}
 %typemap(out) OSyncList* %{
-  VALUE array = rb_ary_new();
-  OSyncList *list, *item;
-  list = $1;
-  for (item = list; item; item = item->next) {
 #define $symname
 #if defined(osync_plugin_env_get_plugins)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncPlugin, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncPlugin);
 #elif defined(osync_plugin_info_get_objtype_sinks)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncObjTypeSink, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncObjTypeSink);
 #elif defined(osync_plugin_config_get_advancedoptions)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncPluginAdvancedOption, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncPluginAdvancedOption);
 #elif defined(osync_plugin_config_get_resources)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncPluginResource, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncPluginResource);
 #elif defined(osync_plugin_advancedoption_get_parameters)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncPluginAdvancedOptionParameter, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncPluginAdvancedOptionParameter);
 #elif defined(osync_plugin_advancedoption_get_valenums)
-    rb_ary_push(array, SWIG_FromCharPtr(SWIG_as_voidptr(item->data)));
+  $result = rubymodule_list_new($1, rubymodule_list_string, NULL);
 #elif defined(osync_plugin_advancedoption_param_get_valenums)
-    rb_ary_push(array, SWIG_FromCharPtr(SWIG_as_voidptr(item->data)));
+  $result = rubymodule_list_new($1, rubymodule_list_string, NULL);
 #elif defined(osync_plugin_resource_get_objformat_sinks)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncObjFormatSink, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncObjFormatSink);
 #elif defined(osync_objtype_sink_get_objformat_sinks)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncObjFormatSink, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncObjFormatSink);
 #elif defined(osync_converter_path_get_edges)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncFormatConverter, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncFormatConverter);
 #elif defined(osync_format_env_get_objformats)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncObjFormat, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncObjFormat);
 #elif defined(osync_format_env_find_converters)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncFormatConverter, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncFormatConverter);
 #elif defined(osync_format_env_find_caps_converters)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncCapsConverter, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncCapsConverter);
 #elif defined(osync_format_env_get_converters)
-    rb_ary_push(array, SWIG_NewPointerObj(SWIG_as_voidptr(item->data), SWIGTYPE_p_OSyncFormatConverter, 0 |  0 ));
+  $result = rubymodule_list_new($1, rubymodule_list_pointer, SWIGTYPE_p_OSyncFormatConverter);
 #elif defined(osync_hashtable_get_deleted)
-    rb_ary_push(array, SWIG_FromCharPtr(SWIG_as_voidptr(item->data)));
+  $result = rubymodule_list_new($1, rubymodule_list_string, NULL);
 #else
-    rb_exc_raise(rb_exc_new2(rb_eArgError, "SWIG typemap for OSyncList in '$symname' is not implemented yet. Add it to swig interface"));
+#error "SWIG typemap for OSyncList in '$symname' is not implemented yet. Add it to swig interface"
 #endif
 #undef $symname
-  }
-  osync_list_free(list);
-  $result = array;
 %}
 
 #endif
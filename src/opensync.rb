@@ -21,17 +21,12 @@
 require "thread"
 require "set"
 require "pathname"
+require "weakref"
 
 #GC.disable
 #$stderr.puts GC.count
 #GC.stress=true
 
-$trace=true
-if $trace
-  @untraced_classes=Set.new
-  @untraced_classes.merge(Object.constants.collect {|sym| Object.const_get(sym) }.select{|cons| cons.kind_of? Module })
-end
-
 # XXX: HACK!, I cannot access ENV on a callback.
 #      it raises "ENV.[] no such file to load -- enc/ansi_x3_4_1968.so"
 ENV2=Hash[ENV]
@@ -47,26 +42,255 @@ class String
 end
 
 module Opensync
+    # Classes that exist before opensync.rb are not traced (see Tracer)
+    UNTRACED_CLASSES=Set.new(Object.constants.reject {|sym| Object.autoload?(sym) }.collect {|sym| Object.const_get(sym) }.select{|cons| cons.kind_of? Module })
 
     # TODO: Remove this
     class OSyncError < Exception
     end
 
+    # Metrics of the callbacks run in this process, by kind of callback
+    # ("objformat_compare", "converter_convert"...): calls, bytes_in,
+    # bytes_out and the "wait", "run" and "gc" (ruby 2.0 and later) time
+    # histograms (count, sum_us, max_us, p50_us, p99_us and buckets_us). Times
+    # are taken from the first call on, or from the start with
+    # OPENSYNC_RUBY_STATS set.
+    def self.rubymodule_stats
+	require "json"
+	JSON.parse(osync_rubymodule_stats)
+    end
+
+    # Native directory scanner for file based sinks (see ruby_fs.h)
+    module FS
+	SCAN_OPTIONS = [:recursive, :batch, :threads]
+
+	# Yields the regular files below root in batches of up to batch
+	# entries, as parallel arrays:
+	#
+	#   Opensync::FS.scan(dir, recursive: true, batch: 1000) do
+	#	|paths, modes, sizes, mtimes, ctimes, inodes|
+	#	...
+	#   end
+	#
+	# paths are relative to root, times are in seconds. Files come in no
+	# particular order. threads is the number of native threads walking
+	# the tree (default: one per CPU, at least 4)
+	def self.scan(root, options={}, &block)
+	    unknown = options.keys - SCAN_OPTIONS
+	    raise ArgumentError, "unknown options: #{unknown.join(", ")}" if not unknown.empty?
+	    Opensync.osync_rubymodule_fs_scan(root.to_s, options.fetch(:recursive, true),
+		options.fetch(:batch, 4096), options.fetch(:threads, nil) || 0, &block)
+	end
+
+	DIGEST_OPTIONS = [:cache, :threads]
+
+	# Content digests of the files at paths (relative to root), 32 hex
+	# digits each (see ruby_digest.h), nil for the files missing or not
+	# regular:
+	#
+	#   cache = Opensync::DigestCache.of(dir)
+	#   digests = Opensync::FS.digest(dir, paths, cache: cache)
+	#
+	# Files are read in parallel by threads native threads (default: one
+	# per CPU, at least 4), except those cache knows with the same size
+	# and mtime
+	def self.digest(root, paths, options={})
+	    unknown = options.keys - DIGEST_OPTIONS
+	    raise ArgumentError, "unknown options: #{unknown.join(", ")}" if not unknown.empty?
+	    Opensync.osync_rubymodule_fs_digest(root.to_s, paths.to_a, options.fetch(:cache, nil),
+		options.fetch(:threads, nil) || 0)
+	end
+
+	# Name of what is kept about the tree at root, an absolute path
+	def self.tree_name(root)
+	    hash = 0xcbf29ce484222325
+	    root.each_byte {|byte| hash = ((hash ^ byte) * 0x100000001b3) & 0xffffffffffffffff }
+	    "#{File.basename(root)}-#{"%016x" % hash}"
+	end
+
+	# Change journal of the tree below root, kept by opensync-ruby-journal
+	# (see ruby_journal.h). A sink passes the cursor it stored after its
+	# last sync and stores the new one once this sync is done:
+	#
+	#   changes = Opensync::FS::Journal.new(dir).changes(cursor)
+	#   if changes.rescan?
+	#	# scan the whole tree
+	#   else
+	#	# visit changes.files (changed, created or removed) and scan
+	#	# changes.trees (new directories), paths relative to root
+	#   end
+	#   cursor = changes.cursor
+	#
+	# The journal is only trusted while its watcher runs: the first sync of
+	# a tree, or the first after the watcher stopped, starts it and rescans.
+	# The watcher stops with its root, or when the journal was not checked
+	# for OPENSYNC_RUBY_JOURNAL_IDLE seconds (default a day, 0: never).
+	class Journal
+	    MAGIC = "ORJ1"
+	    HEADER = 20
+	    READY = "S"
+	    DIRTY = "D"
+	    TREE = "T"
+
+	    Changes = Struct.new(:rescan, :files, :trees, :cursor) do
+		def rescan?
+		    rescan
+		end
+	    end
+
+	    def self.dir
+		ENV2["OPENSYNC_RUBY_JOURNALDIR"] || File.join(Dir.home, ".opensync", "ruby-journal")
+	    end
+
+	    attr_reader :root, :base
+
+	    def initialize(root)
+		@root = File.expand_path(root.to_s)
+		@base = File.join(Journal.dir, FS.tree_name(@root))
+	    end
+
+	    # Changes since cursor (nil: the tree must be rescanned anyway)
+	    def changes(cursor)
+		(id, offset) = cursor.to_s.split(":").collect {|part| Integer(part, 16) } rescue nil
+		records, cursor = read(id, offset)
+		return Changes.new(true, [], [], nil) if not watching?
+		return Changes.new(true, [], [], cursor) if not records
+		encoding = Encoding.find("filesystem")
+		changes = Changes.new(false, [], [], cursor)
+		records.each do
+		    |type, path|
+		    case type
+		    when READY
+		    when DIRTY
+			changes.files << path.force_encoding(encoding)
+		    when TREE
+			changes.trees << path.force_encoding(encoding)
+		    else
+			# Directories removed, events lost, unknown records
+			changes.rescan = true
+			break
+		    end
+		end
+		changes.files.uniq!
+		changes.trees.uniq!
+		changes
+	    end
+
+	    # True when a watcher keeps the journal. Otherwise starts one
+	    def watching?
+		[File.dirname(Journal.dir), Journal.dir].each {|path| Dir.mkdir(path, 0700) if not File.directory?(path) }
+		File.open("#{@base}.lock", File::RDWR | File::CREAT, 0600) do
+		    |lock|
+		    return true if not lock.flock(File::LOCK_EX | File::LOCK_NB)
+		end
+		binary = ENV2["OPENSYNC_RUBY_JOURNAL_BINARY"] || Opensync::OPENSYNC_RUBY_JOURNAL_BINARY
+		# It detaches, the wait is short
+		Process.wait(Process.spawn(binary, @root, @base, :in => File::NULL, :close_others => true))
+		false
+	    rescue SystemCallError
+		false
+	    end
+
+	    private
+
+	    # [records since the cursor, or nil when it is not usable, new cursor].
+	    # The new cursor is nil while the journal is not ready
+	    def read(id, offset)
+		File.open("#{@base}.journal", "rb") do
+		    |io|
+		    (current, previous) = header(io)
+		    return nil, nil if not current
+		    if id and id == current and offset <= io.size
+			found, size = records(io, offset)
+		    elsif id and id == previous and previous != 0 and (old = old_records(previous, offset))
+			found, size = records(io, HEADER)
+			found = old + found
+		    else
+			all, size = records(io, HEADER)
+			return nil, nil if previous == 0 and (all.empty? or all.first.first != READY)
+		    end
+		    return found, "%x:%x" % [current, size]
+		end
+	    rescue SystemCallError
+		return nil, nil
+	    end
+
+	    # Records after offset of the journal rotated out as previous, or nil
+	    def old_records(previous, offset)
+		File.open("#{@base}.journal.old", "rb") do
+		    |io|
+		    records(io, offset).first if header(io).to_a.first == previous and offset <= io.size
+		end
+	    rescue SystemCallError
+		nil
+	    end
+
+	    # [id, previous id] of the journal in io, or nil
+	    def header(io)
+		io.seek(0)
+		(magic, id, previous) = io.read(HEADER).to_s.unpack("a4QQ")
+		[id, previous] if magic == MAGIC and id
+	    end
+
+	    # [complete records of io after offset, offset after them]. The
+	    # watcher may be writing the last one
+	    def records(io, offset)
+		io.seek(offset)
+		data = io.read || ""
+		records = []
+		position = 0
+		while position + 5 <= data.bytesize
+		    (type, length) = data.byteslice(position, 5).unpack("aL")
+		    break if position + 5 + length > data.bytesize
+		    records << [type, data.byteslice(position + 5, length)]
+		    position += 5 + length
+		end
+		[records, offset + position]
+	    end
+	end
+    end
+
+    # Digests of files by inode, size and mtime, for Opensync::FS.digest
+    # (see ruby_digest.h). Nothing reaches the disk until save
+    class DigestCache
+	def self.dir
+	    ENV2["OPENSYNC_RUBY_DIGESTDIR"] || File.join(Dir.home, ".opensync", "ruby-digests")
+	end
+
+	# The cache of the tree at root. Only in memory when its directory
+	# cannot be created
+	def self.of(root)
+	    [File.dirname(DigestCache.dir), DigestCache.dir].each {|path| Dir.mkdir(path, 0700) if not File.directory?(path) }
+	    new(File.join(DigestCache.dir, FS.tree_name(File.expand_path(root.to_s))))
+	rescue SystemCallError
+	    new
+	end
+    end
+
     class MetaModule
-	@current_file=nil
-
-	def self.load_files(pathname)
-	    pathname.each_entry do
-		|entry|
-		next if not entry.extname == ".rb"
-# 		$stderr.puts "Reading file #{entry}"
-		entry=pathname + entry
-		@@current_file=entry
-		require "#{entry}"
-		#$stderr.puts "Yielding classes #{@registry[@@current_file].join(",")}"
-		@registry[@@current_file].each {|obj| yield obj } if @registry
-	    end
-	    @current_file=nil
+	@@current_file=nil
+	# Ruby files of each directory, read once per process: the format and
+	# the conversion passes share the same load
+	@@files={}
+
+	def self.files(pathname)
+	    @@files[pathname.to_s] ||= pathname.entries.select {|entry| entry.extname == ".rb" }.sort.collect {|entry| pathname + entry }
+	end
+
+	# Requires file and yields each object it registered, with file
+	def self.load_file(file)
+# 	    $stderr.puts "Reading file #{file}"
+	    previous, @@current_file = @@current_file, file
+	    require "#{file}"
+	    #$stderr.puts "Yielding classes #{@registry[file].join(",")}"
+	    @registry[file].each {|obj| yield obj, file } if @registry
+	    true
+	ensure
+	    @@current_file=previous
+	end
+
+	def self.load_files(pathname, &block)
+	    files(pathname).each {|file| load_file(file, &block) }
 	    true
 	end
 
@@ -77,20 +301,19 @@ module Opensync
 	    true
 	end
 
-	def self.get_info(method, _env, env)
+	def self.dir
 	    if ENV2.include?(self::ENV_DIR_NAME)
-		pathname=Pathname.new(ENV2[self::ENV_DIR_NAME]).expand_path
+		Pathname.new(ENV2[self::ENV_DIR_NAME]).expand_path
 	    else
-		pathname=Pathname.new(self::DEFAULT_DIR)
+		Pathname.new(self::DEFAULT_DIR)
 	    end
-	    load_files(pathname) do
+	end
+
+	def self.get_info(method, _env, env)
+	    load_files(dir) do
 		|obj|
 # 		$stderr.puts "Calling #{obj}"
-		if obj.kind_of? OSyncObject or (obj.kind_of? Class and obj.ancestors.include?(OSyncObject))
-		    obj.send(method,env)
-		else
-		    obj.send(method,env)
-		end
+		obj.send(method,env)
 		#$stderr.puts "Done #{obj}"
 	    end
 	    true
@@ -98,12 +321,185 @@ module Opensync
     end
 
     # This is not really a plugin but someone that ruby-module calls to run get_sync_info
+    #
+    # Plugins are registered from an index of the plugin directory (see Index)
+    # when it is up to date: each plugin file is only required when one of its
+    # plugins is used, so a sync pays for its own plugin only.
     class MetaPlugin <MetaModule
 	ENV_DIR_NAME = "OPENSYNC_RUBY_PLUGINDIR"
 	DEFAULT_DIR  = Opensync::OPENSYNC_RUBY_PLUGINDIR
         def self.get_sync_info(_env)
-	    get_info(:get_sync_info, _env, Plugin::Env.from(_env))
+	    env = Plugin::Env.from(_env)
+	    pathname = dir
+	    index = Index.new(pathname, files(pathname))
+	    if index.load
+		index.register(env)
+	    else
+		files(pathname).each do
+		    |file|
+		    index.file(file)
+		    load_file(file) {|obj| index.add(obj, env) }
+		end
+		index.save
+	    end
+	    true
         end
+
+	# Registers a stand-in of an indexed plugin: the setters the plugin called
+	# are called again, and its callbacks load the plugin file and build the
+	# real plugin over the same OSyncPlugin on first use
+	def self.register_proxy(env, file, info)
+	    plugin = Plugin.new
+	    _plugin = plugin._self
+	    info[:setters].each {|(setter, value)| Opensync.send(setter, _plugin, value) }
+	    callbacks = nil
+	    info[:callbacks].each do
+		|setter|
+		Opensync.send(setter, _plugin, Proc.new {|*args|
+		    callbacks ||= adopt(_plugin, file, info[:class])
+		    callbacks[setter].call(*args)
+		})
+	    end
+	    env.register_plugin(plugin)
+	end
+
+	# Initializes the class_name plugin of file over _plugin. Returns the
+	# callbacks it set, by setter
+	def self.adopt(_plugin, file, class_name)
+	    klass = nil
+	    load_file(Pathname.new(file)) {|obj| klass = obj if obj.kind_of?(Class) and obj.name == class_name }
+	    raise "#{file} does not register #{class_name} anymore" if not klass
+	    real = klass.new_pvt(_plugin)
+	    calls = Index.record { real.send(:initialize_new) }[Opensync.osync_rubymodule_address(_plugin)]
+	    Hash[calls.select {|(setter, value)| Index.callback?(setter, value) }]
+	end
+
+	#
+	# What each file of a plugin directory registers. Plugin classes using the
+	# default Plugin.get_sync_info are recorded with the plugin setters
+	# (Opensync.osync_plugin_set_*) they call, through the wrappers or not.
+	# Files with anything else (or nothing), or whose plugins set values a
+	# stand-in cannot get again, are loaded every time.
+	#
+	# It is kept with the compiled code cache (see opensync_iseq.rb) and
+	# rebuilt when the directory or any of its files changes.
+	#
+	class Index
+	    VERSION = 2
+	    # Setter values kept in the index
+	    PLAIN = [NilClass, TrueClass, FalseClass, Numeric, String, Symbol]
+
+	    # Setter calls made inside record, by plugin address
+	    @recording = nil
+	    # Plugin setters, only wrapped while record runs
+	    SETTERS = Opensync.methods.collect {|method| method.to_s }.grep(/^osync_plugin_set_/)
+
+	    # Calls the block and returns the plugin setters it called, by
+	    # address of the plugin: [[setter, value]...]
+	    def self.record
+		saved = @recording
+		hook if not saved
+		recording = @recording = Hash.new {|hash, address| hash[address] = [] }
+		yield
+		recording
+	    ensure
+		@recording = saved
+		unhook if not saved
+	    end
+
+	    # Wraps each plugin setter to record its calls
+	    def self.hook
+		SETTERS.each do
+		    |setter|
+		    unrecorded = "#{setter}_unrecorded"
+		    Opensync.singleton_class.send(:alias_method, unrecorded, setter)
+		    Opensync.singleton_class.send(:define_method, setter) do
+			|*args|
+			Index.recorded(setter, args)
+			send(unrecorded, *args)
+		    end
+		end
+	    end
+
+	    # Puts the plugin setters back as they were
+	    def self.unhook
+		SETTERS.each do
+		    |setter|
+		    unrecorded = "#{setter}_unrecorded"
+		    Opensync.singleton_class.send(:alias_method, setter, unrecorded)
+		    Opensync.singleton_class.send(:remove_method, unrecorded)
+		end
+	    end
+	    private_class_method :hook, :unhook
+
+	    def self.recorded(setter, args)
+		@recording[Opensync.osync_rubymodule_address(args.first)] << [setter, args[1]] if @recording
+	    end
+
+	    def self.callback?(setter, value)
+		setter =~ /_func$/ and not value.nil?
+	    end
+
+	    def initialize(pathname, files)
+		@key = [VERSION, RUBY_VERSION, pathname.to_s, pathname.mtime.to_f,
+		        files.collect {|file| [file.to_s, file.mtime.to_f, file.size] }]
+		@path = ISeqCache.entry(pathname.to_s, ".index") if defined?(ISeqCache) and ISeqCache.dir
+		# [file, loaded every time, [plugin info]]
+		@files = []
+	    end
+
+	    # Reads the index, if it matches the directory
+	    def load
+		return false if not @path
+		(key, files) = ::Marshal.load(File.binread(@path))
+		return false if key != @key
+		@files = files
+		true
+	    rescue SystemCallError, TypeError, ArgumentError
+		false
+	    end
+
+	    def save
+		ISeqCache.write(@path, ::Marshal.dump([@key, @files])) if @path
+	    end
+
+	    # Starts the entry of file, as a full load reads it
+	    def file(file)
+		@files << [file.to_s, false, []]
+	    end
+
+	    # Registers obj, from the current file, in env and records it
+	    def add(obj, env)
+		entry = @files.last
+		if obj.kind_of?(Class) and obj <= Plugin and obj.method(:get_sync_info).owner == Plugin.singleton_class
+		    plugin = nil
+		    calls = Index.record { plugin = obj.new }[Opensync.osync_rubymodule_address(plugin._self)]
+		    env.register_plugin(plugin)
+		    (callbacks, setters) = calls.partition {|(setter, value)| Index.callback?(setter, value) }
+		    if setters.all? {|(setter, value)| PLAIN.any? {|klass| value.kind_of?(klass) } }
+			entry[2] << { :class => obj.name, :setters => setters, :callbacks => callbacks.collect {|(setter, value)| setter }.uniq }
+		    else
+			entry[1] = true
+		    end
+		else
+		    obj.send(:get_sync_info, env)
+		    entry[1] = true
+		end
+	    end
+
+	    # Registers the plugins of the index: stand-ins or the loaded files
+	    def register(env)
+		@files.each do
+		    |(file, eager, plugins)|
+		    # Files without plugins are loaded too, for their side effects
+		    if eager or plugins.empty?
+			MetaPlugin.load_file(Pathname.new(file)) {|obj| obj.send(:get_sync_info, env) }
+		    else
+			plugins.each {|info| MetaPlugin.register_proxy(env, file, info) }
+		    end
+		end
+	    end
+	end
     end
 
     # This is not really a format but someone that ruby-module calls to run get_format_info and get_conversion_info
@@ -168,6 +564,23 @@ module Opensync
     end
 
 
+    # Wrappers of osync methods generated at build time (opensync_mapped.rb, by
+    # genmapped.rb). Without it, map_methods compiles them at load time
+    module Mapped
+	# genmapped.rb defines its own for, which records the mapping
+	if not respond_to?(:for)
+	    def self.for(klass, regexp, methods)
+		name=klass.name.sub(/^Opensync::/,"").gsub("::","_")
+		const_defined?(name, false) ? const_get(name) : nil
+	    end
+
+	    begin
+		require File.join(File.dirname(__FILE__), "opensync_mapped")
+	    rescue LoadError
+	    end
+	end
+    end
+
     # Ruby way of doing it
 
     class OSyncObject
@@ -196,15 +609,36 @@ module Opensync
 # 	    class_method_defined?(:ruby_init)
 # 	end
 
+	# Canonical wrapper of each live C object, by SWIG type and C address.
+	# Each wrapper holds a single ref of its C object, released when the
+	# wrapper is collected.
+	@@identity=Hash.new {|hash, klass| hash[klass]={} }
+
+	def self.identity(_self)
+	    ref=@@identity[_self.class][Opensync.osync_rubymodule_address(_self)]
+	    ref.__getobj__ if ref and ref.weakref_alive?
+	rescue WeakRef::RefError
+	    nil
+	end
+
 	def self.cleanup_on_GC(obj,_self)
-	    destructor=Proc.new do
-		$stderr.puts "Cleanning someone!!!!"
+	    identity=@@identity[_self.class]
+	    address=Opensync.osync_rubymodule_address(_self)
+	    ObjectSpace.undefine_finalizer(obj)
+	    ObjectSpace.define_finalizer(obj, destructor(_self, identity, address))
+	    # After the finalizers are reset: ruby 1.9 WeakRef defines its own
+	    identity[address]=WeakRef.new(obj)
+	end
+
+	# Built apart from cleanup_on_GC so the proc does not keep the wrapper alive
+	def self.destructor(_self, identity, address)
+	    Proc.new do
 		# cleanup C world userdata
 		#self.ruby_free(_self) if need_ruby_init?
 		self.unref(_self)
+		ref=identity[address]
+		identity.delete(address) if ref and not ref.weakref_alive?
 	    end
-	    ObjectSpace.undefine_finalizer(obj)
-	    ObjectSpace.define_finalizer(obj, destructor)
 	end
 
 	NEW=:new
@@ -213,11 +647,13 @@ module Opensync
 	end
 
 	def self.from(_self)
-	    # Maybe rescue a previous instance
-	    new_pvt(_self)
+	    # Rescue the live wrapper of _self, if any
+	    identity(_self) or new_pvt(_self)
 	end
 
 	attr_reader :_self
+	# Callbacks set through this wrapper, by setter name (:initialize_func...)
+	attr_reader :callbacks
 	#
 	# TODO: update this doc
 	# Initialize an object in Ruby World. _self represents the SWIK object.
@@ -261,115 +697,146 @@ module Opensync
 	private :initialize_from, :initialize_new
 
 	@@unmapped_methods=Set.new(Opensync.methods.select {|method| /^osync_(?!get_version)/ =~ method.to_s })
-	@@unmapped_methods.delete(:osync_rubymodule_get_data)
-	@@unmapped_methods.delete(:osync_rubymodule_set_data)
-	@@unmapped_methods.delete(:osync_rubymodule_clean_data)
+	@@unmapped_methods.select {|method| method.to_s =~ /^osync_rubymodule_/ }.each {|method| @@unmapped_methods.delete(method)}
 	@@unmapped_methods.select {|method| method.to_s =~ /^osync_trace/ }.each {|method| @@unmapped_methods.delete(method)}
 	def self.map_methods(regexp)
-	    @@unmapped_methods.
-	      select {|method| regexp =~ method.to_s }.
-	      each do
+	    methods=@@unmapped_methods.select {|method| regexp =~ method.to_s }
+	    methods.each {|method| @@unmapped_methods.delete(method) }
+
+	    # Wrappers generated at build time
+	    if mapped=Mapped.for(self, regexp, methods)
+		include mapped
+		extend mapped::ClassMethods
+		methods-=mapped::METHODS
+	    end
+
+	    # Anything else is compiled now
+	    methods.each do
 		|method|
-		@@unmapped_methods.delete(method)
 		#$stderr.puts "Defining #{method} for #{self}"
-		prefix = method.to_s.match(regexp)[0]
-		suffix = method.to_s[prefix.size..-1]
+		(instance_source, class_source)=mapping_source(method, regexp)
+		self.class_eval instance_source if instance_source
+		self.singleton_class.class_eval class_source if class_source
+	    end
+	end
 
-# 		$stderr.puts suffix if self.name=="Opensync::ObjectType::Sink"
+	# Ruby code of the wrappers of an osync method, as [instance methods, class methods].
+	# arity is [min, max] of its C function arguments. A fixed arity gets plain
+	# arguments, anything else gets a splat.
+	def self.mapping_source(method, regexp, arity=nil)
+	    prefix = method.to_s.match(regexp)[0]
+	    suffix = method.to_s[prefix.size..-1]
 
-		case suffix
+# 	    $stderr.puts suffix if self.name=="Opensync::ObjectType::Sink"
 
-		# new is already used. Name it alloc
-		when "new"
-		    self.class_eval "
-		    def self.alloc(*args)
-			args=args.collect {|arg| if arg.kind_of? OSyncObject; arg._self; else; arg; end}
-			Opensync.#{method}(*args)
-		    end
-		    "
+	    case suffix
 
-		# class methods
-		when "unref", "ref" #, "ruby_init", "ruby_free"
-		    self.class_eval "
-		    def self.#{suffix}(*args)
-			Opensync.#{method}(*args)
-		    end
-		    "
-# 		when "is_ruby_initialized"
-# 		    self.class_eval "
-# 		    def self.ruby_initialized?(*args)
-# 			Opensync.#{method}(*args)
-# 		    end
-# 		    "
-		when "initialize"
-		    self.class_eval "
-		    def osync_initialize(*args)
-			Opensync.#{method}(@_self, *args)
-		    end
-		    "
-
-		# getters and setters
-		when /^get_/
-		    property=suffix[4..-1]
-		    # Append 0 to initialize in order to avoid conflict with ruby initialize
-		    property="#{property}0" if property == "initialize"
-		    self.class_eval "
-		    def #{property}
-			self.class.map_object(Opensync.#{method}(@_self))
-		    end
-		    "
-
-		when /^set_/
-		    property=suffix[4..-1]
-# 		    $stderr.puts property if self.name=="Opensync::ObjectType::Sink"
-		    self.class_eval "
-		    def #{property}=(value)
-			value=value._self if value.kind_of? OSyncObject
-			Opensync.#{method}(@_self, value)
-		    end
-		    "
-		    # Callbacks definition
-		    if suffix =~ /_func$/
-			self.class_eval "
-			def #{property}(&block)
-			    self.#{property}=callback(:#{property[0..-6]}, &block)
-			end
-			"
-		    end
-		when /^is_/
-		    property=suffix[3..-1]		    #
-		    self.class_eval "
-		    def #{property}?
-			value=value._self if value.kind_of? OSyncObject
-			self.class.map_object(Opensync.#{method}(@_self))
-		    end
-		    "
-		else
-		    # Append 0 to initialize in order to avoid conflict with ruby initialize
-		    property="#{suffix}0" if suffix == "initialize"
-		    self.class_eval "
-		    def #{suffix}(*args)
-			args=args.collect {|arg| if arg.kind_of? OSyncObject; arg._self; else; arg; end}
-			self.class.map_object(Opensync.#{method}(@_self, *args))
-		    end
-		    "
+	    # new is already used. Name it alloc
+	    when "new"
+		(params, args, unwrap)=mapping_args(arity, 0)
+		[nil, "
+		def alloc(#{params})
+		    #{unwrap}
+		    Opensync.#{method}(#{args})
 		end
-	      end
+		"]
+
+	    # class methods
+	    when "unref", "ref" #, "ruby_init", "ruby_free"
+		(params, args)=mapping_args(arity, 0)
+		[nil, "
+		def #{suffix}(#{params})
+		    Opensync.#{method}(#{args})
+		end
+		"]
+	    when "initialize"
+		(params, args)=mapping_args(arity, 1)
+		["
+		def osync_initialize(#{params})
+		    Opensync.#{method}(#{(["@_self"] + [args]).reject {|arg| arg.empty? }.join(", ")})
+		end
+		"]
+
+	    # getters and setters
+	    when /^get_/
+		property=suffix[4..-1]
+		# Append 0 to initialize in order to avoid conflict with ruby initialize
+		property="#{property}0" if property == "initialize"
+		["
+		def #{property}
+		    self.class.map_object(Opensync.#{method}(@_self), self)
+		end
+		"]
+
+	    when /^set_/
+		property=suffix[4..-1]
+# 		$stderr.puts property if self.name=="Opensync::ObjectType::Sink"
+		source="
+		def #{property}=(value)
+		    value=value._self if value.kind_of? OSyncObject
+		    Opensync.#{method}(@_self, value)
+		end
+		"
+		# Callbacks definition
+		if suffix =~ /_func$/
+		    source="
+		def #{property}=(value)
+		    (@callbacks ||= {})[:#{property}]=value
+		    Opensync.#{method}(@_self, value)
+		end
+		"
+		    source+="
+		def #{property}(&block)
+		    self.#{property}=callback(:#{property[0..-6]}, &block)
+		end
+		"
+		end
+		[source]
+	    when /^is_/
+		property=suffix[3..-1]
+		["
+		def #{property}?
+		    self.class.map_object(Opensync.#{method}(@_self), self)
+		end
+		"]
+	    else
+		(params, args, unwrap)=mapping_args(arity, 1)
+		["
+		def #{suffix}(#{params})
+		    #{unwrap}
+		    self.class.map_object(Opensync.#{method}(#{(["@_self"] + [args]).reject {|arg| arg.empty? }.join(", ")}), self)
+		end
+		"]
+	    end
+	end
+
+	# [parameters, arguments, unwrap code] for a wrapper of a C function with
+	# arity [min, max]. skip is the number of arguments filled by the wrapper itself
+	def self.mapping_args(arity, skip)
+	    if arity and arity[0]==arity[1]
+		args=(1..arity[0]-skip).collect {|i| "arg#{i}" }
+		unwrap=args.collect {|arg| "#{arg}=#{arg}._self if #{arg}.kind_of? OSyncObject" }.join("; ")
+		[args.join(", "), args.join(", "), unwrap]
+	    else
+		["*args", "*args", "args=args.collect {|arg| if arg.kind_of? OSyncObject; arg._self; else; arg; end}"]
+	    end
 	end
 
 	def self.unmapped_methods
 	    @@unmapped_methods.dup
 	end
 
-	def self.map_object(obj)
-	    if obj.kind_of? Array
-		obj.collect {|_obj| self.map_object(_obj) }
+	# owner, the object obj was read from, is kept alive by the Lists in obj
+	def self.map_object(obj, owner=nil)
+	    if klass=@@swig2ruby[obj.class]
+		klass.from(obj)
+	    elsif obj.kind_of? Array
+		obj.collect {|_obj| self.map_object(_obj, owner) }
+	    elsif obj.kind_of? List
+		# Lazy: items are mapped as they are read
+		obj.mapped_by(self, owner)
 	    else
-		if klass=@@swig2ruby[obj.class]
-		    klass.from(obj)
-		else
-		    obj
-		end
+		obj
 	    end
 	end
 
@@ -413,6 +880,27 @@ module Opensync
 	def []=(key, value)
 	    Opensync.osync_rubymodule_set_data(@_self, key.to_s, value)
 	end
+
+	#
+	# When true, data given to this object callbacks (formats and converters)
+	# is an Opensync::Buffer pointing to opensync memory instead of a String
+	# copy. It is only valid inside the callback: use dup or to_s to keep it.
+	# Returning an owned Opensync::Buffer (Buffer.new or Buffer#dup) hands its
+	# memory to opensync without a copy.
+	def zero_copy=(value)
+	    Opensync.osync_rubymodule_set_zero_copy(@_self, value)
+	end
+
+	#
+	# When limit > 0, context callbacks of this object (sink connect,
+	# get_changes, commit, read, sync_done...) do not block their caller: each
+	# one runs in a non-blocking Fiber, so up to limit of them overlap their
+	# I/O waits (see Opensync::Async). They report through the context as
+	# usual. An exception is reported as a context error. Needs ruby >= 3.0.
+	def async=(limit)
+	    Async.install if limit.to_i > 0
+	    Opensync.osync_rubymodule_set_async(@_self, limit.to_i)
+	end
     end
 
     class Plugin < OSyncObject
@@ -426,6 +914,14 @@ module Opensync
 	    env.register_plugin(plugin)
 	end
 
+	# Applies the "RubyGC" advanced option, if present, as the GC policy
+	# (same syntax as OPENSYNC_RUBY_GC: never, every:N, threshold:SIZE or boundary)
+	def configure_gc(config)
+	    return if not config
+	    option = config.advancedoptions.find {|option| option.name == "RubyGC" }
+	    Opensync.osync_rubymodule_set_gc_policy(option.value) if option
+	end
+
 	class Env < OSyncObject
 	    represent SWIG::TYPE_p_OSyncPluginEnv
 	    map_methods /^osync_plugin_env_/
@@ -471,6 +967,20 @@ module Opensync
 	map_methods /^osync_objformat_((?!sink))/
 	represent SWIG::TYPE_p_OSyncObjFormat
 
+	#
+	# When true, compare calls with byte identical data return
+	# OSYNC_CONV_DATA_SAME in C, without calling the compare callback.
+	# Formats where equal bytes might not be the same object keep it off.
+	def compare_fast_path=(value)
+	    Opensync.osync_rubymodule_set_compare_fast(@_self, value)
+	end
+
+	# Compares answered by the fast path (hits) and passed to ruby (misses),
+	# for all formats
+	def self.compare_stats
+	    Opensync.osync_rubymodule_compare_stats
+	end
+
 	class Sink < OSyncObject
 	    map_methods /^osync_objformat_sink_/
 	    represent SWIG::TYPE_p_OSyncObjFormatSink
@@ -499,6 +1009,13 @@ module Opensync
     class Context < OSyncObject
 	map_methods /^osync_context_/
 	represent SWIG::TYPE_p_OSyncContext
+
+	# Reports many changes in a single native call. changes is an Enumerable of
+	# [uid, changetype, hash, data], data being a String, an Opensync::Buffer or nil
+	def report_changes(changes, format, objtype)
+	    format=format._self if format.kind_of? OSyncObject
+	    Opensync.osync_rubymodule_context_report_changes(@_self, changes.to_a, format, objtype)
+	end
     end
 
     class ObjectType < OSyncObject
@@ -534,6 +1051,18 @@ module Opensync
 	    self.class.map_object(Opensync.osync_hashtable_get_changetype(@_self, change))
 	end
 
+	# Hash stored for uid, or nil when the table does not know it. The
+	# generated getter (hash) takes no uid
+	def get_hash(uid)
+	    Opensync.osync_hashtable_get_hash(@_self, uid)
+	end
+
+	# Gets the changetype of each uid and updates the table in a single native
+	# call. A nil hash marks the uid as deleted. Returns the changetypes
+	def classify_and_update(uids, hashes)
+	    Opensync.osync_rubymodule_hashtable_classify_and_update(@_self, uids.to_a, hashes.to_a)
+	end
+
 	# Not allocated by _new, not controled
 	def self.unref(obj)
 	end
@@ -574,38 +1103,313 @@ end
 # TODO: osync_objtype_main_sink_new is mapped where? What is it for? Check docs.
 Opensync::OSyncObject.unmapped_methods.to_a.each {|method| warn("Atention! Method #{method} not mapped!") }
 #GC.stress=true
-if $trace
-  @untraced_classes << Opensync::OSyncObject
-  set_trace_func proc {
-    |event, file, line, id, binding, klass|
-    next if not Opensync::osync_trace_is_enabled
-    next if not klass or @untraced_classes.include?(klass)
-
-    case event
-    when "raise"
-        type=Opensync::TRACE_ERROR
-        msg="RUBY #{klass}.#{id} #{$!}\n#{$!.backtrace.join("\n")}"
-    when "call", "c-call"
-	type=Opensync::TRACE_ENTRY
-        args=binding.eval("local_variables.collect {|var| var }.collect{|var| eval(var.to_s)}")
-	id_s=id.to_s
-	case
-	when (id_s[-1,1] == "=" and args.size==1)
-            msg="RUBY #{klass}.#{id_s[0..-2]}=#{args.first.inspect}"
-	when (id_s[-2,2] == "[]" and args.size==1)
-	    msg="RUBY #{klass}[#{args.first.inspect}]"
-	when (id_s[-3,3] == "[]=" and args.size==2)
-            msg="RUBY #{klass}[#{args.first.inspect}]=#{args.last.inspect}"
-	else
-	    msg="RUBY #{klass}.#{id_s}(#{args.collect{|arg| arg.inspect}.join(",")})"
-	end
-    when "return", "c-return"
-	type=Opensync::TRACE_EXIT
-        msg="RUBY #{klass}.#{id}"
-    else
-        next
-        #$stderr.printf "%8s %s:%-2d %10s %8s\n", event, file, line, id, klass, binding
+
+module Opensync
+    #
+    # Sends ruby calls to osync_trace. It is only enabled when OSYNC_TRACE is set.
+    #
+    # OPENSYNC_RUBY_TRACE_FILTER: comma separated list of Class or Class#method
+    #                             to trace. Default: every class defined by
+    #                             opensync.rb users
+    # OPENSYNC_RUBY_TRACE_SAMPLE: trace only one of each N calls, with argument
+    #                             summaries (class and size) instead of inspect,
+    #                             as single lines (returns are not traced).
+    #                             Default: 1 (every call, return and raise)
+    #
+    module Tracer
+	@untraced=UNTRACED_CLASSES + [OSyncObject, Tracer, Tracer.singleton_class]
+	@filter=nil
+	@sample=1
+	@count=0
+	@tracepoint=nil
+
+	# filter: Array of "Class" or "Class#method" (nil traces all)
+	def self.start(filter=nil, sample=1)
+	    stop
+	    @sample=[sample.to_i, 1].max
+	    @count=0
+	    @filter=nil
+	    if filter and not filter.empty?
+		# class name => nil (all methods) or Set of method names
+		@filter={}
+		filter.each do
+		    |spec|
+		    (klass, method)=spec.strip.split("#", 2)
+		    if method
+			(@filter[klass] ||= Set.new) << method.to_sym if @filter.fetch(klass, true)
+		    else
+			@filter[klass]=nil
+		    end
+		end
+	    end
+
+	    if defined?(TracePoint)
+		events = (@sample==1 ? [:call, :return, :c_call, :c_return, :raise] : [:call, :raise])
+		@tracepoint=TracePoint.new(*events) {|tp| event(tp.event, tp.defined_class, tp.method_id, tp) }
+		@tracepoint.enable
+	    else
+		# ruby 1.9 has no TracePoint
+		@tracepoint=true
+		set_trace_func proc {|event, file, line, id, binding, klass|
+		    event(event.tr("-","_").to_sym, klass, id, binding)
+		}
+	    end
+	    true
+	end
+
+	def self.stop
+	    return if not @tracepoint
+	    if @tracepoint.kind_of? TrueClass
+		set_trace_func(nil)
+	    else
+		@tracepoint.disable
+	    end
+	    @tracepoint=nil
+	end
+
+	def self.enabled?
+	    !!@tracepoint
+	end
+
+	def self.traced?(klass, id)
+	    return false if not klass or @untraced.include?(klass)
+	    return true if not @filter
+	    name=klass.name
+	    return false if not @filter.include?(name)
+	    methods=@filter[name]
+	    not methods or methods.include?(id)
+	end
+
+	# Cheap description of a value: its class and size, if it has one
+	def self.summary(value)
+	    case value
+	    when String, Array, Hash, Buffer, PackedRecord
+		"#{value.class}(#{value.size})"
+	    when nil, true, false, Numeric, Symbol
+		value.inspect
+	    else
+		value.class.to_s
+	    end
+	end
+
+	# binding is a Binding (set_trace_func) or a TracePoint
+	def self.arguments(event, binding)
+	    return [] if not event == :call
+	    binding=binding.binding if binding.respond_to?(:binding)
+	    binding.eval("local_variables").collect {|var| binding.eval(var.to_s) }
+	rescue
+	    []
+	end
+
+	def self.event(event, klass, id, binding)
+	    return if not traced?(klass, id)
+	    case event
+	    when :raise
+		Opensync::osync_trace(Opensync::TRACE_ERROR, "RUBY #{klass}.#{id} #{$!}\n#{$!.backtrace.join("\n") if $!}")
+	    when :call, :c_call
+		if @sample > 1
+		    @count+=1
+		    return if @count % @sample != 0
+		    # No matching exit: an entry would indent the trace for good
+		    args=arguments(event, binding).collect {|arg| summary(arg) }
+		    Opensync::osync_trace(Opensync::TRACE_INTERNAL, "RUBY #{klass}.#{id}(#{args.join(",")})")
+		    return
+		end
+		args=arguments(event, binding).collect {|arg| arg.inspect }
+		Opensync::osync_trace(Opensync::TRACE_ENTRY, "RUBY #{klass}.#{id}(#{args.join(",")})")
+	    when :return, :c_return
+		Opensync::osync_trace(Opensync::TRACE_EXIT, "RUBY #{klass}.#{id}")
+	    end
+	end
+    end
+end
+
+if ENV2.include?("OSYNC_TRACE")
+    Opensync::Tracer.start(ENV2["OPENSYNC_RUBY_TRACE_FILTER"] && ENV2["OPENSYNC_RUBY_TRACE_FILTER"].split(","),
+			   ENV2["OPENSYNC_RUBY_TRACE_SAMPLE"] || 1)
+end
+
+module Opensync
+    #
+    # Async context callbacks (ruby >= 3.0, see OSyncObject#async=)
+    #
+    # Each posted callback runs in a non-blocking Fiber of the ruby thread.
+    # This scheduler suspends it on I/O, sleep and Mutex/Queue waits. The
+    # ruby thread calls run_once while fibers are pending, which also returns
+    # when a new call arrives (wakeup pipe).
+    #
+    module Async
+	def self.available?
+	    Fiber.respond_to?(:set_scheduler)
+	end
+
+	# Installs the default scheduler in the ruby thread, if none is set
+	def self.install
+	    Fiber.set_scheduler(Scheduler.new) if not Fiber.scheduler
+	    Fiber.scheduler
+	end
+
+	class Scheduler
+	    def initialize
+		@wakeup=IO.for_fd(Opensync.osync_rubymodule_async_wakeup_fd, autoclose: false)
+		# Fiber => [io, events, deadline]. io is nil for sleep and block
+		@waiting={}
+		# Fibers unblocked by other threads
+		@ready=[]
+		@lock=Thread::Mutex.new
+		(@unblocked, @unblocker)=IO.pipe
+	    end
+
+	    def now
+		Process.clock_gettime(Process::CLOCK_MONOTONIC)
+	    end
+
+	    def wait(io, events, timeout)
+		@waiting[Fiber.current]=[io, events, timeout && now + timeout]
+		Fiber.yield
+	    ensure
+		@waiting.delete(Fiber.current)
+	    end
+
+	    # Returns the events that are ready or false on timeout
+	    def io_wait(io, events, timeout)
+		wait(io, events, timeout)
+	    end
+
+	    def kernel_sleep(duration=nil)
+		wait(nil, 0, duration)
+		true
+	    end
+
+	    # Returns false on timeout
+	    def block(blocker, timeout=nil)
+		wait(nil, 0, timeout)
+	    end
+
+	    # Might be called from any thread
+	    def unblock(blocker, fiber)
+		@lock.synchronize { @ready << fiber }
+		@unblocker.write_nonblock(".", exception: false)
+	    end
+
+	    def fiber(&block)
+		fiber=Fiber.new(blocking: false, &block)
+		fiber.resume
+		fiber
+	    end
+
+	    def pending?
+		not @waiting.empty? or @lock.synchronize { not @ready.empty? }
+	    end
+
+	    # Waits for something to happen, at most timeout seconds if given, and
+	    # resumes the fibers that can go on
+	    def run_once(timeout=nil)
+		readers=[@wakeup, @unblocked]
+		writers=[]
+		deadline=nil
+		@waiting.each_value do
+		    |(io, events, at)|
+		    readers << io if io and events & IO::READABLE != 0
+		    writers << io if io and events & IO::WRITABLE != 0
+		    deadline=at if at and (not deadline or at < deadline)
+		end
+		wait=(@lock.synchronize { @ready.empty? } ? deadline && [deadline - now, 0].max : 0)
+		wait=timeout if timeout and (not wait or timeout < wait)
+		(readable, writable)=IO.select(readers, writers, nil, wait) || [[], []]
+		@wakeup.read_nonblock(4096, exception: false) if readable.include?(@wakeup)
+		@unblocked.read_nonblock(4096, exception: false) if readable.include?(@unblocked)
+
+		resumes=[]
+		time=now
+		@waiting.each do
+		    |fiber, (io, events, at)|
+		    ready=0
+		    ready|=IO::READABLE if io and readable.include?(io)
+		    ready|=IO::WRITABLE if io and writable.include?(io)
+		    if ready != 0
+			resumes << [fiber, ready & events]
+		    elsif at and at <= time
+			resumes << [fiber, false]
+		    end
+		end
+		@lock.synchronize { resumes.unshift(*@ready.collect {|fiber| [fiber, true] }); @ready.clear }
+		# A fiber resumed once might be waiting for something else now
+		resumes.uniq {|(fiber, value)| fiber }.each {|(fiber, value)| fiber.resume(value) if fiber.alive? }
+	    end
+
+	    # Ruby calls it when the scheduler is replaced or the thread ends.
+	    # Fibers still waiting are dropped, never resumed: the module fails
+	    # their callbacks (at finalize, after giving them some time to finish)
+	    def close
+		@waiting.clear
+		@lock.synchronize { @ready.clear }
+	    end
+	end
+    end
+end
+
+module Opensync
+    #
+    # Runs callbacks outside the main ruby thread, in Ractor lanes (ruby >= 3.0).
+    #
+    # A lane is a Ractor serving its own request queue. An object bound to a
+    # lane (a sink, or any OSyncObject with callbacks) has its callbacks run
+    # there; objects bound to the pool (stateless format and converter
+    # callbacks) run in any pooled lane.
+    #
+    # Lanes cannot see class variables, so OSyncObject wrappers do not work
+    # there: callbacks of bound objects must be shareable (see callback) and
+    # use the procedural API (Opensync.osync_*) over the SWIG pointers they get.
+    #
+    # OPENSYNC_RUBY_RACTORS: size of the pool started when opensync.rb loads
+    #
+    module Ractors
+	@lanes=[]
+
+	def self.available?
+	    defined?(::Ractor) ? true : false
+	end
+
+	# Adds size lanes to the pool
+	def self.pool(size)
+	    size.to_i.times { start_lane(true) }
+	end
+
+	# Binds object (an OSyncObject or a SWIG pointer) to a lane of its own
+	def self.bind(object)
+	    Opensync.osync_rubymodule_set_lane(unwrap(object), start_lane(false))
+	end
+
+	# Binds object to the pool
+	def self.pooled(object)
+	    Opensync.osync_rubymodule_set_lane(unwrap(object), Opensync::RUBYMODULE_LANE_POOL)
+	end
+
+	# Binds object back to the main ruby thread
+	def self.unbind(object)
+	    Opensync.osync_rubymodule_set_lane(unwrap(object), Opensync::RUBYMODULE_LANE_MAIN)
+	end
+
+	# A shareable callback that calls receiver.method(*args). receiver must
+	# be shareable itself, usually a module.
+	def self.callback(receiver, method)
+	    Ractor.make_shareable(nil.instance_exec { Proc.new {|*args| receiver.__send__(method, *args) } })
+	end
+
+	def self.unwrap(object)
+	    object.kind_of?(OSyncObject) ? object._self : object
+	end
+
+	def self.start_lane(pooled)
+	    lane=Opensync.osync_rubymodule_lane_new(pooled)
+	    @lanes << Ractor.new(lane) {|id| Opensync.osync_rubymodule_lane_serve(id) }
+	    lane
+	end
+	private_class_method :unwrap, :start_lane
     end
-    Opensync::osync_trace(type, msg)
-  }
-end
\ No newline at end of file
+end
+
+if ENV2.include?("OPENSYNC_RUBY_RACTORS") and Opensync::Ractors.available?
+    Opensync::Ractors.pool(ENV2["OPENSYNC_RUBY_RACTORS"])
+end
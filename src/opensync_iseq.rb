@@ -0,0 +1,91 @@
+#
+# Compiled code cache. The ruby module requires this before opensync.rb:
+# from then on, every file loaded by require or load (opensync.rb, plugins,
+# formats and the libraries they use) is compiled once and its
+# RubyVM::InstructionSequence binary is kept in a cache directory. Next
+# processes load the binary instead of parsing and compiling the file again.
+#
+# Entries are keyed by the file path, mtime and size and by the ruby build
+# (RUBY_DESCRIPTION). A changed file or another ruby just misses the cache.
+#
+# OPENSYNC_RUBY_CACHEDIR sets the directory (default ~/.opensync/ruby-cache).
+# An empty value disables the cache.
+#
+module Opensync
+    module ISeqCache
+	@hits = 0
+	@misses = 0
+
+	def self.dir
+	    return @dir if defined?(@dir)
+	    @dir = ENV.fetch("OPENSYNC_RUBY_CACHEDIR") { File.join(Dir.home, ".opensync", "ruby-cache") rescue "" }
+	    @dir = nil if @dir.empty?
+	    @dir
+	end
+
+	# Loaded from the cache (hits) and compiled (misses) in this process
+	def self.stats
+	    { :hits => @hits, :misses => @misses, :dir => dir }
+	end
+
+	# FNV-1a of path: a stable, short entry name. Other caches (the plugin
+	# index) keep their entries here too, with another suffix
+	def self.entry(path, suffix=".iseq")
+	    hash = 0xcbf29ce484222325
+	    path.each_byte {|byte| hash = ((hash ^ byte) * 0x100000001b3) & 0xffffffffffffffff }
+	    File.join(dir, "#{File.basename(path, ".rb")}-#{"%016x" % hash}#{suffix}")
+	end
+
+	# Writes data as entry: to a temporary file, renamed so concurrent syncs
+	# see a whole entry or none
+	def self.write(entry, *data)
+	    [File.dirname(dir), dir].each {|path| Dir.mkdir(path, 0700) if not File.directory?(path) }
+	    tmp = "#{entry}.#{Process.pid}.tmp"
+	    File.open(tmp, "wb", 0600) {|io| data.each {|part| io.write(part) } }
+	    File.rename(tmp, entry)
+	    true
+	rescue SystemCallError, RuntimeError
+	    File.unlink(tmp) rescue nil if tmp
+	    false
+	end
+
+	def self.key(path, stat)
+	    "#{RUBY_DESCRIPTION}\0#{path}\0#{stat.mtime.to_i}.#{stat.mtime.nsec}\0#{stat.size}\n"
+	end
+
+	# The instruction sequence of path, or nil to let ruby compile it as usual
+	def self.load(path)
+	    return nil if not dir
+	    stat = File.stat(path)
+	    key = key(path, stat)
+	    entry = entry(path)
+	    begin
+		data = File.binread(entry)
+		if data.start_with?(key.b)
+		    iseq = RubyVM::InstructionSequence.load_from_binary(data.byteslice(key.bytesize..-1))
+		    @hits += 1
+		    return iseq
+		end
+	    rescue SystemCallError, RuntimeError, TypeError, ArgumentError
+		# Missing, stale or written by an incompatible ruby: compile it again
+	    end
+
+	    iseq = RubyVM::InstructionSequence.compile_file(path)
+	    @misses += 1
+	    write(entry, key.b, iseq.to_binary)
+	    iseq
+	rescue SyntaxError, SystemCallError
+	    # Ruby reports it when it loads the file itself
+	    nil
+	end
+    end
+end
+
+# Binaries need ruby >= 2.3 (load_iseq, to_binary and load_from_binary)
+if defined?(RubyVM::InstructionSequence) and RubyVM::InstructionSequence.respond_to?(:load_from_binary)
+    class << RubyVM::InstructionSequence
+	def load_iseq(path)
+	    Opensync::ISeqCache.load(path)
+	end
+    end
+end
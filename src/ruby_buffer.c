@@ -0,0 +1,347 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#include "ruby_buffer.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define BUFFER_VALID 1
+#define BUFFER_OWNED 2
+#define BUFFER_MAPPED 4
+
+struct rubymodule_buffer {
+    char *ptr;
+    long len;
+    int  flags;
+};
+
+/* Live mappings, by the pointer given out: once opensync owns one, that
+ * pointer is all there is to unmap it. The pages are read-only, so copies
+ * (Buffer#dup) share the mapping: refs counts the owners */
+struct rubymodule_mapping {
+    char *ptr;
+    char *base;
+    size_t length;
+    int refs;
+    struct rubymodule_mapping *next;
+};
+
+static VALUE cBuffer = Qnil;
+static struct rubymodule_mapping *mappings = NULL;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int rubymodule_buffer_unmap(char *ptr) {
+    struct rubymodule_mapping **link, *mapping = NULL;
+
+    if (!ptr)
+        return 0;
+    pthread_mutex_lock(&mappings_lock);
+    for (link = &mappings; *link; link = &(*link)->next)
+        if ((*link)->ptr == ptr) {
+            mapping = *link;
+            if (--mapping->refs)
+                mapping = NULL;
+            else
+                *link = mapping->next;
+            pthread_mutex_unlock(&mappings_lock);
+            if (mapping) {
+                munmap(mapping->base, mapping->length);
+                free(mapping);
+            }
+            return 1;
+        }
+    pthread_mutex_unlock(&mappings_lock);
+    return 0;
+}
+
+/* Takes one more reference to the mapping given out as ptr. Returns 0 if
+ * ptr is not a live mapping */
+static int rubymodule_buffer_map_ref(char *ptr) {
+    struct rubymodule_mapping *mapping;
+    int found = 0;
+
+    pthread_mutex_lock(&mappings_lock);
+    for (mapping = mappings; mapping; mapping = mapping->next)
+        if (mapping->ptr == ptr) {
+            mapping->refs++;
+            found = 1;
+            break;
+        }
+    pthread_mutex_unlock(&mappings_lock);
+    return found;
+}
+
+void rubymodule_buffer_release(char *ptr) {
+    if (!rubymodule_buffer_unmap(ptr))
+        free(ptr);
+}
+
+static void rubymodule_buffer_free(struct rubymodule_buffer *buffer) {
+    if (buffer->flags & BUFFER_MAPPED)
+        rubymodule_buffer_unmap(buffer->ptr);
+    else if (buffer->flags & BUFFER_OWNED)
+        free(buffer->ptr);
+    free(buffer);
+}
+
+static VALUE rubymodule_buffer_alloc(char *ptr, long len, int flags) {
+    struct rubymodule_buffer *buffer = malloc(sizeof(struct rubymodule_buffer));
+    buffer->ptr = ptr;
+    buffer->len = len;
+    buffer->flags = flags;
+    return Data_Wrap_Struct(cBuffer, NULL, rubymodule_buffer_free, buffer);
+}
+
+static VALUE rubymodule_buffer_alloc_copy(const char *ptr, long len) {
+    char *copy = malloc(len ? len : 1);
+    memcpy(copy, ptr, len);
+    return rubymodule_buffer_alloc(copy, len, BUFFER_VALID | BUFFER_OWNED);
+}
+
+/* Returns the buffer struct, raising if it is not valid anymore */
+static struct rubymodule_buffer *rubymodule_buffer_get(VALUE self) {
+    struct rubymodule_buffer *buffer;
+    Data_Get_Struct(self, struct rubymodule_buffer, buffer);
+    if (!(buffer->flags & BUFFER_VALID))
+        rb_raise(rb_eRuntimeError, "Opensync::Buffer used after its callback returned or its memory was handed to opensync. Use dup or to_s to keep it");
+    return buffer;
+}
+
+VALUE rubymodule_buffer_borrow(const char *ptr, long len) {
+    if (!ptr)
+        return Qnil;
+    return rubymodule_buffer_alloc((char*) ptr, len, BUFFER_VALID);
+}
+
+void rubymodule_buffer_invalidate(VALUE self) {
+    struct rubymodule_buffer *buffer;
+    if (!rubymodule_buffer_p(self))
+        return;
+    Data_Get_Struct(self, struct rubymodule_buffer, buffer);
+    if (buffer->flags & BUFFER_OWNED)
+        return;
+    buffer->flags &= ~BUFFER_VALID;
+    buffer->ptr = NULL;
+    buffer->len = 0;
+}
+
+int rubymodule_buffer_p(VALUE obj) {
+    return !NIL_P(cBuffer) && rb_obj_is_kind_of(obj, cBuffer) == Qtrue;
+}
+
+void rubymodule_buffer_bytes(VALUE obj, const char **ptr, long *len) {
+    if (rubymodule_buffer_p(obj)) {
+        struct rubymodule_buffer *buffer = rubymodule_buffer_get(obj);
+        *ptr = buffer->ptr;
+        *len = buffer->len;
+        return;
+    }
+    StringValue(obj);
+    *ptr = RSTRING_PTR(obj);
+    *len = RSTRING_LEN(obj);
+}
+
+char *rubymodule_buffer_take(VALUE obj, unsigned int *size) {
+    char *result;
+
+    if (rubymodule_buffer_p(obj)) {
+        struct rubymodule_buffer *buffer = rubymodule_buffer_get(obj);
+        *size = buffer->len;
+        if (buffer->flags & BUFFER_OWNED) {
+            /* Hand the memory over. The ruby object becomes invalid */
+            result = buffer->ptr;
+            buffer->ptr = NULL;
+            buffer->len = 0;
+            buffer->flags = 0;
+            return result;
+        }
+        result = malloc(*size ? *size : 1);
+        memcpy(result, buffer->ptr, *size);
+        return result;
+    }
+
+    *size = RSTRING_LEN(obj);
+    result = malloc(*size ? *size : 1);
+    memcpy(result, RSTRING_PTR(obj), *size);
+    return result;
+}
+
+/* The file pages go right after the prefix, which ends where a page starts,
+ * so the buffer is one contiguous block. Returns Qnil with errno set if the
+ * mapping fails */
+VALUE rubymodule_buffer_map(int fd, uint64_t size, const char *prefix, long prefix_len) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t head = (prefix_len / page + 1) * page;
+    struct rubymodule_mapping *mapping;
+    char *base;
+    int saved;
+
+    /* opensync data sizes are unsigned int */
+    if (size > (uint64_t) UINT_MAX - prefix_len) {
+        errno = EFBIG;
+        return Qnil;
+    }
+    base = mmap(NULL, head + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return Qnil;
+    if (size && mmap(base + head, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        saved = errno;
+        munmap(base, head + size);
+        errno = saved;
+        return Qnil;
+    }
+    if (size)
+        madvise(base + head, size, MADV_SEQUENTIAL);
+    memcpy(base + head - prefix_len, prefix, prefix_len);
+    mprotect(base, head, PROT_READ);
+
+    mapping = malloc(sizeof(struct rubymodule_mapping));
+    mapping->ptr = base + head - prefix_len;
+    mapping->base = base;
+    mapping->length = head + size;
+    mapping->refs = 1;
+    pthread_mutex_lock(&mappings_lock);
+    mapping->next = mappings;
+    mappings = mapping;
+    pthread_mutex_unlock(&mappings_lock);
+    return rubymodule_buffer_alloc(mapping->ptr, prefix_len + size, BUFFER_VALID | BUFFER_OWNED | BUFFER_MAPPED);
+}
+
+int rubymodule_buffer_mapped_p(VALUE obj) {
+    struct rubymodule_buffer *buffer;
+
+    if (!rubymodule_buffer_p(obj))
+        return 0;
+    Data_Get_Struct(obj, struct rubymodule_buffer, buffer);
+    return (buffer->flags & BUFFER_MAPPED) != 0;
+}
+
+VALUE rubymodule_buffer_copy(VALUE obj) {
+    struct rubymodule_buffer *buffer = rubymodule_buffer_get(obj);
+    return rubymodule_buffer_alloc_copy(buffer->ptr, buffer->len);
+}
+
+/* Buffer.new(string) -> owned copy of string */
+static VALUE rb_buffer_s_new(VALUE klass, VALUE string) {
+    StringValue(string);
+    return rubymodule_buffer_alloc_copy(RSTRING_PTR(string), RSTRING_LEN(string));
+}
+
+static VALUE rb_buffer_size(VALUE self) {
+    return LONG2NUM(rubymodule_buffer_get(self)->len);
+}
+
+/* Explicit copy into a String */
+static VALUE rb_buffer_to_s(VALUE self) {
+    struct rubymodule_buffer *buffer = rubymodule_buffer_get(self);
+    return rb_str_new(buffer->ptr, buffer->len);
+}
+
+/* Explicit copy into an owned buffer that survives the callback. A mapping
+ * (or data of opensync that is one) is shared, not copied */
+static VALUE rb_buffer_dup(VALUE self) {
+    struct rubymodule_buffer *buffer = rubymodule_buffer_get(self);
+    if (rubymodule_buffer_map_ref(buffer->ptr))
+        return rubymodule_buffer_alloc(buffer->ptr, buffer->len, BUFFER_VALID | BUFFER_OWNED | BUFFER_MAPPED);
+    return rubymodule_buffer_alloc_copy(buffer->ptr, buffer->len);
+}
+
+static VALUE rb_buffer_byteslice(VALUE self, VALUE offset, VALUE length) {
+    struct rubymodule_buffer *buffer = rubymodule_buffer_get(self);
+    long off = NUM2LONG(offset), len = NUM2LONG(length);
+    if (off < 0)
+        off += buffer->len;
+    if (off < 0 || off > buffer->len || len < 0)
+        return Qnil;
+    if (off + len > buffer->len)
+        len = buffer->len - off;
+    return rb_str_new(buffer->ptr + off, len);
+}
+
+/* Compares bytes with another Buffer or a String, without copying */
+static VALUE rb_buffer_equal(VALUE self, VALUE other) {
+    struct rubymodule_buffer *buffer = rubymodule_buffer_get(self);
+    const char *ptr;
+    long len;
+
+    if (rubymodule_buffer_p(other)) {
+        struct rubymodule_buffer *other_buffer = rubymodule_buffer_get(other);
+        ptr = other_buffer->ptr;
+        len = other_buffer->len;
+    } else if (TYPE(other) == T_STRING) {
+        ptr = RSTRING_PTR(other);
+        len = RSTRING_LEN(other);
+    } else {
+        return Qfalse;
+    }
+    return (len == buffer->len && !memcmp(ptr, buffer->ptr, len)) ? Qtrue : Qfalse;
+}
+
+static VALUE rb_buffer_valid_p(VALUE self) {
+    struct rubymodule_buffer *buffer;
+    Data_Get_Struct(self, struct rubymodule_buffer, buffer);
+    return (buffer->flags & BUFFER_VALID) ? Qtrue : Qfalse;
+}
+
+static VALUE rb_buffer_owned_p(VALUE self) {
+    struct rubymodule_buffer *buffer;
+    Data_Get_Struct(self, struct rubymodule_buffer, buffer);
+    return (buffer->flags & BUFFER_OWNED) ? Qtrue : Qfalse;
+}
+
+static VALUE rb_buffer_mapped_p(VALUE self) {
+    return rubymodule_buffer_mapped_p(self) ? Qtrue : Qfalse;
+}
+
+static VALUE rb_buffer_inspect(VALUE self) {
+    struct rubymodule_buffer *buffer;
+    Data_Get_Struct(self, struct rubymodule_buffer, buffer);
+    if (!(buffer->flags & BUFFER_VALID))
+        return rb_str_new2("#<Opensync::Buffer released>");
+    return rb_sprintf("#<Opensync::Buffer %s size=%ld>", (buffer->flags & BUFFER_MAPPED) ? "mapped" :
+                      (buffer->flags & BUFFER_OWNED) ? "owned" : "borrowed", buffer->len);
+}
+
+void rubymodule_buffer_init(VALUE module) {
+    cBuffer = rb_define_class_under(module, "Buffer", rb_cObject);
+    rb_undef_alloc_func(cBuffer);
+    rb_define_singleton_method(cBuffer, "new", rb_buffer_s_new, 1);
+    rb_define_method(cBuffer, "size", rb_buffer_size, 0);
+    rb_define_method(cBuffer, "length", rb_buffer_size, 0);
+    rb_define_method(cBuffer, "bytesize", rb_buffer_size, 0);
+    rb_define_method(cBuffer, "to_s", rb_buffer_to_s, 0);
+    rb_define_method(cBuffer, "to_str", rb_buffer_to_s, 0);
+    rb_define_method(cBuffer, "dup", rb_buffer_dup, 0);
+    rb_define_method(cBuffer, "clone", rb_buffer_dup, 0);
+    rb_define_method(cBuffer, "byteslice", rb_buffer_byteslice, 2);
+    rb_define_method(cBuffer, "==", rb_buffer_equal, 1);
+    rb_define_method(cBuffer, "valid?", rb_buffer_valid_p, 0);
+    rb_define_method(cBuffer, "owned?", rb_buffer_owned_p, 0);
+    rb_define_method(cBuffer, "mapped?", rb_buffer_mapped_p, 0);
+    rb_define_method(cBuffer, "inspect", rb_buffer_inspect, 0);
+    /* Keep cBuffer alive */
+    rb_gc_register_address(&cBuffer);
+}
@@ -0,0 +1,71 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef _RUBY_BUFFER_H
+#define _RUBY_BUFFER_H
+
+#include <ruby.h>
+#include <stdint.h>
+
+/*
+ * Opensync::Buffer is a byte buffer that ruby can read without copying it
+ * into a String.
+ *
+ * A borrowed buffer points to memory owned by opensync (callback input) and
+ * is only valid while the callback runs. Using it later raises an error.
+ * Code that needs the bytes after the callback must copy them (dup or to_s).
+ *
+ * An owned buffer (Buffer.new, Buffer#dup) holds malloc'd memory. When it is
+ * returned by a callback, that memory is handed to opensync as is.
+ *
+ * A mapped buffer (PackedRecord.map) is an owned buffer whose bytes are a
+ * read-only mmap of a file, after a small prefix. Opensync gets the mapping
+ * itself: it is unmapped by the destroy callback of the ruby format of the
+ * data (before ruby is called), so it must only become data of formats with
+ * a destroy_func. The file must not be truncated while it is mapped.
+ * Buffer#dup of a mapping, or of borrowed data that is one, shares the
+ * mapping instead of copying it: it is unmapped when its last owner is.
+ */
+
+void  rubymodule_buffer_init(VALUE module);
+VALUE rubymodule_buffer_borrow(const char *ptr, long len);
+/* Releases a borrowed buffer when its callback returns. Owned buffers
+ * (including mapped ones) are left alone */
+void  rubymodule_buffer_invalidate(VALUE buffer);
+int   rubymodule_buffer_p(VALUE obj);
+/* Bytes of a String or Buffer, in place. Raises if the buffer was released */
+void  rubymodule_buffer_bytes(VALUE obj, const char **ptr, long *len);
+/* Bytes of a String or Buffer result as a malloc'd block. Owned buffers
+ * give away their memory, anything else is copied */
+char *rubymodule_buffer_take(VALUE obj, unsigned int *size);
+/* Owned, read-only buffer with prefix followed by the size bytes of fd */
+VALUE rubymodule_buffer_map(int fd, uint64_t size, const char *prefix, long prefix_len);
+int   rubymodule_buffer_mapped_p(VALUE obj);
+/* Owned copy of the bytes of a buffer, in malloc'd memory even for a
+ * mapping (whose Buffer#dup shares it) */
+VALUE rubymodule_buffer_copy(VALUE buffer);
+/* Releases ptr if it is a mapping handed over by rubymodule_buffer_take,
+ * unmapping it with its last owner. Returns 0, doing nothing, for any other
+ * memory */
+int   rubymodule_buffer_unmap(char *ptr);
+/* Frees a rubymodule_buffer_take result that nobody took over */
+void  rubymodule_buffer_release(char *ptr);
+
+#endif //_RUBY_BUFFER_H
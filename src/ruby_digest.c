@@ -0,0 +1,720 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+#define _GNU_SOURCE 1
+#include "ruby_digest.h"
+
+#if RUBY_API_VERSION_MAJOR >= 2
+#include <ruby/thread.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Bytes read per read(), a multiple of the 16 byte blocks */
+#define RUBYMODULE_DIGEST_CHUNK       (1 << 20)
+#define RUBYMODULE_DIGEST_MAX_THREADS 64
+
+#define DIGEST_C1 0x87c37b91114253d5ULL
+#define DIGEST_C2 0x4cf5ad432745937fULL
+
+/* Cache slots */
+#define DIGEST_SLOT_FULL 1
+#define DIGEST_SLOT_USED 2      /* looked up or stored since loaded or saved */
+
+struct digest_file_header {
+    char     magic[4];
+    uint32_t entry_size;
+    uint64_t count;
+};
+
+/* Open addressing by (dev, inode), linear probing, never over half full */
+struct digest_cache {
+    char *path;                 /* NULL: memory only */
+    pthread_mutex_t lock;       /* workers look up and store concurrently */
+    struct rubymodule_digest_entry *entries;
+    unsigned char *slots;
+    size_t capacity;
+    size_t count;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* One call of Opensync::FS.digest */
+struct digest_run {
+    int root;
+    struct digest_cache *cache;
+    int64_t racy;               /* files modified from then on are not cached */
+    long count;
+    char **paths;
+    char *names;                /* paths, one after the other */
+    uint8_t (*digests)[16];
+    char *found;                /* digests[i] is valid */
+    int threads;
+    pthread_t *workers;
+    int started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done;        /* a worker exited */
+    long next;                  /* next path to hash */
+    int running;
+    int stop;                   /* cancelled or failed */
+    int interrupted;            /* ruby wants the waiting thread back */
+    int error;                  /* first errno, raised with error_path */
+    char *error_path;
+};
+
+static VALUE cDigestCache;
+
+/* MurmurHash3 x64 128, fed 16 byte blocks at a time */
+struct digest_state {
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t length;
+};
+
+static inline uint64_t digest_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t digest_fmix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void digest_blocks(struct digest_state *state, const uint8_t *data, size_t blocks) {
+    uint64_t h1 = state->h1, h2 = state->h2;
+    size_t i;
+    for (i = 0; i < blocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+        k1 *= DIGEST_C1;
+        k1 = digest_rotl(k1, 31);
+        k1 *= DIGEST_C2;
+        h1 ^= k1;
+        h1 = digest_rotl(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+        k2 *= DIGEST_C2;
+        k2 = digest_rotl(k2, 33);
+        k2 *= DIGEST_C1;
+        h2 ^= k2;
+        h2 = digest_rotl(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+    state->h1 = h1;
+    state->h2 = h2;
+    state->length += blocks * 16;
+}
+
+/* Hashes the last length (< 16) bytes at tail into digest */
+static void digest_final(struct digest_state *state, const uint8_t *tail, size_t length, uint8_t digest[16]) {
+    uint64_t h1 = state->h1, h2 = state->h2, k1 = 0, k2 = 0, total = state->length + length;
+    size_t i;
+    for (i = length; i > 8; i--)
+        k2 = (k2 << 8) | tail[i - 1];
+    for (i = length < 8 ? length : 8; i > 0; i--)
+        k1 = (k1 << 8) | tail[i - 1];
+    if (length > 8) {
+        k2 *= DIGEST_C2;
+        k2 = digest_rotl(k2, 33);
+        k2 *= DIGEST_C1;
+        h2 ^= k2;
+    }
+    if (length > 0) {
+        k1 *= DIGEST_C1;
+        k1 = digest_rotl(k1, 31);
+        k1 *= DIGEST_C2;
+        h1 ^= k1;
+    }
+    h1 ^= total;
+    h2 ^= total;
+    h1 += h2;
+    h2 += h1;
+    h1 = digest_fmix(h1);
+    h2 = digest_fmix(h2);
+    h1 += h2;
+    h2 += h1;
+    memcpy(digest, &h1, 8);
+    memcpy(digest + 8, &h2, 8);
+}
+
+static VALUE digest_hex(const uint8_t digest[16]) {
+    uint64_t h1, h2;
+    char hex[33];
+    memcpy(&h1, digest, 8);
+    memcpy(&h2, digest + 8, 8);
+    snprintf(hex, sizeof(hex), "%016" PRIx64 "%016" PRIx64, h1, h2);
+    return rb_str_new(hex, 32);
+}
+
+/* Slot of (dev, inode): its entry, or the empty slot where it goes */
+static size_t digest_cache_slot(struct digest_cache *cache, uint64_t dev, uint64_t inode) {
+    size_t mask = cache->capacity - 1;
+    size_t slot = digest_fmix(inode * 31 + dev) & mask;
+    while ((cache->slots[slot] & DIGEST_SLOT_FULL) &&
+           (cache->entries[slot].inode != inode || cache->entries[slot].dev != dev))
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+static void digest_cache_resize(struct digest_cache *cache, size_t capacity) {
+    struct rubymodule_digest_entry *entries = cache->entries;
+    unsigned char *slots = cache->slots;
+    size_t old = cache->capacity, i;
+    cache->entries = malloc(capacity * sizeof(struct rubymodule_digest_entry));
+    cache->slots = calloc(capacity, 1);
+    cache->capacity = capacity;
+    for (i = 0; i < old; i++) {
+        size_t slot;
+        if (!(slots[i] & DIGEST_SLOT_FULL))
+            continue;
+        slot = digest_cache_slot(cache, entries[i].dev, entries[i].inode);
+        cache->entries[slot] = entries[i];
+        cache->slots[slot] = slots[i];
+    }
+    free(entries);
+    free(slots);
+}
+
+/* Adds or replaces the entry of its (dev, inode). Called with the lock held */
+static void digest_cache_put(struct digest_cache *cache, const struct rubymodule_digest_entry *entry, unsigned char used) {
+    size_t slot;
+    if ((cache->count + 1) * 2 > cache->capacity)
+        digest_cache_resize(cache, cache->capacity * 2);
+    slot = digest_cache_slot(cache, entry->dev, entry->inode);
+    if (!(cache->slots[slot] & DIGEST_SLOT_FULL))
+        cache->count++;
+    cache->entries[slot] = *entry;
+    cache->slots[slot] = DIGEST_SLOT_FULL | used;
+}
+
+/* Fills the digest of entry if the cache has it for the same size and mtime */
+static int digest_cache_find(struct digest_cache *cache, struct rubymodule_digest_entry *entry) {
+    size_t slot;
+    int found;
+    pthread_mutex_lock(&cache->lock);
+    slot = digest_cache_slot(cache, entry->dev, entry->inode);
+    found = (cache->slots[slot] & DIGEST_SLOT_FULL) && cache->entries[slot].size == entry->size &&
+            cache->entries[slot].mtime == entry->mtime;
+    if (found) {
+        memcpy(entry->digest, cache->entries[slot].digest, 16);
+        cache->slots[slot] |= DIGEST_SLOT_USED;
+        cache->hits++;
+    } else
+        cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+static void digest_cache_store(struct digest_cache *cache, const struct rubymodule_digest_entry *entry) {
+    pthread_mutex_lock(&cache->lock);
+    digest_cache_put(cache, entry, DIGEST_SLOT_USED);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Loads the entries of the cache file, if there is a valid one */
+static void digest_cache_load(struct digest_cache *cache) {
+    struct digest_file_header header;
+    struct rubymodule_digest_entry *entries;
+    struct stat st;
+    uint64_t i;
+    int fd = open(cache->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, RUBYMODULE_DIGEST_MAGIC, 4) || header.entry_size != sizeof(struct rubymodule_digest_entry) ||
+        header.count > (uint64_t) (st.st_size - sizeof(header)) / sizeof(struct rubymodule_digest_entry) ||
+        (uint64_t) st.st_size != sizeof(header) + header.count * sizeof(struct rubymodule_digest_entry)) {
+        close(fd);
+        return;
+    }
+    entries = malloc(header.count * sizeof(struct rubymodule_digest_entry) + 1);
+    for (i = 0; i < header.count;) {
+        ssize_t got = read(fd, (char *) (entries + i), (header.count - i) * sizeof(struct rubymodule_digest_entry));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0 || got % sizeof(struct rubymodule_digest_entry))
+            break;
+        i += got / sizeof(struct rubymodule_digest_entry);
+    }
+    close(fd);
+    if (i == header.count) {
+        size_t capacity = cache->capacity;
+        while (capacity < header.count * 2)
+            capacity *= 2;
+        digest_cache_resize(cache, capacity);
+        for (i = 0; i < header.count; i++)
+            digest_cache_put(cache, &entries[i], 0);
+    }
+    free(entries);
+}
+
+static void digest_cache_free(void *data) {
+    struct digest_cache *cache = data;
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    free(cache->slots);
+    free(cache->path);
+    free(cache);
+}
+
+static struct digest_cache *digest_cache_get(VALUE self) {
+    struct digest_cache *cache;
+    if (!rb_obj_is_kind_of(self, cDigestCache))
+        rb_raise(rb_eTypeError, "wrong argument type %s (expected Opensync::DigestCache)", rb_obj_classname(self));
+    Data_Get_Struct(self, struct digest_cache, cache);
+    return cache;
+}
+
+/* DigestCache.new(path=nil): loads path if it holds a cache, nil keeps it in memory */
+static VALUE rb_digest_cache_s_new(int argc, VALUE *argv, VALUE klass) {
+    struct digest_cache *cache;
+    VALUE path;
+    rb_scan_args(argc, argv, "01", &path);
+    if (!NIL_P(path)) {
+        FilePathValue(path);
+        StringValueCStr(path);
+    }
+    cache = calloc(1, sizeof(struct digest_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->capacity = 1024;
+    cache->entries = malloc(cache->capacity * sizeof(struct rubymodule_digest_entry));
+    cache->slots = calloc(cache->capacity, 1);
+    if (!NIL_P(path)) {
+        cache->path = strdup(StringValueCStr(path));
+        digest_cache_load(cache);
+    }
+    return Data_Wrap_Struct(klass, NULL, digest_cache_free, cache);
+}
+
+/* Writes the whole buffer, or fails with errno set */
+static int digest_write(int fd, const char *data, size_t length) {
+    while (length) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return -1;
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/*
+ * After a save: prune keeps the entries used since the last one (those
+ * stored while writing included), then all of them count as unused again.
+ * Probe chains forbid removing in place: the table is rebuilt from what is
+ * kept. Called with the lock held
+ */
+static void digest_cache_reset_used(struct digest_cache *cache, int prune) {
+    struct rubymodule_digest_entry *kept;
+    size_t i, count = 0;
+    if (prune && (kept = malloc(cache->count * sizeof(struct rubymodule_digest_entry) + 1))) {
+        for (i = 0; i < cache->capacity; i++)
+            if ((cache->slots[i] & DIGEST_SLOT_FULL) && (cache->slots[i] & DIGEST_SLOT_USED))
+                kept[count++] = cache->entries[i];
+        memset(cache->slots, 0, cache->capacity);
+        cache->count = 0;
+        for (i = 0; i < count; i++)
+            digest_cache_put(cache, &kept[i], 0);
+        free(kept);
+        return;
+    }
+    /* Without memory to prune, everything stays: the file is pruned already */
+    for (i = 0; i < cache->capacity; i++)
+        cache->slots[i] &= ~DIGEST_SLOT_USED;
+}
+
+/*
+ * DigestCache#save(prune=false): replaces the cache file and returns the
+ * entries written (nil without a path). prune drops the entries not used
+ * since the cache was loaded or last saved: after a walk of the whole
+ * tree, those of files gone
+ */
+static VALUE rb_digest_cache_save(int argc, VALUE *argv, VALUE self) {
+    struct digest_cache *cache = digest_cache_get(self);
+    struct digest_file_header header;
+    struct rubymodule_digest_entry *entries;
+    char *tmp;
+    size_t i, count = 0;
+    int fd, failed, saved;
+    VALUE prune;
+    rb_scan_args(argc, argv, "01", &prune);
+    if (!cache->path)
+        return Qnil;
+    if (!(tmp = malloc(strlen(cache->path) + 8)))
+        rb_memerror();
+    sprintf(tmp, "%s.XXXXXX", cache->path);
+    if ((fd = mkstemp(tmp)) < 0) {
+        free(tmp);
+        rb_sys_fail(cache->path);
+    }
+    pthread_mutex_lock(&cache->lock);
+    if (!(entries = malloc(cache->count * sizeof(struct rubymodule_digest_entry) + 1))) {
+        pthread_mutex_unlock(&cache->lock);
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        rb_memerror();
+    }
+    for (i = 0; i < cache->capacity; i++) {
+        if (!(cache->slots[i] & DIGEST_SLOT_FULL))
+            continue;
+        if (!RTEST(prune) || (cache->slots[i] & DIGEST_SLOT_USED))
+            entries[count++] = cache->entries[i];
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    memcpy(header.magic, RUBYMODULE_DIGEST_MAGIC, 4);
+    header.entry_size = sizeof(struct rubymodule_digest_entry);
+    header.count = count;
+    failed = digest_write(fd, (const char *) &header, sizeof(header)) ||
+             digest_write(fd, (const char *) entries, count * sizeof(struct rubymodule_digest_entry));
+    saved = errno;
+    free(entries);
+    if (close(fd) < 0 && !failed) {
+        failed = 1;
+        saved = errno;
+    }
+    if (!failed && rename(tmp, cache->path) < 0) {
+        failed = 1;
+        saved = errno;
+    }
+    if (failed) {
+        unlink(tmp);
+        free(tmp);
+        errno = saved;
+        rb_sys_fail(cache->path);
+    }
+    free(tmp);
+    /* Only now: a failed save keeps the entries it would have pruned */
+    pthread_mutex_lock(&cache->lock);
+    digest_cache_reset_used(cache, RTEST(prune));
+    pthread_mutex_unlock(&cache->lock);
+    return ULONG2NUM(count);
+}
+
+static VALUE rb_digest_cache_path(VALUE self) {
+    struct digest_cache *cache = digest_cache_get(self);
+    return cache->path ? rb_str_new2(cache->path) : Qnil;
+}
+
+static VALUE rb_digest_cache_size(VALUE self) {
+    struct digest_cache *cache = digest_cache_get(self);
+    return ULONG2NUM(cache->count);
+}
+
+static VALUE rb_digest_cache_hits(VALUE self) {
+    struct digest_cache *cache = digest_cache_get(self);
+    return ULL2NUM(cache->hits);
+}
+
+static VALUE rb_digest_cache_misses(VALUE self) {
+    struct digest_cache *cache = digest_cache_get(self);
+    return ULL2NUM(cache->misses);
+}
+
+/* Stops the run with errno error on path, unless it already stopped */
+static void digest_fail(struct digest_run *run, int error, const char *path) {
+    pthread_mutex_lock(&run->lock);
+    if (!run->stop) {
+        run->stop = 1;
+        run->error = error;
+        run->error_path = strdup(path);
+    }
+    pthread_mutex_unlock(&run->lock);
+}
+
+/*
+ * Hashes the file at index into run->digests, with buffer as scratch.
+ * Returns 0, or the errno that stops the run. Files removed meanwhile and
+ * files that are not regular are not found
+ */
+static int digest_file(struct digest_run *run, long index, uint8_t *buffer) {
+    struct rubymodule_digest_entry entry;
+    struct digest_state state = { 0, 0, 0 };
+    struct stat before, after;
+    size_t carry = 0;
+    int fd, error;
+
+    /* O_NONBLOCK: a fifo must not block the open */
+    if ((fd = openat(run->root, run->paths[index], O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC)) < 0)
+        return errno == ENOENT || errno == ENOTDIR || errno == ELOOP || errno == ENXIO ? 0 : errno;
+    if (fstat(fd, &before) < 0) {
+        error = errno;
+        close(fd);
+        return error;
+    }
+    if (!S_ISREG(before.st_mode)) {
+        close(fd);
+        return 0;
+    }
+    entry.dev = before.st_dev;
+    entry.inode = before.st_ino;
+    entry.size = before.st_size;
+    entry.mtime = (int64_t) before.st_mtim.tv_sec * 1000000000 + before.st_mtim.tv_nsec;
+    if (run->cache && digest_cache_find(run->cache, &entry)) {
+        close(fd);
+        memcpy(run->digests[index], entry.digest, 16);
+        run->found[index] = 1;
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (;;) {
+        ssize_t got = read(fd, buffer + carry, RUBYMODULE_DIGEST_CHUNK - carry);
+        size_t blocks;
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0) {
+            error = errno;
+            close(fd);
+            return error;
+        }
+        if (!got)
+            break;
+        carry += got;
+        blocks = carry / 16;
+        digest_blocks(&state, buffer, blocks);
+        carry -= blocks * 16;
+        memmove(buffer, buffer + blocks * 16, carry);
+        if (run->stop) {
+            close(fd);
+            return 0;
+        }
+    }
+    digest_final(&state, buffer, carry, entry.digest);
+    memcpy(run->digests[index], entry.digest, 16);
+    run->found[index] = 1;
+    /* Changed while it was read, or may still change within this mtime */
+    if (run->cache && fstat(fd, &after) == 0 && after.st_size == before.st_size &&
+        after.st_mtim.tv_sec == before.st_mtim.tv_sec && after.st_mtim.tv_nsec == before.st_mtim.tv_nsec &&
+        entry.mtime < run->racy)
+        digest_cache_store(run->cache, &entry);
+    close(fd);
+    return 0;
+}
+
+static void *digest_worker(void *data) {
+    struct digest_run *run = data;
+    uint8_t *buffer = malloc(RUBYMODULE_DIGEST_CHUNK);
+    for (;;) {
+        long index;
+        int error;
+        pthread_mutex_lock(&run->lock);
+        index = run->stop ? run->count : run->next++;
+        pthread_mutex_unlock(&run->lock);
+        if (index >= run->count)
+            break;
+        if ((error = digest_file(run, index, buffer)))
+            digest_fail(run, error, run->paths[index]);
+    }
+    free(buffer);
+    pthread_mutex_lock(&run->lock);
+    run->running--;
+    pthread_cond_broadcast(&run->done);
+    pthread_mutex_unlock(&run->lock);
+    return NULL;
+}
+
+/* Waits for the workers to exit. Returns NULL if ruby interrupted the wait */
+static void *digest_wait_nogvl(void *data) {
+    struct digest_run *run = data;
+    int over;
+    pthread_mutex_lock(&run->lock);
+    while (run->running && !run->interrupted)
+        pthread_cond_wait(&run->done, &run->lock);
+    run->interrupted = 0;
+    over = !run->running;
+    pthread_mutex_unlock(&run->lock);
+    return over ? run : NULL;
+}
+
+static void digest_interrupt(void *data) {
+    struct digest_run *run = data;
+    pthread_mutex_lock(&run->lock);
+    run->interrupted = 1;
+    pthread_cond_broadcast(&run->done);
+    pthread_mutex_unlock(&run->lock);
+}
+
+#if RUBY_API_VERSION_MAJOR >= 2
+static int digest_wait(struct digest_run *run) {
+    return rb_thread_call_without_gvl(digest_wait_nogvl, run, digest_interrupt, run) != NULL;
+}
+#else
+/* ruby 1.9 */
+static VALUE digest_wait_blocking(void *run) {
+    return (VALUE) digest_wait_nogvl(run);
+}
+static int digest_wait(struct digest_run *run) {
+    return rb_thread_blocking_region(digest_wait_blocking, run, digest_interrupt, run) != 0;
+}
+#endif
+
+static VALUE digest_run_results(VALUE data) {
+    struct digest_run *run = (struct digest_run *) data;
+    VALUE results;
+    long i;
+    while (!digest_wait(run))
+        /* Thread#raise, Thread#kill... */
+        rb_thread_check_ints();
+    if (run->error) {
+        errno = run->error;
+        rb_sys_fail(run->error_path);
+    }
+    results = rb_ary_new2(run->count);
+    for (i = 0; i < run->count; i++)
+        rb_ary_push(results, run->found[i] ? digest_hex(run->digests[i]) : Qnil);
+    return results;
+}
+
+/* Stops and frees the run, however digest_run_results ended */
+static VALUE digest_run_free(VALUE data) {
+    struct digest_run *run = (struct digest_run *) data;
+    int i;
+    pthread_mutex_lock(&run->lock);
+    run->stop = 1;
+    pthread_mutex_unlock(&run->lock);
+    for (i = 0; i < run->started; i++)
+        pthread_join(run->workers[i], NULL);
+    free(run->error_path);
+    free(run->workers);
+    free(run->paths);
+    free(run->names);
+    free(run->digests);
+    free(run->found);
+    close(run->root);
+    pthread_mutex_destroy(&run->lock);
+    pthread_cond_destroy(&run->done);
+    free(run);
+    return Qnil;
+}
+
+/*
+ * Opensync.osync_rubymodule_fs_digest(root, paths, cache, threads)
+ *
+ * Digests of the files at paths (relative to root), nil for those missing
+ * or not regular. cache is an Opensync::DigestCache or nil. threads 0
+ * picks one per CPU (at least 4: hashing mostly waits for I/O)
+ */
+static VALUE rb_osync_rubymodule_fs_digest(VALUE self, VALUE root, VALUE paths, VALUE cache, VALUE threads) {
+    struct digest_run *run;
+    struct timespec now;
+    const char *path;
+    VALUE list, results;
+    size_t size = 0, used = 0;
+    long i;
+    int fd;
+    FilePathValue(root);
+    path = StringValueCStr(root);
+    Check_Type(paths, T_ARRAY);
+    if (!NIL_P(cache))
+        digest_cache_get(cache);
+    if (NUM2INT(threads) < 0)
+        rb_raise(rb_eArgError, "threads must not be negative");
+    /* Converted before anything is allocated: conversions may raise */
+    list = rb_ary_new2(RARRAY_LEN(paths));
+    for (i = 0; i < RARRAY_LEN(paths); i++) {
+        VALUE entry = rb_ary_entry(paths, i);
+        FilePathValue(entry);
+        StringValueCStr(entry);
+        size += RSTRING_LEN(entry) + 1;
+        rb_ary_push(list, entry);
+    }
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        rb_sys_fail(path);
+    run = calloc(1, sizeof(struct digest_run));
+    run->root = fd;
+    run->cache = NIL_P(cache) ? NULL : digest_cache_get(cache);
+    clock_gettime(CLOCK_REALTIME, &now);
+    run->racy = ((int64_t) now.tv_sec - RUBYMODULE_DIGEST_RACY) * 1000000000 + now.tv_nsec;
+    run->count = RARRAY_LEN(list);
+    run->paths = malloc(run->count * sizeof(char *) + 1);
+    run->names = malloc(size + 1);
+    for (i = 0; i < run->count; i++) {
+        VALUE entry = rb_ary_entry(list, i);
+        run->paths[i] = run->names + used;
+        memcpy(run->paths[i], RSTRING_PTR(entry), RSTRING_LEN(entry) + 1);
+        used += RSTRING_LEN(entry) + 1;
+    }
+    run->digests = malloc(run->count * 16 + 1);
+    run->found = calloc(run->count + 1, 1);
+    run->threads = NUM2INT(threads);
+    if (!run->threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        run->threads = cpus < 4 ? 4 : cpus;
+    }
+    if (run->threads > RUBYMODULE_DIGEST_MAX_THREADS)
+        run->threads = RUBYMODULE_DIGEST_MAX_THREADS;
+    if (run->threads > run->count)
+        run->threads = run->count;
+    pthread_mutex_init(&run->lock, NULL);
+    pthread_cond_init(&run->done, NULL);
+    run->workers = malloc(run->threads * sizeof(pthread_t) + 1);
+    for (i = 0; i < run->threads; i++) {
+        pthread_mutex_lock(&run->lock);
+        run->running++;
+        pthread_mutex_unlock(&run->lock);
+        if (pthread_create(&run->workers[i], NULL, digest_worker, run)) {
+            pthread_mutex_lock(&run->lock);
+            run->running--;
+            pthread_mutex_unlock(&run->lock);
+            break;
+        }
+        run->started++;
+    }
+    if (run->count && !run->started) {
+        digest_run_free((VALUE) run);
+        rb_raise(rb_eRuntimeError, "Could not start the digest threads");
+    }
+    results = rb_ensure(digest_run_results, (VALUE) run, digest_run_free, (VALUE) run);
+    RB_GC_GUARD(list);
+    RB_GC_GUARD(cache);
+    return results;
+}
+
+void rubymodule_digest_init(VALUE module) {
+    rb_define_module_function(module, "osync_rubymodule_fs_digest", rb_osync_rubymodule_fs_digest, 4);
+    cDigestCache = rb_define_class_under(module, "DigestCache", rb_cObject);
+    rb_undef_alloc_func(cDigestCache);
+    rb_define_singleton_method(cDigestCache, "new", rb_digest_cache_s_new, -1);
+    rb_define_method(cDigestCache, "save", rb_digest_cache_save, -1);
+    rb_define_method(cDigestCache, "path", rb_digest_cache_path, 0);
+    rb_define_method(cDigestCache, "size", rb_digest_cache_size, 0);
+    rb_define_method(cDigestCache, "hits", rb_digest_cache_hits, 0);
+    rb_define_method(cDigestCache, "misses", rb_digest_cache_misses, 0);
+    /* Keep cDigestCache alive */
+    rb_gc_register_address(&cDigestCache);
+}
@@ -0,0 +1,65 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef _RUBY_DIGEST_H
+#define _RUBY_DIGEST_H
+
+#include <ruby.h>
+#include <ruby/version.h>
+#include <stdint.h>
+
+/*
+ * Content digests of files for file based sinks (Opensync::FS.digest).
+ *
+ * A digest is the 128 bit MurmurHash3 (x64 variant, seed 0) of the file
+ * contents, as 32 hex digits. A pool of native threads reads and hashes
+ * the files, one at a time each, while the ruby thread waits outside the
+ * GVL.
+ *
+ * An Opensync::DigestCache remembers the digest of each file by device
+ * and inode, along with the size and mtime (in ns) it had. A file whose
+ * size and mtime did not change is not read again: a touch reads it once,
+ * a chmod or chown not at all. Files modified in the last
+ * RUBYMODULE_DIGEST_RACY seconds, or while they were read, are not cached,
+ * as a write in the same mtime tick would go unnoticed.
+ *
+ * The cache file is a header followed by the entries, in host byte order
+ * (it is only read back on the same host):
+ *
+ *   "ODC1" u32 entry size, u64 entry count
+ *   u64 dev, u64 inode, u64 size, i64 mtime_ns, u8 digest[16]
+ *
+ * A file that does not match is ignored: the cache starts empty.
+ */
+
+#define RUBYMODULE_DIGEST_MAGIC "ODC1"
+#define RUBYMODULE_DIGEST_RACY  2
+
+struct rubymodule_digest_entry {
+    uint64_t dev;
+    uint64_t inode;
+    uint64_t size;
+    int64_t  mtime;     /* ns */
+    uint8_t  digest[16];
+};
+
+void rubymodule_digest_init(VALUE module);
+
+#endif //_RUBY_DIGEST_H
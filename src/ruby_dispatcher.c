@@ -0,0 +1,217 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * Bounded MPSC ring based on Dmitry Vyukov's bounded queue: each cell carries
+ * a sequence number that tells producers whether it is free and the consumer
+ * whether it was published.
+ */
+
+#include "ruby_dispatcher.h"
+
+#define RUBYMODULE_DISPATCHER_MASK (RUBYMODULE_DISPATCHER_SIZE - 1)
+
+#define LOAD_ACQUIRE(ptr)        __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val)  __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define FULL_BARRIER()           __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+void rubymodule_dispatcher_init(struct rubymodule_dispatcher *dispatcher) {
+    unsigned long i;
+    for (i = 0; i < RUBYMODULE_DISPATCHER_SIZE; i++) {
+        dispatcher->cells[i].sequence = i;
+        dispatcher->cells[i].call = NULL;
+    }
+    dispatcher->enqueue_pos = 0;
+    dispatcher->dequeue_pos = 0;
+    dispatcher->sleeping = 0;
+    dispatcher->waiting = 0;
+    dispatcher->interrupted = 0;
+    pthread_mutex_init(&dispatcher->lock, NULL);
+    pthread_cond_init(&dispatcher->requested, NULL);
+    pthread_cond_init(&dispatcher->not_full, NULL);
+}
+
+void rubymodule_dispatcher_destroy(struct rubymodule_dispatcher *dispatcher) {
+    pthread_cond_destroy(&dispatcher->not_full);
+    pthread_cond_destroy(&dispatcher->requested);
+    pthread_mutex_destroy(&dispatcher->lock);
+}
+
+void rubymodule_call_init(struct rubymodule_call *call, rubymodule_call_func func, void **args, void *result) {
+    call->func   = func;
+    call->args   = args;
+    call->result = result;
+    call->detached = 0;
+    call->done   = 0;
+    call->queued = 0;
+    pthread_mutex_init(&call->lock, NULL);
+    pthread_cond_init(&call->returned, NULL);
+}
+
+void rubymodule_call_destroy(struct rubymodule_call *call) {
+    pthread_cond_destroy(&call->returned);
+    pthread_mutex_destroy(&call->lock);
+}
+
+/* Lock free push. Returns 0 if the ring is full */
+static int rubymodule_dispatcher_try_push(struct rubymodule_dispatcher *dispatcher, struct rubymodule_call *call) {
+    struct rubymodule_dispatcher_cell *cell;
+    unsigned long pos = __atomic_load_n(&dispatcher->enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        long diff;
+        cell = &dispatcher->cells[pos & RUBYMODULE_DISPATCHER_MASK];
+        diff = (long) LOAD_ACQUIRE(&cell->sequence) - (long) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&dispatcher->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&dispatcher->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->call = call;
+    STORE_RELEASE(&cell->sequence, pos + 1);
+    return 1;
+}
+
+void rubymodule_dispatcher_submit(struct rubymodule_dispatcher *dispatcher, struct rubymodule_call *call) {
+    if (!rubymodule_dispatcher_try_push(dispatcher, call)) {
+        /* Ring is full: park until the consumer frees a cell */
+        pthread_mutex_lock(&dispatcher->lock);
+        dispatcher->waiting++;
+        FULL_BARRIER();
+        while (!rubymodule_dispatcher_try_push(dispatcher, call))
+            pthread_cond_wait(&dispatcher->not_full, &dispatcher->lock);
+        dispatcher->waiting--;
+        pthread_mutex_unlock(&dispatcher->lock);
+    }
+    /* Wake up the consumer only if it went to sleep */
+    FULL_BARRIER();
+    if (__atomic_load_n(&dispatcher->sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&dispatcher->lock);
+        pthread_cond_signal(&dispatcher->requested);
+        pthread_mutex_unlock(&dispatcher->lock);
+    }
+}
+
+void rubymodule_call_wait(struct rubymodule_call *call) {
+    pthread_mutex_lock(&call->lock);
+    while (!call->done)
+        pthread_cond_wait(&call->returned, &call->lock);
+    pthread_mutex_unlock(&call->lock);
+}
+
+void rubymodule_dispatcher_request(struct rubymodule_dispatcher *dispatcher, struct rubymodule_call *call) {
+    rubymodule_dispatcher_submit(dispatcher, call);
+    rubymodule_call_wait(call);
+    rubymodule_call_destroy(call);
+}
+
+void rubymodule_dispatcher_post(struct rubymodule_dispatcher *dispatcher, struct rubymodule_call *call) {
+    call->detached = 1;
+    rubymodule_dispatcher_submit(dispatcher, call);
+}
+
+/* Single consumer pop. Returns NULL if nothing was published */
+static struct rubymodule_call *rubymodule_dispatcher_pop(struct rubymodule_dispatcher *dispatcher) {
+    struct rubymodule_call *call;
+    unsigned long pos = dispatcher->dequeue_pos;
+    struct rubymodule_dispatcher_cell *cell = &dispatcher->cells[pos & RUBYMODULE_DISPATCHER_MASK];
+
+    if ((long) LOAD_ACQUIRE(&cell->sequence) - (long) (pos + 1) != 0)
+        return NULL;
+    call = cell->call;
+    STORE_RELEASE(&cell->sequence, pos + RUBYMODULE_DISPATCHER_SIZE);
+    dispatcher->dequeue_pos = pos + 1;
+    /* Pairs with the barrier in submit before a producer parks */
+    FULL_BARRIER();
+    return call;
+}
+
+struct rubymodule_call *rubymodule_dispatcher_try_next(struct rubymodule_dispatcher *dispatcher) {
+    struct rubymodule_call *call = rubymodule_dispatcher_pop(dispatcher);
+
+    /* A cell is free now. Tell any parked producer */
+    if (call && __atomic_load_n(&dispatcher->waiting, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&dispatcher->lock);
+        pthread_cond_broadcast(&dispatcher->not_full);
+        pthread_mutex_unlock(&dispatcher->lock);
+    }
+    return call;
+}
+
+static struct rubymodule_call *rubymodule_dispatcher_wait(struct rubymodule_dispatcher *dispatcher, int interruptible) {
+    struct rubymodule_call *call;
+    for (;;) {
+        if ((call = rubymodule_dispatcher_try_next(dispatcher)))
+            return call;
+        pthread_mutex_lock(&dispatcher->lock);
+        __atomic_store_n(&dispatcher->sleeping, 1, __ATOMIC_RELAXED);
+        FULL_BARRIER();
+        /* Check again as a producer might have pushed before it saw sleeping */
+        call = rubymodule_dispatcher_pop(dispatcher);
+        if (!call && !(interruptible && dispatcher->interrupted))
+            pthread_cond_wait(&dispatcher->requested, &dispatcher->lock);
+        else if (call && dispatcher->waiting)
+            pthread_cond_broadcast(&dispatcher->not_full);
+        __atomic_store_n(&dispatcher->sleeping, 0, __ATOMIC_RELAXED);
+        if (!call && interruptible && dispatcher->interrupted) {
+            dispatcher->interrupted = 0;
+            pthread_mutex_unlock(&dispatcher->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&dispatcher->lock);
+        if (call)
+            return call;
+    }
+}
+
+struct rubymodule_call *rubymodule_dispatcher_next(struct rubymodule_dispatcher *dispatcher) {
+    return rubymodule_dispatcher_wait(dispatcher, 0);
+}
+
+struct rubymodule_call *rubymodule_dispatcher_next_interruptible(struct rubymodule_dispatcher *dispatcher) {
+    return rubymodule_dispatcher_wait(dispatcher, 1);
+}
+
+void rubymodule_dispatcher_interrupt(struct rubymodule_dispatcher *dispatcher) {
+    pthread_mutex_lock(&dispatcher->lock);
+    dispatcher->interrupted = 1;
+    pthread_cond_signal(&dispatcher->requested);
+    pthread_mutex_unlock(&dispatcher->lock);
+}
+
+void rubymodule_call_complete(struct rubymodule_call *call) {
+    pthread_mutex_lock(&call->lock);
+    call->done = 1;
+    pthread_cond_signal(&call->returned);
+    /* call may be gone as soon as the lock is released */
+    pthread_mutex_unlock(&call->lock);
+}
+
+void rubymodule_call_run(struct rubymodule_call *call) {
+    /* A posted call might be freed by func itself */
+    int detached = call->detached;
+
+    call->func(call);
+    if (!detached)
+        rubymodule_call_complete(call);
+}
@@ -0,0 +1,99 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef _RUBY_DISPATCHER_H
+#define _RUBY_DISPATCHER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * The dispatcher hands calls from any OpenSync thread to the single thread
+ * that owns the ruby interpreter. Callers push a pointer to a request record
+ * (usually living in their own stack) into a bounded multi-producer ring and
+ * block on the record's own completion. The ruby thread is the only consumer
+ * and drains the ring back to back, sleeping only when it is empty.
+ */
+
+/* Number of cells in the ring. Must be a power of two */
+#define RUBYMODULE_DISPATCHER_SIZE 64
+
+struct rubymodule_call;
+typedef void (* rubymodule_call_func) (struct rubymodule_call *call);
+
+struct rubymodule_call {
+    rubymodule_call_func func;
+    void*		*args;
+    void   		*result;
+    /* Posted without a waiting caller: func owns the call (see rubymodule_dispatcher_post) */
+    int			detached;
+    /* When it was requested (rubymodule_stats_clock), for the wait metrics */
+    uint64_t		queued;
+    /* completion, signaled by the consumer after func returns */
+    int			done;
+    pthread_mutex_t	lock;
+    pthread_cond_t	returned;
+};
+
+struct rubymodule_dispatcher_cell {
+    unsigned long		sequence;
+    struct rubymodule_call	*call;
+};
+
+struct rubymodule_dispatcher {
+    struct rubymodule_dispatcher_cell cells[RUBYMODULE_DISPATCHER_SIZE];
+    /* producers position, shared */
+    unsigned long	enqueue_pos;
+    /* consumer position, only touched by the consumer thread */
+    unsigned long	dequeue_pos;
+    /* Set while the consumer is (about to be) blocked in requested */
+    int			sleeping;
+    /* Number of producers blocked in not_full */
+    int			waiting;
+    /* Set by rubymodule_dispatcher_interrupt, cleared by the consumer */
+    int			interrupted;
+    pthread_mutex_t	lock;
+    pthread_cond_t	requested;
+    pthread_cond_t	not_full;
+};
+
+void rubymodule_dispatcher_init(struct rubymodule_dispatcher *dispatcher);
+void rubymodule_dispatcher_destroy(struct rubymodule_dispatcher *dispatcher);
+
+/* Producer side */
+void rubymodule_call_init(struct rubymodule_call *call, rubymodule_call_func func, void **args, void *result);
+void rubymodule_call_destroy(struct rubymodule_call *call);
+void rubymodule_dispatcher_submit(struct rubymodule_dispatcher *dispatcher, struct rubymodule_call *call);
+void rubymodule_call_wait(struct rubymodule_call *call);
+void rubymodule_dispatcher_request(struct rubymodule_dispatcher *dispatcher, struct rubymodule_call *call);
+/* Submits call without waiting for it. It must not live in the caller stack */
+void rubymodule_dispatcher_post(struct rubymodule_dispatcher *dispatcher, struct rubymodule_call *call);
+
+/* Consumer side */
+struct rubymodule_call *rubymodule_dispatcher_try_next(struct rubymodule_dispatcher *dispatcher);
+struct rubymodule_call *rubymodule_dispatcher_next(struct rubymodule_dispatcher *dispatcher);
+/* Like next, but returns NULL once rubymodule_dispatcher_interrupt is called */
+struct rubymodule_call *rubymodule_dispatcher_next_interruptible(struct rubymodule_dispatcher *dispatcher);
+void rubymodule_dispatcher_interrupt(struct rubymodule_dispatcher *dispatcher);
+void rubymodule_call_complete(struct rubymodule_call *call);
+/* Runs call->func and completes it, unless it was posted */
+void rubymodule_call_run(struct rubymodule_call *call);
+
+#endif //_RUBY_DISPATCHER_H
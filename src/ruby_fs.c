@@ -0,0 +1,495 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#define _GNU_SOURCE 1
+#include "ruby_fs.h"
+
+#include <ruby/encoding.h>
+#if RUBY_API_VERSION_MAJOR >= 2
+#include <ruby/thread.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Bytes of directory entries read per getdents64 */
+#define RUBYMODULE_FS_DENTS       65536
+/* Full batches waiting for the ruby thread, per worker, before workers wait */
+#define RUBYMODULE_FS_BACKLOG     2
+#define RUBYMODULE_FS_MAX_THREADS 64
+
+/* As returned by getdents64 */
+struct fs_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+struct fs_entry {
+    size_t   path;      /* offset in the batch names */
+    size_t   length;
+    uint32_t mode;
+    uint64_t size;
+    int64_t  mtime;
+    int64_t  ctime;
+    uint64_t inode;
+};
+
+struct fs_batch {
+    struct fs_batch *next;
+    long count;
+    struct fs_entry *entries;
+    char *names;        /* paths of all entries, one after the other */
+    size_t names_used;
+    size_t names_size;
+};
+
+/* A directory waiting to be read */
+struct fs_dir {
+    struct fs_dir *next;
+    char path[];        /* relative to the root, "" for the root */
+};
+
+struct fs_scan {
+    int root;
+    int recursive;
+    long batch;
+    int threads;
+    pthread_t *workers;
+    int started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* a directory was queued or the scan ended */
+    pthread_cond_t ready;       /* a batch is full or a worker exited */
+    pthread_cond_t space;       /* the ruby thread took a batch */
+    struct fs_dir *dirs;        /* LIFO, depth first keeps it short */
+    long pending;               /* queued directories and the ones being read */
+    struct fs_batch *full;
+    struct fs_batch *full_tail;
+    long full_count;
+    int running;                /* workers not exited */
+    int stop;                   /* cancelled or failed */
+    int interrupted;            /* ruby wants the waiting thread back */
+    int error;                  /* first errno, raised with error_path */
+    char *error_path;
+    struct fs_batch *current;   /* being yielded */
+};
+
+static void fs_batch_free(struct fs_batch *batch) {
+    if (!batch)
+        return;
+    free(batch->entries);
+    free(batch->names);
+    free(batch);
+}
+
+static struct fs_batch *fs_batch_new(long size) {
+    struct fs_batch *batch = calloc(1, sizeof(struct fs_batch));
+    batch->entries = malloc(size * sizeof(struct fs_entry));
+    batch->names_size = size * 32;
+    batch->names = malloc(batch->names_size);
+    return batch;
+}
+
+/* Stops the scan with errno error on path, unless it already stopped */
+static void fs_fail(struct fs_scan *scan, int error, const char *dir, const char *name) {
+    pthread_mutex_lock(&scan->lock);
+    if (!scan->stop) {
+        scan->stop = 1;
+        scan->error = error;
+        scan->error_path = malloc(strlen(dir) + (name ? strlen(name) : 0) + 3);
+        if (name)
+            sprintf(scan->error_path, "%s%s%s", dir, *dir ? "/" : "", name);
+        else
+            strcpy(scan->error_path, *dir ? dir : ".");
+        pthread_cond_broadcast(&scan->work);
+        pthread_cond_broadcast(&scan->ready);
+        pthread_cond_broadcast(&scan->space);
+    }
+    pthread_mutex_unlock(&scan->lock);
+}
+
+/* Hands a full batch to the ruby thread, waiting while too many are queued */
+static void fs_push(struct fs_scan *scan, struct fs_batch *batch, int wait) {
+    pthread_mutex_lock(&scan->lock);
+    while (wait && !scan->stop && scan->full_count >= scan->threads * RUBYMODULE_FS_BACKLOG)
+        pthread_cond_wait(&scan->space, &scan->lock);
+    if (scan->stop) {
+        pthread_mutex_unlock(&scan->lock);
+        fs_batch_free(batch);
+        return;
+    }
+    if (scan->full_tail)
+        scan->full_tail->next = batch;
+    else
+        scan->full = batch;
+    scan->full_tail = batch;
+    scan->full_count++;
+    pthread_cond_signal(&scan->ready);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static void fs_queue_dir(struct fs_scan *scan, const char *dir, const char *name) {
+    size_t dir_length = strlen(dir), name_length = strlen(name);
+    struct fs_dir *entry = malloc(sizeof(struct fs_dir) + dir_length + name_length + 2);
+
+    if (dir_length) {
+        memcpy(entry->path, dir, dir_length);
+        entry->path[dir_length++] = '/';
+    }
+    memcpy(entry->path + dir_length, name, name_length + 1);
+
+    pthread_mutex_lock(&scan->lock);
+    entry->next = scan->dirs;
+    scan->dirs = entry;
+    scan->pending++;
+    pthread_cond_signal(&scan->work);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static void fs_add(struct fs_scan *scan, struct fs_batch **batch, const char *dir, const char *name, const struct stat *st) {
+    size_t dir_length = strlen(dir), length = dir_length + strlen(name) + (dir_length ? 1 : 0);
+    struct fs_entry *entry;
+
+    if (!*batch)
+        *batch = fs_batch_new(scan->batch);
+    if ((*batch)->names_used + length > (*batch)->names_size) {
+        while ((*batch)->names_used + length > (*batch)->names_size)
+            (*batch)->names_size *= 2;
+        (*batch)->names = realloc((*batch)->names, (*batch)->names_size);
+    }
+
+    entry = &(*batch)->entries[(*batch)->count++];
+    entry->path = (*batch)->names_used;
+    entry->length = length;
+    if (dir_length) {
+        memcpy((*batch)->names + entry->path, dir, dir_length);
+        (*batch)->names[entry->path + dir_length++] = '/';
+    }
+    memcpy((*batch)->names + entry->path + dir_length, name, length - dir_length);
+    (*batch)->names_used += length;
+    entry->mode = st->st_mode;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtime;
+    entry->ctime = st->st_ctime;
+    entry->inode = st->st_ino;
+
+    if ((*batch)->count == scan->batch) {
+        fs_push(scan, *batch, 1);
+        *batch = NULL;
+    }
+}
+
+/* Reports the regular files of dir and queues its subdirectories */
+static void fs_read_dir(struct fs_scan *scan, const char *dir, char *buffer, struct fs_batch **batch) {
+    int fd = openat(scan->root, *dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    long length = 0, offset;
+
+    if (fd < 0) {
+        /* Removed (or replaced by a symlink) since it was listed */
+        if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP)
+            fs_fail(scan, errno, dir, NULL);
+        return;
+    }
+    while (!scan->stop && (length = syscall(SYS_getdents64, fd, buffer, RUBYMODULE_FS_DENTS)) > 0) {
+        for (offset = 0; offset < length; offset += ((struct fs_dirent64 *) (buffer + offset))->d_reclen) {
+            struct fs_dirent64 *dirent = (struct fs_dirent64 *) (buffer + offset);
+            const char *name = dirent->d_name;
+            struct stat st;
+            int link = 0;
+
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+                continue;
+            if (dirent->d_type == DT_DIR) {
+                if (scan->recursive)
+                    fs_queue_dir(scan, dir, name);
+                continue;
+            }
+            if (dirent->d_type != DT_REG && dirent->d_type != DT_LNK && dirent->d_type != DT_UNKNOWN)
+                continue;
+
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+                    (S_ISLNK(st.st_mode) && (link = 1) && fstatat(fd, name, &st, 0) < 0)) {
+                /* Removed meanwhile, or a dangling symlink */
+                if (errno != ENOENT) {
+                    fs_fail(scan, errno, dir, name);
+                    break;
+                }
+                continue;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                /* File systems without d_type. Symlinks to directories are not followed */
+                if (!link && scan->recursive)
+                    fs_queue_dir(scan, dir, name);
+            } else if (S_ISREG(st.st_mode)) {
+                fs_add(scan, batch, dir, name, &st);
+            }
+        }
+    }
+    if (length < 0)
+        fs_fail(scan, errno, dir, NULL);
+    close(fd);
+}
+
+static void *fs_worker(void *data) {
+    struct fs_scan *scan = data;
+    struct fs_batch *batch = NULL;
+    char *buffer = malloc(RUBYMODULE_FS_DENTS);
+
+    pthread_mutex_lock(&scan->lock);
+    for (;;) {
+        struct fs_dir *dir;
+
+        while (!scan->stop && !scan->dirs && scan->pending)
+            pthread_cond_wait(&scan->work, &scan->lock);
+        if (scan->stop || !scan->dirs)
+            break;
+        dir = scan->dirs;
+        scan->dirs = dir->next;
+        pthread_mutex_unlock(&scan->lock);
+
+        fs_read_dir(scan, dir->path, buffer, &batch);
+        free(dir);
+
+        pthread_mutex_lock(&scan->lock);
+        if (--scan->pending == 0)
+            pthread_cond_broadcast(&scan->work);
+    }
+    pthread_mutex_unlock(&scan->lock);
+
+    /* What is left, without waiting: the scan is over */
+    if (batch && batch->count)
+        fs_push(scan, batch, 0);
+    else
+        fs_batch_free(batch);
+    free(buffer);
+
+    pthread_mutex_lock(&scan->lock);
+    scan->running--;
+    pthread_cond_broadcast(&scan->ready);
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+/* Next full batch, NULL when the scan is over or ruby interrupted the wait */
+static void *fs_next_nogvl(void *data) {
+    struct fs_scan *scan = data;
+    struct fs_batch *batch;
+
+    pthread_mutex_lock(&scan->lock);
+    while (!scan->full && scan->running && !scan->stop && !scan->interrupted)
+        pthread_cond_wait(&scan->ready, &scan->lock);
+    scan->interrupted = 0;
+    batch = scan->stop ? NULL : scan->full;
+    if (batch) {
+        scan->full = batch->next;
+        if (!scan->full)
+            scan->full_tail = NULL;
+        scan->full_count--;
+        pthread_cond_signal(&scan->space);
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return batch;
+}
+
+static void fs_interrupt(void *data) {
+    struct fs_scan *scan = data;
+
+    pthread_mutex_lock(&scan->lock);
+    scan->interrupted = 1;
+    pthread_cond_broadcast(&scan->ready);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+#if RUBY_API_VERSION_MAJOR >= 2
+static struct fs_batch *fs_next(struct fs_scan *scan) {
+    return rb_thread_call_without_gvl(fs_next_nogvl, scan, fs_interrupt, scan);
+}
+#else
+/* ruby 1.9 */
+static VALUE fs_next_blocking(void *scan) {
+    return (VALUE) fs_next_nogvl(scan);
+}
+
+static struct fs_batch *fs_next(struct fs_scan *scan) {
+    return (struct fs_batch *) rb_thread_blocking_region(fs_next_blocking, scan, fs_interrupt, scan);
+}
+#endif
+
+/* Over when no batch is queued and every worker exited, or on errors */
+static int fs_over(struct fs_scan *scan) {
+    int over;
+
+    pthread_mutex_lock(&scan->lock);
+    over = scan->stop || (!scan->full && !scan->running);
+    pthread_mutex_unlock(&scan->lock);
+    return over;
+}
+
+static VALUE fs_scan_run(VALUE data) {
+    struct fs_scan *scan = (struct fs_scan *) data;
+    rb_encoding *encoding = rb_filesystem_encoding();
+
+    for (;;) {
+        struct fs_batch *batch = scan->current = fs_next(scan);
+        VALUE paths, modes, sizes, mtimes, ctimes, inodes;
+        long i;
+
+        if (!batch) {
+            if (fs_over(scan))
+                break;
+            /* Thread#raise, Thread#kill... */
+            rb_thread_check_ints();
+            continue;
+        }
+        paths = rb_ary_new2(batch->count);
+        modes = rb_ary_new2(batch->count);
+        sizes = rb_ary_new2(batch->count);
+        mtimes = rb_ary_new2(batch->count);
+        ctimes = rb_ary_new2(batch->count);
+        inodes = rb_ary_new2(batch->count);
+        for (i = 0; i < batch->count; i++) {
+            struct fs_entry *entry = &batch->entries[i];
+            rb_ary_push(paths, rb_enc_str_new(batch->names + entry->path, entry->length, encoding));
+            rb_ary_push(modes, UINT2NUM(entry->mode));
+            rb_ary_push(sizes, ULL2NUM(entry->size));
+            rb_ary_push(mtimes, LL2NUM(entry->mtime));
+            rb_ary_push(ctimes, LL2NUM(entry->ctime));
+            rb_ary_push(inodes, ULL2NUM(entry->inode));
+        }
+        scan->current = NULL;
+        fs_batch_free(batch);
+        rb_yield_values(6, paths, modes, sizes, mtimes, ctimes, inodes);
+    }
+
+    if (scan->error) {
+        errno = scan->error;
+        rb_sys_fail(scan->error_path);
+    }
+    return Qnil;
+}
+
+/* Stops and frees the scan, however fs_scan_run ended */
+static VALUE fs_scan_free(VALUE data) {
+    struct fs_scan *scan = (struct fs_scan *) data;
+    int i;
+
+    pthread_mutex_lock(&scan->lock);
+    scan->stop = 1;
+    pthread_cond_broadcast(&scan->work);
+    pthread_cond_broadcast(&scan->space);
+    pthread_mutex_unlock(&scan->lock);
+    for (i = 0; i < scan->started; i++)
+        pthread_join(scan->workers[i], NULL);
+
+    while (scan->dirs) {
+        struct fs_dir *dir = scan->dirs;
+        scan->dirs = dir->next;
+        free(dir);
+    }
+    while (scan->full) {
+        struct fs_batch *batch = scan->full;
+        scan->full = batch->next;
+        fs_batch_free(batch);
+    }
+    fs_batch_free(scan->current);
+    free(scan->error_path);
+    free(scan->workers);
+    close(scan->root);
+    pthread_mutex_destroy(&scan->lock);
+    pthread_cond_destroy(&scan->work);
+    pthread_cond_destroy(&scan->ready);
+    pthread_cond_destroy(&scan->space);
+    free(scan);
+    return Qnil;
+}
+
+/*
+ * Opensync.osync_rubymodule_fs_scan(root, recursive, batch, threads) {|paths, modes, sizes, mtimes, ctimes, inodes| }
+ *
+ * threads 0 picks one per CPU (at least 4: the walk mostly waits for I/O)
+ */
+static VALUE rb_osync_rubymodule_fs_scan(VALUE self, VALUE root, VALUE recursive, VALUE batch, VALUE threads) {
+    struct fs_scan *scan;
+    const char *path;
+    int fd, i;
+
+    rb_need_block();
+    FilePathValue(root);
+    path = StringValueCStr(root);
+    if (NUM2LONG(batch) < 1)
+        rb_raise(rb_eArgError, "batch must be positive");
+    if (NUM2INT(threads) < 0)
+        rb_raise(rb_eArgError, "threads must not be negative");
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        rb_sys_fail(path);
+
+    scan = calloc(1, sizeof(struct fs_scan));
+    scan->root = fd;
+    scan->recursive = RTEST(recursive);
+    scan->batch = NUM2LONG(batch);
+    scan->threads = NUM2INT(threads);
+    if (!scan->threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        scan->threads = cpus < 4 ? 4 : cpus;
+    }
+    if (scan->threads > RUBYMODULE_FS_MAX_THREADS)
+        scan->threads = RUBYMODULE_FS_MAX_THREADS;
+    pthread_mutex_init(&scan->lock, NULL);
+    pthread_cond_init(&scan->work, NULL);
+    pthread_cond_init(&scan->ready, NULL);
+    pthread_cond_init(&scan->space, NULL);
+    fs_queue_dir(scan, "", "");
+
+    scan->workers = malloc(scan->threads * sizeof(pthread_t));
+    for (i = 0; i < scan->threads; i++) {
+        pthread_mutex_lock(&scan->lock);
+        scan->running++;
+        pthread_mutex_unlock(&scan->lock);
+        if (pthread_create(&scan->workers[i], NULL, fs_worker, scan)) {
+            pthread_mutex_lock(&scan->lock);
+            scan->running--;
+            pthread_mutex_unlock(&scan->lock);
+            break;
+        }
+        scan->started++;
+    }
+    if (!scan->started) {
+        fs_scan_free((VALUE) scan);
+        rb_raise(rb_eRuntimeError, "Could not start the scan threads");
+    }
+
+    return rb_ensure(fs_scan_run, (VALUE) scan, fs_scan_free, (VALUE) scan);
+}
+
+void rubymodule_fs_init(VALUE module) {
+    rb_define_module_function(module, "osync_rubymodule_fs_scan", rb_osync_rubymodule_fs_scan, 4);
+}
@@ -0,0 +1,44 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef _RUBY_FS_H
+#define _RUBY_FS_H
+
+#include <ruby.h>
+#include <ruby/version.h>
+
+/*
+ * Native directory scanner for file based sinks (Opensync::FS.scan).
+ *
+ * A pool of native threads walks the tree with openat/getdents64/fstatat,
+ * one directory at a time each, while the ruby thread waits for batches
+ * outside the GVL. Every batch is yielded as parallel arrays (paths relative
+ * to the root, modes, sizes, mtimes, ctimes and inodes, times in seconds),
+ * so ruby builds no object per entry besides the path and the numbers.
+ *
+ * Only regular files are reported, symlinks to them included. Symlinks to
+ * directories are not followed (no loops). Entries come in no particular
+ * order. Entries removed while the scan runs are skipped; any other error
+ * stops the scan and is raised as Errno::* with the failing path.
+ */
+
+void rubymodule_fs_init(VALUE module);
+
+#endif //_RUBY_FS_H
@@ -0,0 +1,870 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#define _GNU_SOURCE 1
+#include "ruby_host.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef OPENSYNC_RUBY_HOST_BINARY
+#define OPENSYNC_RUBY_HOST_BINARY "opensync-ruby-host"
+#endif
+
+#define HOST_MAGIC           0x4f525248 /* ORRH */
+#define HOST_VERSION         2
+#define HOST_SLOT_SIZE       (4 * 1024 * 1024)
+#define HOST_HEADER_SIZE     64
+#define HOST_ERROR_MAX       256
+/* How long a client waits for a host it started to listen (ms) */
+#define HOST_CONNECT_TIMEOUT 10000
+/* How long a call waits for the host before running in process (ms), default of OPENSYNC_RUBY_HOST_TIMEOUT */
+#define HOST_CALL_TIMEOUT    30000
+#define HOST_ALL_SLOTS       ((1u << RUBYMODULE_HOST_SLOTS) - 1)
+
+enum { SLOT_FREE, SLOT_REQUEST, SLOT_DONE };
+
+/* Shared region: a header, then RUBYMODULE_HOST_SLOTS slots */
+struct host_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+};
+
+/* A slot is followed by slot_size bytes of data: the input blocks, one after
+ * the other, replaced by the output when the call is done */
+struct host_slot {
+    uint32_t state;
+    int32_t  op;
+    char     names[2][RUBYMODULE_HOST_NAME_MAX];
+    uint32_t present;   /* bit i: in[i] was not NULL */
+    uint32_t size[RUBYMODULE_HOST_BLOCKS];
+    int32_t  ok;
+    int32_t  local;
+    int32_t  has_out;
+    uint32_t outsize;
+    int64_t  value;
+    char     error[HOST_ERROR_MAX];
+};
+
+#define SLOT_STRIDE(size) ((sizeof(struct host_slot) + (size) + 63) & ~((size_t) 63))
+#define REGION_SIZE(size) (HOST_HEADER_SIZE + RUBYMODULE_HOST_SLOTS * SLOT_STRIDE(size))
+
+static struct host_slot *host_slot(void *region, uint32_t slot_size, int i) {
+    return (struct host_slot *) ((char *) region + HOST_HEADER_SIZE + i * SLOT_STRIDE(slot_size));
+}
+
+static char *host_slot_data(struct host_slot *slot) {
+    return (char *) (slot + 1);
+}
+
+/*
+ * Formats served by a host: the format directory and the name, size and
+ * mtime of each file there. A client only uses a host with the same key
+ */
+
+/* Format directory, as the ruby side reads it (MetaFormat.dir) */
+static const char *host_format_path(void) {
+    const char *path = getenv("OPENSYNC_RUBY_FORMATSDIR");
+#ifdef OPENSYNC_RUBY_FORMATSDIR
+    if (!path || !*path)
+        path = OPENSYNC_RUBY_FORMATSDIR;
+#endif
+    return path ? path : "";
+}
+
+/* FNV-1a */
+static uint64_t host_hash(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *byte = data;
+    while (size--)
+        hash = (hash ^ *byte++) * 0x100000001b3ULL;
+    return hash;
+}
+
+static uint64_t host_formats_key(const char *format_path) {
+    uint64_t key = 0xcbf29ce484222325ULL;
+    uint32_t version = HOST_VERSION;
+    struct dirent **entries;
+    int count, i;
+
+    key = host_hash(key, &version, sizeof(version));
+    key = host_hash(key, format_path, strlen(format_path) + 1);
+    if ((count = scandir(format_path, &entries, NULL, alphasort)) < 0)
+        return key;
+    for (i = 0; i < count; i++) {
+        struct stat st;
+        char *file;
+        if (entries[i]->d_name[0] != '.' && asprintf(&file, "%s/%s", format_path, entries[i]->d_name) >= 0) {
+            if (!stat(file, &st)) {
+                int64_t stamp[2] = { (int64_t) st.st_size, (int64_t) st.st_mtime };
+                key = host_hash(key, entries[i]->d_name, strlen(entries[i]->d_name) + 1);
+                key = host_hash(key, stamp, sizeof(stamp));
+            }
+            free(file);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return key;
+}
+
+/*
+ * Client
+ */
+
+struct host_connection {
+    int       sock;
+    int       request_fd;
+    int       slot_fd[RUBYMODULE_HOST_SLOTS];
+    void     *region;
+    unsigned  busy;       /* slots in use */
+    unsigned  abandoned;  /* busy slots whose caller timed out, freed once done */
+    int       refs;
+    int       dead;
+};
+
+enum { HOST_UNCONFIGURED, HOST_DISABLED, HOST_ENABLED };
+
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  host_slot_freed = PTHREAD_COND_INITIALIZER;
+static int   host_state = HOST_UNCONFIGURED;
+static char *host_path = NULL;
+static uint64_t host_key = 0;
+/* Call timeout (ms), 0 for none */
+static int   host_timeout = HOST_CALL_TIMEOUT;
+static struct host_connection *host_connection = NULL;
+/* Set while a call connects, outside host_lock. Other calls run in process meanwhile */
+static int   host_connecting = 0;
+/* Set in opensync-ruby-host: it never forwards its own calls */
+static int   host_serving = 0;
+
+/*
+ * The socket lives in a directory only this user can use, named after the
+ * key: processes with other formats get their own host
+ */
+static char *host_default_path(uint64_t key) {
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    struct stat st;
+    char *dir, *path = NULL;
+
+    if (runtime && *runtime) {
+        if (asprintf(&dir, "%s/opensync-ruby-host", runtime) < 0)
+            return NULL;
+    } else if (asprintf(&dir, "/tmp/opensync-ruby-host-%u", (unsigned) getuid()) < 0)
+        return NULL;
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        fprintf(stderr, "Not using the ruby host: could not create %s: %s\n", dir, strerror(errno));
+    else if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))
+        fprintf(stderr, "Not using the ruby host: %s is not a private directory of this user\n", dir);
+    else if (asprintf(&path, "%s/host-%016llx", dir, (unsigned long long) key) < 0)
+        path = NULL;
+    free(dir);
+    return path;
+}
+
+void rubymodule_host_configure(const char *socket_path) {
+    const char *timeout = getenv("OPENSYNC_RUBY_HOST_TIMEOUT");
+
+    pthread_mutex_lock(&host_lock);
+    free(host_path);
+    host_path = NULL;
+    if (socket_path && *socket_path && strcmp(socket_path, "0")) {
+        host_key = host_formats_key(host_format_path());
+        host_path = strcmp(socket_path, "1") ? strdup(socket_path) : host_default_path(host_key);
+    }
+    if (timeout && *timeout)
+        host_timeout = atoi(timeout) > 0 ? atoi(timeout) : 0;
+    __atomic_store_n(&host_state, host_path ? HOST_ENABLED : HOST_DISABLED, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&host_lock);
+}
+
+int rubymodule_host_enabled(void) {
+    int state = __atomic_load_n(&host_state, __ATOMIC_ACQUIRE);
+    if (state == HOST_UNCONFIGURED) {
+        rubymodule_host_configure(getenv("OPENSYNC_RUBY_HOST"));
+        state = __atomic_load_n(&host_state, __ATOMIC_ACQUIRE);
+    }
+    return state == HOST_ENABLED && !host_serving;
+}
+
+/* Called with host_lock held */
+static void host_connection_unref(struct host_connection *connection) {
+    int i;
+    if (--connection->refs > 0)
+        return;
+    close(connection->sock);
+    close(connection->request_fd);
+    for (i = 0; i < RUBYMODULE_HOST_SLOTS; i++)
+        close(connection->slot_fd[i]);
+    munmap(connection->region, REGION_SIZE(HOST_SLOT_SIZE));
+    free(connection);
+}
+
+/* Connects to the socket at path. If check_peer, only to a host run by this user */
+static int host_socket_connect(const char *path, osync_bool check_peer) {
+    struct sockaddr_un addr;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    if (check_peer && (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid())) {
+        osync_trace(TRACE_ERROR, "%s: %s is served by another user", __func__, path);
+        close(sock);
+        errno = EPERM;
+        return -1;
+    }
+    return sock;
+}
+
+/* Starts the host for the formats of format_path detached from this process, so it outlives it */
+static osync_bool host_spawn(const char *path, const char *format_path) {
+    const char *binary = getenv("OPENSYNC_RUBY_HOST_BINARY");
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    pid_t pid;
+    int fd;
+
+    if (!binary || !*binary)
+        binary = OPENSYNC_RUBY_HOST_BINARY;
+    if (max_fd < 0 || max_fd > 65536)
+        max_fd = 65536;
+    pid = fork();
+    if (pid < 0)
+        return FALSE;
+    if (pid == 0) {
+        /* Only async signal safe calls from here: other threads were copied mid-flight */
+        if (setsid() < 0 || fork() != 0)
+            _exit(0);
+        for (fd = 3; fd < max_fd; fd++)
+            close(fd);
+        if ((fd = open("/dev/null", O_RDONLY)) >= 0)
+            dup2(fd, 0);
+        execl(binary, binary, path, format_path, (char *) NULL);
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+    return TRUE;
+}
+
+/* Sends the formats key, the shared region and the eventfds over sock */
+static osync_bool host_send_fds(int sock, uint64_t key, int *fds, int count) {
+    struct iovec iov = { &key, sizeof(key) };
+    char control[CMSG_SPACE(sizeof(int) * (RUBYMODULE_HOST_SLOTS + 2))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(key);
+}
+
+/* Connects to the host at path, starting one if spawn is set */
+static int host_open(const char *path, osync_bool spawn) {
+    int sock, waited;
+    if (!spawn)
+        return host_socket_connect(path, TRUE);
+    if (!host_spawn(path, host_format_path()))
+        return -1;
+    for (waited = 0; (sock = host_socket_connect(path, TRUE)) < 0 && waited < HOST_CONNECT_TIMEOUT; waited += 10)
+        usleep(10000);
+    return sock;
+}
+
+/*
+ * Hands the shared memory to the host and waits until it is mapped there.
+ * FALSE if the host serves other formats: it stops listening then
+ */
+static osync_bool host_handshake(int sock, uint64_t key, int *fds) {
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    char ready;
+    if (!host_send_fds(sock, key, fds, RUBYMODULE_HOST_SLOTS + 2))
+        return FALSE;
+    return poll(&pfd, 1, HOST_CONNECT_TIMEOUT) == 1 && read(sock, &ready, 1) == 1 && ready;
+}
+
+/* Called without host_lock: it might start a host and wait for it */
+static struct host_connection *host_connect(const char *path, uint64_t key, OSyncError **error) {
+    struct host_connection *connection;
+    struct host_header *header;
+    int fds[RUBYMODULE_HOST_SLOTS + 2];
+    int memfd, spawn, i;
+
+    connection = calloc(1, sizeof(struct host_connection));
+    connection->sock = -1;
+    connection->request_fd = -1;
+    for (i = 0; i < RUBYMODULE_HOST_SLOTS; i++)
+        connection->slot_fd[i] = -1;
+
+    memfd = memfd_create("opensync-ruby-host", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, REGION_SIZE(HOST_SLOT_SIZE)) < 0 ||
+        (connection->region = mmap(NULL, REGION_SIZE(HOST_SLOT_SIZE), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+        osync_error_set(error, OSYNC_ERROR_INITIALIZATION, "Could not create the ruby host shared memory: %s", strerror(errno));
+        connection->region = NULL;
+        goto error;
+    }
+    header = connection->region;
+    header->magic = HOST_MAGIC;
+    header->version = HOST_VERSION;
+    header->slots = RUBYMODULE_HOST_SLOTS;
+    header->slot_size = HOST_SLOT_SIZE;
+
+    connection->request_fd = eventfd(0, EFD_CLOEXEC);
+    fds[0] = memfd;
+    fds[1] = connection->request_fd;
+    for (i = 0; i < RUBYMODULE_HOST_SLOTS; i++)
+        fds[i + 2] = connection->slot_fd[i] = eventfd(0, EFD_CLOEXEC);
+    for (i = 1; i < RUBYMODULE_HOST_SLOTS + 2; i++)
+        if (fds[i] < 0) {
+            osync_error_set(error, OSYNC_ERROR_INITIALIZATION, "Could not create the ruby host eventfds: %s", strerror(errno));
+            goto error;
+        }
+
+    /* A running host first. A dying one, or one with other formats, may still accept: then start a new one */
+    for (spawn = FALSE; ; spawn = TRUE) {
+        if ((connection->sock = host_open(path, spawn)) >= 0 && host_handshake(connection->sock, key, fds))
+            break;
+        if (connection->sock >= 0)
+            close(connection->sock);
+        connection->sock = -1;
+        if (spawn) {
+            osync_error_set(error, OSYNC_ERROR_DISCONNECTED, "Could not connect to the ruby host at %s: %s", path, strerror(errno));
+            goto error;
+        }
+    }
+    /* The region stays mapped: the fd is not needed anymore */
+    close(memfd);
+    connection->refs = 1;
+    return connection;
+
+error:
+    if (memfd >= 0)
+        close(memfd);
+    if (connection->sock >= 0)
+        close(connection->sock);
+    if (connection->request_fd >= 0)
+        close(connection->request_fd);
+    for (i = 0; i < RUBYMODULE_HOST_SLOTS; i++)
+        if (connection->slot_fd[i] >= 0)
+            close(connection->slot_fd[i]);
+    if (connection->region)
+        munmap(connection->region, REGION_SIZE(HOST_SLOT_SIZE));
+    free(connection);
+    return NULL;
+}
+
+/* Marks connection dead, failing the calls waiting for a slot */
+static void host_disconnected(struct host_connection *connection) {
+    pthread_mutex_lock(&host_lock);
+    connection->dead = TRUE;
+    pthread_cond_broadcast(&host_slot_freed);
+    pthread_mutex_unlock(&host_lock);
+}
+
+/* Milliseconds left until deadline (CLOCK_MONOTONIC), -1 without a timeout */
+static int host_remaining(const struct timespec *deadline) {
+    struct timespec now;
+    long left;
+    if (!host_timeout)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return left > 0 ? (int) left : 0;
+}
+
+/* Frees the abandoned slots the host is done with. Called with host_lock held */
+static void host_reclaim(struct host_connection *connection) {
+    int slot;
+    for (slot = 0; slot < RUBYMODULE_HOST_SLOTS; slot++) {
+        struct host_slot *s = host_slot(connection->region, HOST_SLOT_SIZE, slot);
+        if (!(connection->abandoned & (1u << slot)) || __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != SLOT_DONE)
+            continue;
+        __atomic_store_n(&s->state, SLOT_FREE, __ATOMIC_RELAXED);
+        connection->abandoned &= ~(1u << slot);
+        connection->busy &= ~(1u << slot);
+    }
+}
+
+/* Waits for the host to finish the call in slot: 1 if done, 0 if it went away, -1 on timeout */
+static int host_wait(struct host_connection *connection, int slot, const struct timespec *deadline) {
+    struct host_slot *s = host_slot(connection->region, HOST_SLOT_SIZE, slot);
+    struct pollfd fds[2];
+    uint64_t count;
+    int ready;
+
+    fds[0].fd = connection->slot_fd[slot];
+    fds[0].events = POLLIN;
+    fds[1].fd = connection->sock;
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) == SLOT_DONE)
+            return 1;
+        if ((ready = poll(fds, 2, host_remaining(deadline))) < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        if (!ready)
+            return __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) == SLOT_DONE ? 1 : -1;
+        if (fds[0].revents & POLLIN) {
+            if (read(fds[0].fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                return 0;
+            continue;
+        }
+        /* After the ready byte the host never writes to the socket: readable means closed */
+        if (fds[1].revents)
+            return __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) == SLOT_DONE;
+    }
+}
+
+int rubymodule_host_call(struct rubymodule_host_request *request, OSyncError **error) {
+    struct host_connection *connection;
+    struct host_slot *s;
+    struct timespec deadline;
+    char *data, *path;
+    unsigned long total = 0;
+    uint64_t one = 1, key;
+    int slot = -1, result = 0, status, i;
+
+    if (!rubymodule_host_enabled())
+        return -1;
+    for (i = 0; i < RUBYMODULE_HOST_BLOCKS; i++)
+        total += request->in[i] ? request->insize[i] : 0;
+    for (i = 0; i < 2; i++)
+        if (request->names[i] && strlen(request->names[i]) >= RUBYMODULE_HOST_NAME_MAX)
+            return -1;
+    if (total > HOST_SLOT_SIZE)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += host_timeout / 1000;
+    deadline.tv_nsec += (host_timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&host_lock);
+    /* A host that went away is replaced on the next call */
+    if (host_connection && host_connection->dead) {
+        host_connection_unref(host_connection);
+        host_connection = NULL;
+    }
+    if (!host_connection) {
+        /* Another call is starting the host: do not wait for it */
+        if (host_connecting) {
+            pthread_mutex_unlock(&host_lock);
+            return -1;
+        }
+        host_connecting = TRUE;
+        path = strdup(host_path);
+        key = host_key;
+        pthread_mutex_unlock(&host_lock);
+        connection = path ? host_connect(path, key, error) : NULL;
+        free(path);
+        pthread_mutex_lock(&host_lock);
+        host_connecting = FALSE;
+        if (!(host_connection = connection)) {
+            pthread_mutex_unlock(&host_lock);
+            return 0;
+        }
+    }
+    connection = host_connection;
+    connection->refs++;
+    for (;;) {
+        struct timespec slice;
+        host_reclaim(connection);
+        if (connection->dead || connection->busy != HOST_ALL_SLOTS)
+            break;
+        if (!host_remaining(&deadline)) {
+            /* Every slot is taken for too long: run it in process */
+            result = -1;
+            goto exit;
+        }
+        /* Abandoned slots are not signaled when done: look again every 10ms */
+        clock_gettime(CLOCK_REALTIME, &slice);
+        slice.tv_nsec += 10000000L;
+        if (slice.tv_nsec >= 1000000000L) {
+            slice.tv_sec++;
+            slice.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&host_slot_freed, &host_lock, &slice);
+    }
+    if (!connection->dead) {
+        slot = ffs(~connection->busy) - 1;
+        connection->busy |= 1u << slot;
+    }
+    pthread_mutex_unlock(&host_lock);
+    if (slot < 0)
+        goto disconnected;
+
+    s = host_slot(connection->region, HOST_SLOT_SIZE, slot);
+    data = host_slot_data(s);
+    s->op = request->op;
+    s->present = 0;
+    for (i = 0; i < 2; i++)
+        strcpy(s->names[i], request->names[i] ? request->names[i] : "");
+    for (i = 0; i < RUBYMODULE_HOST_BLOCKS; i++) {
+        s->size[i] = 0;
+        if (!request->in[i])
+            continue;
+        s->present |= 1u << i;
+        s->size[i] = request->insize[i];
+        memcpy(data, request->in[i], request->insize[i]);
+        data += request->insize[i];
+    }
+    __atomic_store_n(&s->state, SLOT_REQUEST, __ATOMIC_RELEASE);
+    if (write(connection->request_fd, &one, sizeof(one)) != sizeof(one) || !(status = host_wait(connection, slot, &deadline))) {
+        host_disconnected(connection);
+        goto disconnected;
+    }
+    if (status < 0) {
+        /* The host is still busy with it: the slot is freed once it is done */
+        osync_trace(TRACE_INTERNAL, "%s: ruby host call %d timed out, running it in process", __func__, request->op);
+        pthread_mutex_lock(&host_lock);
+        connection->abandoned |= 1u << slot;
+        slot = -1;
+        result = -1;
+        goto exit;
+    }
+
+    if (s->ok && s->local) {
+        result = -1;
+    } else if (s->ok) {
+        request->value = s->value;
+        request->out = NULL;
+        request->outsize = 0;
+        if (s->has_out && s->outsize <= HOST_SLOT_SIZE) {
+            /* NUL terminated, for print */
+            request->out = malloc(s->outsize + 1);
+            memcpy(request->out, host_slot_data(s), s->outsize);
+            request->out[s->outsize] = 0;
+            request->outsize = s->outsize;
+        }
+        result = 1;
+    } else {
+        s->error[HOST_ERROR_MAX - 1] = 0;
+        osync_error_set(error, OSYNC_ERROR_GENERIC, "%s", s->error);
+    }
+    __atomic_store_n(&s->state, SLOT_FREE, __ATOMIC_RELAXED);
+    goto unlocked_exit;
+
+disconnected:
+    osync_error_set(error, OSYNC_ERROR_DISCONNECTED, "The ruby host at %s went away", host_path);
+unlocked_exit:
+    pthread_mutex_lock(&host_lock);
+exit:
+    if (slot >= 0) {
+        connection->busy &= ~(1u << slot);
+        pthread_cond_broadcast(&host_slot_freed);
+    }
+    host_connection_unref(connection);
+    pthread_mutex_unlock(&host_lock);
+    return result;
+}
+
+/*
+ * Host
+ */
+
+struct host_client {
+    int sock;
+    rubymodule_host_handler handler;
+};
+
+static int host_clients = 0;
+static time_t host_last_seen = 0;
+static const char *host_serve_path = NULL;
+static uint64_t host_serve_key = 0;
+/* Set once a client with other formats came: this host takes no new clients */
+static int host_retired = 0;
+
+/* Gets the formats key and the fds sent by host_send_fds */
+static int host_recv_fds(int sock, uint64_t *key, int *fds, int count) {
+    struct iovec iov = { key, sizeof(*key) };
+    char control[CMSG_SPACE(sizeof(int) * (RUBYMODULE_HOST_SLOTS + 2))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(*key))
+        return FALSE;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * count))
+        return FALSE;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+    return TRUE;
+}
+
+static void host_run(rubymodule_host_handler handler, struct host_slot *s, uint32_t slot_size) {
+    struct rubymodule_host_request request;
+    OSyncError *error = NULL;
+    char *data = host_slot_data(s);
+    unsigned long offset = 0;
+    int i;
+
+    memset(&request, 0, sizeof(request));
+    request.op = s->op;
+    for (i = 0; i < 2; i++) {
+        s->names[i][RUBYMODULE_HOST_NAME_MAX - 1] = 0;
+        request.names[i] = s->names[i][0] ? s->names[i] : NULL;
+    }
+    for (i = 0; i < RUBYMODULE_HOST_BLOCKS; i++) {
+        if (!(s->present & (1u << i)))
+            continue;
+        if (offset + s->size[i] > slot_size) {
+            s->ok = FALSE;
+            snprintf(s->error, HOST_ERROR_MAX, "Malformed ruby host request");
+            return;
+        }
+        request.in[i] = data + offset;
+        request.insize[i] = s->size[i];
+        offset += s->size[i];
+    }
+    s->ok = handler(&request, data, slot_size, &error);
+    s->local = request.local;
+    s->value = request.value;
+    s->has_out = request.out != NULL;
+    s->outsize = request.outsize;
+    if (!s->ok) {
+        snprintf(s->error, HOST_ERROR_MAX, "%s", error ? osync_error_print(&error) : "Ruby host call failed");
+        if (error)
+            osync_error_unref(&error);
+    }
+}
+
+/* Serves one client until it closes the socket */
+static void *host_client_thread(void *data) {
+    struct host_client *client = data;
+    int fds[RUBYMODULE_HOST_SLOTS + 2];
+    struct host_header *header = MAP_FAILED;
+    struct pollfd pfds[2];
+    struct stat st;
+    uint64_t count, one = 1, key;
+    int i;
+
+    for (i = 0; i < RUBYMODULE_HOST_SLOTS + 2; i++)
+        fds[i] = -1;
+    if (!host_recv_fds(client->sock, &key, fds, RUBYMODULE_HOST_SLOTS + 2))
+        goto exit;
+    if (key != host_serve_key) {
+        /* The formats changed since this host started: leave the socket to a new one */
+        pthread_mutex_lock(&host_lock);
+        if (!host_retired) {
+            host_retired = TRUE;
+            unlink(host_serve_path);
+        }
+        pthread_mutex_unlock(&host_lock);
+        /* No ready byte: the client starts a host for its formats */
+        goto exit;
+    }
+    if (fstat(fds[0], &st) < 0 || st.st_size < (off_t) REGION_SIZE(HOST_SLOT_SIZE))
+        goto exit;
+    header = mmap(NULL, REGION_SIZE(HOST_SLOT_SIZE), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (header == MAP_FAILED || header->magic != HOST_MAGIC || header->version != HOST_VERSION ||
+        header->slots != RUBYMODULE_HOST_SLOTS || header->slot_size != HOST_SLOT_SIZE)
+        goto exit;
+    /* Ready: the client waits for this byte before its first call */
+    if (write(client->sock, "\1", 1) != 1)
+        goto exit;
+
+    pfds[0].fd = fds[1];
+    pfds[0].events = POLLIN;
+    pfds[1].fd = client->sock;
+    pfds[1].events = POLLIN;
+    for (;;) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfds[1].revents)
+            break;
+        if (!(pfds[0].revents & POLLIN) || read(fds[1], &count, sizeof(count)) != sizeof(count))
+            continue;
+        for (i = 0; i < RUBYMODULE_HOST_SLOTS; i++) {
+            struct host_slot *s = host_slot(header, HOST_SLOT_SIZE, i);
+            if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != SLOT_REQUEST)
+                continue;
+            host_run(client->handler, s, HOST_SLOT_SIZE);
+            __atomic_store_n(&s->state, SLOT_DONE, __ATOMIC_RELEASE);
+            if (write(fds[i + 2], &one, sizeof(one)) != sizeof(one))
+                break;
+        }
+    }
+
+exit:
+    if (header != MAP_FAILED)
+        munmap(header, REGION_SIZE(HOST_SLOT_SIZE));
+    for (i = 0; i < RUBYMODULE_HOST_SLOTS + 2; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    close(client->sock);
+    free(client);
+    pthread_mutex_lock(&host_lock);
+    host_clients--;
+    host_last_seen = time(NULL);
+    pthread_mutex_unlock(&host_lock);
+    return NULL;
+}
+
+static int host_listen(const char *path) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), other;
+    mode_t mask;
+
+    if (sock < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    /* Only this user may connect */
+    mask = umask(077);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        if (errno != EADDRINUSE)
+            goto error;
+        /* Another host is serving, or a dead one left its socket behind */
+        if ((other = host_socket_connect(path, FALSE)) >= 0) {
+            close(other);
+            errno = EADDRINUSE;
+            goto error;
+        }
+        if (unlink(path) < 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            goto error;
+    }
+    umask(mask);
+    if (listen(sock, 16) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+
+error:
+    umask(mask);
+    close(sock);
+    return -1;
+}
+
+int rubymodule_host_serve(const char *socket_path, const char *format_path, rubymodule_host_handler handler, int idle) {
+    struct pollfd pfd;
+    struct ucred cred;
+    socklen_t len;
+    int sock;
+
+    host_serving = 1;
+    host_serve_path = socket_path;
+    host_serve_key = host_formats_key(format_path ? format_path : host_format_path());
+    if ((sock = host_listen(socket_path)) < 0) {
+        fprintf(stderr, "opensync-ruby-host: could not listen on %s: %s\n", socket_path, strerror(errno));
+        return FALSE;
+    }
+    host_last_seen = time(NULL);
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    for (;;) {
+        struct host_client *client;
+        pthread_attr_t attr;
+        pthread_t thread;
+        int fd, quit;
+
+        pthread_mutex_lock(&host_lock);
+        /* Retired: serve the clients left, then go */
+        if (host_retired && pfd.fd >= 0) {
+            close(sock);
+            pfd.fd = -1;
+        }
+        quit = host_retired && !host_clients;
+        pthread_mutex_unlock(&host_lock);
+        if (quit)
+            break;
+        if (poll(&pfd, 1, 1000) <= 0) {
+            pthread_mutex_lock(&host_lock);
+            quit = !host_clients && idle > 0 && time(NULL) - host_last_seen >= idle;
+            pthread_mutex_unlock(&host_lock);
+            if (quit)
+                break;
+            continue;
+        }
+        if ((fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC)) < 0)
+            continue;
+        len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != geteuid()) {
+            close(fd);
+            continue;
+        }
+        client = malloc(sizeof(struct host_client));
+        client->sock = fd;
+        client->handler = handler;
+        pthread_mutex_lock(&host_lock);
+        host_clients++;
+        pthread_mutex_unlock(&host_lock);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, host_client_thread, client)) {
+            close(fd);
+            free(client);
+            pthread_mutex_lock(&host_lock);
+            host_clients--;
+            pthread_mutex_unlock(&host_lock);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if (pfd.fd >= 0) {
+        close(sock);
+        unlink(socket_path);
+    }
+    return TRUE;
+}
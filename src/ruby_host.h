@@ -0,0 +1,110 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+
+#ifndef _RUBY_HOST_H
+#define _RUBY_HOST_H
+
+#include <opensync/opensync.h>
+#include <stdint.h>
+
+/*
+ * Out of process ruby host for formats.
+ *
+ * This isolates format and converter code only. Plugin and sink callbacks
+ * (and the OSyncContext, OSyncChange... they get) are not forwarded: they
+ * run in this process as before, and a ruby plugin that crashes still takes
+ * it down.
+ *
+ * When OPENSYNC_RUBY_HOST is set (to a socket path, or 1 for the default
+ * one), format and converter data callbacks (compare, copy, print, revision
+ * and convert) are not run by the ruby thread of this process but by
+ * opensync-ruby-host, a long lived process with its own ruby and its own
+ * copy of the ruby formats. It is started on the first call if it is not
+ * running and exits after being idle for a while.
+ *
+ * Each client process shares a memory region (memfd) with the host, split
+ * in slots: one call in flight per slot, its input and output bytes in the
+ * slot. A call wakes the host with an eventfd and waits on the eventfd of
+ * its slot. Formats and converters are found in the host by name, so only
+ * bytes cross: callbacks that need other opensync objects (marshal, besides
+ * plugins and sinks) still run in this process.
+ *
+ * The default socket is in $XDG_RUNTIME_DIR/opensync-ruby-host (or
+ * /tmp/opensync-ruby-host-<uid>), a 0700 directory of this user, and is
+ * named after a key of the format directory: its path and the name, size
+ * and mtime of each file. Clients only talk to a host of the same user and
+ * send it their key first: a host with other formats stops taking clients
+ * and the client starts a new one.
+ *
+ * If the host dies, calls in flight fail with OSYNC_ERROR_DISCONNECTED and
+ * the next call starts a new host. Calls still waiting after
+ * OPENSYNC_RUBY_HOST_TIMEOUT ms (default 30000, 0: no limit), or made
+ * while another one starts the host, run in process.
+ */
+
+#define RUBYMODULE_HOST_SLOTS    8
+#define RUBYMODULE_HOST_NAME_MAX 64
+#define RUBYMODULE_HOST_BLOCKS   3
+
+enum rubymodule_host_op {
+    RUBYMODULE_HOST_PING,
+    RUBYMODULE_HOST_COMPARE,
+    RUBYMODULE_HOST_COPY,
+    RUBYMODULE_HOST_PRINT,
+    RUBYMODULE_HOST_REVISION,
+    RUBYMODULE_HOST_CONVERT
+};
+
+/* A call, as the client builds it and as the host handler sees it */
+struct rubymodule_host_request {
+    int          op;
+    /* Format name, or the source and target formats of a converter */
+    const char  *names[2];
+    /* Input blocks: data (and right data for compare, config for convert) */
+    const char  *in[RUBYMODULE_HOST_BLOCKS];
+    unsigned int insize[RUBYMODULE_HOST_BLOCKS];
+    /* Results: a number (compare result, revision, success, free_input...)
+     * and an output block (malloc'd on the client side) */
+    int64_t      value;
+    char        *out;
+    unsigned int outsize;
+    /* Set by the host when it cannot run the call (a format it does not
+     * know): the client runs it in process */
+    int          local;
+};
+
+/* Run by the host for each call. Returns FALSE with error set on failure.
+ * out is written into the slot, up to max bytes */
+typedef osync_bool (* rubymodule_host_handler) (struct rubymodule_host_request *request, char *out, unsigned int max, OSyncError **error);
+
+/* Client. socket_path NULL disables it (default: OPENSYNC_RUBY_HOST) */
+void rubymodule_host_configure(const char *socket_path);
+int  rubymodule_host_enabled(void);
+/* Forwards request to the host. Returns 1 if done, 0 if it failed (error
+ * set) and -1 if it was not forwarded (disabled, too big for a slot or
+ * unknown to the host): the caller runs it in process */
+int  rubymodule_host_call(struct rubymodule_host_request *request, OSyncError **error);
+
+/* Host: serves the clients of the formats in format_path (NULL: the
+ * default) on socket_path until idle for idle seconds */
+int  rubymodule_host_serve(const char *socket_path, const char *format_path, rubymodule_host_handler handler, int idle);
+
+#endif //_RUBY_HOST_H
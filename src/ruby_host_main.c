@@ -0,0 +1,155 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * opensync-ruby-host: runs the data callbacks of the ruby formats and
+ * converters for processes started with OPENSYNC_RUBY_HOST (see ruby_host.h).
+ * Formats are loaded as in any OpenSync process, by the format plugins
+ * (ruby-format included), and kept warm between syncs. Plugins are never
+ * loaded here: their callbacks stay in the client.
+ *
+ * Usage: opensync-ruby-host socket_path [format_path]
+ * format_path: the format plugins and ruby formats of the clients (default
+ * OPENSYNC_RUBY_FORMATSDIR). Clients only use a host with the same files
+ * OPENSYNC_RUBY_HOST_IDLE: seconds without clients before exiting (default 600, 0: never)
+ */
+
+#include "ruby_module.h"
+#include "callbacks_prototypes.h"
+#include "ruby_buffer.h"
+#include "ruby_host.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define HOST_IDLE 600
+
+static OSyncFormatEnv *format_env;
+
+/* Results of the initialize callbacks, by format, or by converter and
+ * config. The engine calls them in its process, this one has to call them
+ * for its own copies */
+static GHashTable *userdata;
+static pthread_mutex_t userdata_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *host_userdata(void *owner, OSyncFormatConverter *converter, const char *config, OSyncError **error) {
+    gpointer data = NULL;
+    char *key = g_strdup_printf("%p:%s", owner, config ? config : "");
+
+    pthread_mutex_lock(&userdata_lock);
+    if (!g_hash_table_lookup_extended(userdata, key, NULL, &data)) {
+        data = converter ? rubymodule_converter_userdata(converter, config, error) : rubymodule_objformat_userdata(owner, error);
+        if (!osync_error_is_set(error)) {
+            g_hash_table_insert(userdata, key, data);
+            key = NULL;
+        }
+    }
+    pthread_mutex_unlock(&userdata_lock);
+    g_free(key);
+    return data;
+}
+
+static osync_bool host_handle(struct rubymodule_host_request *request, char *out, unsigned int max, OSyncError **error) {
+    OSyncObjFormat *format = NULL, *target;
+    OSyncFormatConverter *converter = NULL;
+    char *output = NULL;
+    unsigned int outputsize = 0;
+    osync_bool owned = TRUE, free_input = FALSE;
+    void *data;
+
+    if (request->op == RUBYMODULE_HOST_PING)
+        return TRUE;
+    /* Formats not loaded here run in the client */
+    if (!request->names[0] || !(format = osync_format_env_find_objformat(format_env, request->names[0]))) {
+        request->local = TRUE;
+        return TRUE;
+    }
+    if (request->op == RUBYMODULE_HOST_CONVERT) {
+        if (!request->names[1] || !(target = osync_format_env_find_objformat(format_env, request->names[1])) ||
+            !(converter = osync_format_env_find_converter(format_env, format, target))) {
+            request->local = TRUE;
+            return TRUE;
+        }
+        data = host_userdata(converter, converter, request->in[1], error);
+    } else
+        data = host_userdata(format, NULL, NULL, error);
+    if (osync_error_is_set(error))
+        return FALSE;
+
+    switch (request->op) {
+    case RUBYMODULE_HOST_COMPARE:
+        request->value = osync_rubymodule_objformat_compare(format, request->in[0], request->insize[0], request->in[1], request->insize[1], data, error);
+        break;
+    case RUBYMODULE_HOST_COPY:
+        osync_rubymodule_objformat_copy(format, request->in[0], request->insize[0], &output, &outputsize, data, error);
+        break;
+    case RUBYMODULE_HOST_PRINT:
+        /* Owned by ruby */
+        owned = FALSE;
+        output = osync_rubymodule_objformat_print(format, request->in[0], request->insize[0], data, error);
+        outputsize = output ? strlen(output) : 0;
+        break;
+    case RUBYMODULE_HOST_REVISION:
+        request->value = osync_rubymodule_objformat_revision(format, request->in[0], request->insize[0], data, error);
+        break;
+    case RUBYMODULE_HOST_CONVERT:
+        osync_rubymodule_converter_convert(converter, (char *) request->in[0], request->insize[0], &output, &outputsize, &free_input, request->in[1], data, error);
+        request->value = free_input;
+        break;
+    default:
+        osync_error_set(error, OSYNC_ERROR_PARAMETER, "Unknown ruby host call %d", request->op);
+    }
+    if (!osync_error_is_set(error) && output && outputsize > max)
+        osync_error_set(error, OSYNC_ERROR_GENERIC, "Result of %u bytes does not fit a ruby host slot", outputsize);
+    if (!osync_error_is_set(error) && output) {
+        /* The inputs are not used anymore: out overlaps them */
+        memmove(out, output, outputsize);
+        request->out = out;
+        request->outsize = outputsize;
+    }
+    if (owned)
+        rubymodule_buffer_release(output);
+    return !osync_error_is_set(error);
+}
+
+int main(int argc, char **argv) {
+    OSyncError *error = NULL;
+    const char *idle = getenv("OPENSYNC_RUBY_HOST_IDLE");
+    const char *format_path = argc > 2 && *argv[2] ? argv[2] : getenv("OPENSYNC_RUBY_FORMATSDIR");
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s socket_path [format_path]\n", argv[0]);
+        return 1;
+    }
+    /* Never forward to itself */
+    rubymodule_host_configure(NULL);
+    /* The ruby formats are looked up there too */
+    if (format_path && *format_path)
+        setenv("OPENSYNC_RUBY_FORMATSDIR", format_path, 1);
+    else
+        format_path = NULL;
+    userdata = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    format_env = osync_format_env_new(&error);
+    if (!format_env || !osync_format_env_load_plugins(format_env, format_path, &error)) {
+        fprintf(stderr, "opensync-ruby-host: %s\n", osync_error_print(&error));
+        return 1;
+    }
+    return rubymodule_host_serve(argv[1], format_path, host_handle, idle ? atoi(idle) : HOST_IDLE) ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef _RUBY_JOURNAL_H
+#define _RUBY_JOURNAL_H
+
+/*
+ * Change journal of a directory tree, written by opensync-ruby-journal and
+ * read by Opensync::FS::Journal (opensync.rb), so file sinks visit only the
+ * paths that changed since their last sync instead of the whole tree.
+ *
+ * The watcher keeps inotify watches on every directory of the tree and
+ * appends one record per changed path to BASE.journal, a file that starts
+ * with a header:
+ *
+ *   "ORJ1", u64 id, u64 previous id
+ *
+ * followed by records:
+ *
+ *   u8 type, u32 length, path (length bytes, relative to the root)
+ *
+ * in host byte order. id is new for each watcher run, so a cursor (id and
+ * offset) taken from a journal is meaningless for the next one. When the
+ * journal grows beyond RUBYMODULE_JOURNAL_MAX it is renamed BASE.journal.old
+ * and a new one, whose previous id is the old one's, is started.
+ *
+ * The watcher holds a lock on BASE.lock while it runs: a reader that can
+ * take it knows there is no journal to trust. Readers open BASE.lock on each
+ * check, and the watcher exits once nobody did for its idle time.
+ */
+
+#define RUBYMODULE_JOURNAL_MAGIC "ORJ1"
+#define RUBYMODULE_JOURNAL_HEADER 20
+#define RUBYMODULE_JOURNAL_MAX (16 * 1024 * 1024)
+
+/* Record types */
+/* All watches set: changes after it are complete */
+#define RUBYMODULE_JOURNAL_READY 'S'
+/* A file changed, was created or removed */
+#define RUBYMODULE_JOURNAL_DIRTY 'D'
+/* A directory was created or moved in: its whole subtree is new */
+#define RUBYMODULE_JOURNAL_TREE 'T'
+/* A directory was removed or moved out */
+#define RUBYMODULE_JOURNAL_REMOVED 'X'
+/* Events were lost (queue overflow, watch limit): the tree must be rescanned */
+#define RUBYMODULE_JOURNAL_RESCAN 'R'
+
+#endif //_RUBY_JOURNAL_H
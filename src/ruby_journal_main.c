@@ -0,0 +1,355 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * opensync-ruby-journal: keeps the change journal of a directory tree (see
+ * ruby_journal.h). Opensync::FS::Journal starts it when no watcher holds the
+ * journal lock; it detaches and runs until the root goes away or no reader
+ * checked the journal for a while. Readers open the lock file each time, so
+ * the watcher watches it too.
+ *
+ * Usage: opensync-ruby-journal root journal_base
+ * OPENSYNC_RUBY_JOURNAL_IDLE: seconds without readers before exiting (default 86400, 0: never)
+ *
+ * Every directory takes one inotify watch: trees with more directories than
+ * fs.inotify.max_user_watches can not be journaled and are always rescanned.
+ */
+
+#include "ruby_journal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+/* Tries to take the lock, 10ms apart: a reader may be holding it to check for a watcher */
+#define LOCK_TRIES 100
+#define JOURNAL_IDLE 86400
+
+static const char *root;
+static char *journal_path, *old_path;
+static int inotify_fd, journal_fd = -1;
+/* Watch of the lock file, and when a reader last opened it */
+static int lock_wd = -1;
+static int64_t last_read;
+static uint64_t journal_id;
+static off_t journal_size;
+/* Watch descriptor -> path of the directory, relative to root ("" for root) */
+static GHashTable *watches;
+/* Records of the events of one read, deduplicated by type and path */
+static GString *pending;
+static GHashTable *batch;
+
+static gboolean write_all(int fd, const char *data, size_t size) {
+    ssize_t written;
+
+    while (size) {
+        if ((written = write(fd, data, size)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        data += written;
+        size -= written;
+    }
+    return TRUE;
+}
+
+/* Starts a new journal, written aside and renamed so readers never see it
+ * without a header */
+static gboolean journal_start(uint64_t previous) {
+    char header[RUBYMODULE_JOURNAL_HEADER];
+    char *tmp = g_strdup_printf("%s.tmp", journal_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+
+    do
+        journal_id = ((uint64_t) g_random_int() << 32) | g_random_int();
+    while (!journal_id || journal_id == previous);
+    memcpy(header, RUBYMODULE_JOURNAL_MAGIC, 4);
+    memcpy(header + 4, &journal_id, 8);
+    memcpy(header + 12, &previous, 8);
+    if (fd < 0 || !write_all(fd, header, sizeof(header)) || rename(tmp, journal_path) < 0) {
+        fprintf(stderr, "opensync-ruby-journal: %s: %s\n", tmp, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        unlink(tmp);
+        g_free(tmp);
+        return FALSE;
+    }
+    g_free(tmp);
+    if (journal_fd >= 0)
+        close(journal_fd);
+    journal_fd = fd;
+    journal_size = sizeof(header);
+    return TRUE;
+}
+
+static void journal_add(char type, const char *path) {
+    uint32_t length = strlen(path);
+    char *key = g_strdup_printf("%c%s", type, path);
+
+    if (g_hash_table_lookup(batch, key)) {
+        g_free(key);
+        return;
+    }
+    g_hash_table_insert(batch, key, key);
+    g_string_append_c(pending, type);
+    g_string_append_len(pending, (const char *) &length, sizeof(length));
+    g_string_append_len(pending, path, length);
+}
+
+/* Writes the pending records. A journal that misses records must not be
+ * read: on failure the watcher exits, releasing the lock */
+static void journal_flush(void) {
+    if (!pending->len)
+        return;
+    if (!write_all(journal_fd, pending->str, pending->len)) {
+        fprintf(stderr, "opensync-ruby-journal: %s: %s\n", journal_path, strerror(errno));
+        exit(1);
+    }
+    journal_size += pending->len;
+    g_string_truncate(pending, 0);
+    g_hash_table_remove_all(batch);
+    if (journal_size > RUBYMODULE_JOURNAL_MAX) {
+        /* Readers behind the old journal still find it, as the previous one */
+        if (link(journal_path, old_path) < 0 && (errno != EEXIST || unlink(old_path) < 0 || link(journal_path, old_path) < 0))
+            exit(1);
+        if (!journal_start(journal_id))
+            exit(1);
+    }
+}
+
+/* Monotonic ms */
+static int64_t now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static char *child_path(const char *dir, const char *name) {
+    return *dir ? g_strdup_printf("%s/%s", dir, name) : g_strdup(name);
+}
+
+/* Watches path and every directory below it. FALSE when a watch could not
+ * be set (usually max_user_watches): changes there would be lost */
+static gboolean watch_tree(const char *path) {
+    char *full = child_path(root, path);
+    gboolean ok = TRUE;
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+    int wd;
+
+    if ((wd = inotify_add_watch(inotify_fd, full, WATCH_MASK)) < 0 || !(dir = opendir(full))) {
+        /* Removed or replaced meanwhile: its parent reports it. The root
+         * has no parent watching it */
+        ok = *path && (errno == ENOENT || errno == ENOTDIR);
+        g_free(full);
+        return ok;
+    }
+    g_hash_table_replace(watches, GINT_TO_POINTER(wd), g_strdup(path));
+    while (ok && (entry = readdir(dir))) {
+        char *child;
+
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        child = child_path(path, entry->d_name);
+        if (entry->d_type == DT_DIR)
+            ok = watch_tree(child);
+        else if (entry->d_type == DT_UNKNOWN) {
+            char *child_full = child_path(root, child);
+
+            if (!lstat(child_full, &st) && S_ISDIR(st.st_mode))
+                ok = watch_tree(child);
+            g_free(child_full);
+        }
+        g_free(child);
+    }
+    closedir(dir);
+    g_free(full);
+    return ok;
+}
+
+/* Drops the watches of a directory moved out: the tree may be anywhere now */
+static void unwatch_tree(const char *path) {
+    size_t length = strlen(path);
+    GHashTableIter iter;
+    gpointer wd, dir;
+
+    g_hash_table_iter_init(&iter, watches);
+    while (g_hash_table_iter_next(&iter, &wd, &dir))
+        if (!strncmp(dir, path, length) && (!((char *) dir)[length] || ((char *) dir)[length] == '/'))
+            inotify_rm_watch(inotify_fd, GPOINTER_TO_INT(wd));
+}
+
+static void handle(const struct inotify_event *event) {
+    const char *dir;
+    char *path;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        journal_add(RUBYMODULE_JOURNAL_RESCAN, "");
+        /* Reads might be lost too */
+        last_read = now();
+        return;
+    }
+    if (event->wd == lock_wd) {
+        if (event->mask & IN_OPEN)
+            last_read = now();
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        g_hash_table_remove(watches, GINT_TO_POINTER(event->wd));
+        return;
+    }
+    if (!(dir = g_hash_table_lookup(watches, GINT_TO_POINTER(event->wd))))
+        return;
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        /* Subdirectories are reported by their parents. Without its root,
+         * the journal has nothing left to follow */
+        if (!*dir) {
+            journal_add(RUBYMODULE_JOURNAL_RESCAN, "");
+            journal_flush();
+            exit(0);
+        }
+        return;
+    }
+    if (!event->len)
+        return;
+    path = child_path(dir, event->name);
+    if (!(event->mask & IN_ISDIR))
+        journal_add(RUBYMODULE_JOURNAL_DIRTY, path);
+    else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        journal_add(RUBYMODULE_JOURNAL_TREE, path);
+        if (!watch_tree(path)) {
+            journal_add(RUBYMODULE_JOURNAL_RESCAN, "");
+            journal_flush();
+            exit(1);
+        }
+    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        unwatch_tree(path);
+        journal_add(RUBYMODULE_JOURNAL_REMOVED, path);
+    }
+    g_free(path);
+}
+
+int main(int argc, char **argv) {
+    char buffer[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    char *lock_path;
+    ssize_t length, offset;
+    int lock_fd, tries, idle;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s root journal_base\n", argv[0]);
+        return 1;
+    }
+    root = argv[1];
+    idle = getenv("OPENSYNC_RUBY_JOURNAL_IDLE") ? atoi(getenv("OPENSYNC_RUBY_JOURNAL_IDLE")) : JOURNAL_IDLE;
+    lock_path = g_strdup_printf("%s.lock", argv[2]);
+    journal_path = g_strdup_printf("%s.journal", argv[2]);
+    old_path = g_strdup_printf("%s.journal.old", argv[2]);
+
+    /* Detach: the caller only waits for this process */
+    switch (fork()) {
+    case -1:
+        return 1;
+    case 0:
+        break;
+    default:
+        return 0;
+    }
+    setsid();
+
+    if ((lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        fprintf(stderr, "opensync-ruby-journal: %s: %s\n", lock_path, strerror(errno));
+        return 1;
+    }
+    for (tries = 0; flock(lock_fd, LOCK_EX | LOCK_NB) < 0; tries++) {
+        /* Another watcher keeps this journal */
+        if (errno != EWOULDBLOCK || tries == LOCK_TRIES)
+            return 0;
+        usleep(10000);
+    }
+    if ((inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "opensync-ruby-journal: inotify: %s\n", strerror(errno));
+        return 1;
+    }
+    watches = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    batch = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    pending = g_string_new(NULL);
+
+    /* Journals of previous runs are stale */
+    unlink(old_path);
+    if (!journal_start(0))
+        return 1;
+    if (!watch_tree("")) {
+        fprintf(stderr, "opensync-ruby-journal: %s: unable to watch the tree: %s\n", root, strerror(errno));
+        return 1;
+    }
+    journal_add(RUBYMODULE_JOURNAL_READY, "");
+    journal_flush();
+    /* Not fatal: without it, the watcher only exits with its root */
+    if (idle > 0 && (lock_wd = inotify_add_watch(inotify_fd, lock_path, IN_OPEN)) < 0)
+        idle = 0;
+    last_read = now();
+
+    for (;;) {
+        struct pollfd ready = { inotify_fd, POLLIN, 0 };
+        int timeout = -1;
+
+        if (idle > 0) {
+            int64_t left = last_read + idle * 1000LL - now();
+
+            /* Nobody reads the journal: the next reader starts a watcher and rescans */
+            if (left <= 0)
+                return 0;
+            timeout = left > INT_MAX ? INT_MAX : left;
+        }
+        if (poll(&ready, 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        if (!(ready.revents & POLLIN))
+            continue;
+        if ((length = read(inotify_fd, buffer, sizeof(buffer))) < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        for (offset = 0; offset < length; offset += sizeof(struct inotify_event) + event->len)
+            handle(event = (const struct inotify_event *) (buffer + offset));
+        journal_flush();
+    }
+}
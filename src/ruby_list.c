@@ -0,0 +1,183 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#include "ruby_list.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct rubymodule_list {
+    OSyncList *list;
+    long size;                      /* -1 until counted */
+    rubymodule_list_item_func item;
+    void *type;
+    VALUE mapper;                   /* map_object is called on each item, if not nil */
+    VALUE owner;                    /* object that returned the list, kept alive while it is used */
+    char **strings;                 /* copies of a string list made by rubymodule_list_new, or NULL */
+};
+
+static VALUE cList = Qnil;
+static ID id_map_object;
+
+static void rubymodule_list_mark(struct rubymodule_list *list) {
+    rb_gc_mark(list->mapper);
+    rb_gc_mark(list->owner);
+}
+
+static void rubymodule_list_free(struct rubymodule_list *list) {
+    long i;
+
+    osync_list_free(list->list);
+    if (list->strings) {
+        for (i = 0; i < list->size; i++)
+            free(list->strings[i]);
+        free(list->strings);
+    }
+    free(list);
+}
+
+VALUE rubymodule_list_new(OSyncList *list, rubymodule_list_item_func item, void *type) {
+    struct rubymodule_list *result = malloc(sizeof(struct rubymodule_list));
+    result->list = list;
+    result->size = -1;
+    result->item = item;
+    result->type = type;
+    result->mapper = Qnil;
+    result->owner = Qnil;
+    result->strings = NULL;
+    /* Strings are copied now, the owner may free them before they are read.
+     * Ruby Strings are still only made when an item is read */
+    if (item == rubymodule_list_string) {
+        long i = 0;
+        result->size = osync_list_length(list);
+        result->strings = malloc((result->size ? result->size : 1) * sizeof(char*));
+        for (; list; list = list->next)
+            result->strings[i++] = list->data ? strdup((const char*) list->data) : NULL;
+        osync_list_free(result->list);
+        result->list = NULL;
+    }
+    return Data_Wrap_Struct(cList, rubymodule_list_mark, rubymodule_list_free, result);
+}
+
+VALUE rubymodule_list_string(void *data, void *type) {
+    return data ? rb_str_new2((const char*) data) : Qnil;
+}
+
+static struct rubymodule_list *rubymodule_list_get(VALUE self) {
+    struct rubymodule_list *list;
+    Data_Get_Struct(self, struct rubymodule_list, list);
+    return list;
+}
+
+static VALUE rubymodule_list_map(struct rubymodule_list *list, VALUE value) {
+    if (!NIL_P(list->mapper))
+        value = rb_funcall(list->mapper, id_map_object, 1, value);
+    return value;
+}
+
+static VALUE rubymodule_list_item(struct rubymodule_list *list, OSyncList *item) {
+    return rubymodule_list_map(list, list->item(item->data, list->type));
+}
+
+static VALUE rb_list_each(VALUE self) {
+    struct rubymodule_list *list;
+    OSyncList *item;
+
+    RETURN_ENUMERATOR(self, 0, 0);
+    list = rubymodule_list_get(self);
+    if (list->strings) {
+        long i;
+        for (i = 0; i < list->size; i++)
+            rb_yield(rubymodule_list_map(list, list->item(list->strings[i], list->type)));
+        return self;
+    }
+    for (item = list->list; item; item = item->next)
+        rb_yield(rubymodule_list_item(list, item));
+    return self;
+}
+
+static VALUE rb_list_size(VALUE self) {
+    struct rubymodule_list *list = rubymodule_list_get(self);
+    OSyncList *item;
+
+    if (list->size < 0) {
+        list->size = 0;
+        for (item = list->list; item; item = item->next)
+            list->size++;
+    }
+    return LONG2NUM(list->size);
+}
+
+static VALUE rb_list_empty_p(VALUE self) {
+    return NUM2LONG(rb_list_size(self)) ? Qfalse : Qtrue;
+}
+
+/* list[index], negative indexes count from the end */
+static VALUE rb_list_aref(VALUE self, VALUE index) {
+    struct rubymodule_list *list = rubymodule_list_get(self);
+    OSyncList *item;
+    long i = NUM2LONG(index);
+
+    if (i < 0)
+        i += NUM2LONG(rb_list_size(self));
+    if (i < 0 || i >= NUM2LONG(rb_list_size(self)))
+        return Qnil;
+    if (list->strings)
+        return rubymodule_list_map(list, list->item(list->strings[i], list->type));
+    for (item = list->list; item && i > 0; item = item->next)
+        i--;
+    return item ? rubymodule_list_item(list, item) : Qnil;
+}
+
+/*
+ * mapped_by(mapper, owner=nil): items read from now on are given to
+ * mapper.map_object. owner, the object that returned the list, is kept alive
+ * with it. Returns self
+ */
+static VALUE rb_list_mapped_by(int argc, VALUE *argv, VALUE self) {
+    struct rubymodule_list *list = rubymodule_list_get(self);
+    VALUE mapper, owner;
+
+    rb_scan_args(argc, argv, "11", &mapper, &owner);
+    list->mapper = mapper;
+    if (!NIL_P(owner))
+        list->owner = owner;
+    return self;
+}
+
+static VALUE rb_list_inspect(VALUE self) {
+    return rb_sprintf("#<Opensync::List size=%ld>", NUM2LONG(rb_list_size(self)));
+}
+
+void rubymodule_list_init(VALUE module) {
+    id_map_object = rb_intern("map_object");
+    cList = rb_define_class_under(module, "List", rb_cObject);
+    rb_undef_alloc_func(cList);
+    rb_include_module(cList, rb_mEnumerable);
+    rb_define_method(cList, "each", rb_list_each, 0);
+    rb_define_method(cList, "size", rb_list_size, 0);
+    rb_define_method(cList, "length", rb_list_size, 0);
+    rb_define_method(cList, "empty?", rb_list_empty_p, 0);
+    rb_define_method(cList, "[]", rb_list_aref, 1);
+    rb_define_method(cList, "mapped_by", rb_list_mapped_by, -1);
+    rb_define_method(cList, "inspect", rb_list_inspect, 0);
+    /* Keep cList alive */
+    rb_gc_register_address(&cList);
+}
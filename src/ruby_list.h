@@ -0,0 +1,48 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef _RUBY_LIST_H
+#define _RUBY_LIST_H
+
+#include <ruby.h>
+#include <opensync/opensync.h>
+
+/*
+ * Opensync::List is the ruby side of an OSyncList returned by opensync. It
+ * owns the list (not its items) and frees it when collected. Items are
+ * converted to ruby only when read, so each, first or find do not build an
+ * Array of the whole list.
+ *
+ * Strings are duplicated in C when the list is created, so reading the
+ * deleted uids of a hashtable while updating it is safe; the ruby Strings
+ * are still only made as items are read. Other
+ * items still belong to the object that returned the list, which the list
+ * keeps alive once mapped_by gives it as owner.
+ */
+
+/* Converts an item of the list into ruby. type is given to rubymodule_list_new */
+typedef VALUE (*rubymodule_list_item_func)(void *data, void *type);
+
+void  rubymodule_list_init(VALUE module);
+VALUE rubymodule_list_new(OSyncList *list, rubymodule_list_item_func item, void *type);
+/* Item function for lists of char* */
+VALUE rubymodule_list_string(void *data, void *type);
+
+#endif //_RUBY_LIST_H
@@ -22,17 +22,47 @@
 // TODO Call free after any unregister. Maybe done
 
 #include "ruby_module.h"
+#include "ruby_dispatcher.h"
+#include "ruby_digest.h"
+#include "ruby_fs.h"
+#include "ruby_buffer.h"
+#include "ruby_host.h"
+#include "ruby_list.h"
+#include "ruby_packed.h"
+#include "ruby_ractor.h"
+#include "ruby_stats.h"
 
 #include <pthread.h>
 #include <ruby/ruby.h>
+#if RUBY_API_VERSION_MAJOR >= 2
+#include <ruby/debug.h>
+#endif
 #include <opensync/opensync-version.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <glib.h>
 #include "opensyncRUBY_wrap.c"
+// Only the callback slots enum. The callbacks code is included later
+#define RUBYMODULE_CALLBACKS_SLOTS_ONLY
+#include "callbacks.h"
+#undef RUBYMODULE_CALLBACKS_SLOTS_ONLY
 #include <stdio.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#if RUBY_API_VERSION_MAJOR >= 3
+/* Async sink callbacks run in non-blocking Fibers (see osync_rubymodule_set_async) */
+#define RUBYMODULE_ASYNC
+#include <ruby/fiber/scheduler.h>
+#endif
+/* Seconds the pending async callbacks get to finish at finalize */
+#define RUBYMODULE_ASYNC_DRAIN_TIMEOUT 10
 
 #define RBOOL(value) ((value==Qfalse) || (value==Qnil) ? FALSE : TRUE)
 #define BOOLR(value) (value==FALSE ? Qfalse : Qtrue)
@@ -41,12 +71,13 @@
 /* Check_Type(val, T_STRING) raises exception but I these macros are
  * used in not-protected code */
 #define IS_STRING(value) (TYPE(value)==T_STRING)
+/* A String or an Opensync::Buffer */
+#define IS_BYTES(value)  (IS_STRING(value) || rubymodule_buffer_p(value))
 #define IS_ARRAY(value)  (TYPE(value)==T_ARRAY)
 #define IS_FIXNUM(value) (FIXNUM_P(value))
 #define IS_TIME(value)   (TYPE(value)==rb_cTime)
 
 #define CAST_VALUE(value)     (value==NULL?Qnil:(VALUE)value)
-#define IND_VALUE(value)      (value==NULL?Qnil:*(VALUE*)value)
 
 #ifdef STACK_END_ADDRESS
 
@@ -101,53 +132,176 @@ RUBY_GLOBAL_SETUP
 
 /* This mutex avoids concurrent use of ruby context (which is prohibit) */
 static pthread_mutex_t 	ruby_context_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t 	ruby_call_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t 	rubymodule_data_lock = PTHREAD_MUTEX_INITIALIZER;
 //static pthread_t     	main_thread;
 static pthread_t     	ruby_thread = 0;
 static osync_bool      	ruby_running = FALSE;
 static osync_bool      	ruby_started = FALSE;
 
-pthread_cond_t 		fcall_ruby_running = PTHREAD_COND_INITIALIZER;
-pthread_cond_t 		fcall_requested = PTHREAD_COND_INITIALIZER;
-pthread_cond_t 		fcall_returned = PTHREAD_COND_INITIALIZER;
+/* Queue of calls waiting for the ruby thread */
+static struct rubymodule_dispatcher ruby_dispatcher;
 
 static pthread_t 	ruby_thread;
 osync_bool is_running_in_rubythread();
 
 GHashTable 		*rubymodule_data;
 
-struct threaded_funcall;
-typedef void (* threaded_func) ();
-struct threaded_funcall {
-   threaded_func 	func;
-   void*		*args;
-   void   		*result;
-};
-static struct threaded_funcall funcall_data = {NULL, NULL, NULL};
+/* Method names used by callbacks, interned once at rubymodule_initialize */
+static ID id_call, id_to_i, id_get_sync_info, id_get_format_info, id_get_conversion_info;
 
 void rubymodule_ruby_needed();
 
+/*
+ * Garbage collection policy
+ *
+ * Ruby objects created for callbacks are only reachable from the ruby world,
+ * so ruby GC is able to clean them by itself. Forcing a full GC after each
+ * callback is expensive and only useful to detect memory problems early.
+ * The policy is read from OPENSYNC_RUBY_GC environment variable or set by ruby
+ * code (see Opensync.osync_rubymodule_set_gc_policy):
+ *
+ *   never         never force a GC. Let ruby decide
+ *   every:N       force a GC after each N callbacks
+ *   threshold:S   force a GC when RSS grew S bytes (k, M or G suffix)
+ *                 since the last forced GC
+ *   boundary      force a GC after sync_done and disconnect (default)
+ */
+typedef enum {
+    RUBYMODULE_GC_NEVER,
+    RUBYMODULE_GC_EVERY,
+    RUBYMODULE_GC_THRESHOLD,
+    RUBYMODULE_GC_BOUNDARY
+} rubymodule_gc_policy;
+
+static const char *rubymodule_gc_policy_names[] = { "never", "every", "threshold", "boundary" };
+
+/* RSS is only sampled every RUBYMODULE_GC_RSS_SAMPLE calls in threshold policy */
+#define RUBYMODULE_GC_RSS_SAMPLE 64
+
+/*
+ * policy and arg are set before any callback runs. The counters are updated
+ * by the ruby thread and by the Ractor lanes (see ruby_ractor.h): atomics
+ */
+static struct {
+    rubymodule_gc_policy policy;
+    unsigned long        arg;      /* calls for every, bytes for threshold */
+    unsigned long        calls;    /* calls since last forced GC */
+    unsigned long        rss_base; /* RSS after last forced GC */
+    unsigned long        count;    /* number of forced GCs */
+    unsigned long        time_us;  /* spent in forced GCs */
+} rubymodule_gc = { RUBYMODULE_GC_BOUNDARY, 0, 0, 0, 0, 0 };
+
+static unsigned long rubymodule_gc_rss() {
+    unsigned long size = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void rubymodule_gc_force() {
+    struct timeval start, end;
+
+    debug_fcall("GarbageCollecting...");
+    gettimeofday(&start, NULL);
+    rb_gc();
+    gettimeofday(&end, NULL);
+    debug_fcall("done!");
+
+    __atomic_add_fetch(&rubymodule_gc.count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&rubymodule_gc.time_us, (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec), __ATOMIC_RELAXED);
+    if (rubymodule_gc.policy == RUBYMODULE_GC_THRESHOLD)
+        __atomic_store_n(&rubymodule_gc.rss_base, rubymodule_gc_rss(), __ATOMIC_RELAXED);
+}
+
+/* Parses "policy[:arg]". Returns FALSE if it is not valid */
+static osync_bool rubymodule_gc_set_policy(const char *spec) {
+    rubymodule_gc_policy policy;
+    unsigned long arg = 0;
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? ( size_t ) ( colon - spec ) : strlen(spec);
+    char *end;
+
+    for (policy = RUBYMODULE_GC_NEVER; policy <= RUBYMODULE_GC_BOUNDARY; policy++)
+        if (strlen(rubymodule_gc_policy_names[policy]) == len && !strncmp(spec, rubymodule_gc_policy_names[policy], len))
+            break;
+    if (policy > RUBYMODULE_GC_BOUNDARY)
+        return FALSE;
+
+    if (policy == RUBYMODULE_GC_EVERY || policy == RUBYMODULE_GC_THRESHOLD) {
+        if (!colon)
+            return FALSE;
+        arg = strtoul(colon + 1, &end, 10);
+        switch (toupper(*end)) {
+        case 'G': arg *= 1024; /* fall through */
+        case 'M': arg *= 1024; /* fall through */
+        case 'K': arg *= 1024; /* fall through */
+        case '\0': break;
+        default: return FALSE;
+        }
+        if (arg == 0)
+            return FALSE;
+    }
+
+    rubymodule_gc.policy = policy;
+    rubymodule_gc.arg = arg;
+    rubymodule_gc.calls = 0;
+    rubymodule_gc.rss_base = policy == RUBYMODULE_GC_THRESHOLD ? rubymodule_gc_rss() : 0;
+    return TRUE;
+}
+
+/* Called after each ruby callback, from any lane */
+static void rubymodule_gc_after_call() {
+    unsigned long calls = __atomic_add_fetch(&rubymodule_gc.calls, 1, __ATOMIC_RELAXED);
+    switch (rubymodule_gc.policy) {
+    case RUBYMODULE_GC_EVERY:
+        /* Only the lane that resets the count forces the GC */
+        if (calls >= rubymodule_gc.arg &&
+                __atomic_compare_exchange_n(&rubymodule_gc.calls, &calls, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            rubymodule_gc_force();
+        break;
+    case RUBYMODULE_GC_THRESHOLD:
+        if (calls % RUBYMODULE_GC_RSS_SAMPLE == 0 &&
+                rubymodule_gc_rss() > __atomic_load_n(&rubymodule_gc.rss_base, __ATOMIC_RELAXED) + rubymodule_gc.arg)
+            rubymodule_gc_force();
+        break;
+    default:
+        break;
+    }
+}
+
+/* Called when a sync or a connection ends (sync_done/disconnect) */
+static void rubymodule_gc_boundary() {
+    if (rubymodule_gc.policy == RUBYMODULE_GC_BOUNDARY)
+        rubymodule_gc_force();
+}
+
+void rubymodule_gc_stats(unsigned long *count, double *time) {
+    *count = __atomic_load_n(&rubymodule_gc.count, __ATOMIC_RELAXED);
+    *time = __atomic_load_n(&rubymodule_gc.time_us, __ATOMIC_RELAXED) / 1e6;
+}
+
 VALUE rb_funcall2_wrapper ( VALUE* params ) {
     VALUE result;
-    char  *name;
 
+#ifdef DEBUG_FCALL
     debug_fcall("STACK: %p ", &result);
-    name = RSTRING_PTR(rb_funcall2 (params[0], rb_intern("inspect"), 0,0));
-    debug_fcall("%s.%s()...",name, ( char* )params[1]);
+    debug_fcall("%s.%s()...", RSTRING_PTR(rb_inspect(params[0])), rb_id2name ( ( ID ) params[1] ));
+#endif
 
-    result = rb_funcall2 ( params[0], rb_intern ( ( char* ) params[1] ), ( int ) params[2], ( VALUE* ) params[3] );
+    result = rb_funcall2 ( params[0], ( ID ) params[1], ( int ) params[2], ( VALUE* ) params[3] );
     debug_fcall("returned!");
 
-    debug_fcall("GarbageCollecting...");
-    rb_funcall (rb_mGC, rb_intern ("start"), 0,  NULL);
-    debug_fcall("done!");
+    rubymodule_gc_after_call();
 
     debug_fcall("\n");
     return result;
 }
 
-static VALUE rb_funcall2_protected ( VALUE recv, const char* method, int argc, VALUE* args, int* status ) {
+static VALUE rb_funcall2_protected ( VALUE recv, ID method, int argc, VALUE* args, int* status ) {
     VALUE params[4];
     VALUE result;
     params[0]= recv;
@@ -182,54 +336,679 @@ static char * osync_rubymodule_error_bt ( ) {
     return RSTRING_PTR ( message );
 }
 
-static void unregister_and_free(gpointer data) {
-    rb_gc_unregister_address(data);
-    free(data);
+/*
+ * Ruby values held by C code
+ *
+ * Every VALUE that C world keeps (callbacks blocks, plugin/sink/format user
+ * data) lives in a slot of a chunked table. All slots are marked by a single
+ * ruby object (rubymodule_store_root), so keeping or releasing a value is
+ * O(1) instead of rb_gc_(un)register_address, which scans a global list.
+ * C code refers to a slot by a handle (its index + 1). Handle 0 means nil and
+ * handles fit in a void* (see HANDLE2PTR/PTR2HANDLE) so they can be used as
+ * opensync user data. Released slots hold Qundef until they are reused, so
+ * a stale or unknown handle reads nil and is never released twice.
+ *
+ * The store is used from the ruby thread, which is also the thread where mark
+ * runs, and from Ractor lanes, if any (see ruby_ractor.h). Lanes only get
+ * values that are shareable.
+ */
+#define RUBYMODULE_STORE_CHUNK 256
+
+#define HANDLE2PTR(handle)    GUINT_TO_POINTER(handle)
+#define PTR2HANDLE(ptr)       GPOINTER_TO_UINT(ptr)
+#define PTR_VALUE(ptr)        rubymodule_store_get(PTR2HANDLE(ptr))
+
+static struct {
+    VALUE        **chunks;
+    unsigned int nchunks;
+    unsigned int used;       /* slots ever used */
+    unsigned int *free;      /* stack of released handles */
+    unsigned int nfree;
+} rubymodule_store = { NULL, 0, 0, NULL, 0 };
+
+static VALUE rubymodule_store_root = Qnil;
+static pthread_mutex_t rubymodule_store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Always taken: a lane might start between the lock and the unlock */
+#define STORE_LOCK()   pthread_mutex_lock ( &rubymodule_store_lock )
+#define STORE_UNLOCK() pthread_mutex_unlock ( &rubymodule_store_lock )
+
+static void rubymodule_store_mark(void *unused) {
+    unsigned int i;
+    for (i = 0; i < rubymodule_store.used; i++) {
+        VALUE value = rubymodule_store.chunks[i / RUBYMODULE_STORE_CHUNK][i % RUBYMODULE_STORE_CHUNK];
+        if (value != Qundef)
+            rb_gc_mark(value);
+    }
+}
+
+/* Slot of handle, NULL if it is not a handle in use. Called with the store lock */
+static VALUE *rubymodule_store_slot(unsigned int handle) {
+    VALUE *slot;
+    if (!handle || handle > rubymodule_store.used)
+        return NULL;
+    slot = &rubymodule_store.chunks[(handle - 1) / RUBYMODULE_STORE_CHUNK][(handle - 1) % RUBYMODULE_STORE_CHUNK];
+    return *slot == Qundef ? NULL : slot;
+}
+
+static void rubymodule_store_init() {
+    rubymodule_store_root = Data_Wrap_Struct(rb_cObject, rubymodule_store_mark, NULL, &rubymodule_store);
+    rb_gc_register_address(&rubymodule_store_root);
+}
+
+static void rubymodule_store_destroy() {
+    unsigned int i;
+    rb_gc_unregister_address(&rubymodule_store_root);
+    rubymodule_store_root = Qnil;
+    for (i = 0; i < rubymodule_store.nchunks; i++)
+        g_free(rubymodule_store.chunks[i]);
+    g_free(rubymodule_store.chunks);
+    g_free(rubymodule_store.free);
+    memset(&rubymodule_store, 0, sizeof(rubymodule_store));
+}
+
+unsigned int rubymodule_store_new(VALUE value) {
+    unsigned int index;
+
+    if (NIL_P(value))
+        return 0;
+
+    STORE_LOCK();
+    if (rubymodule_store.nfree) {
+        index = rubymodule_store.free[--rubymodule_store.nfree] - 1;
+    } else {
+        index = rubymodule_store.used++;
+        if (index / RUBYMODULE_STORE_CHUNK >= rubymodule_store.nchunks) {
+            rubymodule_store.chunks = g_realloc(rubymodule_store.chunks, sizeof(VALUE*) * (rubymodule_store.nchunks + 1));
+            rubymodule_store.chunks[rubymodule_store.nchunks++] = g_new0(VALUE, RUBYMODULE_STORE_CHUNK);
+            rubymodule_store.free = g_realloc(rubymodule_store.free, sizeof(unsigned int) * rubymodule_store.nchunks * RUBYMODULE_STORE_CHUNK);
+        }
+    }
+    rubymodule_store.chunks[index / RUBYMODULE_STORE_CHUNK][index % RUBYMODULE_STORE_CHUNK] = value;
+    STORE_UNLOCK();
+    return index + 1;
+}
+
+/* Value of handle, nil if invalid. Never raises, so it can be called holding other locks */
+static VALUE rubymodule_store_peek(unsigned int handle) {
+    VALUE value = Qnil, *slot;
+    if (!handle)
+        return Qnil;
+    STORE_LOCK();
+    if ((slot = rubymodule_store_slot(handle)))
+        value = *slot;
+    STORE_UNLOCK();
+    if (!slot)
+        osync_trace(TRACE_ERROR, "%s: invalid handle %u", __func__, handle);
+    return value;
+}
+
+/* Raises if the value cannot be used in the current lane: call it without locks */
+VALUE rubymodule_store_get(unsigned int handle) {
+    return rubymodule_lanes_check(rubymodule_store_peek(handle));
+}
+
+void rubymodule_store_free(unsigned int handle) {
+    VALUE *slot;
+    if (!handle)
+        return;
+    STORE_LOCK();
+    if ((slot = rubymodule_store_slot(handle))) {
+        *slot = Qundef;
+        rubymodule_store.free[rubymodule_store.nfree++] = handle;
+    }
+    STORE_UNLOCK();
+    if (!slot)
+        osync_trace(TRACE_ERROR, "%s: invalid or released handle %u", __func__, handle);
+}
+
+static void rubymodule_store_release(gpointer data) {
+    rubymodule_store_free(PTR2HANDLE(data));
+}
+
+/*
+ * Ruby values related to an opensync object (plugin, sink, format...):
+ * callbacks, indexed by the slots generated in callbacks.h, and any other
+ * value set from ruby with osync_rubymodule_set_data
+ */
+struct rubymodule_owner {
+    unsigned int callbacks[RUBYMODULE_CB_COUNT];
+    GHashTable   *data;
+    /* Pass input data to callbacks as borrowed Opensync::Buffer */
+    osync_bool   zero_copy;
+    /* compare answers OSYNC_CONV_DATA_SAME for byte identical data without ruby */
+    osync_bool   compare_fast;
+    /* Where callbacks run (see ruby_ractor.h) */
+    int          lane;
+    /* Async context callbacks allowed at once (0: synchronous) and running */
+    int          async_limit;
+    int          in_flight;
 };
 
+static void rubymodule_owner_free ( gpointer data ) {
+    struct rubymodule_owner *owner = data;
+    int slot;
+    for ( slot = 0; slot < RUBYMODULE_CB_COUNT; slot++ )
+        rubymodule_store_free ( owner->callbacks[slot] );
+    if ( owner->data )
+        g_hash_table_destroy ( owner->data );
+    g_free ( owner );
+}
+
+/* Must be called with rubymodule_data_lock */
+static struct rubymodule_owner *rubymodule_owner_get ( void* ptr, osync_bool create ) {
+    struct rubymodule_owner *owner = g_hash_table_lookup ( rubymodule_data, ptr );
+    if ( owner == NULL && create ) {
+        owner = g_new0 ( struct rubymodule_owner, 1 );
+        g_hash_table_insert ( rubymodule_data, ptr, owner );
+    }
+    return owner;
+}
+
+static void osync_rubymodule_set_callback ( void* ptr, enum rubymodule_callback_slot slot, VALUE callback ) {
+    struct rubymodule_owner *owner;
+
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    owner = rubymodule_owner_get ( ptr, TRUE );
+#ifdef RUBYMODULE_RACTORS
+    if ( owner->lane != RUBYMODULE_LANE_MAIN && !rb_ractor_shareable_p ( callback ) ) {
+        pthread_mutex_unlock ( &rubymodule_data_lock );
+        rb_raise ( rb_eArgError, "callbacks of objects bound to a Ractor lane must be shareable (see Ractor.make_shareable)" );
+    }
+#endif
+    rubymodule_store_free ( owner->callbacks[slot] );
+    owner->callbacks[slot] = rubymodule_store_new ( callback );
+    pthread_mutex_unlock ( &rubymodule_data_lock );
+}
+
+static VALUE osync_rubymodule_get_callback ( void* ptr, enum rubymodule_callback_slot slot ) {
+    struct rubymodule_owner *owner;
+    unsigned int handle = 0;
+
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    owner = rubymodule_owner_get ( ptr, FALSE );
+    if ( owner != NULL )
+        handle = owner->callbacks[slot];
+    pthread_mutex_unlock ( &rubymodule_data_lock );
+
+    return rubymodule_store_get ( handle );
+}
+
+static void osync_rubymodule_set_zero_copy ( void* ptr, osync_bool zero_copy ) {
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    rubymodule_owner_get ( ptr, TRUE )->zero_copy = zero_copy;
+    pthread_mutex_unlock ( &rubymodule_data_lock );
+}
+
+static void osync_rubymodule_set_compare_fast ( void* ptr, osync_bool compare_fast ) {
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    rubymodule_owner_get ( ptr, TRUE )->compare_fast = compare_fast;
+    pthread_mutex_unlock ( &rubymodule_data_lock );
+}
+
+/* Binds the callbacks of ptr to lane. Returns FALSE if some callback is not shareable */
+static osync_bool osync_rubymodule_set_lane ( void* ptr, int lane ) {
+    struct rubymodule_owner *owner;
+    osync_bool shareable = TRUE;
+
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    owner = rubymodule_owner_get ( ptr, TRUE );
+#ifdef RUBYMODULE_RACTORS
+    if ( lane != RUBYMODULE_LANE_MAIN ) {
+        int slot;
+        for ( slot = 0; slot < RUBYMODULE_CB_COUNT; slot++ )
+            if ( owner->callbacks[slot] && !rb_ractor_shareable_p ( rubymodule_store_peek ( owner->callbacks[slot] ) ) )
+                shareable = FALSE;
+    }
+#endif
+    if ( shareable )
+        owner->lane = lane;
+    pthread_mutex_unlock ( &rubymodule_data_lock );
+    return shareable;
+}
+
+static int osync_rubymodule_lane ( void* ptr ) {
+    struct rubymodule_owner *owner;
+    int lane = RUBYMODULE_LANE_MAIN;
+
+    /* Nothing is bound before a lane exists */
+    if ( !rubymodule_lanes_enabled() )
+        return lane;
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    owner = rubymodule_owner_get ( ptr, FALSE );
+    if ( owner != NULL )
+        lane = owner->lane;
+    pthread_mutex_unlock ( &rubymodule_data_lock );
+
+    return lane;
+}
+
+/*
+ * Dispatcher that must run the callbacks of ptr, or NULL if the current
+ * thread can run them itself: the ruby thread runs anything (callbacks of
+ * bound objects are shareable) and a lane runs its own and pool callbacks
+ */
+static struct rubymodule_dispatcher *rubymodule_dispatcher_for ( void* ptr ) {
+    struct rubymodule_dispatcher *dispatcher;
+    int lane, current;
+
+    if ( is_running_in_rubythread() )
+        return NULL;
+    lane = osync_rubymodule_lane ( ptr );
+    current = rubymodule_lane_current();
+    if ( current != RUBYMODULE_LANE_MAIN && lane != RUBYMODULE_LANE_MAIN && ( lane == current || lane == RUBYMODULE_LANE_POOL ) )
+        return NULL;
+    dispatcher = rubymodule_lane_dispatcher ( lane );
+    return dispatcher ? dispatcher : &ruby_dispatcher;
+}
+
+/*
+ * Async context callbacks
+ *
+ * Sink callbacks report their result through OSyncContext, so the caller
+ * does not need to wait for them. When a sink sets an async limit, these
+ * callbacks are posted to the ruby thread, which runs each one in a
+ * non-blocking Fiber: while it waits for I/O under the Fiber scheduler
+ * (Opensync::Async::Scheduler), other calls and fibers go on. Callers block
+ * only when limit callbacks of that sink are still running.
+ *
+ * While fibers are pending, the ruby thread polls the scheduler instead of
+ * sleeping on the dispatcher. Producers write to the wakeup pipe so a new
+ * call ends the scheduler wait.
+ */
+struct rubymodule_async {
+    struct rubymodule_call call;
+    /* Runs in the fiber */
+    rubymodule_call_func   body;
+    /* Releases the call once body returned or it was cancelled */
+    rubymodule_call_func   dispose;
+    void                   *owner;
+    OSyncContext           *ctx;
+    /* Pending list */
+    struct rubymodule_async *prev, *next;
+};
+
+/* Fibers not finished yet, and their calls. Only changed by the ruby thread */
+static int rubymodule_async_pending = 0;
+static struct rubymodule_async *rubymodule_async_list = NULL;
+/* Call scheduled by rubymodule_async_start, until its fiber starts */
+static struct rubymodule_async *rubymodule_async_starting = NULL;
+static int rubymodule_async_wakeup[2] = { -1, -1 };
+static pthread_cond_t rubymodule_async_done = PTHREAD_COND_INITIALIZER;
+
+static void osync_rubymodule_set_async ( void* ptr, int limit ) {
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    rubymodule_owner_get ( ptr, TRUE )->async_limit = limit > 0 ? limit : 0;
+    /* Callers waiting for room might go on now */
+    pthread_cond_broadcast ( &rubymodule_async_done );
+    pthread_mutex_unlock ( &rubymodule_data_lock );
+}
+
+/*
+ * Whether a call to ptr through dispatcher can be posted instead of
+ * requested. If so, it takes one of the owner slots, waiting for one if all
+ * are in use. Only plain threads post: lanes must not block holding a GVL
+ */
+static osync_bool rubymodule_async_acquire ( struct rubymodule_dispatcher *dispatcher, void* ptr ) {
+#ifdef RUBYMODULE_ASYNC
+    struct rubymodule_owner *owner;
+    osync_bool async = FALSE;
+
+    if ( dispatcher != &ruby_dispatcher || rubymodule_lane_current() != RUBYMODULE_LANE_MAIN )
+        return FALSE;
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    while ( ( owner = rubymodule_owner_get ( ptr, FALSE ) ) && owner->async_limit > 0 ) {
+        if ( owner->in_flight < owner->async_limit ) {
+            owner->in_flight++;
+            async = TRUE;
+            break;
+        }
+        pthread_cond_wait ( &rubymodule_async_done, &rubymodule_data_lock );
+    }
+    pthread_mutex_unlock ( &rubymodule_data_lock );
+    return async;
+#else
+    return FALSE;
+#endif
+}
+
+static void rubymodule_async_release ( void* ptr ) {
+    struct rubymodule_owner *owner;
+
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    if ( ( owner = rubymodule_owner_get ( ptr, FALSE ) ) && owner->in_flight > 0 )
+        owner->in_flight--;
+    pthread_cond_broadcast ( &rubymodule_async_done );
+    pthread_mutex_unlock ( &rubymodule_data_lock );
+}
+
+/* Wakes the ruby thread up if it might be waiting in the scheduler */
+static void rubymodule_async_notify() {
+    char byte = 0;
+
+    __atomic_thread_fence ( __ATOMIC_SEQ_CST );
+    if ( __atomic_load_n ( &rubymodule_async_pending, __ATOMIC_RELAXED ) &&
+            write ( rubymodule_async_wakeup[1], &byte, 1 ) < 0 ) {
+        /* Full pipe: the ruby thread has a wakeup to read anyway */
+    }
+}
+
+#ifdef RUBYMODULE_ASYNC
+/* Takes async out of the pending ones and disposes it */
+static void rubymodule_async_finish ( struct rubymodule_async *async ) {
+    if ( async->prev )
+        async->prev->next = async->next;
+    else
+        rubymodule_async_list = async->next;
+    if ( async->next )
+        async->next->prev = async->prev;
+    __atomic_sub_fetch ( &rubymodule_async_pending, 1, __ATOMIC_SEQ_CST );
+    rubymodule_async_release ( async->owner );
+    async->dispose ( &async->call );
+}
+
+static VALUE rubymodule_async_fiber ( RB_BLOCK_CALL_FUNC_ARGLIST ( yielded, data ) ) {
+    struct rubymodule_async *async = ( struct rubymodule_async * ) data;
+
+    if ( rubymodule_async_starting == async )
+        rubymodule_async_starting = NULL;
+    async->body ( &async->call );
+    rubymodule_async_finish ( async );
+    return Qnil;
+}
+
+/* Fails the pending calls, whose fibers will never be resumed */
+static void rubymodule_async_cancel_all ( const char *reason ) {
+    OSyncError *error = NULL;
+
+    osync_trace ( TRACE_ERROR, "%s: %d async callbacks pending: %s", __func__, rubymodule_async_pending, reason );
+    while ( rubymodule_async_list ) {
+        struct rubymodule_async *async = rubymodule_async_list;
+        osync_error_set ( &error, OSYNC_ERROR_GENERIC, "(RUBY) Async callback cancelled: %s", reason );
+        osync_context_report_osyncerror ( async->ctx, error );
+        osync_error_unref ( &error );
+        rubymodule_async_finish ( async );
+    }
+}
+
+/* Like Fiber.schedule: the scheduler creates a non-blocking fiber and resumes it */
+static VALUE rubymodule_async_schedule ( VALUE call ) {
+    VALUE scheduler = rb_fiber_scheduler_get();
+
+    if ( NIL_P ( scheduler ) )
+        return rubymodule_async_fiber ( Qnil, call, 0, NULL, Qnil );
+    return rb_block_call ( scheduler, rb_intern ( "fiber" ), 0, NULL, rubymodule_async_fiber, call );
+}
+#endif
+
+/* func of posted calls. Starts the fiber, which runs until its first wait */
+static void rubymodule_async_start ( struct rubymodule_call *call ) {
+#ifdef RUBYMODULE_ASYNC
+    struct rubymodule_async *async = ( struct rubymodule_async * ) call;
+    int state = 0;
+
+    __atomic_add_fetch ( &rubymodule_async_pending, 1, __ATOMIC_SEQ_CST );
+    async->prev = NULL;
+    async->next = rubymodule_async_list;
+    if ( rubymodule_async_list )
+        rubymodule_async_list->prev = async;
+    rubymodule_async_list = async;
+    rubymodule_async_starting = async;
+    rb_protect ( rubymodule_async_schedule, ( VALUE ) call, &state );
+    if ( state ) {
+        osync_trace ( TRACE_ERROR, "%s: %s", __func__, osync_rubymodule_error_bt() );
+        rb_set_errinfo ( Qnil );
+    }
+    /* The scheduler did not start the fiber: run it now, blocking */
+    if ( rubymodule_async_starting == async ) {
+        rubymodule_async_starting = NULL;
+        rubymodule_async_fiber ( Qnil, ( VALUE ) call, 0, NULL, Qnil );
+    }
+#endif
+}
+
+static void rubymodule_async_post ( struct rubymodule_async *async, rubymodule_call_func body, rubymodule_call_func dispose, void* owner, OSyncContext *ctx, void **args ) {
+    rubymodule_call_init ( &async->call, rubymodule_async_start, args, NULL );
+    async->call.queued = rubymodule_stats_clock();
+    async->body = body;
+    async->dispose = dispose;
+    async->owner = owner;
+    async->ctx = ctx;
+    rubymodule_dispatcher_post ( &ruby_dispatcher, &async->call );
+    rubymodule_async_notify();
+}
+
+/* Callbacks with a context have no caller to tell, posted or not: their failure goes to ctx */
+static void rubymodule_context_failed ( OSyncContext *ctx, OSyncError **error ) {
+    osync_context_report_osyncerror ( ctx, *error );
+}
+
+#ifdef RUBYMODULE_ASYNC
+static VALUE rubymodule_async_run_once ( VALUE scheduler ) {
+    return rb_funcall ( scheduler, rb_intern ( "run_once" ), 0 );
+}
+
+/* run_once waiting at most timeout seconds. args is [scheduler, timeout] */
+static VALUE rubymodule_async_run_once_within ( VALUE args ) {
+    return rb_funcall ( RARRAY_PTR ( args )[0], rb_intern ( "run_once" ), 1, RARRAY_PTR ( args )[1] );
+}
+
+/* Ruby calls close on the scheduler it replaces */
+static VALUE rubymodule_async_unset_scheduler ( VALUE unused ) {
+    return rb_fiber_scheduler_set ( Qnil );
+}
+#endif
+
+/* Runs the fibers that can go on, waiting for them or for a new call */
+static void rubymodule_async_poll() {
+#ifdef RUBYMODULE_ASYNC
+    VALUE scheduler = rb_fiber_scheduler_get();
+    int state = 0;
+
+    if ( NIL_P ( scheduler ) ) {
+        rubymodule_async_cancel_all ( "the Fiber scheduler was removed" );
+        return;
+    }
+    rb_protect ( rubymodule_async_run_once, scheduler, &state );
+    if ( state ) {
+        osync_trace ( TRACE_ERROR, "%s: %s", __func__, osync_rubymodule_error_bt() );
+        rb_set_errinfo ( Qnil );
+    }
+#endif
+}
+
+/*
+ * Called at finalize: lets the pending fibers run for up to
+ * RUBYMODULE_ASYNC_DRAIN_TIMEOUT seconds, then fails the ones left, so
+ * opensync does not wait for their contexts forever. The scheduler is
+ * removed afterwards and drops the fibers it still had, which are never
+ * resumed
+ */
+static void rubymodule_async_drain() {
+#ifdef RUBYMODULE_ASYNC
+    VALUE scheduler = rb_fiber_scheduler_get();
+    uint64_t deadline = rubymodule_stats_now() + RUBYMODULE_ASYNC_DRAIN_TIMEOUT * 1000000000ULL;
+    int state = 0;
+
+    while ( !NIL_P ( scheduler ) && __atomic_load_n ( &rubymodule_async_pending, __ATOMIC_SEQ_CST ) ) {
+        uint64_t now = rubymodule_stats_now();
+        VALUE args;
+
+        if ( now >= deadline )
+            break;
+        args = rb_ary_new3 ( 2, scheduler, rb_float_new ( ( deadline - now ) / 1e9 ) );
+        rb_protect ( rubymodule_async_run_once_within, args, &state );
+        if ( state ) {
+            osync_trace ( TRACE_ERROR, "%s: %s", __func__, osync_rubymodule_error_bt() );
+            rb_set_errinfo ( Qnil );
+            break;
+        }
+    }
+    if ( rubymodule_async_pending )
+        rubymodule_async_cancel_all ( "the ruby module was finalized" );
+    if ( !NIL_P ( scheduler ) ) {
+        rb_protect ( rubymodule_async_unset_scheduler, Qnil, &state );
+        if ( state ) {
+            osync_trace ( TRACE_ERROR, "%s: %s", __func__, osync_rubymodule_error_bt() );
+            rb_set_errinfo ( Qnil );
+        }
+    }
+#endif
+}
+
+/* Hands call to dispatcher and waits for it. Lanes wait outside the GVL */
+static void rubymodule_request ( struct rubymodule_dispatcher *dispatcher, struct rubymodule_call *call ) {
+    rubymodule_dispatcher_submit ( dispatcher, call );
+    if ( dispatcher == &ruby_dispatcher )
+        rubymodule_async_notify();
+    if ( rubymodule_lane_current() == RUBYMODULE_LANE_MAIN )
+        rubymodule_call_wait ( call );
+    else
+        rubymodule_lanes_wait ( call );
+    rubymodule_call_destroy ( call );
+}
+
+static osync_bool osync_rubymodule_zero_copy ( void* ptr ) {
+    struct rubymodule_owner *owner;
+    osync_bool zero_copy = FALSE;
+
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    owner = rubymodule_owner_get ( ptr, FALSE );
+    if ( owner != NULL )
+        zero_copy = owner->zero_copy;
+    pthread_mutex_unlock ( &rubymodule_data_lock );
+
+    return zero_copy;
+}
+
+/* Compares answered by rubymodule_compare_fast and passed on to ruby */
+static unsigned long rubymodule_compare_hits = 0;
+static unsigned long rubymodule_compare_misses = 0;
+
+/*
+ * Native pre-check of the compare callback of format, run in the caller
+ * thread. Returns TRUE if the data is byte identical (the same object, for
+ * any format that opted in). Otherwise, ruby has to decide.
+ */
+static osync_bool rubymodule_compare_fast ( void* format, const char *leftdata, unsigned int leftsize, const char *rightdata, unsigned int rightsize ) {
+    struct rubymodule_owner *owner;
+    osync_bool compare_fast = FALSE;
+
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    owner = rubymodule_owner_get ( format, FALSE );
+    if ( owner != NULL )
+        compare_fast = owner->compare_fast;
+    pthread_mutex_unlock ( &rubymodule_data_lock );
+    if ( !compare_fast )
+        return FALSE;
+
+    if ( leftsize == rightsize && ( leftdata == rightdata || !memcmp ( leftdata, rightdata, leftsize ) ) ) {
+        __atomic_add_fetch ( &rubymodule_compare_hits, 1, __ATOMIC_RELAXED );
+        return TRUE;
+    }
+    __atomic_add_fetch ( &rubymodule_compare_misses, 1, __ATOMIC_RELAXED );
+    return FALSE;
+}
+
+/*
+ * Data callbacks forwarded to opensync-ruby-host (see ruby_host.h), run in
+ * the caller thread. Each returns TRUE if the host handled the call, with its
+ * result or error set. FALSE means it runs in this process.
+ */
+static osync_bool rubymodule_remote_compare ( OSyncObjFormat *format, const char *leftdata, unsigned int leftsize, const char *rightdata, unsigned int rightsize, OSyncConvCmpResult *result, OSyncError **error ) {
+    struct rubymodule_host_request request = { RUBYMODULE_HOST_COMPARE, { osync_objformat_get_name ( format ) }, { leftdata, rightdata }, { leftsize, rightsize } };
+    int status = rubymodule_host_call ( &request, error );
+    if ( status < 0 )
+        return FALSE;
+    *result = status ? ( OSyncConvCmpResult ) request.value : ( OSyncConvCmpResult ) 0;
+    return TRUE;
+}
+
+static osync_bool rubymodule_remote_copy ( OSyncObjFormat *format, const char *input, unsigned int inputsize, char **output, unsigned int *outputsize, osync_bool *result, OSyncError **error ) {
+    struct rubymodule_host_request request = { RUBYMODULE_HOST_COPY, { osync_objformat_get_name ( format ) }, { input }, { inputsize } };
+    int status = rubymodule_host_call ( &request, error );
+    if ( status < 0 )
+        return FALSE;
+    *result = status;
+    if ( status ) {
+        *output = request.out;
+        *outputsize = request.outsize;
+    }
+    return TRUE;
+}
+
+static osync_bool rubymodule_remote_print ( OSyncObjFormat *format, const char *data, unsigned int size, char **result, OSyncError **error ) {
+    struct rubymodule_host_request request = { RUBYMODULE_HOST_PRINT, { osync_objformat_get_name ( format ) }, { data }, { size } };
+    int status = rubymodule_host_call ( &request, error );
+    if ( status < 0 )
+        return FALSE;
+    *result = status ? request.out : NULL;
+    return TRUE;
+}
+
+static osync_bool rubymodule_remote_revision ( OSyncObjFormat *format, const char *data, unsigned int size, time_t *result, OSyncError **error ) {
+    struct rubymodule_host_request request = { RUBYMODULE_HOST_REVISION, { osync_objformat_get_name ( format ) }, { data }, { size } };
+    int status = rubymodule_host_call ( &request, error );
+    if ( status < 0 )
+        return FALSE;
+    *result = status ? ( time_t ) request.value : 0;
+    return TRUE;
+}
+
+static osync_bool rubymodule_remote_convert ( OSyncFormatConverter *converter, char *input, unsigned int inputsize, char **output, unsigned int *outputsize, osync_bool *free_input, const char *config, osync_bool *result, OSyncError **error ) {
+    struct rubymodule_host_request request = { RUBYMODULE_HOST_CONVERT,
+        { osync_objformat_get_name ( osync_converter_get_sourceformat ( converter ) ), osync_objformat_get_name ( osync_converter_get_targetformat ( converter ) ) },
+        { input, config }, { inputsize, config ? strlen ( config ) + 1 : 0 } };
+    int status = rubymodule_host_call ( &request, error );
+    if ( status < 0 )
+        return FALSE;
+    *result = status;
+    if ( status ) {
+        *output = request.out;
+        *outputsize = request.outsize;
+        *free_input = request.value;
+    }
+    return TRUE;
+}
+
 static void osync_rubymodule_set_data ( void* ptr, char const *key, VALUE data ) {
-    GHashTable *ptr_data;
+    struct rubymodule_owner *owner;
 
     pthread_mutex_lock ( &rubymodule_data_lock );
 
-    ptr_data = ( GHashTable* ) g_hash_table_lookup ( rubymodule_data, ptr );
-    if ( ptr_data == NULL ) {
-        ptr_data = g_hash_table_new_full ( &g_str_hash, &g_str_equal, NULL, &unregister_and_free );
-        g_hash_table_insert ( rubymodule_data, ptr, ptr_data );
+    owner = rubymodule_owner_get ( ptr, TRUE );
+    if ( owner->data == NULL ) {
+        owner->data = g_hash_table_new_full ( &g_str_hash, &g_str_equal, &g_free, &rubymodule_store_release );
     }
 
     /* Free the value if present */
-    g_hash_table_remove ( ptr_data, key );
+    g_hash_table_remove ( owner->data, key );
 
     if ( data != Qnil ) {
-        //rb_gc_register_address ( &data );
-        VALUE *pdata = malloc(sizeof(VALUE));
-        *pdata = data;
-        g_hash_table_insert ( ptr_data, ( char* ) key, pdata );
-        rb_gc_register_address ( pdata );
+        g_hash_table_insert ( owner->data, g_strdup ( key ), HANDLE2PTR ( rubymodule_store_new ( data ) ) );
     }
 
     pthread_mutex_unlock ( &rubymodule_data_lock );
 }
 
 static VALUE osync_rubymodule_get_data ( void* ptr, char const *key ) {
-    GHashTable *ptr_data;
-    VALUE      *saved_data;
+    struct rubymodule_owner *owner;
+    unsigned int handle = 0;
 
-    ptr_data = ( GHashTable* ) g_hash_table_lookup ( rubymodule_data, ptr );
-    if ( ptr_data == NULL ) {
-        return Qnil;
+    pthread_mutex_lock ( &rubymodule_data_lock );
+    owner = rubymodule_owner_get ( ptr, FALSE );
+    if ( owner != NULL && owner->data != NULL ) {
+        handle = PTR2HANDLE ( g_hash_table_lookup ( owner->data, key ) );
     }
+    pthread_mutex_unlock ( &rubymodule_data_lock );
 
-    saved_data = ( VALUE* ) g_hash_table_lookup ( ptr_data, key );
-    if ( !saved_data ) {
-        return Qnil;
-    }
-    return *saved_data;
+    return rubymodule_store_get ( handle );
 }
 
 static void osync_rubymodule_clean_data ( void* ptr ) {
+    pthread_mutex_lock ( &rubymodule_data_lock );
     g_hash_table_remove ( rubymodule_data, ptr );
+    pthread_mutex_unlock ( &rubymodule_data_lock );
 }
 
 static VALUE rb_osync_rubymodule_get_data ( int argc, VALUE *argv, VALUE self ) {
@@ -273,6 +1052,32 @@ fail:
     return Qnil;
 }
 
+static VALUE rb_osync_rubymodule_set_gc_policy ( int argc, VALUE *argv, VALUE self ) {
+    if ( ( argc < 1 ) || ( argc > 1 ) ) {
+        rb_raise ( rb_eArgError, "wrong # of arguments(%d for 1)",argc );
+        SWIG_fail;
+    }
+    Check_Type ( argv[0], T_STRING );
+    if ( !rubymodule_gc_set_policy ( StringValueCStr ( argv[0] ) ) ) {
+        rb_raise ( rb_eArgError, "invalid GC policy '%s'. Use never, every:N, threshold:SIZE or boundary", StringValueCStr ( argv[0] ) );
+        SWIG_fail;
+    }
+    return Qnil;
+fail:
+    return Qnil;
+}
+
+static VALUE rb_osync_rubymodule_gc_stats ( int argc, VALUE *argv, VALUE self ) {
+    VALUE stats = rb_hash_new();
+    unsigned long count;
+    double time;
+    rubymodule_gc_stats ( &count, &time );
+    rb_hash_aset ( stats, ID2SYM ( rb_intern ( "policy" ) ), SWIG_FromCharPtr ( rubymodule_gc_policy_names[rubymodule_gc.policy] ) );
+    rb_hash_aset ( stats, ID2SYM ( rb_intern ( "forced" ) ), ULONG2NUM ( count ) );
+    rb_hash_aset ( stats, ID2SYM ( rb_intern ( "time" ) ), rb_float_new ( time ) );
+    return stats;
+}
+
 static VALUE rb_osync_rubymodule_clean_data ( int argc, VALUE *argv, VALUE self ) {
     void *ptr = 0;
     int res1 = 0 ;
@@ -291,6 +1096,129 @@ fail:
     return Qnil;
 }
 
+static VALUE rb_osync_rubymodule_set_zero_copy ( int argc, VALUE *argv, VALUE self ) {
+    void *ptr = 0;
+    int res1 = 0 ;
+
+    if ( ( argc < 2 ) || ( argc > 2 ) ) {
+        rb_raise ( rb_eArgError, "wrong # of arguments(%d for 2)",argc );
+        SWIG_fail;
+    }
+    res1 = SWIG_ConvertPtr ( argv[0], &ptr, 0 , 0 );
+    if ( !SWIG_IsOK ( res1 ) ) {
+        SWIG_exception_fail ( SWIG_ArgError ( res1 ), Ruby_Format_TypeError ( "", "void*", "osync_rubymodule_set_zero_copy", 1, argv[0] ) );
+    }
+    osync_rubymodule_set_zero_copy ( ptr, RBOOL ( argv[1] ) );
+    return Qnil;
+fail:
+    return Qnil;
+}
+
+static VALUE rb_osync_rubymodule_set_compare_fast ( int argc, VALUE *argv, VALUE self ) {
+    void *ptr = 0;
+    int res1 = 0 ;
+
+    if ( ( argc < 2 ) || ( argc > 2 ) ) {
+        rb_raise ( rb_eArgError, "wrong # of arguments(%d for 2)",argc );
+        SWIG_fail;
+    }
+    res1 = SWIG_ConvertPtr ( argv[0], &ptr, 0 , 0 );
+    if ( !SWIG_IsOK ( res1 ) ) {
+        SWIG_exception_fail ( SWIG_ArgError ( res1 ), Ruby_Format_TypeError ( "", "void*", "osync_rubymodule_set_compare_fast", 1, argv[0] ) );
+    }
+    osync_rubymodule_set_compare_fast ( ptr, RBOOL ( argv[1] ) );
+    return Qnil;
+fail:
+    return Qnil;
+}
+
+static VALUE rb_osync_rubymodule_compare_stats ( int argc, VALUE *argv, VALUE self ) {
+    VALUE stats = rb_hash_new();
+    rb_hash_aset ( stats, ID2SYM ( rb_intern ( "hits" ) ), ULONG2NUM ( __atomic_load_n ( &rubymodule_compare_hits, __ATOMIC_RELAXED ) ) );
+    rb_hash_aset ( stats, ID2SYM ( rb_intern ( "misses" ) ), ULONG2NUM ( __atomic_load_n ( &rubymodule_compare_misses, __ATOMIC_RELAXED ) ) );
+    return stats;
+}
+
+static VALUE rb_osync_rubymodule_set_async ( int argc, VALUE *argv, VALUE self ) {
+    void *ptr = 0;
+    int res1 = 0 ;
+
+    if ( ( argc < 2 ) || ( argc > 2 ) ) {
+        rb_raise ( rb_eArgError, "wrong # of arguments(%d for 2)",argc );
+        SWIG_fail;
+    }
+    res1 = SWIG_ConvertPtr ( argv[0], &ptr, 0 , 0 );
+    if ( !SWIG_IsOK ( res1 ) ) {
+        SWIG_exception_fail ( SWIG_ArgError ( res1 ), Ruby_Format_TypeError ( "", "void*", "osync_rubymodule_set_async", 1, argv[0] ) );
+    }
+#ifndef RUBYMODULE_ASYNC
+    if ( NUM2INT ( argv[1] ) > 0 ) {
+        rb_raise ( rb_eNotImpError, "async callbacks need ruby >= 3.0" );
+        SWIG_fail;
+    }
+#endif
+    osync_rubymodule_set_async ( ptr, NUM2INT ( argv[1] ) );
+    return Qnil;
+fail:
+    return Qnil;
+}
+
+/* Read end of the pipe that wakes up the Fiber scheduler for new calls */
+static VALUE rb_osync_rubymodule_async_wakeup_fd ( int argc, VALUE *argv, VALUE self ) {
+    if ( rubymodule_async_wakeup[0] < 0 ) {
+        if ( pipe ( rubymodule_async_wakeup ) < 0 )
+            rb_sys_fail ( "pipe" );
+        fcntl ( rubymodule_async_wakeup[0], F_SETFL, O_NONBLOCK );
+        fcntl ( rubymodule_async_wakeup[1], F_SETFL, O_NONBLOCK );
+        fcntl ( rubymodule_async_wakeup[0], F_SETFD, FD_CLOEXEC );
+        fcntl ( rubymodule_async_wakeup[1], F_SETFD, FD_CLOEXEC );
+    }
+    return INT2FIX ( rubymodule_async_wakeup[0] );
+}
+
+static VALUE rb_osync_rubymodule_set_lane ( int argc, VALUE *argv, VALUE self ) {
+    void *ptr = 0;
+    int res1 = 0 ;
+
+    if ( ( argc < 2 ) || ( argc > 2 ) ) {
+        rb_raise ( rb_eArgError, "wrong # of arguments(%d for 2)",argc );
+        SWIG_fail;
+    }
+    res1 = SWIG_ConvertPtr ( argv[0], &ptr, 0 , 0 );
+    if ( !SWIG_IsOK ( res1 ) ) {
+        SWIG_exception_fail ( SWIG_ArgError ( res1 ), Ruby_Format_TypeError ( "", "void*", "osync_rubymodule_set_lane", 1, argv[0] ) );
+    }
+    if ( rubymodule_lane_current() != RUBYMODULE_LANE_MAIN ) {
+        rb_raise ( rb_eRuntimeError, "objects are bound to lanes by the main Ractor" );
+        SWIG_fail;
+    }
+    if ( !osync_rubymodule_set_lane ( ptr, NUM2INT ( argv[1] ) ) ) {
+        rb_raise ( rb_eArgError, "callbacks of objects bound to a Ractor lane must be shareable (see Ractor.make_shareable)" );
+        SWIG_fail;
+    }
+    return Qnil;
+fail:
+    return Qnil;
+}
+
+/* C address of a SWIG pointer. Identifies the C object behind its SWIG wrappers */
+static VALUE rb_osync_rubymodule_address ( int argc, VALUE *argv, VALUE self ) {
+    void *ptr = 0;
+    int res1 = 0 ;
+
+    if ( ( argc < 1 ) || ( argc > 1 ) ) {
+        rb_raise ( rb_eArgError, "wrong # of arguments(%d for 1)",argc );
+        SWIG_fail;
+    }
+    res1 = SWIG_ConvertPtr ( argv[0], &ptr, 0 , 0 );
+    if ( !SWIG_IsOK ( res1 ) ) {
+        SWIG_exception_fail ( SWIG_ArgError ( res1 ), Ruby_Format_TypeError ( "", "void*", "osync_rubymodule_address", 1, argv[0] ) );
+    }
+    return ULL2NUM ( ( unsigned long long ) ( uintptr_t ) ptr );
+fail:
+    return Qnil;
+}
+
 /*
 static void free_plugin_data ( VALUE *data ) {
     // I guess gc will free this data
@@ -298,8 +1226,37 @@ static void free_plugin_data ( VALUE *data ) {
     free(data);
 }*/
 
+/* filename from OPENSYNC_RUBY_LIBDIR when set (uninstalled runs, like the
+ * bench suite) or from the installed ruby directory */
+static VALUE rb_require_libfile(const char *filename) {
+    const char *dir = getenv("OPENSYNC_RUBY_LIBDIR");
+    char path[PATH_MAX];
+
+    if ( !dir || !*dir )
+        return rb_require(filename);
+    snprintf ( path, sizeof(path), "%s/%s", dir, strrchr(filename, '/') + 1 );
+    return rb_require(path);
+}
+
+static VALUE rb_load_iseq_cache(VALUE filename) {
+    return rb_require_libfile(RUBY_ISEQ_FILE);
+}
+
 VALUE rb_load_basefile(const char *filename) {
-    return rb_require(RUBY_BASE_FILE);
+    static int iseq_cache_loaded = 0;
+    int state = 0;
+
+    /* Files required from now on are cached compiled. Optional: a missing or
+     * broken cache only costs the compilation */
+    if ( !iseq_cache_loaded ) {
+        iseq_cache_loaded = 1;
+        rb_protect ( rb_load_iseq_cache, Qnil, &state );
+        if ( state ) {
+            osync_trace ( TRACE_INTERNAL, "compiled code cache not loaded" );
+            rb_set_errinfo ( Qnil );
+        }
+    }
+    return rb_require_libfile(RUBY_BASE_FILE);
 }
 
 VALUE rb_load_metaclass(const char *classpath) {
@@ -307,19 +1264,42 @@ VALUE rb_load_metaclass(const char *classpath) {
     return rb_path2class(classpath);
 }
 
+/* Time from the ruby thread launch to the end of the first get_*_info */
+static struct timeval rubymodule_launch_time;
+static double rubymodule_startup = -1;
+
+static void rubymodule_startup_done(const char *what) {
+    struct timeval now;
+    if (rubymodule_startup >= 0)
+        return;
+    gettimeofday ( &now, NULL );
+    rubymodule_startup = ( now.tv_sec - rubymodule_launch_time.tv_sec ) + ( now.tv_usec - rubymodule_launch_time.tv_usec ) / 1e6;
+    osync_trace ( TRACE_INTERNAL, "ruby startup: %.3fs from thread launch to the first %s", rubymodule_startup, what );
+}
+
+double rubymodule_startup_time() {
+    return rubymodule_startup;
+}
+
 VALUE rb_get_sync_info(VALUE plugin_env) {
     VALUE meta_class = rb_load_metaclass(RUBY_PLUGIN_CLASS);
-    return rb_funcall(meta_class,rb_intern("get_sync_info"), 1, plugin_env);
+    VALUE result = rb_funcall(meta_class,id_get_sync_info, 1, plugin_env);
+    rubymodule_startup_done ( "get_sync_info" );
+    return result;
 }
 
 VALUE rb_get_conversion_info(VALUE format_env) {
     VALUE meta_class = rb_load_metaclass(RUBY_FORMAT_CLASS);
-    return rb_funcall(meta_class,rb_intern("get_conversion_info"), 1, format_env);
+    VALUE result = rb_funcall(meta_class,id_get_conversion_info, 1, format_env);
+    rubymodule_startup_done ( "get_conversion_info" );
+    return result;
 }
 
 VALUE rb_get_format_info(VALUE format_env) {
     VALUE meta_class = rb_load_metaclass(RUBY_FORMAT_CLASS);
-    return rb_funcall(meta_class,rb_intern("get_format_info"), 1, format_env);
+    VALUE result = rb_funcall(meta_class,id_get_format_info, 1, format_env);
+    rubymodule_startup_done ( "get_format_info" );
+    return result;
 }
 
 // Include generated code for callbacks and rubycalls
@@ -327,11 +1307,24 @@ VALUE rb_get_format_info(VALUE format_env) {
 
 /** Plugin */
 
+/* User data of the ruby initialize callback of format, or NULL if it has
+ * none. For opensync-ruby-host, that has no engine to call it */
+void* rubymodule_objformat_userdata ( OSyncObjFormat *format, OSyncError **error ) {
+    if ( osync_rubymodule_get_callback ( format, RUBYMODULE_CB_OBJFORMAT_INITIALIZE ) == Qnil )
+        return NULL;
+    return osync_rubymodule_objformat_initialize ( format, error );
+}
+
+void* rubymodule_converter_userdata ( OSyncFormatConverter *converter, const char *config, OSyncError **error ) {
+    if ( osync_rubymodule_get_callback ( converter, RUBYMODULE_CB_CONVERTER_INITIALIZE ) == Qnil )
+        return NULL;
+    return osync_rubymodule_converter_initialize ( converter, config, error );
+}
+
 VALUE rb_osync_plugin_set_data ( int argc, VALUE *argv, VALUE self ) {
     OSyncPlugin *arg1 = ( OSyncPlugin * ) 0 ;
     void *argp1 = 0 ;
     int res1 = 0 ;
-    VALUE *data = 0 ;
 
     if ( ( argc < 2 ) || ( argc > 2 ) ) {
         rb_raise ( rb_eArgError, "wrong # of arguments(%d for 2)",argc );
@@ -343,18 +1336,8 @@ VALUE rb_osync_plugin_set_data ( int argc, VALUE *argv, VALUE self ) {
     }
     arg1 = ( OSyncPlugin * ) ( argp1 );
 
-    data = ( VALUE* ) osync_plugin_get_data ( arg1 );
-    if ( data ) {
-        rb_gc_unregister_address ( data );
-	free(data);
-    }
-    data = NULL;
-    if (argv[1]!=Qnil) {
-	data = malloc(sizeof(VALUE));
-	*data = argv[1];
-	rb_gc_register_address ( data );
-    }
-    osync_plugin_set_data ( arg1, data );
+    rubymodule_store_free ( PTR2HANDLE ( osync_plugin_get_data ( arg1 ) ) );
+    osync_plugin_set_data ( arg1, HANDLE2PTR ( rubymodule_store_new ( argv[1] ) ) );
     return Qnil;
 fail:
     return Qnil;
@@ -365,7 +1348,6 @@ VALUE rb_osync_objtype_sink_get_userdata ( int argc, VALUE *argv, VALUE self ) {
     OSyncObjTypeSink *arg1 = ( OSyncObjTypeSink * ) 0 ;
     void *argp1 = 0 ;
     int res1 = 0 ;
-    VALUE *vresult = NULL;
 
     if ( ( argc < 1 ) || ( argc > 1 ) ) {
         rb_raise ( rb_eArgError, "wrong # of arguments(%d for 1)",argc );
@@ -376,11 +1358,7 @@ VALUE rb_osync_objtype_sink_get_userdata ( int argc, VALUE *argv, VALUE self ) {
         SWIG_exception_fail ( SWIG_ArgError ( res1 ), Ruby_Format_TypeError ( "", "OSyncObjTypeSink *","osync_objtype_sink_get_data", 1, argv[0] ) );
     }
     arg1 = ( OSyncObjTypeSink * ) ( argp1 );
-    vresult = osync_objtype_sink_get_userdata ( arg1 );
-
-    if ( vresult )
-        return *vresult;
-    return Qnil;
+    return PTR_VALUE ( osync_objtype_sink_get_userdata ( arg1 ) );
 fail:
     return Qnil;
 }
@@ -389,7 +1367,6 @@ VALUE rb_osync_objtype_sink_set_userdata ( int argc, VALUE *argv, VALUE self ) {
     OSyncObjTypeSink *arg1 = ( OSyncObjTypeSink * ) 0 ;
     void *argp1 = 0 ;
     int res1 = 0 ;
-    VALUE *data;
 
     if ( ( argc < 2 ) || ( argc > 2 ) ) {
         rb_raise ( rb_eArgError, "wrong # of arguments(%d for 2)",argc );
@@ -400,19 +1377,172 @@ VALUE rb_osync_objtype_sink_set_userdata ( int argc, VALUE *argv, VALUE self ) {
         SWIG_exception_fail ( SWIG_ArgError ( res1 ), Ruby_Format_TypeError ( "", "OSyncObjTypeSink *","osync_objtype_sink_set_data", 1, argv[0] ) );
     }
     arg1 = ( OSyncObjTypeSink * ) ( argp1 );
-    data = osync_objtype_sink_get_userdata ( arg1 );
-    if ( data ) {
-        rb_gc_unregister_address ( data );
-	free(data);
-    }
-    data = NULL;
-    if (argv[1]!=Qnil) {
-	data = malloc(sizeof(VALUE));
-	*data = argv[1];
-	rb_gc_register_address ( data );
-    }
-    osync_objtype_sink_set_userdata ( arg1, data);
+    rubymodule_store_free ( PTR2HANDLE ( osync_objtype_sink_get_userdata ( arg1 ) ) );
+    osync_objtype_sink_set_userdata ( arg1, HANDLE2PTR ( rubymodule_store_new ( argv[1] ) ) );
+    return Qnil;
+fail:
+    return Qnil;
+}
+
+/* Also used by the osync_data_new and osync_data_set_data wrappers */
+osync_bool rubymodule_objformat_unmaps ( OSyncObjFormat *format ) {
+    return format && osync_rubymodule_get_callback ( format, RUBYMODULE_CB_OBJFORMAT_DESTROY ) != Qnil;
+}
+
+/** Batched changes */
+
+/*
+ * Reports a list of changes with a single call from ruby.
+ * Each entry is an Array [uid, changetype, hash, data], where hash might be nil
+ * and data is a String, an Opensync::Buffer or nil (no data, like deleted).
+ * Owned buffers are handed over without a copy, mapped ones only if format
+ * has a destroy callback to unmap them (see ruby_buffer.h).
+ * All changes get format and objtype.
+ * Returns the number of reported changes.
+ */
+static VALUE rb_osync_rubymodule_context_report_changes ( int argc, VALUE *argv, VALUE self ) {
+    OSyncContext *ctx;
+    OSyncObjFormat *format;
+    const char *objtype;
+    void *argp = 0;
+    int res = 0;
+    long i;
+
+    if ( ( argc < 4 ) || ( argc > 4 ) ) {
+        rb_raise ( rb_eArgError, "wrong # of arguments(%d for 4)",argc );
+        SWIG_fail;
+    }
+    res = SWIG_ConvertPtr ( argv[0], &argp, SWIGTYPE_p_OSyncContext, 0 );
+    if ( !SWIG_IsOK ( res ) ) {
+        SWIG_exception_fail ( SWIG_ArgError ( res ), Ruby_Format_TypeError ( "", "OSyncContext *", "osync_rubymodule_context_report_changes", 1, argv[0] ) );
+    }
+    ctx = ( OSyncContext * ) argp;
+    Check_Type ( argv[1], T_ARRAY );
+    res = SWIG_ConvertPtr ( argv[2], &argp, SWIGTYPE_p_OSyncObjFormat, 0 );
+    if ( !SWIG_IsOK ( res ) ) {
+        SWIG_exception_fail ( SWIG_ArgError ( res ), Ruby_Format_TypeError ( "", "OSyncObjFormat *", "osync_rubymodule_context_report_changes", 3, argv[2] ) );
+    }
+    format = ( OSyncObjFormat * ) argp;
+    objtype = StringValueCStr ( argv[3] );
+
+    for ( i = 0; i < RARRAY_LEN ( argv[1] ); i++ ) {
+        VALUE entry = rb_ary_entry ( argv[1], i );
+        VALUE uid, hash, data, message;
+        const char *uid_str, *hash_str = NULL;
+        OSyncError *error = NULL;
+        OSyncChange *change;
+        OSyncData *odata;
+        char *buffer = NULL;
+        unsigned int size = 0;
+
+        if ( !IS_ARRAY ( entry ) || RARRAY_LEN ( entry ) != 4 )
+            rb_raise ( rb_eArgError, "change %ld should be an Array with [uid, changetype, hash, data]", i );
+        uid  = rb_ary_entry ( entry, 0 );
+        hash = rb_ary_entry ( entry, 2 );
+        data = rb_ary_entry ( entry, 3 );
+        if ( !IS_STRING ( uid ) || !IS_FIXNUM ( rb_ary_entry ( entry, 1 ) ) ||
+                !( NIL_P ( hash ) || IS_STRING ( hash ) ) || !( NIL_P ( data ) || IS_BYTES ( data ) ) )
+            rb_raise ( rb_eTypeError, "change %ld should be [uid:string, changetype:fixnum, hash:string/nil, data:string/buffer/nil]", i );
+        /* Anything that raises comes before the change and its data exist */
+        uid_str = StringValueCStr ( uid );
+        if ( !NIL_P ( hash ) )
+            hash_str = StringValueCStr ( hash );
+
+        if ( rubymodule_buffer_mapped_p ( data ) && !rubymodule_objformat_unmaps ( format ) )
+            data = rubymodule_buffer_copy ( data );
+        if ( !NIL_P ( data ) )
+            buffer = rubymodule_buffer_take ( data, &size );
+
+        if ( ! ( change = osync_change_new ( &error ) ) ) {
+            rubymodule_buffer_release ( buffer );
+            goto error;
+        }
+        if ( ! ( odata = osync_data_new ( buffer, size, format, &error ) ) ) {
+            rubymodule_buffer_release ( buffer );
+            osync_change_unref ( change );
+            goto error;
+        }
+        osync_data_set_objtype ( odata, objtype );
+        osync_change_set_uid ( change, uid_str );
+        if ( hash_str )
+            osync_change_set_hash ( change, hash_str );
+        osync_change_set_changetype ( change, FIX2INT ( rb_ary_entry ( entry, 1 ) ) );
+        osync_change_set_data ( change, odata );
+        osync_data_unref ( odata );
+
+        osync_context_report_change ( ctx, change );
+        osync_change_unref ( change );
+        continue;
+error:
+        message = rb_str_new2 ( osync_error_print ( &error ) );
+        osync_error_unref ( &error );
+        rb_exc_raise ( rb_exc_new3 ( rb_eStandardError, message ) );
+    }
+    return LONG2NUM ( i );
+fail:
     return Qnil;
+}
+
+/*
+ * Classifies uids against the hashtable and updates it, with a single call from
+ * ruby. A nil hash means the entry is gone (deleted).
+ * Returns an Array with the changetype of each uid.
+ */
+static VALUE rb_osync_rubymodule_hashtable_classify_and_update ( int argc, VALUE *argv, VALUE self ) {
+    OSyncHashTable *hashtable;
+    void *argp = 0;
+    int res = 0;
+    long i;
+    VALUE types;
+
+    if ( ( argc < 3 ) || ( argc > 3 ) ) {
+        rb_raise ( rb_eArgError, "wrong # of arguments(%d for 3)",argc );
+        SWIG_fail;
+    }
+    res = SWIG_ConvertPtr ( argv[0], &argp, SWIGTYPE_p_OSyncHashTable, 0 );
+    if ( !SWIG_IsOK ( res ) ) {
+        SWIG_exception_fail ( SWIG_ArgError ( res ), Ruby_Format_TypeError ( "", "OSyncHashTable *", "osync_rubymodule_hashtable_classify_and_update", 1, argv[0] ) );
+    }
+    hashtable = ( OSyncHashTable * ) argp;
+    Check_Type ( argv[1], T_ARRAY );
+    Check_Type ( argv[2], T_ARRAY );
+    if ( RARRAY_LEN ( argv[1] ) != RARRAY_LEN ( argv[2] ) )
+        rb_raise ( rb_eArgError, "uids and hashes must have the same size" );
+
+    types = rb_ary_new2 ( RARRAY_LEN ( argv[1] ) );
+    for ( i = 0; i < RARRAY_LEN ( argv[1] ); i++ ) {
+        VALUE uid  = rb_ary_entry ( argv[1], i );
+        VALUE hash = rb_ary_entry ( argv[2], i );
+        const char *uid_str, *hash_str = NULL;
+        OSyncError *error = NULL;
+        OSyncChange *change;
+        OSyncChangeType type;
+        VALUE message;
+
+        if ( !IS_STRING ( uid ) || !( NIL_P ( hash ) || IS_STRING ( hash ) ) )
+            rb_raise ( rb_eTypeError, "entry %ld should be uid:string and hash:string/nil", i );
+        uid_str = StringValueCStr ( uid );
+        if ( !NIL_P ( hash ) )
+            hash_str = StringValueCStr ( hash );
+
+        if ( ! ( change = osync_change_new ( &error ) ) ) {
+            message = rb_str_new2 ( osync_error_print ( &error ) );
+            osync_error_unref ( &error );
+            rb_exc_raise ( rb_exc_new3 ( rb_eStandardError, message ) );
+        }
+        osync_change_set_uid ( change, uid_str );
+        if ( !hash_str ) {
+            type = OSYNC_CHANGE_TYPE_DELETED;
+        } else {
+            osync_change_set_hash ( change, hash_str );
+            type = osync_hashtable_get_changetype ( hashtable, change );
+        }
+        osync_change_set_changetype ( change, type );
+        osync_hashtable_update_change ( hashtable, change );
+        osync_change_unref ( change );
+        rb_ary_push ( types, INT2FIX ( type ) );
+    }
+    return types;
 fail:
     return Qnil;
 }
@@ -483,7 +1613,7 @@ VALUE rb_osync_converter_new(int argc, VALUE *argv, VALUE self) {
     arg5 = (OSyncError **)(argp5);
   }
   result = (OSyncFormatConverter *)osync_converter_new(arg1,arg2,arg3,osync_rubymodule_converter_convert,arg5);
-  osync_rubymodule_set_data (result, "convert_func", argv[3] );
+  osync_rubymodule_set_callback (result, RUBYMODULE_CB_CONVERTER_CONVERT, argv[3] );
   vresult = SWIG_NewPointerObj(SWIG_as_voidptr(result), SWIGTYPE_p_OSyncFormatConverter, 0 |  0 );
   {
     if (error5) {
@@ -510,64 +1640,214 @@ fail:
   return Qnil;
 }
 
+#if RUBY_API_VERSION_MAJOR >= 2 && defined(RUBY_INTERNAL_EVENT_GC_ENTER)
+/* Times ruby GC for the metrics of the callback running in this thread */
+static VALUE rubymodule_gc_hook = Qnil;
+
+static void rubymodule_gc_event ( VALUE tpval, void *data ) {
+    if ( rb_tracearg_event_flag ( rb_tracearg_from_tracepoint ( tpval ) ) == RUBY_INTERNAL_EVENT_GC_ENTER )
+        rubymodule_stats_gc_enter();
+    else
+        rubymodule_stats_gc_exit();
+}
+#endif
+
+/* Takes times from now on. GC is only traced from here: the hook is not free */
+static void rubymodule_stats_start() {
+    rubymodule_stats_timing ( TRUE );
+#if RUBY_API_VERSION_MAJOR >= 2 && defined(RUBY_INTERNAL_EVENT_GC_ENTER)
+    if ( NIL_P ( rubymodule_gc_hook ) ) {
+        rubymodule_gc_hook = rb_tracepoint_new ( 0, RUBY_INTERNAL_EVENT_GC_ENTER | RUBY_INTERNAL_EVENT_GC_EXIT, rubymodule_gc_event, NULL );
+        rb_gc_register_address ( &rubymodule_gc_hook );
+        rb_tracepoint_enable ( rubymodule_gc_hook );
+        rubymodule_stats_gc_traced ( TRUE );
+    }
+#endif
+}
+
+/* Callback metrics of this process, as JSON (see ruby_stats.h). Times are
+ * taken from the first read on */
+static VALUE rb_osync_rubymodule_stats ( int argc, VALUE *argv, VALUE self ) {
+    char *json = rubymodule_stats_json();
+    VALUE result = rb_str_new_cstr ( json );
+    free ( json );
+    rubymodule_stats_start();
+    return result;
+}
+
 /**
  * @brief This register ruby module and methods and initialize internal local data structure
  */
 void rubymodule_initialize() {
+    // Method names used on each callback
+    id_call = rb_intern ( "call" );
+    id_to_i = rb_intern ( "to_i" );
+    id_get_sync_info = rb_intern ( "get_sync_info" );
+    id_get_format_info = rb_intern ( "get_format_info" );
+    id_get_conversion_info = rb_intern ( "get_conversion_info" );
+#ifdef RUBYMODULE_RACTORS
+    // Lane callbacks use the procedural API: SWIG wrappers and the native
+    // helpers below, which keep their state in the receiver. The SWIG runtime
+    // state (type table, TYPE_p_* classes) is set up by Init_opensync and only
+    // read later: opensync.i tracks no objects and its types have no casts for
+    // SWIG_TypeCheck to reorder. tests/check_lanes calls the wrappers from two
+    // lanes at once. The methods that change rubymodule data (callbacks, user
+    // data, lanes) stay in the main Ractor
+    rb_ext_ractor_safe ( true );
+#endif
     // Initialize SWIG methods
     Init_opensync();
+    // Opensync::Buffer, used for zero copy callback data
+    rubymodule_buffer_init ( mOpensync );
+    rubymodule_list_init ( mOpensync );
+    // Opensync::PackedRecord, file records read in place by format callbacks
+    rubymodule_packed_init ( mOpensync );
+    // Opensync::FS.scan, the native directory scanner
+    rubymodule_fs_init ( mOpensync );
+    // Opensync::FS.digest and Opensync::DigestCache, content hashes of files
+    rubymodule_digest_init ( mOpensync );
+#ifdef RUBYMODULE_RACTORS
+    rb_ext_ractor_safe ( false );
+#endif
     // Initialize callbacks methods
     Init_rubymodule_callbacks();
     // Expose some internal methods to ruby world
     rb_define_module_function ( mOpensync, "osync_rubymodule_get_data", rb_osync_rubymodule_get_data, -1 );
     rb_define_module_function ( mOpensync, "osync_rubymodule_set_data", rb_osync_rubymodule_set_data, -1 );
     rb_define_module_function ( mOpensync, "osync_rubymodule_clean_data", rb_osync_rubymodule_clean_data, -1 );
+    rb_define_module_function ( mOpensync, "osync_rubymodule_set_gc_policy", rb_osync_rubymodule_set_gc_policy, -1 );
+    rb_define_module_function ( mOpensync, "osync_rubymodule_gc_stats", rb_osync_rubymodule_gc_stats, -1 );
+    rb_define_module_function ( mOpensync, "osync_rubymodule_set_zero_copy", rb_osync_rubymodule_set_zero_copy, -1 );
+    rb_define_module_function ( mOpensync, "osync_rubymodule_set_compare_fast", rb_osync_rubymodule_set_compare_fast, -1 );
+    rb_define_module_function ( mOpensync, "osync_rubymodule_compare_stats", rb_osync_rubymodule_compare_stats, -1 );
+    rb_define_module_function ( mOpensync, "osync_rubymodule_set_async", rb_osync_rubymodule_set_async, -1 );
+    rb_define_module_function ( mOpensync, "osync_rubymodule_async_wakeup_fd", rb_osync_rubymodule_async_wakeup_fd, -1 );
+    rb_define_module_function ( mOpensync, "osync_rubymodule_context_report_changes", rb_osync_rubymodule_context_report_changes, -1 );
+    rb_define_module_function ( mOpensync, "osync_rubymodule_hashtable_classify_and_update", rb_osync_rubymodule_hashtable_classify_and_update, -1 );
+    rb_define_module_function ( mOpensync, "osync_rubymodule_address", rb_osync_rubymodule_address, -1 );
+    rb_define_module_function ( mOpensync, "osync_rubymodule_stats", rb_osync_rubymodule_stats, -1 );
+    // Ractor lanes
+    rb_define_module_function ( mOpensync, "osync_rubymodule_set_lane", rb_osync_rubymodule_set_lane, -1 );
+    rb_define_const ( mOpensync, "RUBYMODULE_LANE_MAIN", INT2FIX ( RUBYMODULE_LANE_MAIN ) );
+    rb_define_const ( mOpensync, "RUBYMODULE_LANE_POOL", INT2FIX ( RUBYMODULE_LANE_POOL ) );
+    rubymodule_lanes_init ( mOpensync );
+    // User data kept in rubymodule store
+    rb_define_module_function ( mOpensync, "osync_plugin_set_data", rb_osync_plugin_set_data, -1 );
+    rb_define_module_function ( mOpensync, "osync_objtype_sink_get_userdata", rb_osync_objtype_sink_get_userdata, -1 );
+    rb_define_module_function ( mOpensync, "osync_objtype_sink_set_userdata", rb_osync_objtype_sink_set_userdata, -1 );
     // Converter new/set_callback implementation
     rb_define_module_function ( mOpensync, "osync_converter_new", rb_osync_converter_new, -1 );
     // Some constants exposed to RUBY
     rb_define_const(mOpensync, "OPENSYNC_RUBY_PLUGINDIR", SWIG_FromCharPtr (OPENSYNC_RUBY_PLUGINDIR));
     rb_define_const(mOpensync, "OPENSYNC_RUBY_FORMATSDIR", SWIG_FromCharPtr (OPENSYNC_RUBY_FORMATSDIR));
     rb_define_const(mOpensync, "OPENSYNC_RUBYLIB_DIR", SWIG_FromCharPtr (OPENSYNC_RUBYLIB_DIR));
+    rb_define_const(mOpensync, "OPENSYNC_RUBY_JOURNAL_BINARY", SWIG_FromCharPtr (OPENSYNC_RUBY_JOURNAL_BINARY));
+    // GC policy from environment. Ruby code might change it later
+    if ( getenv ( "OPENSYNC_RUBY_GC" ) && !rubymodule_gc_set_policy ( getenv ( "OPENSYNC_RUBY_GC" ) ) )
+        fprintf ( stderr, "Ignoring invalid OPENSYNC_RUBY_GC='%s'\n", getenv ( "OPENSYNC_RUBY_GC" ) );
+    // Callback metrics. With OPENSYNC_RUBY_STATS (a path or -), dumped at finalize,
+    // and on SIGUSR2 too with OPENSYNC_RUBY_STATS_SIGNAL set
+    rubymodule_stats_init ( RUBYMODULE_KIND_COUNT, rubymodule_kind_names );
+    if ( getenv ( "OPENSYNC_RUBY_STATS" ) ) {
+        rubymodule_stats_start();
+        if ( getenv ( "OPENSYNC_RUBY_STATS_SIGNAL" ) && !rubymodule_stats_dump_on ( SIGUSR2, getenv ( "OPENSYNC_RUBY_STATS" ) ) )
+            fprintf ( stderr, "Not dumping ruby callback stats on SIGUSR2: it has a handler already\n" );
+    }
+    // Root of all ruby values kept by C code
+    rubymodule_store_init();
     // Initialize hash that maps objects to its properties (which include callbacks blocks)
-    rubymodule_data = g_hash_table_new_full ( g_direct_hash, g_direct_equal, NULL, ( GDestroyNotify ) g_hash_table_destroy );
+    rubymodule_data = g_hash_table_new_full ( g_direct_hash, g_direct_equal, NULL, rubymodule_owner_free );
 }
 
 void rubymodule_finalize() {
+    RUBY_PROLOGUE
+    rubymodule_lanes_stop ( &ruby_dispatcher );
+    rubymodule_async_drain();
+    RUBY_EPILOGUE
+    if ( getenv ( "OPENSYNC_RUBY_STATS" ) && !rubymodule_stats_dump ( getenv ( "OPENSYNC_RUBY_STATS" ) ) )
+        fprintf ( stderr, "Could not write ruby callback stats to %s\n", getenv ( "OPENSYNC_RUBY_STATS" ) );
     g_hash_table_destroy ( rubymodule_data );
+    rubymodule_store_destroy();
     RUBY_PROLOGUE
     ruby_finalize();
     RUBY_EPILOGUE
 }
 
+static VALUE rubymodule_check_ints_protected ( VALUE unused ) {
+    rb_thread_check_ints();
+    return Qnil;
+}
+
+/* Handles what interrupted an idle wait. Exceptions (Thread#raise, signals) must not end the ruby thread */
+static void rubymodule_check_ints() {
+    int state = 0;
+
+    rb_protect ( rubymodule_check_ints_protected, Qnil, &state );
+    if ( state ) {
+        osync_trace ( TRACE_ERROR, "%s: %s", __func__, osync_rubymodule_error_bt() );
+        rb_set_errinfo ( Qnil );
+    }
+}
+
 osync_bool is_running_in_rubythread() {
   return ruby_thread == pthread_self();
 }
 
 void *rubymodule_ruby_thread(void *threadid) {
     debug_thread("Thread launched!\n");
+    gettimeofday ( &rubymodule_launch_time, NULL );
     pthread_mutex_lock ( &ruby_context_lock);
     int page = sysconf(_SC_PAGE_SIZE);
     mprotect((void *)((unsigned long)&STACK_END_ADDRESS & ~(page-1)), page, PROT_READ | PROT_WRITE | PROT_EXEC);
     RUBY_PROLOGUE
     RUBY_INIT_STACK;
     ruby_init();
+#if RUBY_API_VERSION_MAJOR >= 3
+    {
+        /* ruby_init alone does not load the builtin ruby code (Integer#times, Ractor...) */
+        static char *options[] = { RUBY_SCRIPTNAME, "-e", "" };
+        ruby_options ( 3, options );
+    }
+#else
     ruby_init_loadpath();
+#endif
     ruby_script ( RUBY_SCRIPTNAME );
     rubymodule_initialize();
     RUBY_EPILOGUE
     debug_thread("Accepting commands!\n");
     ruby_running=TRUE;
     ruby_thread = pthread_self();
-    pthread_cond_broadcast(&fcall_ruby_running);
     while (ruby_running) {
+       struct rubymodule_call *call;
        debug_thread("Waiting a command!\n");
-       pthread_cond_wait(&fcall_requested, &ruby_context_lock);
+       /* Fibers of async callbacks are waiting: the scheduler waits for them and for new calls */
+       if (__atomic_load_n(&rubymodule_async_pending, __ATOMIC_SEQ_CST)) {
+           call = rubymodule_dispatcher_try_next(&ruby_dispatcher);
+           if (!call) {
+               RUBY_PROLOGUE
+               rubymodule_async_poll();
+               RUBY_EPILOGUE
+               continue;
+           }
+       /*
+        * Idle: waits without the GVL, so ruby threads started by plugins run
+        * between callbacks (and other Ractors can stop this one for GC). A
+        * busy ruby thread might delay the next call up to a ruby time slice
+        */
+       } else {
+           RUBY_PROLOGUE
+           call = rubymodule_lanes_next(&ruby_dispatcher);
+           if (!call)
+               rubymodule_check_ints();
+           RUBY_EPILOGUE
+           if (!call)
+               continue;
+       }
        debug_thread("Got command! Executing\n");
        RUBY_PROLOGUE
-       funcall_data.func();
+       rubymodule_call_run(call);
        RUBY_EPILOGUE
        debug_thread("Returning!\n");
-       pthread_cond_signal(&fcall_returned);
     }
     rubymodule_finalize();
     pthread_mutex_unlock ( &ruby_context_lock);
@@ -583,6 +1863,8 @@ void rubymodule_ruby_needed() {
        pthread_attr_t attr;
        pthread_attr_init(&attr);
        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+       /* Calls can be queued even before the ruby thread is running */
+       rubymodule_dispatcher_init(&ruby_dispatcher);
        //pthread_attr_setstacksize (&attr, 100*1000*1000);
        rc = pthread_create(&ruby_thread, NULL, rubymodule_ruby_thread, NULL);
        if (rc){
@@ -40,6 +40,8 @@
 
 #define RUBY_SCRIPTNAME   "ruby-module"
 #define RUBY_BASE_FILE 	  OPENSYNC_RUBYLIB_DIR "/" "opensync.rb"
+/* Compiled code cache, required before RUBY_BASE_FILE */
+#define RUBY_ISEQ_FILE 	  OPENSYNC_RUBYLIB_DIR "/" "opensync_iseq.rb"
 // #define RUBY_BASE_FILE 	  "~/prog/opensync/binary-meta/sources/ruby-module/src/opensync.rb"
 #define RUBY_PLUGIN_CLASS "Opensync::MetaPlugin"
 #define RUBY_FORMAT_CLASS "Opensync::MetaFormat"
@@ -47,6 +49,14 @@
 osync_bool rubymodule_get_sync_info(OSyncPluginEnv* env, OSyncError** error) ;
 osync_bool rubymodule_get_format_info(OSyncFormatEnv* env, OSyncError** error);
 osync_bool rubymodule_get_conversion_info(OSyncFormatEnv* env, OSyncError** error);
+/* Seconds from the ruby thread launch to the end of the first get_*_info, or -1 */
+double rubymodule_startup_time();
+/* Results of the ruby initialize callbacks, for opensync-ruby-host */
+void* rubymodule_objformat_userdata(OSyncObjFormat* format, OSyncError** error);
+void* rubymodule_converter_userdata(OSyncFormatConverter* converter, const char* config, OSyncError** error);
+/* Whether data of format is released by its ruby destroy callback, the only
+ * one that unmaps mapped payloads (see ruby_buffer.h) */
+osync_bool rubymodule_objformat_unmaps(OSyncObjFormat* format);
 
 
 #endif //_RUBY_PLUGIN_H
@@ -0,0 +1,340 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#include "ruby_packed.h"
+#include "ruby_buffer.h"
+
+#include <ruby/encoding.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A view over a packed String or Opensync::Buffer. Nothing is copied: every
+ * accessor reads the source bytes, so a released Buffer raises as usual */
+struct rubymodule_packed {
+    VALUE source;
+};
+
+/* A record as seen by one accessor call */
+struct rubymodule_packed_view {
+    const char *ptr;
+    struct rubymodule_packed_header header;
+};
+
+static VALUE cPackedRecord = Qnil;
+
+int rubymodule_packed_header(const char *ptr, long len, struct rubymodule_packed_header *header) {
+    if (!ptr || len < (long) sizeof(struct rubymodule_packed_header))
+        return 0;
+    memcpy(header, ptr, sizeof(struct rubymodule_packed_header));
+    if (memcmp(header->magic, RUBYMODULE_PACKED_MAGIC, sizeof(header->magic)))
+        return 0;
+    if (header->path_offset < sizeof(struct rubymodule_packed_header)
+            || (uint64_t) header->path_offset + header->path_length > (uint64_t) len)
+        return 0;
+    if (header->data_offset < sizeof(struct rubymodule_packed_header)
+            || header->data_offset > (uint64_t) len
+            || header->size > (uint64_t) len - header->data_offset)
+        return 0;
+    return 1;
+}
+
+static void rubymodule_packed_mark(struct rubymodule_packed *packed) {
+    rb_gc_mark(packed->source);
+}
+
+static void rubymodule_packed_free(struct rubymodule_packed *packed) {
+    free(packed);
+}
+
+/* Reads the header of self, raising if its source is not a record anymore */
+static void rubymodule_packed_get(VALUE self, struct rubymodule_packed_view *view) {
+    struct rubymodule_packed *packed;
+    long len;
+
+    if (rb_obj_is_kind_of(self, cPackedRecord) != Qtrue)
+        rb_raise(rb_eTypeError, "wrong argument type %s (expected Opensync::PackedRecord)", rb_obj_classname(self));
+    Data_Get_Struct(self, struct rubymodule_packed, packed);
+    rubymodule_buffer_bytes(packed->source, &view->ptr, &len);
+    if (!rubymodule_packed_header(view->ptr, len, &view->header))
+        rb_raise(rb_eRuntimeError, "Opensync::PackedRecord source is not a packed record anymore");
+}
+
+static long rubymodule_packed_field(VALUE value) {
+    return NIL_P(value) ? 0 : NUM2LONG(rb_Integer(value));
+}
+
+/* Header of a new record, for a payload of size bytes */
+static void rubymodule_packed_new_header(struct rubymodule_packed_header *header, VALUE path, VALUE mode, VALUE uid, VALUE gid, VALUE mtime, uint64_t size) {
+    StringValue(path);
+    if (RSTRING_LEN(path) > (long) UINT32_MAX)
+        rb_raise(rb_eArgError, "path too long for a packed record");
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, RUBYMODULE_PACKED_MAGIC, sizeof(header->magic));
+    header->mode = rubymodule_packed_field(mode);
+    header->uid = rubymodule_packed_field(uid);
+    header->gid = rubymodule_packed_field(gid);
+    header->mtime = NIL_P(mtime) ? 0 : NUM2LL(rb_Integer(mtime));
+    header->size = size;
+    header->path_offset = sizeof(*header);
+    header->path_length = RSTRING_LEN(path);
+    header->data_offset = header->path_offset + header->path_length;
+}
+
+/* PackedRecord.pack(path, data, mode=0, uid=0, gid=0, mtime=0) -> String
+ * data can be a String or an Opensync::Buffer, mtime an Integer or a Time */
+static VALUE rb_packed_s_pack(int argc, VALUE *argv, VALUE klass) {
+    VALUE path, data, mode, uid, gid, mtime, result;
+    struct rubymodule_packed_header header;
+    const char *data_ptr;
+    long data_len;
+    char *ptr;
+
+    rb_scan_args(argc, argv, "24", &path, &data, &mode, &uid, &gid, &mtime);
+    StringValue(path);
+    rubymodule_buffer_bytes(data, &data_ptr, &data_len);
+    rubymodule_packed_new_header(&header, path, mode, uid, gid, mtime, data_len);
+
+    result = rb_str_new(NULL, header.data_offset + header.size);
+    ptr = RSTRING_PTR(result);
+    memcpy(ptr, &header, sizeof(header));
+    memcpy(ptr + header.path_offset, RSTRING_PTR(path), header.path_length);
+    /* data is read again: path or mtime conversion might have released a Buffer */
+    rubymodule_buffer_bytes(data, &data_ptr, &data_len);
+    if ((uint64_t) data_len != header.size)
+        rb_raise(rb_eRuntimeError, "packed record data changed while packing it");
+    memcpy(ptr + header.data_offset, data_ptr, header.size);
+    return result;
+}
+
+/* PackedRecord.map(path, file, mode=0, uid=0, gid=0, mtime=0) -> Opensync::Buffer
+ * A record whose payload is a read-only mapping of file instead of a copy
+ * (see ruby_buffer.h). Only the pages read are loaded, and the page cache
+ * can drop them again */
+static VALUE rb_packed_s_map(int argc, VALUE *argv, VALUE klass) {
+    VALUE path, file, mode, uid, gid, mtime, result;
+    struct rubymodule_packed_header header;
+    const char *filename;
+    struct stat st;
+    char *prefix;
+    int fd, saved;
+
+    rb_scan_args(argc, argv, "24", &path, &file, &mode, &uid, &gid, &mtime);
+    StringValue(path);
+    FilePathValue(file);
+    filename = StringValueCStr(file);
+    /* Conversions first: nothing can raise while fd is open */
+    rubymodule_packed_new_header(&header, path, mode, uid, gid, mtime, 0);
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+        rb_sys_fail(filename);
+    saved = fstat(fd, &st) < 0 ? errno : !S_ISREG(st.st_mode) ? EINVAL : 0;
+    if (saved) {
+        close(fd);
+        errno = saved;
+        rb_sys_fail(filename);
+    }
+    header.size = st.st_size;
+    prefix = malloc(header.data_offset);
+    memcpy(prefix, &header, sizeof(header));
+    memcpy(prefix + header.path_offset, RSTRING_PTR(path), header.path_length);
+    result = rubymodule_buffer_map(fd, header.size, prefix, header.data_offset);
+    saved = errno;
+    free(prefix);
+    close(fd);
+    if (NIL_P(result)) {
+        errno = saved;
+        rb_sys_fail(filename);
+    }
+    return result;
+}
+
+/* PackedRecord.new(bytes): view over a packed String or Buffer, without copying it */
+static VALUE rb_packed_s_new(VALUE klass, VALUE source) {
+    struct rubymodule_packed_header header;
+    struct rubymodule_packed *packed;
+    const char *ptr;
+    long len;
+
+    rubymodule_buffer_bytes(source, &ptr, &len);
+    if (!rubymodule_packed_header(ptr, len, &header))
+        rb_raise(rb_eArgError, "not a packed record");
+    packed = malloc(sizeof(struct rubymodule_packed));
+    packed->source = source;
+    return Data_Wrap_Struct(klass, rubymodule_packed_mark, rubymodule_packed_free, packed);
+}
+
+static VALUE rb_packed_s_packed_p(VALUE klass, VALUE source) {
+    struct rubymodule_packed_header header;
+    const char *ptr;
+    long len;
+
+    if (!rubymodule_buffer_p(source) && TYPE(source) != T_STRING)
+        return Qfalse;
+    rubymodule_buffer_bytes(source, &ptr, &len);
+    return rubymodule_packed_header(ptr, len, &header) ? Qtrue : Qfalse;
+}
+
+static VALUE rb_packed_mode(VALUE self) {
+    struct rubymodule_packed_view view;
+    rubymodule_packed_get(self, &view);
+    return UINT2NUM(view.header.mode);
+}
+
+static VALUE rb_packed_uid(VALUE self) {
+    struct rubymodule_packed_view view;
+    rubymodule_packed_get(self, &view);
+    return UINT2NUM(view.header.uid);
+}
+
+static VALUE rb_packed_gid(VALUE self) {
+    struct rubymodule_packed_view view;
+    rubymodule_packed_get(self, &view);
+    return UINT2NUM(view.header.gid);
+}
+
+static VALUE rb_packed_mtime(VALUE self) {
+    struct rubymodule_packed_view view;
+    rubymodule_packed_get(self, &view);
+    return LL2NUM(view.header.mtime);
+}
+
+static VALUE rb_packed_size(VALUE self) {
+    struct rubymodule_packed_view view;
+    rubymodule_packed_get(self, &view);
+    return ULL2NUM(view.header.size);
+}
+
+/* Copies of the path (UTF-8) and of the payload */
+static VALUE rb_packed_path(VALUE self) {
+    struct rubymodule_packed_view view;
+    rubymodule_packed_get(self, &view);
+    return rb_enc_str_new(view.ptr + view.header.path_offset, view.header.path_length, rb_utf8_encoding());
+}
+
+static VALUE rb_packed_data(VALUE self) {
+    struct rubymodule_packed_view view;
+    rubymodule_packed_get(self, &view);
+    return rb_str_new(view.ptr + view.header.data_offset, view.header.size);
+}
+
+/* Comparisons in place, without building path or data strings */
+static VALUE rb_packed_path_equal(VALUE self, VALUE other) {
+    struct rubymodule_packed_view left, right;
+    rubymodule_packed_get(self, &left);
+    rubymodule_packed_get(other, &right);
+    return (left.header.path_length == right.header.path_length
+            && !memcmp(left.ptr + left.header.path_offset, right.ptr + right.header.path_offset, left.header.path_length)) ? Qtrue : Qfalse;
+}
+
+static VALUE rb_packed_data_equal(VALUE self, VALUE other) {
+    struct rubymodule_packed_view left, right;
+    rubymodule_packed_get(self, &left);
+    rubymodule_packed_get(other, &right);
+    return (left.header.size == right.header.size
+            && !memcmp(left.ptr + left.header.data_offset, right.ptr + right.header.data_offset, left.header.size)) ? Qtrue : Qfalse;
+}
+
+static VALUE rb_packed_equal(VALUE self, VALUE other) {
+    struct rubymodule_packed_view left, right;
+
+    if (rb_obj_is_kind_of(other, cPackedRecord) != Qtrue)
+        return Qfalse;
+    rubymodule_packed_get(self, &left);
+    rubymodule_packed_get(other, &right);
+    if (left.header.mode != right.header.mode || left.header.uid != right.header.uid
+            || left.header.gid != right.header.gid || left.header.mtime != right.header.mtime)
+        return Qfalse;
+    return (RTEST(rb_packed_path_equal(self, other)) && RTEST(rb_packed_data_equal(self, other))) ? Qtrue : Qfalse;
+}
+
+/* The same record with another path, as a new packed String */
+static VALUE rb_packed_with_path(VALUE self, VALUE path) {
+    struct rubymodule_packed_view view;
+    struct rubymodule_packed_header header;
+    VALUE result;
+    char *ptr;
+
+    StringValue(path);
+    if (RSTRING_LEN(path) > (long) UINT32_MAX)
+        rb_raise(rb_eArgError, "path too long for a packed record");
+    rubymodule_packed_get(self, &view);
+    header = view.header;
+    header.path_offset = sizeof(header);
+    header.path_length = RSTRING_LEN(path);
+    header.data_offset = header.path_offset + header.path_length;
+
+    result = rb_str_new(NULL, header.data_offset + header.size);
+    /* rb_str_new may run the GC: read the source again */
+    rubymodule_packed_get(self, &view);
+    ptr = RSTRING_PTR(result);
+    memcpy(ptr, &header, sizeof(header));
+    memcpy(ptr + header.path_offset, RSTRING_PTR(path), header.path_length);
+    memcpy(ptr + header.data_offset, view.ptr + view.header.data_offset, header.size);
+    return result;
+}
+
+/* The packed bytes as a String. A String source is shared, not copied */
+static VALUE rb_packed_to_s(VALUE self) {
+    struct rubymodule_packed *packed;
+    struct rubymodule_packed_view view;
+
+    rubymodule_packed_get(self, &view);
+    Data_Get_Struct(self, struct rubymodule_packed, packed);
+    if (TYPE(packed->source) == T_STRING)
+        return rb_str_dup(packed->source);
+    return rb_str_new(view.ptr, view.header.data_offset + view.header.size);
+}
+
+static VALUE rb_packed_inspect(VALUE self) {
+    struct rubymodule_packed_view view;
+    rubymodule_packed_get(self, &view);
+    return rb_sprintf("#<Opensync::PackedRecord %.*s mode=%o size=%llu>", (int) view.header.path_length,
+                      view.ptr + view.header.path_offset, view.header.mode, (unsigned long long) view.header.size);
+}
+
+void rubymodule_packed_init(VALUE module) {
+    cPackedRecord = rb_define_class_under(module, "PackedRecord", rb_cObject);
+    rb_undef_alloc_func(cPackedRecord);
+    rb_define_singleton_method(cPackedRecord, "new", rb_packed_s_new, 1);
+    rb_define_singleton_method(cPackedRecord, "pack", rb_packed_s_pack, -1);
+    rb_define_singleton_method(cPackedRecord, "map", rb_packed_s_map, -1);
+    rb_define_singleton_method(cPackedRecord, "packed?", rb_packed_s_packed_p, 1);
+    rb_define_method(cPackedRecord, "mode", rb_packed_mode, 0);
+    rb_define_method(cPackedRecord, "uid", rb_packed_uid, 0);
+    rb_define_method(cPackedRecord, "gid", rb_packed_gid, 0);
+    rb_define_method(cPackedRecord, "mtime", rb_packed_mtime, 0);
+    rb_define_method(cPackedRecord, "size", rb_packed_size, 0);
+    rb_define_method(cPackedRecord, "path", rb_packed_path, 0);
+    rb_define_method(cPackedRecord, "data", rb_packed_data, 0);
+    rb_define_method(cPackedRecord, "path_equal?", rb_packed_path_equal, 1);
+    rb_define_method(cPackedRecord, "data_equal?", rb_packed_data_equal, 1);
+    rb_define_method(cPackedRecord, "==", rb_packed_equal, 1);
+    rb_define_method(cPackedRecord, "with_path", rb_packed_with_path, 1);
+    rb_define_method(cPackedRecord, "to_s", rb_packed_to_s, 0);
+    rb_define_method(cPackedRecord, "to_str", rb_packed_to_s, 0);
+    rb_define_method(cPackedRecord, "inspect", rb_packed_inspect, 0);
+    /* Keep cPackedRecord alive */
+    rb_gc_register_address(&cPackedRecord);
+}
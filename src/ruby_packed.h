@@ -0,0 +1,63 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+
+#ifndef _RUBY_PACKED_H
+#define _RUBY_PACKED_H
+
+#include <ruby.h>
+#include <stdint.h>
+
+/*
+ * Opensync::PackedRecord is a file record (mode, uid, gid, mtime, path and
+ * contents) stored as a flat block of bytes, so format callbacks can read a
+ * field or compare two records without deserialising them.
+ *
+ * The block is a fixed header followed by the path and the payload:
+ *
+ *   [header][path bytes][payload bytes]
+ *
+ * Integers are in host byte order: records only travel inside the process.
+ * Data crossing processes goes through the objformat marshal callbacks.
+ *
+ * PackedRecord.map builds the record of a file around a read-only mapping
+ * of it, as a mapped Opensync::Buffer (see ruby_buffer.h).
+ */
+
+#define RUBYMODULE_PACKED_MAGIC "OPR1"
+
+struct rubymodule_packed_header {
+    char     magic[4];
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t  mtime;
+    uint64_t size;		/* payload length */
+    uint32_t path_offset;
+    uint32_t path_length;
+    uint64_t data_offset;
+};
+
+void rubymodule_packed_init(VALUE module);
+/* Copies the header of the packed record in ptr (len bytes) into header.
+ * Returns 0 if ptr is not a packed record. ptr needs no alignment */
+int  rubymodule_packed_header(const char *ptr, long len, struct rubymodule_packed_header *header);
+
+#endif //_RUBY_PACKED_H
@@ -0,0 +1,257 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+
+#include "ruby_ractor.h"
+
+#if RUBY_API_VERSION_MAJOR >= 2
+#include <ruby/thread.h>
+#endif
+
+#include <time.h>
+
+/*
+ * Idle waits of the ruby thread and of the lanes happen outside the GVL, so
+ * other ruby threads (and Ractors) run meanwhile. Ruby interrupts the wait
+ * (signals, Thread#raise, GC barriers) through the dispatcher.
+ */
+static void *rubymodule_lanes_next_nogvl(void *dispatcher) {
+    return rubymodule_dispatcher_next_interruptible(dispatcher);
+}
+
+static void rubymodule_lanes_interrupt(void *dispatcher) {
+    rubymodule_dispatcher_interrupt(dispatcher);
+}
+
+#if RUBY_API_VERSION_MAJOR >= 2
+struct rubymodule_call *rubymodule_lanes_next(struct rubymodule_dispatcher *dispatcher) {
+    return rb_thread_call_without_gvl(rubymodule_lanes_next_nogvl, dispatcher, rubymodule_lanes_interrupt, dispatcher);
+}
+#else
+/* ruby 1.9 */
+static VALUE rubymodule_lanes_next_blocking(void *dispatcher) {
+    return (VALUE) rubymodule_lanes_next_nogvl(dispatcher);
+}
+
+struct rubymodule_call *rubymodule_lanes_next(struct rubymodule_dispatcher *dispatcher) {
+    return (struct rubymodule_call *) rb_thread_blocking_region(rubymodule_lanes_next_blocking, dispatcher, rubymodule_lanes_interrupt, dispatcher);
+}
+#endif
+
+#ifdef RUBYMODULE_RACTORS
+
+struct rubymodule_lane {
+    struct rubymodule_dispatcher dispatcher;
+    int serving;
+};
+
+/* Lane 0 is the ruby thread, which has its own dispatcher in ruby_module.c */
+static struct rubymodule_lane rubymodule_lanes[RUBYMODULE_LANES_MAX];
+static int rubymodule_lanes_count = 1;
+/* Lanes of the pool and the next one to use */
+static int rubymodule_pool[RUBYMODULE_LANES_MAX];
+static int rubymodule_pool_size = 0;
+static unsigned long rubymodule_pool_next = 0;
+static __thread int rubymodule_lane_self = RUBYMODULE_LANE_MAIN;
+
+int rubymodule_lanes_enabled(void) {
+    return __atomic_load_n(&rubymodule_lanes_count, __ATOMIC_ACQUIRE) > 1;
+}
+
+int rubymodule_lane_current(void) {
+    return rubymodule_lane_self;
+}
+
+struct rubymodule_dispatcher *rubymodule_lane_dispatcher(int lane) {
+    if (lane == RUBYMODULE_LANE_POOL) {
+        int size = __atomic_load_n(&rubymodule_pool_size, __ATOMIC_ACQUIRE);
+        if (!size)
+            return NULL;
+        lane = rubymodule_pool[__atomic_fetch_add(&rubymodule_pool_next, 1, __ATOMIC_RELAXED) % size];
+    }
+    if (lane <= RUBYMODULE_LANE_MAIN || lane >= __atomic_load_n(&rubymodule_lanes_count, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &rubymodule_lanes[lane].dispatcher;
+}
+
+static void *rubymodule_lanes_wait_nogvl(void *call) {
+    rubymodule_call_wait(call);
+    return NULL;
+}
+
+void rubymodule_lanes_wait(struct rubymodule_call *call) {
+    /* Not interruptible: call lives in the caller stack until it is done */
+    rb_thread_call_without_gvl(rubymodule_lanes_wait_nogvl, call, NULL, NULL);
+}
+
+VALUE rubymodule_lanes_check(VALUE value) {
+    if (rubymodule_lane_self != RUBYMODULE_LANE_MAIN && !rb_ractor_shareable_p(value))
+        rb_raise(rb_eArgError, "value is not shareable and cannot be used in Ractor lane %d (see Ractor.make_shareable)", rubymodule_lane_self);
+    return value;
+}
+
+/* Waits up to 10ms for call, outside the GVL. Returns whether it is done */
+static void *rubymodule_lanes_stop_wait_nogvl(void *_call) {
+    struct rubymodule_call *call = _call;
+    struct timespec deadline;
+    long done;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 10000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&call->lock);
+    if (!call->done)
+        pthread_cond_timedwait(&call->returned, &call->lock, &deadline);
+    done = call->done;
+    pthread_mutex_unlock(&call->lock);
+    return (void *) done;
+}
+
+void rubymodule_lanes_stop(struct rubymodule_dispatcher *serve) {
+    int lane;
+    for (lane = RUBYMODULE_LANE_MAIN + 1; lane < rubymodule_lanes_count; lane++) {
+        struct rubymodule_call stop, *call;
+        if (!__atomic_load_n(&rubymodule_lanes[lane].serving, __ATOMIC_ACQUIRE))
+            continue;
+        /* A call without func ends rb_lane_serve */
+        rubymodule_call_init(&stop, NULL, NULL, NULL);
+        rubymodule_dispatcher_submit(&rubymodule_lanes[lane].dispatcher, &stop);
+        /* The lane might be running a call that waits for serve: run them meanwhile */
+        do {
+            while ((call = rubymodule_dispatcher_try_next(serve)))
+                rubymodule_call_run(call);
+        } while (!rb_thread_call_without_gvl(rubymodule_lanes_stop_wait_nogvl, &stop, NULL, NULL));
+        rubymodule_call_destroy(&stop);
+    }
+}
+
+/* Opensync.osync_rubymodule_lane_new(pooled) -> lane. Ruby starts the Ractor that serves it */
+static VALUE rb_lane_new(VALUE self, VALUE pooled) {
+    int lane;
+    if (rubymodule_lane_self != RUBYMODULE_LANE_MAIN)
+        rb_raise(rb_eRuntimeError, "lanes are created by the main Ractor");
+    if (rubymodule_lanes_count >= RUBYMODULE_LANES_MAX)
+        rb_raise(rb_eRuntimeError, "too many Ractor lanes (max %d)", RUBYMODULE_LANES_MAX - 1);
+    lane = rubymodule_lanes_count;
+    rubymodule_dispatcher_init(&rubymodule_lanes[lane].dispatcher);
+    rubymodule_lanes[lane].serving = 0;
+    /* Calls can be queued before the Ractor starts serving */
+    __atomic_store_n(&rubymodule_lanes_count, lane + 1, __ATOMIC_RELEASE);
+    if (RTEST(pooled)) {
+        rubymodule_pool[rubymodule_pool_size] = lane;
+        __atomic_store_n(&rubymodule_pool_size, rubymodule_pool_size + 1, __ATOMIC_RELEASE);
+    }
+    return INT2FIX(lane);
+}
+
+struct rubymodule_lane_serving {
+    int lane;
+    /* The call that stopped the lane */
+    struct rubymodule_call *stop;
+};
+
+static VALUE rubymodule_lane_loop(VALUE _serving) {
+    struct rubymodule_lane_serving *serving = (struct rubymodule_lane_serving *) _serving;
+    struct rubymodule_call *call;
+
+    for (;;) {
+        call = rubymodule_lanes_next(&rubymodule_lanes[serving->lane].dispatcher);
+        if (!call) {
+            /* Interrupted: let ruby handle it (it raises if the Ractor is terminated) */
+            rb_thread_check_ints();
+            continue;
+        }
+        if (!call->func)
+            break;
+        rubymodule_call_run(call);
+    }
+    serving->stop = call;
+    return Qnil;
+}
+
+/* Also run when the lane ends with an exception */
+static VALUE rubymodule_lane_done(VALUE _serving) {
+    struct rubymodule_lane_serving *serving = (struct rubymodule_lane_serving *) _serving;
+
+    __atomic_store_n(&rubymodule_lanes[serving->lane].serving, 0, __ATOMIC_RELEASE);
+    rubymodule_lane_self = RUBYMODULE_LANE_MAIN;
+    if (serving->stop)
+        rubymodule_call_complete(serving->stop);
+    return Qnil;
+}
+
+/* Opensync.osync_rubymodule_lane_serve(lane): runs the calls of lane until stopped */
+static VALUE rb_lane_serve(VALUE self, VALUE _lane) {
+    struct rubymodule_lane_serving serving = { NUM2INT(_lane), NULL };
+
+    if (serving.lane <= RUBYMODULE_LANE_MAIN || serving.lane >= rubymodule_lanes_count || rubymodule_lanes[serving.lane].serving)
+        rb_raise(rb_eArgError, "invalid Ractor lane %d", serving.lane);
+    __atomic_store_n(&rubymodule_lanes[serving.lane].serving, 1, __ATOMIC_RELEASE);
+    rubymodule_lane_self = serving.lane;
+
+    return rb_ensure(rubymodule_lane_loop, (VALUE) &serving, rubymodule_lane_done, (VALUE) &serving);
+}
+
+void rubymodule_lanes_init(VALUE module) {
+    rb_define_module_function(module, "osync_rubymodule_lane_new", rb_lane_new, 1);
+    /* Called by the Ractor of each lane */
+    rb_ext_ractor_safe(true);
+    rb_define_module_function(module, "osync_rubymodule_lane_serve", rb_lane_serve, 1);
+    rb_ext_ractor_safe(false);
+}
+
+#else /* RUBYMODULE_RACTORS */
+
+int rubymodule_lanes_enabled(void) {
+    return 0;
+}
+
+int rubymodule_lane_current(void) {
+    return RUBYMODULE_LANE_MAIN;
+}
+
+struct rubymodule_dispatcher *rubymodule_lane_dispatcher(int lane) {
+    return NULL;
+}
+
+void rubymodule_lanes_wait(struct rubymodule_call *call) {
+    rubymodule_call_wait(call);
+}
+
+VALUE rubymodule_lanes_check(VALUE value) {
+    return value;
+}
+
+void rubymodule_lanes_stop(struct rubymodule_dispatcher *serve) {
+}
+
+static VALUE rb_lane_new(VALUE self, VALUE pooled) {
+    rb_raise(rb_eNotImpError, "Ractor lanes need ruby >= 3.0");
+    return Qnil;
+}
+
+void rubymodule_lanes_init(VALUE module) {
+    rb_define_module_function(module, "osync_rubymodule_lane_new", rb_lane_new, 1);
+}
+
+#endif /* RUBYMODULE_RACTORS */
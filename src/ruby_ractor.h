@@ -0,0 +1,79 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+
+#ifndef _RUBY_RACTOR_H
+#define _RUBY_RACTOR_H
+
+#include <ruby.h>
+#include <ruby/version.h>
+
+#include "ruby_dispatcher.h"
+
+/*
+ * Ractor lanes (ruby >= 3.0)
+ *
+ * By default every callback runs on the ruby thread. A lane is a Ractor that
+ * serves its own dispatcher ring, so callbacks of objects bound to different
+ * lanes run in parallel. An object is bound either to a lane of its own
+ * (sinks) or to the pool, a set of lanes used round-robin by stateless
+ * callbacks (formats and converters).
+ *
+ * Callbacks of bound objects, and the user data they get, must be shareable
+ * (see Ractor.make_shareable) as they run outside the main Ractor.
+ */
+
+#if RUBY_API_VERSION_MAJOR >= 3
+#define RUBYMODULE_RACTORS
+#include <ruby/ractor.h>
+#endif
+
+/* Max number of lanes, including the ruby thread (lane 0) */
+#define RUBYMODULE_LANES_MAX 64
+/* The ruby thread. Every object starts here */
+#define RUBYMODULE_LANE_MAIN 0
+/* Any lane of the pool */
+#define RUBYMODULE_LANE_POOL -1
+
+void  rubymodule_lanes_init(VALUE module);
+/* True once a lane was created */
+int   rubymodule_lanes_enabled(void);
+/* Lane served by the current thread, RUBYMODULE_LANE_MAIN if none */
+int   rubymodule_lane_current(void);
+/* Dispatcher of lane, NULL for the ruby thread (or an empty pool) */
+struct rubymodule_dispatcher *rubymodule_lane_dispatcher(int lane);
+/*
+ * Stops all lanes. Called from the ruby thread before ruby is finalized. Calls
+ * submitted to serve (the ruby thread dispatcher) meanwhile are run, as a
+ * lane might be waiting for one of them
+ */
+void  rubymodule_lanes_stop(struct rubymodule_dispatcher *serve);
+/*
+ * Next call of the ruby thread or of a lane, waiting outside the GVL (any
+ * ruby version). NULL if ruby interrupted the wait: handle the interrupts
+ * (rb_thread_check_ints) and call it again
+ */
+struct rubymodule_call *rubymodule_lanes_next(struct rubymodule_dispatcher *dispatcher);
+/* Waits for a call submitted from a lane, outside the GVL */
+void  rubymodule_lanes_wait(struct rubymodule_call *call);
+/* Raises if value cannot be used in the current lane */
+VALUE rubymodule_lanes_check(VALUE value);
+
+#endif //_RUBY_RACTOR_H
@@ -0,0 +1,364 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#define _GNU_SOURCE 1
+#include "ruby_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Bucket b counts durations below 2^b ns (and at least 2^(b-1)): up to ~9 min */
+#define STATS_BUCKETS 40
+
+/* Shards have a single writer: plain stores, atomic only against torn reads */
+#define STAT_LOAD(ptr)      __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define STAT_ADD(ptr, val)  __atomic_store_n(ptr, STAT_LOAD(ptr) + (val), __ATOMIC_RELAXED)
+
+struct stats_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats_kind {
+    struct stats_histogram metrics[RUBYMODULE_STATS_METRICS];
+    uint64_t calls;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+struct stats_shard {
+    struct stats_shard *next;
+    struct stats_kind  kinds[];
+};
+
+static const char * const metric_names[RUBYMODULE_STATS_METRICS] = { "wait", "run", "gc" };
+
+static int stats_count = 0;
+static int stats_timing = 0;
+static int stats_gc_traced = 0;
+static const char * const *stats_names = NULL;
+/* Shards of the running threads. Only changed and summed under stats_lock */
+static struct stats_shard *stats_shards = NULL;
+/* Totals of the threads that finished */
+static struct stats_shard *stats_retired = NULL;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct stats_shard *stats_shard = NULL;
+/* Ruby GC time of this thread */
+static __thread uint64_t stats_gc_total = 0;
+static __thread uint64_t stats_gc_started = 0;
+
+static void stats_histogram_add(struct stats_histogram *to, const struct stats_histogram *from) {
+    uint64_t max = STAT_LOAD(&from->max);
+    int bucket;
+
+    to->count += STAT_LOAD(&from->count);
+    to->sum += STAT_LOAD(&from->sum);
+    if (max > to->max)
+        to->max = max;
+    for (bucket = 0; bucket < STATS_BUCKETS; bucket++)
+        to->buckets[bucket] += STAT_LOAD(&from->buckets[bucket]);
+}
+
+static void stats_kind_add(struct stats_kind *to, const struct stats_kind *from) {
+    int metric;
+
+    for (metric = 0; metric < RUBYMODULE_STATS_METRICS; metric++)
+        stats_histogram_add(&to->metrics[metric], &from->metrics[metric]);
+    to->calls += STAT_LOAD(&from->calls);
+    to->bytes_in += STAT_LOAD(&from->bytes_in);
+    to->bytes_out += STAT_LOAD(&from->bytes_out);
+}
+
+/* Thread exit: its shard is added to stats_retired and freed */
+static void stats_shard_retire(void *data) {
+    struct stats_shard *shard = data, **link;
+    int kind;
+
+    pthread_mutex_lock(&stats_lock);
+    for (link = &stats_shards; *link && *link != shard; link = &(*link)->next);
+    if (*link)
+        *link = shard->next;
+    if (!stats_retired)
+        stats_retired = calloc(1, sizeof(struct stats_shard) + stats_count * sizeof(struct stats_kind));
+    if (stats_retired)
+        for (kind = 0; kind < stats_count; kind++)
+            stats_kind_add(&stats_retired->kinds[kind], &shard->kinds[kind]);
+    pthread_mutex_unlock(&stats_lock);
+    free(shard);
+    stats_shard = NULL;
+}
+
+static void stats_key_create(void) {
+    pthread_key_create(&stats_key, stats_shard_retire);
+}
+
+void rubymodule_stats_init(int count, const char * const *names) {
+    pthread_once(&stats_key_once, stats_key_create);
+    pthread_mutex_lock(&stats_lock);
+    stats_count = count;
+    stats_names = names;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void rubymodule_stats_gc_traced(int traced) {
+    __atomic_store_n(&stats_gc_traced, traced, __ATOMIC_RELAXED);
+}
+
+void rubymodule_stats_timing(int enabled) {
+    __atomic_store_n(&stats_timing, enabled, __ATOMIC_RELAXED);
+}
+
+uint64_t rubymodule_stats_clock(void) {
+    return __atomic_load_n(&stats_timing, __ATOMIC_RELAXED) ? rubymodule_stats_now() : 0;
+}
+
+static struct stats_shard *stats_shard_get(void) {
+    if (stats_shard)
+        return stats_shard;
+    pthread_mutex_lock(&stats_lock);
+    if (stats_count && (stats_shard = calloc(1, sizeof(struct stats_shard) + stats_count * sizeof(struct stats_kind)))) {
+        stats_shard->next = stats_shards;
+        stats_shards = stats_shard;
+        pthread_setspecific(stats_key, stats_shard);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return stats_shard;
+}
+
+static int stats_bucket(uint64_t ns) {
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+void rubymodule_stats_record(int kind, enum rubymodule_stats_metric metric, uint64_t ns) {
+    struct stats_shard *shard = stats_shard_get();
+    struct stats_histogram *histogram;
+
+    if (!shard || kind < 0 || kind >= stats_count)
+        return;
+    histogram = &shard->kinds[kind].metrics[metric];
+    STAT_ADD(&histogram->count, 1);
+    STAT_ADD(&histogram->sum, ns);
+    STAT_ADD(&histogram->buckets[stats_bucket(ns)], 1);
+    if (ns > STAT_LOAD(&histogram->max))
+        __atomic_store_n(&histogram->max, ns, __ATOMIC_RELAXED);
+}
+
+void rubymodule_stats_begin(struct rubymodule_stats_span *span) {
+    span->gc = stats_gc_total;
+    span->start = rubymodule_stats_clock();
+}
+
+void rubymodule_stats_end(struct rubymodule_stats_span *span, int kind, uint64_t bytes_in, uint64_t bytes_out) {
+    struct stats_shard *shard = stats_shard_get();
+
+    if (!shard || kind < 0 || kind >= stats_count)
+        return;
+    STAT_ADD(&shard->kinds[kind].calls, 1);
+    STAT_ADD(&shard->kinds[kind].bytes_in, bytes_in);
+    STAT_ADD(&shard->kinds[kind].bytes_out, bytes_out);
+    if (span->start) {
+        rubymodule_stats_record(kind, RUBYMODULE_STATS_RUN, rubymodule_stats_now() - span->start);
+        if (__atomic_load_n(&stats_gc_traced, __ATOMIC_RELAXED))
+            rubymodule_stats_record(kind, RUBYMODULE_STATS_GC, stats_gc_total - span->gc);
+    }
+}
+
+void rubymodule_stats_gc_enter(void) {
+    stats_gc_started = rubymodule_stats_clock();
+}
+
+void rubymodule_stats_gc_exit(void) {
+    if (stats_gc_started)
+        stats_gc_total += rubymodule_stats_now() - stats_gc_started;
+    stats_gc_started = 0;
+}
+
+/* Growing string for the JSON */
+struct stats_text {
+    char  *ptr;
+    size_t len;
+    size_t size;
+};
+
+static void stats_printf(struct stats_text *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void stats_printf(struct stats_text *text, const char *format, ...) {
+    va_list args;
+    int len;
+
+    for (;;) {
+        va_start(args, format);
+        len = vsnprintf(text->ptr + text->len, text->size - text->len, format, args);
+        va_end(args);
+        if (len < 0)
+            return;
+        if (text->len + len < text->size)
+            break;
+        text->size = (text->len + len + 1) * 2;
+        text->ptr = realloc(text->ptr, text->size);
+    }
+    text->len += len;
+}
+
+/* Upper bound of the bucket holding the given fraction of the samples */
+static double stats_percentile(const struct stats_histogram *histogram, double fraction) {
+    uint64_t seen = 0, wanted = (uint64_t) (histogram->count * fraction);
+    int bucket;
+
+    if (!histogram->count)
+        return 0;
+    for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen > wanted)
+            break;
+    }
+    if (bucket == STATS_BUCKETS)
+        bucket--;
+    return bucket ? (double) (1ULL << bucket) / 1000 : 0;
+}
+
+static void stats_histogram_json(struct stats_text *text, const char *name, const struct stats_histogram *histogram) {
+    int bucket, first = 1;
+
+    stats_printf(text, "\"%s\":{\"count\":%llu,\"sum_us\":%.3f,\"max_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"buckets_us\":{",
+                 name, (unsigned long long) histogram->count, histogram->sum / 1000.0, histogram->max / 1000.0,
+                 stats_percentile(histogram, 0.5), stats_percentile(histogram, 0.99));
+    for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        if (!histogram->buckets[bucket])
+            continue;
+        stats_printf(text, "%s\"%.3f\":%llu", first ? "" : ",", bucket ? (double) (1ULL << bucket) / 1000 : 0,
+                     (unsigned long long) histogram->buckets[bucket]);
+        first = 0;
+    }
+    stats_printf(text, "}}");
+}
+
+char *rubymodule_stats_json(void) {
+    struct stats_text text = { NULL, 0, 0 };
+    struct stats_shard *shard;
+    struct stats_kind total;
+    int kind, metric, first = 1;
+
+    stats_printf(&text, "{\"pid\":%d,\"callbacks\":{", (int) getpid());
+    pthread_mutex_lock(&stats_lock);
+    for (kind = 0; kind < stats_count; kind++) {
+        memset(&total, 0, sizeof(total));
+        if (stats_retired)
+            stats_kind_add(&total, &stats_retired->kinds[kind]);
+        for (shard = stats_shards; shard; shard = shard->next)
+            stats_kind_add(&total, &shard->kinds[kind]);
+        if (!total.calls)
+            continue;
+        stats_printf(&text, "%s\"%s\":{\"calls\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu", first ? "" : ",", stats_names[kind],
+                     (unsigned long long) total.calls,
+                     (unsigned long long) total.bytes_in, (unsigned long long) total.bytes_out);
+        for (metric = 0; metric < RUBYMODULE_STATS_METRICS; metric++) {
+            /* Unknown without GC tracepoints */
+            if (metric == RUBYMODULE_STATS_GC && !__atomic_load_n(&stats_gc_traced, __ATOMIC_RELAXED))
+                continue;
+            stats_printf(&text, ",");
+            stats_histogram_json(&text, metric_names[metric], &total.metrics[metric]);
+        }
+        stats_printf(&text, "}");
+        first = 0;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    stats_printf(&text, "}}\n");
+    return text.ptr;
+}
+
+int rubymodule_stats_dump(const char *path) {
+    char *json = rubymodule_stats_json();
+    FILE *file = strcmp(path, "-") ? fopen(path, "w") : stderr;
+    int ok = file && fputs(json, file) >= 0;
+
+    if (file && file != stderr)
+        ok = !fclose(file) && ok;
+    else if (file)
+        fflush(file);
+    free(json);
+    return ok;
+}
+
+static int stats_signal_pipe[2] = { -1, -1 };
+static char *stats_signal_path = NULL;
+
+static void stats_signal(int signum) {
+    char byte = 0;
+    int saved = errno;
+    if (write(stats_signal_pipe[1], &byte, 1) < 0) {
+        /* Already pending */
+    }
+    errno = saved;
+}
+
+/* Formats and writes out of the signal handler */
+static void *stats_dump_thread(void *unused) {
+    char byte;
+    ssize_t len;
+    for (;;) {
+        len = read(stats_signal_pipe[0], &byte, 1);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len != 1)
+            break;
+        if (!rubymodule_stats_dump(stats_signal_path))
+            fprintf(stderr, "Could not write ruby callback stats to %s\n", stats_signal_path);
+    }
+    return NULL;
+}
+
+int rubymodule_stats_dump_on(int signum, const char *path) {
+    struct sigaction action, old;
+    pthread_t thread;
+
+    /* Never take over a handler of the application */
+    if (stats_signal_path || sigaction(signum, NULL, &old) < 0 || old.sa_handler != SIG_DFL)
+        return 0;
+    if (pipe2(stats_signal_pipe, O_CLOEXEC) < 0)
+        return 0;
+    stats_signal_path = strdup(path);
+    if (!stats_signal_path || pthread_create(&thread, NULL, stats_dump_thread, NULL)) {
+        close(stats_signal_pipe[0]);
+        close(stats_signal_pipe[1]);
+        free(stats_signal_path);
+        stats_signal_path = NULL;
+        return 0;
+    }
+    pthread_detach(thread);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stats_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return !sigaction(signum, &action, NULL);
+}
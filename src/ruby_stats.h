@@ -0,0 +1,88 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef _RUBY_STATS_H
+#define _RUBY_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Per callback metrics. Each generated wrapper records, by kind of callback:
+ *
+ * wait: time from the request until the ruby thread (or lane) starts the call
+ * run:  time running the callback
+ * gc:   ruby GC time inside the call (rubymodule_stats_gc_enter/exit)
+ *
+ * as log2 histograms of nanoseconds, and the calls and bytes given to and
+ * returned by ruby. Each thread records into its own shard, with no locks and
+ * no shared cache lines. Shards are only summed when someone reads them
+ * (rubymodule_stats_json), and are added to the totals when their thread
+ * exits.
+ *
+ * Reading the clock costs more than the rest: times (GC included) are only
+ * taken after rubymodule_stats_timing(1). Calls and bytes are always counted.
+ */
+
+enum rubymodule_stats_metric {
+    RUBYMODULE_STATS_WAIT,
+    RUBYMODULE_STATS_RUN,
+    RUBYMODULE_STATS_GC,
+    RUBYMODULE_STATS_METRICS
+};
+
+/* Started by rubymodule_stats_begin, in the thread running the call. start
+ * is 0 if times are off */
+struct rubymodule_stats_span {
+    uint64_t start;
+    uint64_t gc;
+};
+
+static inline uint64_t rubymodule_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* names: one per kind, kinds are 0 to count - 1 */
+void rubymodule_stats_init(int count, const char * const *names);
+void rubymodule_stats_timing(int enabled);
+/* Whether rubymodule_stats_gc_enter/exit are called. If not, the gc metric
+ * is left out */
+void rubymodule_stats_gc_traced(int traced);
+/* rubymodule_stats_now, or 0 if times are off */
+uint64_t rubymodule_stats_clock(void);
+void rubymodule_stats_record(int kind, enum rubymodule_stats_metric metric, uint64_t ns);
+void rubymodule_stats_begin(struct rubymodule_stats_span *span);
+void rubymodule_stats_end(struct rubymodule_stats_span *span, int kind, uint64_t bytes_in, uint64_t bytes_out);
+
+/* Ruby GC in this thread */
+void rubymodule_stats_gc_enter(void);
+void rubymodule_stats_gc_exit(void);
+
+/* All shards, as JSON (malloc'd) */
+char *rubymodule_stats_json(void);
+/* Writes the JSON to path ("-": stderr). Returns 0 on failure */
+int rubymodule_stats_dump(const char *path);
+/* Dumps to path on signum too, from a thread of its own. Returns 0 if signum
+ * already has a handler: it is left alone */
+int rubymodule_stats_dump_on(int signum, const char *path);
+
+#endif //_RUBY_STATS_H
@@ -0,0 +1,35 @@
+#
+# Plugin used by check_background. initialize starts a ruby thread that
+# ticks every 10ms; discover is true if it ticked while the ruby thread was
+# idle, between both callbacks.
+#
+class CheckBackground < Opensync::Plugin
+    ID="ruby-check-background"
+
+    def self.get_sync_info(env)
+	env.register_plugin(self.new)
+    end
+
+    def initialize_new
+	self.name=ID
+	self.longname="Background ruby thread check"
+	self.description="Used by tests/check_background"
+	self.initialize_func {|plugin, info| initialize0 }
+	self.finalize_func {|plugin, plugin_data| true }
+	self.discover_func {|plugin, info, plugin_data| discover0 }
+    end
+
+    def initialize0
+	@ticks=0
+	Thread.new { loop { @ticks+=1; sleep 0.01 } }
+	@before=@ticks
+	true
+    end
+
+    def discover0
+	$stderr.puts "#{@ticks - @before} ticks between callbacks"
+	@ticks - @before >= 5
+    end
+end
+
+Opensync::MetaPlugin.register(CheckBackground)
@@ -0,0 +1,127 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * SWIG wrappers are marked Ractor safe (see rubymodule_initialize): two
+ * threads call get_changes of the two sinks of lanes/check_lanes.rb at the
+ * same time, so the wrappers run concurrently in two lanes. Every call must
+ * succeed.
+ */
+
+#include "ruby_module.h"
+#include "callbacks_prototypes.h"
+
+#include <pthread.h>
+
+#define CHECK_PLUGIN "ruby-check-lanes"
+#define CHECK_SINKS  2
+#define CHECK_CALLS  10
+
+struct check_caller {
+    pthread_t thread;
+    OSyncObjTypeSink *sink;
+    OSyncPluginInfo *info;
+    int failed;
+};
+
+static void report_result(void *data, OSyncError *error) {
+    if (error) {
+        fprintf(stderr, "get_changes failed: %s\n", osync_error_print(&error));
+        (*(int *) data)++;
+    }
+}
+
+static void *call_sink(void *data) {
+    struct check_caller *caller = data;
+    OSyncError *error = NULL;
+    int i;
+
+    for (i = 0; i < CHECK_CALLS; i++) {
+        OSyncContext *ctx = osync_context_new(&error);
+        if (!ctx) {
+            caller->failed++;
+            break;
+        }
+        osync_context_set_callback(ctx, report_result, &caller->failed);
+        osync_rubymodule_objtype_sink_get_changes(caller->sink, caller->info, ctx, TRUE,
+                                                  osync_objtype_sink_get_userdata(caller->sink));
+        osync_context_unref(ctx);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    OSyncError *error = NULL;
+    OSyncPluginEnv *plugin_env;
+    OSyncPlugin *plugin;
+    OSyncPluginInfo *info;
+    struct check_caller callers[CHECK_SINKS];
+    void *plugin_data;
+    int i, failed = 0;
+
+    setenv("OPENSYNC_RUBY_PLUGINDIR", CHECK_LANESDIR, 0);
+
+    plugin_env = osync_plugin_env_new(&error);
+    if (!plugin_env || !rubymodule_get_sync_info(plugin_env, &error))
+        goto error;
+    if (!(plugin = osync_plugin_env_find_plugin(plugin_env, CHECK_PLUGIN))) {
+        fprintf(stderr, "Plugin %s not registered\n", CHECK_PLUGIN);
+        return 1;
+    }
+    if (!(info = osync_plugin_info_new(&error)))
+        goto error;
+    for (i = 0; i < CHECK_SINKS; i++) {
+        char name[16];
+        OSyncObjTypeSink *sink;
+
+        snprintf(name, sizeof(name), "lane%d", i);
+        if (!(sink = osync_objtype_sink_new(name, &error)))
+            goto error;
+        osync_plugin_info_add_objtype(info, sink);
+        osync_objtype_sink_unref(sink);
+    }
+
+    plugin_data = osync_rubymodule_plugin_initialize(plugin, info, &error);
+    if (osync_error_is_set(&error))
+        goto error;
+    for (i = 0; i < CHECK_SINKS; i++) {
+        char name[16];
+
+        snprintf(name, sizeof(name), "lane%d", i);
+        callers[i].sink = osync_plugin_info_find_objtype(info, name);
+        callers[i].info = info;
+        callers[i].failed = 0;
+        pthread_create(&callers[i].thread, NULL, call_sink, &callers[i]);
+    }
+    for (i = 0; i < CHECK_SINKS; i++) {
+        pthread_join(callers[i].thread, NULL);
+        failed += callers[i].failed;
+    }
+    osync_rubymodule_plugin_finalize(plugin, plugin_data);
+    if (failed) {
+        fprintf(stderr, "%d of %d concurrent get_changes failed\n", failed, CHECK_SINKS * CHECK_CALLS);
+        return 1;
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "%s\n", error ? osync_error_print(&error) : "failed");
+    return 1;
+}
@@ -0,0 +1,68 @@
+/*
+ * ruby_module - Ruby bidings for the opensync framework
+ * Copyright (C) 2011  Luiz Angelo Daros de Luca <luizluca@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * Strings of an Opensync::List are copied when the list is created: the
+ * plugin in list/check_list.rb marks each deleted uid of a hashtable as
+ * deleted while it reads them, which frees the uids the list points to.
+ */
+
+#include "ruby_module.h"
+#include "callbacks_prototypes.h"
+
+#define CHECK_PLUGIN "ruby-check-list"
+
+int main(int argc, char **argv) {
+    OSyncError *error = NULL;
+    OSyncPluginEnv *plugin_env;
+    OSyncPlugin *plugin;
+    OSyncPluginInfo *info;
+    void *plugin_data;
+    osync_bool read;
+
+    setenv("OPENSYNC_RUBY_PLUGINDIR", CHECK_LISTDIR, 0);
+
+    plugin_env = osync_plugin_env_new(&error);
+    if (!plugin_env || !rubymodule_get_sync_info(plugin_env, &error))
+        goto error;
+    if (!(plugin = osync_plugin_env_find_plugin(plugin_env, CHECK_PLUGIN))) {
+        fprintf(stderr, "Plugin %s not registered\n", CHECK_PLUGIN);
+        return 1;
+    }
+    if (!(info = osync_plugin_info_new(&error)))
+        goto error;
+
+    plugin_data = osync_rubymodule_plugin_initialize(plugin, info, &error);
+    if (osync_error_is_set(&error))
+        goto error;
+    read = osync_rubymodule_plugin_discover(plugin, info, plugin_data, &error);
+    osync_rubymodule_plugin_finalize(plugin, plugin_data);
+    if (osync_error_is_set(&error))
+        goto error;
+    if (!read) {
+        fprintf(stderr, "Deleted uids changed while they were read\n");
+        return 1;
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "%s\n", error ? osync_error_print(&error) : "failed");
+    return 1;
+}
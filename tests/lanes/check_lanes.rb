@@ -0,0 +1,59 @@
+#
+# Plugin used by check_lanes. Both sinks are bound to a Ractor lane of
+# their own and their get_changes hammer the SWIG wrappers: each call
+# creates, reads back and drops changes, and raises (failing the
+# context) if anything read back is not what it wrote.
+#
+class CheckLanes < Opensync::Plugin
+    ID="ruby-check-lanes"
+    ROUNDS=2000
+
+    def self.get_sync_info(env)
+	env.register_plugin(self.new)
+    end
+
+    # Runs in a lane: only shareable state and the procedural API
+    def self.get_changes(sink, info, ctx, slow_sync, userdata)
+	name=Opensync.osync_objtype_sink_get_name(sink)
+	ROUNDS.times do
+	    |i|
+	    uid="#{name}-#{i}"
+	    change=Opensync.osync_change_new
+	    Opensync.osync_change_set_uid(change, uid)
+	    Opensync.osync_change_set_changetype(change, Opensync::OSYNC_CHANGE_TYPE_MODIFIED)
+	    Opensync.osync_change_set_hash(change, "#{uid}-hash")
+	    if Opensync.osync_change_get_uid(change) != uid or
+		    Opensync.osync_change_get_changetype(change) != Opensync::OSYNC_CHANGE_TYPE_MODIFIED or
+		    Opensync.osync_change_get_hash(change) != "#{uid}-hash"
+		raise "#{uid} did not read back in lane #{name}"
+	    end
+	    Opensync.osync_change_unref(change)
+	end
+	Opensync.osync_context_report_success(ctx)
+    end
+
+    def initialize_new
+	self.name=ID
+	self.longname="Ractor lanes check"
+	self.description="Used by tests/check_lanes"
+	self.initialize_func {|plugin, info| initialize0(info) }
+	self.finalize_func {|plugin, plugin_data| true }
+	self.discover_func {|plugin, info, plugin_data| true }
+    end
+
+    def initialize0(info)
+	if not Opensync::Ractors.available?
+	    $stderr.puts "no Ractors, sinks run in the main ruby thread"
+	    return true
+	end
+	callback=Opensync::Ractors.callback(CheckLanes, :get_changes)
+	info.objtype_sinks.each do
+	    |sink|
+	    sink.get_changes_func=callback
+	    Opensync::Ractors.bind(sink)
+	end
+	true
+    end
+end
+
+Opensync::MetaPlugin.register(CheckLanes)
@@ -0,0 +1,56 @@
+#
+# Plugin used by check_list. initialize stores some uids in a hashtable and
+# opens it again, so none of them is reported. discover marks each deleted
+# uid as deleted while reading them, which frees the uid kept by the
+# hashtable, and is true if every uid was still read back intact.
+#
+require 'tmpdir'
+require 'fileutils'
+
+class CheckList < Opensync::Plugin
+    ID="ruby-check-list"
+    UIDS=(1..100).collect {|i| "uid-#{i}" }
+
+    def self.get_sync_info(env)
+	env.register_plugin(self.new)
+    end
+
+    def initialize_new
+	self.name=ID
+	self.longname="Opensync::List check"
+	self.description="Used by tests/check_list"
+	self.initialize_func {|plugin, info| initialize0 }
+	self.finalize_func {|plugin, plugin_data| FileUtils.rm_rf(@dir); true }
+	self.discover_func {|plugin, info, plugin_data| discover0 }
+    end
+
+    def initialize0
+	@dir=Dir.mktmpdir
+	path=File.join(@dir, "hashtable.db")
+	hashtable=Opensync::HashTable.new(path, "data")
+	hashtable.load
+	hashtable.classify_and_update(UIDS, UIDS.collect {|uid| "hash-#{uid}" })
+	hashtable.save
+	Opensync.osync_hashtable_unref(hashtable._self)
+	@hashtable=Opensync::HashTable.new(path, "data")
+	@hashtable.load
+	true
+    end
+
+    def discover0
+	read=[]
+	@hashtable.deleted.each do |uid|
+	    change=Opensync::Change.new
+	    change.uid=uid
+	    change.changetype=Opensync::OSYNC_CHANGE_TYPE_DELETED
+	    @hashtable.update_change(change)
+	    # Reuse the freed memory
+	    UIDS.collect {|u| u.dup }
+	    read << uid
+	end
+	$stderr.puts "read #{read.size} deleted uids"
+	read.sort == UIDS.sort
+    end
+end
+
+Opensync::MetaPlugin.register(CheckList)